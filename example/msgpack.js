@@ -0,0 +1,190 @@
+/*
+	This file is part of JUCI (https://github.com/mkschreder/orange.git)
+
+	Copyright (c) 2015-2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+*/
+
+// Minimal MessagePack codec used by the "rpc-msgpack" websocket subprotocol.
+(function(scope){
+	function utf8Encode(str){
+		var out = [];
+		for(var i = 0; i < str.length; i++){
+			var c = str.charCodeAt(i);
+			if(c >= 0xd800 && c < 0xdc00 && i + 1 < str.length){
+				c = 0x10000 + ((c - 0xd800) << 10) + (str.charCodeAt(++i) - 0xdc00);
+			}
+			if(c < 0x80) out.push(c);
+			else if(c < 0x800) out.push(0xc0 | (c >> 6), 0x80 | (c & 0x3f));
+			else if(c < 0x10000) out.push(0xe0 | (c >> 12), 0x80 | ((c >> 6) & 0x3f), 0x80 | (c & 0x3f));
+			else out.push(0xf0 | (c >> 18), 0x80 | ((c >> 12) & 0x3f), 0x80 | ((c >> 6) & 0x3f), 0x80 | (c & 0x3f));
+		}
+		return out;
+	}
+
+	function utf8Decode(bytes, start, end){
+		var str = "";
+		for(var i = start; i < end;){
+			var c = bytes[i++];
+			if(c >= 0xf0) c = ((c & 0x07) << 18) | ((bytes[i++] & 0x3f) << 12) | ((bytes[i++] & 0x3f) << 6) | (bytes[i++] & 0x3f);
+			else if(c >= 0xe0) c = ((c & 0x0f) << 12) | ((bytes[i++] & 0x3f) << 6) | (bytes[i++] & 0x3f);
+			else if(c >= 0xc0) c = ((c & 0x1f) << 6) | (bytes[i++] & 0x3f);
+			if(c >= 0x10000){
+				c -= 0x10000;
+				str += String.fromCharCode(0xd800 + (c >> 10), 0xdc00 + (c & 0x3ff));
+			} else {
+				str += String.fromCharCode(c);
+			}
+		}
+		return str;
+	}
+
+	function putUint(out, tag, value, bytes){
+		out.push(tag);
+		for(var i = bytes - 1; i >= 0; i--){
+			out.push(Math.floor(value / Math.pow(2, i * 8)) & 0xff);
+		}
+	}
+
+	function putHeader(out, value, fix, fixmax, tags){
+		if(value <= fixmax) out.push(fix | value);
+		else if(value <= 0xffff) putUint(out, tags[0], value, 2);
+		else putUint(out, tags[1], value, 4);
+	}
+
+	function encodeValue(out, value){
+		if(value === null || value === undefined){
+			out.push(0xc0);
+		} else if(value === true || value === false){
+			out.push(value ? 0xc3 : 0xc2);
+		} else if(typeof value == "number"){
+			if(value % 1 === 0 && value >= 0 && value <= 0xffffffff){
+				if(value < 0x80) out.push(value);
+				else if(value <= 0xff) putUint(out, 0xcc, value, 1);
+				else if(value <= 0xffff) putUint(out, 0xcd, value, 2);
+				else putUint(out, 0xce, value, 4);
+			} else if(value % 1 === 0 && value < 0 && value >= -0x80000000){
+				if(value >= -32) out.push(value & 0xff);
+				else putUint(out, 0xd2, value >>> 0, 4);
+			} else {
+				var view = new DataView(new ArrayBuffer(8));
+				view.setFloat64(0, value);
+				out.push(0xcb);
+				for(var i = 0; i < 8; i++) out.push(view.getUint8(i));
+			}
+		} else if(typeof value == "string"){
+			var bytes = utf8Encode(value);
+			if(bytes.length < 32) out.push(0xa0 | bytes.length);
+			else if(bytes.length <= 0xff) putUint(out, 0xd9, bytes.length, 1);
+			else if(bytes.length <= 0xffff) putUint(out, 0xda, bytes.length, 2);
+			else putUint(out, 0xdb, bytes.length, 4);
+			for(var j = 0; j < bytes.length; j++) out.push(bytes[j]);
+		} else if(Array.isArray(value)){
+			putHeader(out, value.length, 0x90, 15, [0xdc, 0xdd]);
+			value.map(function(x){ encodeValue(out, x); });
+		} else {
+			var keys = Object.keys(value).filter(function(k){ return value[k] !== undefined; });
+			putHeader(out, keys.length, 0x80, 15, [0xde, 0xdf]);
+			keys.map(function(k){
+				encodeValue(out, k);
+				encodeValue(out, value[k]);
+			});
+		}
+	}
+
+	function Reader(bytes){
+		this.bytes = bytes;
+		this.view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+		this.pos = 0;
+	}
+
+	Reader.prototype.uint = function(bytes){
+		var value = 0;
+		for(var i = 0; i < bytes; i++) value = value * 256 + this.bytes[this.pos++];
+		return value;
+	}
+
+	Reader.prototype.string = function(len){
+		var str = utf8Decode(this.bytes, this.pos, this.pos + len);
+		this.pos += len;
+		return str;
+	}
+
+	Reader.prototype.array = function(len){
+		var arr = [];
+		for(var i = 0; i < len; i++) arr.push(this.value());
+		return arr;
+	}
+
+	Reader.prototype.map = function(len){
+		var obj = {};
+		for(var i = 0; i < len; i++){
+			var key = this.value();
+			obj[key] = this.value();
+		}
+		return obj;
+	}
+
+	Reader.prototype.value = function(){
+		if(this.pos >= this.bytes.length) throw new Error("msgpack: unexpected end of data");
+		var tag = this.bytes[this.pos++];
+		var value;
+		if(tag < 0x80) return tag;
+		if(tag >= 0xe0) return tag - 0x100;
+		if((tag & 0xe0) == 0xa0) return this.string(tag & 0x1f);
+		if((tag & 0xf0) == 0x80) return this.map(tag & 0x0f);
+		if((tag & 0xf0) == 0x90) return this.array(tag & 0x0f);
+		switch(tag){
+			case 0xc0: return null;
+			case 0xc2: return false;
+			case 0xc3: return true;
+			case 0xca: value = this.view.getFloat32(this.pos); this.pos += 4; return value;
+			case 0xcb: value = this.view.getFloat64(this.pos); this.pos += 8; return value;
+			case 0xcc: return this.uint(1);
+			case 0xcd: return this.uint(2);
+			case 0xce: return this.uint(4);
+			case 0xcf: return this.uint(8);
+			case 0xd0: value = this.view.getInt8(this.pos); this.pos += 1; return value;
+			case 0xd1: value = this.view.getInt16(this.pos); this.pos += 2; return value;
+			case 0xd2: value = this.view.getInt32(this.pos); this.pos += 4; return value;
+			case 0xd3: value = this.view.getInt32(this.pos) * 4294967296 + this.view.getUint32(this.pos + 4); this.pos += 8; return value;
+			case 0xd9: return this.string(this.uint(1));
+			case 0xda: return this.string(this.uint(2));
+			case 0xdb: return this.string(this.uint(4));
+			case 0xdc: return this.array(this.uint(2));
+			case 0xdd: return this.array(this.uint(4));
+			case 0xde: return this.map(this.uint(2));
+			case 0xdf: return this.map(this.uint(4));
+		}
+		throw new Error("msgpack: unsupported type 0x"+tag.toString(16));
+	}
+
+	var MsgPack = {
+		// returns a Uint8Array with packed value
+		encode: function(value){
+			var out = [];
+			encodeValue(out, value);
+			return new Uint8Array(out);
+		},
+		// accepts ArrayBuffer, Uint8Array or node Buffer
+		decode: function(data){
+			var bytes = (data instanceof ArrayBuffer)?new Uint8Array(data):new Uint8Array(data.buffer, data.byteOffset, data.byteLength);
+			var reader = new Reader(bytes);
+			var value = reader.value();
+			if(reader.pos != bytes.length) throw new Error("msgpack: trailing data");
+			return value;
+		}
+	};
+
+	if(typeof module !== 'undefined' && module.exports) module.exports = MsgPack;
+	scope.MsgPack = MsgPack;
+})(typeof exports === 'undefined'? this : global);
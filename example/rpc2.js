@@ -19,17 +19,27 @@
 	
 	var gettext = function(text){ return text; }; 
 
+	var RPC_PROTOCOL_JSON = "rpc"; 
+	var RPC_PROTOCOL_MSGPACK = "rpc-msgpack"; 
+
 	function RPC(){
 		this.requests = {}; 
 		this.events = {}; 
 		this.seq = parseInt(Math.random()*65535); 
 		this.connected = false; 
 		this.sid = ""; 
+		this.protocol = RPC_PROTOCOL_JSON; 
 	}
 
-	RPC.prototype.$connect = function(address){
-		var socket = this.socket = new WebSocket(address); 	
+	// protocol is optional and can be either "rpc" (json, default) or "rpc-msgpack" (binary)
+	RPC.prototype.$connect = function(address, protocol){
 		var self = this; 
+		if(protocol) self.protocol = protocol; 
+		var socket = this.socket = new WebSocket(address, self.protocol); 	
+		if(self.protocol == RPC_PROTOCOL_MSGPACK) {
+			if(!scope.MsgPack) scope.MsgPack = require("./msgpack"); 
+			socket.binaryType = "arraybuffer"; 
+		}
 		var def = $.Deferred(); 
 		console.log("Starting websocket.."); 
 		socket.onopen = function(){
@@ -47,7 +57,7 @@
 		socket.onclose = function(){
 			self.connected = false; 	
 			setTimeout(function(){
-				self.$connect(address).done(function(){
+				self.$connect(address, self.protocol).done(function(){
 					def.resolve(); 
 				}); 
 			}, 5000); 
@@ -62,15 +72,25 @@
 
 	}
 
+	RPC.prototype._encode = function(obj){
+		if(this.protocol == RPC_PROTOCOL_MSGPACK) return scope.MsgPack.encode(obj); 
+		return JSON.stringify(obj)+"\n"; 
+	}
+
 	RPC.prototype._onMessage = function(data){
 		var obj = null; 
 		var self = this; 
-		try { obj = JSON.parse(data); } catch(e) { 
+		try { 
+			if(typeof data == "string") obj = JSON.parse(data); 
+			else obj = scope.MsgPack.decode(data); 
+		} catch(e) { 
 			console.log("RPC: could not parse data: "+e+": "+data); 
 			return; 
 		} 
-		if(!obj.map) return; 
-		console.log("RPC got data: "+data); 
+		if(!obj) return; 
+		// server sends single messages as objects and batches as arrays 
+		if(!obj.map) obj = [obj]; 
+		console.log("RPC got data: "+JSON.stringify(obj)); 
 		obj.map(function(msg){ 
 			if(!msg.jsonrpc || msg.jsonrpc != "2.0") return; 
 			if(msg.id && msg.result != undefined && self.requests[msg.id]){
@@ -95,14 +115,14 @@
 			id: self.seq,
 			deferred: $.Deferred()
 		}; 
-		var str = JSON.stringify({
+		var msg = {
 			jsonrpc: "2.0", 
 			id: req.id, 
 			method: method, 
 			params: params || []
-		})+"\n";  
-		console.log("websocket > "+str); 
-		self.socket.send(str); 
+		}; 
+		console.log("websocket > "+JSON.stringify(msg)); 
+		self.socket.send(self._encode(msg)); 
 		return req.deferred.promise();  
 	}
 
@@ -153,14 +173,14 @@
 			id: self.seq,
 			deferred: $.Deferred()
 		}; 
-		var str = JSON.stringify({
+		var msg = {
 			jsonrpc: "2.0", 
 			id: req.id, 
 			method: "list", 
 			params: [self.sid, "*"]
-		})+"\n"; 
-		console.log("websocket > "+str); 
-		self.socket.send(str); 
+		}; 
+		console.log("websocket > "+JSON.stringify(msg)); 
+		self.socket.send(self._encode(msg)); 
 		return req.deferred.promise();  
 
 	}
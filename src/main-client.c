@@ -29,27 +29,157 @@
 #include "orange_ws_server.h"
 #include "orange_rpc.h"
 #include "orange_eq.h"
+#include "orange_unix_server.h"
+#include <sys/socket.h>
+#include <sys/un.h>
 
 static void usage(void){
 	printf("Usage: \n"); 
-	printf("\torangerpc-client [-q <queue_name>] <broadcast> <event-name> <event-data-json>\n"); 
+	printf("\torangerpc-client [-q <queue_name>] [-t shm|mq] <broadcast> <event-name> <event-data-json>\n"); 
+	printf("\torangerpc-client [-q <queue_name>] [-t shm|mq] -i (reads '<event-name> <event-data-json>' lines from stdin)\n"); 
+	printf("\torangerpc-client -s <unix:///path/to/socket> <rpc> <method> <params-json>\n"); 
 	exit(-1); 
 }
 
+// sends one jsonrpc request over the unix socket and prints the response
+static int _unix_rpc(const char *path, const char *method, const char *params){
+	struct sockaddr_un addr; 
+	char *buf = NULL; 
+	int ret = -1; 
+
+	if(strncmp(path, ORANGE_UNIX_SCHEME, strlen(ORANGE_UNIX_SCHEME)) == 0) path += strlen(ORANGE_UNIX_SCHEME); 
+	memset(&addr, 0, sizeof(addr)); 
+	addr.sun_family = AF_UNIX; 
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1); 
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0); 
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+		fprintf(stderr, "Could not connect to %s: %s\n", path, strerror(errno)); 
+		goto out; 
+	}
+
+	size_t len = strlen(method) + strlen(params) + 64; 
+	buf = malloc(len > ORANGE_UNIX_MAX_MESSAGE ? len : ORANGE_UNIX_MAX_MESSAGE); 
+	if(!buf) goto out; 
+	int n = snprintf(buf, len, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"%s\",\"params\":%s}", method, params); 
+	if(send(fd, buf, n, 0) != n){
+		fprintf(stderr, "Could not send request: %s\n", strerror(errno)); 
+		goto out; 
+	}
+
+	ssize_t r = recv(fd, buf, ORANGE_UNIX_MAX_MESSAGE - 1, 0); 
+	if(r <= 0){
+		fprintf(stderr, "No response from server!\n"); 
+		goto out; 
+	}
+	buf[r] = 0; 
+	printf("%s\n", buf); 
+	ret = 0; 
+out: 
+	free(buf); 
+	if(fd >= 0) close(fd); 
+	return ret; 
+}
+
+// how long to keep trying when the server does not empty the shared memory ring
+#define SEND_RETRY_US 1000
+#define SEND_RETRIES 1000
+
+// queue that events are sent to. Kept so that the queue can be opened again when the server replaces it. 
+static const char *queue_name = NULL; // default: orangerpcd-events
+static enum orange_eq_transport transport = ORANGE_EQ_AUTO; 
+
+static int _send_event(struct orange_eq *queue, const char *name, const char *data){
+	struct blob b; 
+	int ret = -EINVAL; 
+	blob_init(&b, 0, 0); 
+	blob_put_string(&b, name); 
+	if(!blob_put_json(&b, data)){
+		fprintf(stderr, "Invalid event data for %s: %s\n", name, data); 
+		goto out; 
+	}
+	for(int c = 0; c < SEND_RETRIES; c++){
+		ret = orange_eq_send(queue, &b); 
+		// server has restarted (or handed over to a new instance) and created a new ring. 
+		// -EINVAL means that the queue could not be opened again for an earlier event. 
+		if(ret == -EPIPE || ret == -EINVAL){
+			orange_eq_close(queue); 
+			if(orange_eq_open_transport(queue, queue_name, false, transport) != 0){
+				ret = -errno; 
+				break; 
+			}
+			continue; 
+		}
+		if(ret != -EAGAIN) break; 
+		usleep(SEND_RETRY_US); 
+	}
+	if(ret != 0) fprintf(stderr, "Could not send event %s: %s\n", name, strerror((ret < 0)?-ret:errno)); 
+out: 
+	blob_free(&b); 
+	return ret; 
+}
+
+// long lived producer. Queue is opened once and every line of input becomes one event. 
+static int _send_stdin_events(struct orange_eq *queue){
+	char *line = NULL; 
+	size_t size = 0; 
+	ssize_t len; 
+	int errors = 0; 
+	while((len = getline(&line, &size, stdin)) > 0){
+		if(line[len - 1] == '\n') line[--len] = 0; 
+		if(!len) continue; 
+		char *data = strchr(line, ' '); 
+		if(!data){
+			fprintf(stderr, "Expected '<event-name> <event-data-json>': %s\n", line); 
+			errors++; 
+			continue; 
+		}
+		*data++ = 0; 
+		if(_send_event(queue, line, data) != 0) errors++; 
+	}
+	free(line); 
+	return (errors)?-1:0; 
+}
+
 int main(int argc, char **argv){
-	const char *queue_name = NULL; // default: orangerpcd-events; 
+	const char *socket_path = NULL; 
+	bool from_stdin = false; 
+	// a doorbell without a reader means the server is gone. That is reported as EPIPE by orange_eq_send(). 
+	signal(SIGPIPE, SIG_IGN); 
 	int c = 0; 	
-	while((c = getopt(argc, argv, "q:")) != -1){
+	while((c = getopt(argc, argv, "q:s:t:i")) != -1){
 		switch(c){
 			case 'q': 
 				queue_name = optarg; 
 				break; 
+			case 't': 
+				if(strcmp(optarg, "shm") == 0) transport = ORANGE_EQ_SHM; 
+				else if(strcmp(optarg, "mq") == 0) transport = ORANGE_EQ_MQUEUE; 
+				else usage(); 
+				break; 
+			case 'i': 
+				from_stdin = true; 
+				break; 
+			case 's': 
+				socket_path = optarg; 
+				break; 
 			default: 
 				usage(); 
 				break; 
 		}
 	}
 
+	struct orange_eq queue; 
+	if(from_stdin){
+		if(orange_eq_open_transport(&queue, queue_name, false, transport) != 0){
+			fprintf(stderr, "Unable to open event queue. Check that server is running!\n"); 
+			return -1; 
+		}
+		int ret = _send_stdin_events(&queue); 
+		orange_eq_close(&queue); 
+		return ret; 
+	}
+
 	if(optind < argc - 3) usage(); 
 	
 	const char *cmd = argv[optind++]; 	
@@ -58,24 +188,18 @@ int main(int argc, char **argv){
 
 	if(!cmd || !name || !data) usage(); 
 
-	struct orange_eq queue; 
-	if(orange_eq_open(&queue, queue_name, false) != 0){
-		fprintf(stderr, "Unable to open event queue. Check that server is running!\n"); 
-		return -1; 
+	if(strcmp(cmd, "rpc") == 0){
+		if(!socket_path) usage(); 
+		return _unix_rpc(socket_path, name, data); 
 	}
 
-	struct blob b; 
-	blob_init(&b, 0, 0); 
-	blob_put_string(&b, name); 
-	blob_put_json(&b, data); 
-
-	if(orange_eq_send(&queue, &b) != 0){
-		fprintf(stderr, "Could not send message!\n"); 
+	if(orange_eq_open_transport(&queue, queue_name, false, transport) != 0){
+		fprintf(stderr, "Unable to open event queue. Check that server is running!\n"); 
 		return -1; 
 	}
-	
-	blob_free(&b); 
+
+	int ret = _send_event(&queue, name, data); 
 	orange_eq_close(&queue); 
 
-	return 0; 
+	return (ret == 0)?0:-1; 
 }
@@ -27,11 +27,20 @@
 #include "orange.h"
 #include "orange_luaobject.h"
 #include "orange_ws_server.h"
+#include "orange_unix_server.h"
+#include "orange_mux_server.h"
 #include "orange_rpc.h"
+#include "orange_handoff.h"
+
+// how long old and new instance wait for each other during a restart
+#define HANDOFF_TIMEOUT_MS 10000
+// how long old instance keeps running requests of its clients after handing off
+#define HANDOFF_DRAIN_US 10000000ULL
 
 pthread_mutex_t runlock; 
 pthread_cond_t runcond; 
 sig_atomic_t running; 
+sig_atomic_t restart; 
 
 static void handle_sigint(int sig){
 	DEBUG("Interrupted!\n"); 
@@ -41,18 +50,100 @@ static void handle_sigint(int sig){
 	pthread_mutex_unlock(&runlock); 
 }
 
+static void handle_sighup(int sig){
+	restart = true; 
+	pthread_mutex_lock(&runlock); 
+	pthread_cond_signal(&runcond); 
+	pthread_mutex_unlock(&runlock); 
+}
+
+// starts a new instance and passes our listening sockets and sessions to it. Returns 0 once the new instance is 
+// serving. Otherwise we take the sockets back and go on as before. 
+static int _handoff(struct orange *app, orange_server_t *servers, const char **urls, int count, char **argv){
+	struct orange_handoff handoff; 
+	orange_handoff_init(&handoff); 
+
+	// new connections wait in the backlog until the new instance accepts them
+	for(int c = 0; c < count; c++){
+		int fd = orange_server_detach(servers[c]); 
+		if(fd >= 0) orange_handoff_add_socket(&handoff, urls[c], fd); 
+	}
+
+	struct blob state; 
+	blob_init(&state, 0, 0); 
+	blob_offset_t t = blob_open_table(&state); 
+	blob_put_string(&state, "sessions"); 
+	orange_export_sessions(app, &state); 
+	blob_close_table(&state, t); 
+	orange_handoff_set_state(&handoff, blob_field_first_child(blob_head(&state))); 
+	blob_free(&state); 
+
+	int ret = orange_handoff_spawn(&handoff, argv); 
+	if(ret == 0) ret = orange_handoff_wait(&handoff, HANDOFF_TIMEOUT_MS); 
+	if(ret < 0){
+		for(int c = 0; c < count; c++){
+			int fd = orange_handoff_take_socket(&handoff, urls[c]); 
+			if(fd >= 0) orange_server_adopt(servers[c], urls[c], fd); 
+		}
+	}
+	orange_handoff_deinit(&handoff); 
+	return ret; 
+}
+
+// restores sessions that the previous instance passed to us
+static void _handoff_restore(struct orange_handoff *handoff, struct orange *app){
+	struct blob state; 
+	blob_init(&state, 0, 0); 
+	if(orange_handoff_get_state(handoff, &state)){
+		const struct blob_field *root = blob_field_first_child(blob_head(&state)), *key; 
+		blob_field_for_each_child(root, key){
+			const struct blob_field *value = blob_field_next_child(root, key); 
+			if(!value) break; 
+			if(strcmp(blob_field_get_string(key), "sessions") == 0){
+				int count = orange_import_sessions(app, value); 
+				syslog(LOG_INFO, "restored %d sessions of previous instance", count); 
+			}
+			key = value; 
+		}
+	}
+	blob_free(&state); 
+}
+
 int main(int argc, char **argv){
 	running = true; 
 
 	pthread_mutex_init(&runlock, NULL); 
 	pthread_cond_init(&runcond, NULL); 
 
-  	const char *www_root = "/www"; 
-	const char *listen_socket = "ws://127.0.0.1:5303"; 
+  	const char *www_root = NULL; 
+	// several listen sockets can be given (for example websocket and unix socket)
+	const char *listen_sockets[ORANGE_MUX_MAX_BACKENDS] = { "ws://127.0.0.1:5303" }; 
+	int num_listen = 0; 
 	const char *plugin_dir = "/usr/lib/orange/api/"; 
 	const char *pw_file = "/etc/orange/shadow"; 
 	const char *acl_dir = "";
 	int num_workers = 10; 
+	// pool may grow up to this many workers when requests are stuck in slow plugins
+	int max_workers = 32; 
+	// requests one client may have running at the same time (-1 means use default)
+	int peer_limit = -1; 
+	// requests waiting for a worker in total and per client (0 means use default)
+	unsigned int max_queued = 0, peer_max_queued = 0; 
+	// largest json-rpc batch (0 means use default)
+	int max_batch = 0; 
+	// local events broadcast together and milliseconds to wait for more events of a burst (0 means use default)
+	unsigned int event_batch = 0, event_window_ms = 0; 
+	// coalescing of event storms (window in ms, events per second and burst for each event name)
+	unsigned int coalesce_ms = 0, coalesce_rate = 0, coalesce_burst = 0; 
+	char coalesce_key[64] = ""; 
+	// bytes of recent events kept for replay (-1 means use default)
+	long event_log = -1; 
+	// per client send queue limits in KiB (0 means use server default)
+	unsigned int tx_low = 0, tx_high = 0, tx_max = 0; 
+	// bytes written to one client per write callback in KiB
+	unsigned int tx_budget = 0; 
+	// clients that never subscribe get all events (only for old user interfaces, bypasses event acls)
+	bool broadcast_all = false; 
 
 	printf("Orange RPCD v%s\n",VERSION); 
 	printf("Lua/JSONRPC server\n"); 
@@ -62,7 +153,7 @@ int main(int argc, char **argv){
 	openlog("orangerpcd", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1); 
 
 	int c = 0; 	
-	while((c = getopt(argc, argv, "d:l:p:vx:a:w:")) != -1){
+	while((c = getopt(argc, argv, "d:l:p:vx:a:ew:W:q:b:P:Q:B:E:C:R:")) != -1){
 		switch(c){
 			case 'd': 
 				www_root = optarg; 
@@ -70,8 +161,15 @@ int main(int argc, char **argv){
 			case 'a': 
 				acl_dir = optarg; 
 				break; 
+			case 'e': 
+				broadcast_all = true; 
+				break; 
 			case 'l':
-				listen_socket = optarg; 
+				if(num_listen >= ORANGE_MUX_MAX_BACKENDS){
+					fprintf(stderr, "at most %d listen sockets are supported!\n", ORANGE_MUX_MAX_BACKENDS); 
+					return -1; 
+				}
+				listen_sockets[num_listen++] = optarg; 
 				break; 
 			case 'p': 
 				plugin_dir = optarg; 
@@ -87,6 +185,45 @@ int main(int argc, char **argv){
 				if(num_workers > 100) 
 					printf("WARNING: using more than 100 workers may not make sense!\n"); 
 				break; 
+			case 'W':
+				max_workers = abs(atoi(optarg)); 
+				break; 
+			case 'P':
+				peer_limit = abs(atoi(optarg)); 
+				break; 
+			case 'Q':
+				if(sscanf(optarg, "%u,%u", &max_queued, &peer_max_queued) < 1){
+					fprintf(stderr, "-Q expects <max queued>[,<max queued per client>]\n"); 
+					return -1; 
+				}
+				break; 
+			case 'B':
+				max_batch = abs(atoi(optarg)); 
+				break; 
+			case 'E':
+				if(sscanf(optarg, "%u,%u", &event_batch, &event_window_ms) < 1){
+					fprintf(stderr, "-E expects <max events>[,<window in ms>]\n"); 
+					return -1; 
+				}
+				break; 
+			case 'C':
+				if(sscanf(optarg, "%u,%u,%u,%63s", &coalesce_ms, &coalesce_rate, &coalesce_burst, coalesce_key) < 2){
+					fprintf(stderr, "-C expects <window in ms>,<rate>[,<burst>[,<data key>]]\n"); 
+					return -1; 
+				}
+				break; 
+			case 'R':
+				event_log = labs(atol(optarg)); 
+				break; 
+			case 'q':
+				if(sscanf(optarg, "%u,%u,%u", &tx_low, &tx_high, &tx_max) != 3){
+					fprintf(stderr, "-q expects <low>,<high>,<max> in KiB\n"); 
+					return -1; 
+				}
+				break; 
+			case 'b':
+				tx_budget = abs(atoi(optarg)); 
+				break; 
 			default: break; 
 		}
 	}
@@ -95,36 +232,107 @@ int main(int argc, char **argv){
 	num_workers = 0; 
 	printf("Note: threading is disabled!\n"); 
 	#else
-	printf("Threading is enabled! Running with %d workers.\n", num_workers); 
+	printf("Threading is enabled! Running with %d to %d workers.\n", num_workers, (max_workers > num_workers)?max_workers:num_workers); 
 	#endif
 	
-    orange_server_t server = orange_ws_server_new(www_root); 
+	if(num_listen == 0) num_listen = 1; 
+
+	// when we are started by a running instance (see _handoff) we take over its sockets and sessions
+	struct orange_handoff handoff; 
+	orange_handoff_init(&handoff); 
+	int handed_off = orange_handoff_receive(&handoff, HANDOFF_TIMEOUT_MS); 
+	if(handed_off < 0){
+		orange_handoff_complete(&handoff, handed_off); 
+		return -1; 
+	}
+
+	// sessions of the previous instance must exist before any request of its clients can reach us
+	struct orange *app = orange_new(plugin_dir, pw_file, acl_dir); 
+	if(handed_off) _handoff_restore(&handoff, app); 
+	if(broadcast_all && orange_has_event_acls(app)){
+		syslog(LOG_WARNING, "event acls are configured, clients only get events they subscribe to (-e ignored)"); 
+		broadcast_all = false; 
+	}
+
+	orange_server_t servers[ORANGE_MUX_MAX_BACKENDS]; 
+	for(int c = 0; c < num_listen; c++){
+		const char *listen_socket = listen_sockets[c]; 
+		if(strncmp(listen_socket, ORANGE_UNIX_SCHEME, strlen(ORANGE_UNIX_SCHEME)) == 0){
+			servers[c] = orange_unix_server_new(); 
+		} else {
+			servers[c] = orange_ws_server_new(www_root); 
+			if(tx_max) orange_ws_server_set_tx_limits(servers[c], tx_low * 1024, tx_high * 1024, tx_max * 1024); 
+			if(tx_budget) orange_ws_server_set_tx_budget(servers[c], tx_budget * 1024); 
+			if(broadcast_all) orange_ws_server_set_broadcast_all(servers[c], true); 
+		}
+
+		int fd = orange_handoff_take_socket(&handoff, listen_socket); 
+		int ret = -ENOMEM; 
+		if(servers[c] && fd >= 0) ret = orange_server_adopt(servers[c], listen_socket, fd); 
+		else if(servers[c]) ret = orange_server_listen(servers[c], listen_socket); 
+		else if(fd >= 0) close(fd); 
+		if(ret < 0){
+			fprintf(stderr, "server could not listen on specified socket %s!\n", listen_socket); 
+			orange_handoff_complete(&handoff, ret); 
+			orange_delete(&app); 
+			return -1;                       
+		}
+	}
 
-    if(orange_server_listen(server, listen_socket) < 0){
-        fprintf(stderr, "server could not listen on specified socket!\n"); 
-        return -1;                       
-    }
+	// a single server is used directly. Several servers are combined into one. 
+	orange_server_t server = servers[0]; 
+	if(num_listen > 1){
+		server = orange_mux_server_new(); 
+		for(int c = 0; c < num_listen; c++){
+			orange_mux_server_add(server, listen_sockets[c], servers[c]); 
+		}
+	}
 
 	signal(SIGINT, handle_sigint); 
 	signal(SIGUSR1, handle_sigint); 
-
-	struct orange *app = orange_new(plugin_dir, pw_file, acl_dir); 
+	signal(SIGHUP, handle_sighup); 
 
 	struct orange_rpc rpc; 
 	orange_rpc_init(&rpc, server, app, 5000000UL, num_workers); 
+	orange_rpc_set_max_workers(&rpc, max_workers, 0, 0); 
+	if(peer_limit >= 0) orange_rpc_set_peer_limit(&rpc, peer_limit); 
+	if(max_queued || peer_max_queued) orange_rpc_set_queue_limit(&rpc, max_queued, peer_max_queued); 
+	if(max_batch) orange_rpc_set_max_batch(&rpc, max_batch); 
+	if(event_batch) orange_rpc_set_event_batch(&rpc, event_batch, event_window_ms * 1000ULL); 
+	if(event_log >= 0) orange_rpc_set_event_log_size(&rpc, event_log); 
+	if(coalesce_ms || coalesce_rate) orange_rpc_set_event_coalescing(&rpc, coalesce_ms * 1000ULL, coalesce_rate, coalesce_burst, coalesce_key); 
+
+	// previous instance exits once we confirm
+	if(handed_off) orange_handoff_complete(&handoff, 0); 
+	// closes sockets of the previous instance that we no longer listen on
+	orange_handoff_deinit(&handoff); 
 
 	syslog(LOG_INFO, "orangerpcd jsonrpc server started (%d)", getpid()); 
 
-	#if CONFIG_THREADS
-	// wait for abort
-	pthread_mutex_lock(&runlock); 
-	pthread_cond_wait(&runcond, &runlock); 
-	pthread_mutex_unlock(&runlock); 
-	#else 
+	bool handed_over = false; 
 	while(running){
+		#if CONFIG_THREADS
+		// wait for abort or restart
+		pthread_mutex_lock(&runlock); 
+		while(running && !restart) pthread_cond_wait(&runcond, &runlock); 
+		pthread_mutex_unlock(&runlock); 
+		#else 
 		orange_rpc_process_requests(&rpc); 
+		#endif
+		if(restart){
+			restart = false; 
+			syslog(LOG_INFO, "handing over to new instance (%d)", getpid()); 
+			if(_handoff(app, servers, listen_sockets, num_listen, argv) == 0){
+				handed_over = true; 
+				running = false; 
+			}
+		}
+	}
+
+	// clients of ours reconnect to the new instance once they are disconnected so let running requests finish first
+	if(handed_over && orange_rpc_drain(&rpc, HANDOFF_DRAIN_US) < 0){
+		syslog(LOG_INFO, "some requests were still running after handoff (%d)", getpid()); 
 	}
-	#endif
 
 	DEBUG("cleaning up\n"); 
 	orange_rpc_deinit(&rpc); 
@@ -39,7 +39,11 @@
 #include "orange_luaobject.h"
 #include "orange_lua.h"
 #include "orange_user.h"
+#include "orange_session_store.h"
+#include "orange_acl_cache.h"
+#include "orange_creds.h"
 #include "orange_eq.h"
+#include "util.h"
 
 #include "sha1.h"
 
@@ -162,72 +166,6 @@ static bool _orange_load_users(struct orange *self){
 	return true; 
 }
 
-static char *_load_file(const char *path){
-	int fd = open(path, O_RDONLY); 
-	if(fd == -1) return NULL; 
-	int filesize = lseek(fd, 0, SEEK_END); 
-	lseek(fd, 0, SEEK_SET); 
-	char *text = calloc(1, filesize + 1); 
-	assert(text); 
-	int ret = read(fd, text, filesize); 
-	close(fd); 
-	if(ret != filesize) { free(text); return NULL; }
-	return text; 
-}
-
-static int _orange_load_passwords(struct orange *self, const char *pwfile){
-	DEBUG("loading passwords from %s\n", pwfile); 
-	char *passwords = _load_file(pwfile); 
-	if(!passwords) return -EACCES; 
-	char *cur = passwords; 
-	int line = 0; 
-	while(1){	
-		char *nl = strchr(cur, '\n'); 
-		char *sp = NULL; 
-		if(nl) *nl = 0; 
-		char *user = strtok_r(cur, " ", &sp); 
-		char *hash = strtok_r(NULL, " ", &sp); 
-		if(user && hash){
-			struct avl_node *node = avl_find(&self->users, user); 
-			if(node){
-				struct orange_user *u = container_of(node, struct orange_user, avl); 
-				if(u){
-					orange_user_set_pw_hash(u, hash); 
-					DEBUG("updated existing user %s\n", user); 
-				}
-			} 
-		} else {
-			ERROR("Could not load user password on line %d: expected format <user> <hash>!\n", line); 
-		}
-		if(!nl) break; 
-		cur = nl; *cur = '\n'; // restore the new line
-		// skip until begining of next line
-		while(*cur != '\n' && *cur) cur++; 
-		while(*cur == '\n') cur++; 
-		if(*cur == 0) break; 
-		line++; 
-	}
-	free(passwords); 
-	return 0; 
-}
-
-static struct orange_session* _find_session(struct orange *self, const char *sid){
-	if(!sid || strlen(sid) == 0) return NULL; 
-	struct avl_node *id = avl_find(&self->sessions, sid); 	
-	if(!id) return NULL;  
-	return container_of(id, struct orange_session, avl); 
-}
-
-static void _prune_sessions(struct orange *self){
-	struct orange_session *ses, *tmp; 
-	avl_for_each_element_safe(&self->sessions, ses, avl, tmp){
-		if(orange_session_expired(ses)){
-			avl_delete(&self->sessions, &ses->avl); 
-			orange_session_delete(&ses); 
-		}
-	}
-}
-
 static bool _try_auth(const char *sha1hash, const char *challenge, const char *response){
 	if(!sha1hash) return false; 
 
@@ -240,55 +178,15 @@ static bool _try_auth(const char *sha1hash, const char *challenge, const char *r
 	sha1_update(&ctx, (const unsigned char*)sha1hash, strlen(sha1hash)); 
 	sha1_final(&ctx, binhash); 
 	char hash[SHA1_BLOCK_SIZE*2+1] = {0}; 
-	for(int c = 0; c < SHA1_BLOCK_SIZE; c++) sprintf(hash + (c * 2), "%02x", binhash[c]); 
+	hex_encode(hash, binhash, SHA1_BLOCK_SIZE); 
 
 	DEBUG("authenticating against digest %s\n", hash); 
 	return !strncmp((const char*)hash, response, SHA1_BLOCK_SIZE*2); 
 }
 
-static int _load_session_acls(struct orange_session *ses, const char *dir, const char *pat){
-	glob_t glob_result;
-	char path[255]; 
-	if(!dir || !strlen(dir)) dir = getenv("JUCI_ACL_DIR_PATH"); 
-	if(!dir) dir = JUCI_ACL_DIR_PATH; 
-	DEBUG("loading acls from %s/%s.acl\n", dir, pat); 
-	snprintf(path, sizeof(path), "%s/%s.acl", dir, pat); 
-	glob(path, 0, NULL, &glob_result);
-	for(unsigned int i=0;i<glob_result.gl_pathc;++i){
-		char *text = _load_file(glob_result.gl_pathv[i]); 
-		if(!text) continue; 
-		char *cur = text; 	
-		int line = 1; 
-		while(true){
-			char *nl = strchr(cur, '\n'); 
-			char *sp = NULL; 
-			if(nl) *nl = 0; 
-			char *scope = strtok_r(cur, " ", &sp); 
-			char *object = strtok_r(NULL, " ", &sp); 
-			char *method = strtok_r(NULL, " ", &sp); 
-			char *perm = strtok_r(NULL, " ", &sp); 
-			if(scope && object && method && perm){
-				if(scope[0] == '!'){
-					DEBUG("revoking session acl '%s %s %s %s'\n", scope + 1, object, method, perm); 
-					orange_session_revoke(ses, scope + 1, object, method, perm); 
-				} else {
-					DEBUG("granting session acl '%s %s %s %s'\n", scope, object, method, perm); 
-					orange_session_grant(ses, scope, object, method, perm); 
-				} 
-			} else {
-				ERROR("parse error on line %d of %s: expected 4 fields separated by spaces!\n", line, glob_result.gl_pathv[i]); 	
-			}
-			if(!nl) break; // if this was the last line then we break 
-			cur = nl; *cur = '\n'; // restore newline 
-			while(*cur != '\n' && *cur != 0) cur++; 
-			while(*cur == '\n') cur++; 
-			if(*cur == 0) break; 
-			line++; 
-		}
-		free(text); 
-	}
-	globfree(&glob_result);
-	return 0; 
+static void _load_session_acls(struct orange *self, struct orange_session *ses){
+	struct orange_acl *profile = orange_acl_cache_get(self->acl_cache, ses->user); 
+	orange_session_set_profile(ses, &profile); 
 }
 
 void orange_add_user(struct orange *self, struct orange_user **user){
@@ -302,21 +200,21 @@ struct orange* orange_new(const char *plugin_path, const char *pwfile, const cha
 	struct orange *self = calloc(1, sizeof(struct orange)); 
 	assert(self); 
 	avl_init(&self->objects, avl_strcmp, false, NULL); 
-	avl_init(&self->sessions, avl_strcmp, false, NULL); 
+	self->sessions = orange_session_store_new(); 
 	avl_init(&self->users, avl_strcmp, false, NULL); 
 	
 	_orange_load_users(self); 
 
 	self->plugin_path = strdup(plugin_path); 
 	self->pwfile = strdup(pwfile); 
+	self->creds = orange_creds_new(self->pwfile); 
+	if(!acl_path || !strlen(acl_path)) acl_path = getenv("JUCI_ACL_DIR_PATH"); 
+	if(!acl_path) acl_path = JUCI_ACL_DIR_PATH; 
 	self->acl_path = strdup(acl_path); 
+	self->acl_cache = orange_acl_cache_new(self->acl_path); 
 
 	pthread_mutex_init(&self->lock, NULL); 
 
-	if(_orange_load_passwords(self, self->pwfile) != 0){
-		ERROR("could not load password file from %s\n", pwfile); 
-	}
-
 	_orange_load_plugins(self, self->plugin_path, NULL); 
 
 	return self; 
@@ -325,14 +223,14 @@ struct orange* orange_new(const char *plugin_path, const char *pwfile, const cha
 void orange_delete(struct orange **_self){
 	struct orange *self = *_self; 
 	struct orange_luaobject *obj, *nobj;
-    struct orange_session *ses, *nses;
     struct orange_user *user, *nuser;
 
 	avl_remove_all_elements(&self->objects, obj, avl, nobj)
 		orange_luaobject_delete(&obj); 
 
-    avl_remove_all_elements(&self->sessions, ses, avl, nses)
-		orange_session_delete(&ses); 
+	orange_session_store_delete(&self->sessions); 
+	orange_acl_cache_delete(&self->acl_cache); 
+	orange_creds_delete(&self->creds); 
 
     avl_remove_all_elements(&self->users, user, avl, nuser)
 		orange_user_delete(&user); 
@@ -348,99 +246,165 @@ void orange_delete(struct orange **_self){
 }
 
 bool orange_session_is_valid(struct orange *self, const char *sid){
-	pthread_mutex_lock(&self->lock); 
-	struct orange_session *ses = _find_session(self, sid); 
-	bool ret = !!ses; 
-	pthread_mutex_unlock(&self->lock); 
+	struct orange_session *ses = orange_session_store_find(self->sessions, sid); 
+	if(!ses) return false; 
+	orange_session_unref(&ses); 
+	return true; 
+}
+int orange_event_access(struct orange *self, const char *sid, const char *pattern){
+	struct orange_session *ses = orange_session_store_find(self->sessions, sid); 
+	if(!ses) return -EACCES; 
+	int ret = -EACCES; 
+	// acl entries are globs so a subscription pattern is allowed if the pattern text itself matches an entry
+	if(orange_session_access(ses, "event", pattern, "*", "r")) ret = 0; 
+	orange_session_unref(&ses); 
 	return ret; 
 }
-/*
-struct orange_session *orange_find_session(struct orange *self, const char *sid){ 
-	return _find_session(self, sid); 
+bool orange_has_event_acls(struct orange *self){
+	char path[255]; 
+	glob_t glob_result; 
+	bool found = false; 
+	snprintf(path, sizeof(path), "%s/*.acl", self->acl_path); 
+	if(glob(path, 0, NULL, &glob_result) == 0){
+		for(size_t i = 0; i < glob_result.gl_pathc && !found; ++i){
+			FILE *file = fopen(glob_result.gl_pathv[i], "r"); 
+			if(!file) continue; 
+			char line[256]; 
+			while(!found && fgets(line, sizeof(line), file)){
+				// granted and revoked entries both count (see orange_acl_load)
+				const char *scope = (line[0] == '!')?line + 1:line; 
+				found = strncmp(scope, "event ", 6) == 0; 
+			}
+			fclose(file); 
+		}
+	}
+	globfree(&glob_result); 
+	return found; 
 }
-*/
 int orange_login(struct orange *self, const char *username, const char *challenge, const char *response, struct orange_sid *sid){
 	// always reset the output value
 	memset(sid, 0, sizeof(struct orange_sid)); 
 
-	pthread_mutex_lock(&self->lock); 
-
 	// good time to prune old sessions? 
-	_prune_sessions(self); 
+	orange_session_store_expire(self->sessions); 
 
+	// users are only added at startup and never removed while we are running
+	pthread_mutex_lock(&self->lock); 
 	struct avl_node *node = avl_find(&self->users, username); 
+	pthread_mutex_unlock(&self->lock); 
 	if(!node){
 		DEBUG("user %s not found!\n", username);
-		pthread_mutex_unlock(&self->lock); 
 		return -EINVAL; 
 	}
 	struct orange_user *user = container_of(node, struct orange_user, avl); 
 
-	// update user hashes (TODO: perhaps this should be loaded into secure memory somehow and discarded after login?)
-	_orange_load_passwords(self, self->pwfile); 
-
-	if(_try_auth(user->pwhash, challenge, response)){
-		struct orange_session *ses = orange_session_new(user, ORANGE_SESSION_DEFAULT_TIMEOUT); 	
-		struct orange_user_acl *acl; 
-		orange_user_for_each_acl(user, acl){
-			DEBUG("loading session acl from user profile: %s\n", (const char*)acl->avl.key); 
-			_load_session_acls(ses, self->acl_path, acl->avl.key); 
-		}
-		struct blob buf; 
-		blob_init(&buf, 0, 0); 
-		orange_session_to_blob(ses, &buf); 
-		//blob_dump_json(&buf); 
-		blob_free(&buf); 
-		if(avl_insert(&self->sessions, &ses->avl) != 0){
-			DEBUG("could not insert session!\n");
-			orange_session_delete(&ses); 
-			pthread_mutex_unlock(&self->lock); 
-			return -EINVAL; 
-		}
-		memcpy(sid, &ses->sid, sizeof(struct orange_sid)); 
-		pthread_mutex_unlock(&self->lock); 
-		return 0; 
-	} else {
+	// password file is only read again if it has changed
+	char pwhash[128]; 
+	if(orange_creds_get(self->creds, username, pwhash, sizeof(pwhash)) != 0 || !_try_auth(pwhash, challenge, response)){
 		DEBUG("login failed for %s!\n", username); 
+		return -EACCES; 
 	}
-	pthread_mutex_unlock(&self->lock); 
-	return -EACCES; 
+
+	struct orange_session *ses = orange_session_new(user, ORANGE_SESSION_DEFAULT_TIMEOUT); 	
+	_load_session_acls(self, ses); 
+	// session belongs to the store once inserted so we copy the id first
+	memcpy(sid, &ses->sid, sizeof(struct orange_sid)); 
+	if(orange_session_store_insert(self->sessions, ses) != 0){
+		DEBUG("could not insert session!\n");
+		orange_session_delete(&ses); 
+		memset(sid, 0, sizeof(struct orange_sid)); 
+		return -EINVAL; 
+	}
+	return 0; 
 }
 
 int orange_login_plaintext(struct orange *self, const char *username, const char *password, struct orange_sid *sid){
-	// NOTE: no locking required. Done by orange_login()
 	unsigned char binhash[SHA1_BLOCK_SIZE+1] = {0}; 
 	SHA1_CTX ctx; 
 	sha1_init(&ctx); 
 	sha1_update(&ctx, (const unsigned char*)password, strlen(password)); 
 	sha1_final(&ctx, binhash); 
 	char hash[SHA1_BLOCK_SIZE*2+1] = {0}; 
-	for(int c = 0; c < SHA1_BLOCK_SIZE; c++) sprintf(hash + (c * 2), "%02x", binhash[c]); 
+	hex_encode(hash, binhash, SHA1_BLOCK_SIZE); 
 	
 	// hash again to simulate what would happen on the client
 	sha1_init(&ctx); 
 	sha1_update(&ctx, (const unsigned char*)hash, SHA1_BLOCK_SIZE * 2); 
 	sha1_final(&ctx, binhash); 
-	for(int c = 0; c < SHA1_BLOCK_SIZE; c++) sprintf(hash + (c * 2), "%02x", binhash[c]); 
+	hex_encode(hash, binhash, SHA1_BLOCK_SIZE); 
 
 	return orange_login(self, username, NULL, hash, sid); 
 }
 
 int orange_logout(struct orange *self, const char *sid){
+	// sessions that are in use by running calls are deleted when the calls are done
+	if(orange_session_store_remove(self->sessions, sid) != 0) return -EINVAL; 
+	return 0; 
+}
+
+static void _export_session(void *arg, struct orange_session *ses){
+	struct blob *out = (struct blob*)arg; 
+	long long left = orange_session_seconds_left(ses); 
+	if(left <= 0) return; 
+	blob_offset_t s = blob_open_array(out); 
+	blob_put_string(out, ses->sid.hash); 
+	blob_put_string(out, ses->user->username); 
+	blob_put_int(out, left); 
+	blob_put_int(out, ses->timeout_s); 
+	blob_close_array(out, s); 
+}
+
+void orange_export_sessions(struct orange *self, struct blob *out){
+	orange_session_store_expire(self->sessions); 
+	blob_offset_t a = blob_open_array(out); 
+	orange_session_store_for_each(self->sessions, _export_session, out); 
+	blob_close_array(out, a); 
+}
+
+int orange_import_sessions(struct orange *self, const struct blob_field *sessions){
+	const struct blob_field *item; 
+	int count = 0; 
+	if(!sessions) return 0; 
 	pthread_mutex_lock(&self->lock); 
-	struct avl_node *node = avl_find(&self->sessions, sid); 
-	if(!node) {
-		pthread_mutex_unlock(&self->lock); 
-		return -EINVAL; 
+	blob_field_for_each_child(sessions, item){
+		// [sid, username, seconds left, timeout]
+		const struct blob_field *fsid = blob_field_first_child(item); 
+		const struct blob_field *fuser = (fsid)?blob_field_next_child(item, fsid):NULL; 
+		const struct blob_field *fleft = (fuser)?blob_field_next_child(item, fuser):NULL; 
+		const struct blob_field *ftimeout = (fleft)?blob_field_next_child(item, fleft):NULL; 
+		if(!ftimeout || blob_field_type(fsid) != BLOB_FIELD_STRING || blob_field_type(fuser) != BLOB_FIELD_STRING) continue; 
+
+		const char *sid = blob_field_get_string(fsid); 
+		long long left = blob_field_get_int(fleft), timeout = blob_field_get_int(ftimeout); 
+		if(strlen(sid) != sizeof(((struct orange_sid*)0)->hash) - 1 || left <= 0 || timeout <= 0) continue; 
+
+		// sessions of users that no longer exist are dropped
+		struct avl_node *node = avl_find(&self->users, blob_field_get_string(fuser)); 
+		if(!node) continue; 
+		struct orange_user *user = container_of(node, struct orange_user, avl); 
+
+		struct orange_session *ses = orange_session_new(user, timeout); 
+		strcpy(ses->sid.hash, sid); 
+		orange_session_set_expiry(ses, left); 
+		_load_session_acls(self, ses); 
+		if(orange_session_store_insert(self->sessions, ses) != 0){
+			orange_session_delete(&ses); 
+			continue; 
+		}
+		count++; 
 	}
-	struct orange_session *ses = container_of(node, struct orange_session, avl); 
-	avl_delete(&self->sessions, node); 
-	orange_session_delete(&ses); 
 	pthread_mutex_unlock(&self->lock); 
-	return 0; 
+	return count; 
 }
 
 int orange_call(struct orange *self, const char *sid, const char *object, const char *method, const struct blob_field *args, struct blob *out){
+	return orange_call_cancelable(self, sid, object, method, args, NULL, out); 
+}
+
+int orange_call_cancelable(struct orange *self, const char *sid, const char *object, const char *method, const struct blob_field *args, const volatile int *cancel, struct blob *out){
+	// session stays valid until we drop our reference even if it is logged out while the call is running
+	struct orange_session *ses = orange_session_store_find(self->sessions, sid); 
+
 	pthread_mutex_lock(&self->lock); 
 
 	struct avl_node *avl = avl_find(&self->objects, object); 
@@ -456,10 +420,10 @@ int orange_call(struct orange *self, const char *sid, const char *object, const
 		blob_close_table(out, t); 
 
 		pthread_mutex_unlock(&self->lock); 
+		if(ses) orange_session_unref(&ses); 
 		return -ENOENT; 
 	}
 	
-	struct orange_session *ses = _find_session(self, sid); 
 	if(ses) {
 		DEBUG("found session for request: %s\n", sid); 
 	} else {
@@ -491,6 +455,7 @@ int orange_call(struct orange *self, const char *sid, const char *object, const
 		blob_close_table(out, t); 
 
 		pthread_mutex_unlock(&self->lock); 
+		orange_session_unref(&ses); 
 		return -EACCES; 
 	}
 	
@@ -535,6 +500,8 @@ int orange_call(struct orange *self, const char *sid, const char *object, const
 			blob_close_table(out, t); 
 
 			orange_luaobject_delete(&obj); 
+			pthread_mutex_unlock(&self->lock); 
+			orange_session_unref(&ses); 
 			return -ENOENT; 
 		}
 		do_free = true; 
@@ -544,14 +511,24 @@ int orange_call(struct orange *self, const char *sid, const char *object, const
 	// so we enable concurrency and run the actual backend script
 	pthread_mutex_unlock(&self->lock); 
 
-	int ret = orange_luaobject_call(obj, ses, method, args, out); 
+	int ret = orange_luaobject_call(obj, ses, method, args, cancel, out); 
 
 	if(do_free)
 		orange_luaobject_delete(&obj); 
+	orange_session_unref(&ses); 
 
 	return ret; 
 }
 
+enum orange_lane orange_method_lane(struct orange *self, const char *object, const char *method){
+	enum orange_lane lane = ORANGE_LANE_NORMAL; 
+	pthread_mutex_lock(&self->lock); 
+	struct avl_node *avl = avl_find(&self->objects, object); 
+	if(avl) lane = orange_luaobject_lane(container_of(avl, struct orange_luaobject, avl), method); 
+	pthread_mutex_unlock(&self->lock); 
+	return lane; 
+}
+
 int orange_list(struct orange *self, const char *sid, const char *path, struct blob *out){
 	pthread_mutex_lock(&self->lock); 
 	struct orange_luaobject *entry; 
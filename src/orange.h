@@ -27,14 +27,28 @@
 
 struct orange_message; 
 
+// scheduling class of a request. Plugins can move their methods to another lane using a __lanes table. 
+enum orange_lane {
+	ORANGE_LANE_CONTROL, // login, challenge and other cheap calls that must stay responsive
+	ORANGE_LANE_NORMAL, 
+	ORANGE_LANE_BULK, // slow calls (scans, shell commands)
+	ORANGE_LANE_COUNT
+}; 
+
+struct orange_session_store; 
+struct orange_acl_cache; 
+struct orange_creds; 
+
 struct orange {
 	struct avl_tree objects; 
-	struct avl_tree sessions; 
+	struct orange_session_store *sessions; // has its own lock so session lookups do not take the lock below
 	struct avl_tree users; 
 	
 	char *plugin_path; 	
 	char *pwfile; 
+	struct orange_creds *creds; // has its own lock
 	char *acl_path; 
+	struct orange_acl_cache *acl_cache; // has its own lock
 
 	pthread_mutex_t lock; 
 }; 
@@ -48,9 +62,22 @@ int orange_login_plaintext(struct orange *self, const char *username, const char
 int orange_login(struct orange *self, const char *username, const char *challenge, const char *response, struct orange_sid *new_sid); 
 int orange_logout(struct orange *self, const char *sid); 
 bool orange_session_is_valid(struct orange *self, const char *sid); 
+// checks that session may subscribe to events matching pattern (acl line "event <pattern> * r"). Returns 0 or -EACCES. 
+int orange_event_access(struct orange *self, const char *sid, const char *pattern); 
+// checks whether any acl file has entries in the "event" scope
+bool orange_has_event_acls(struct orange *self); 
 //struct orange_session* orange_find_session(struct orange *self, const char *sid); 
+// puts all live sessions into out as an array of [sid, username, seconds left, timeout] so that they can be 
+// restored by another instance with orange_import_sessions(). Acls are loaded again from the user profiles on 
+// import so changes to acl files take effect. Returns number of sessions restored. 
+void orange_export_sessions(struct orange *self, struct blob *out); 
+int orange_import_sessions(struct orange *self, const struct blob_field *sessions); 
 int orange_list(struct orange *self, const char *sid, const char *path, struct blob *out); 
 
-int orange_call(struct orange *self, const char *sid, const char *object, const char *method, const struct blob_field *args, struct blob *out); 
+int orange_call(struct orange *self, const char *sid, const char *object, const char *method, const struct blob_field *args, struct blob *out);
+// same as orange_call but the call is aborted when *cancel becomes nonzero
+int orange_call_cancelable(struct orange *self, const char *sid, const char *object, const char *method, const struct blob_field *args, const volatile int *cancel, struct blob *out);
+// returns lane hint for a method (ORANGE_LANE_NORMAL if plugin does not specify one)
+enum orange_lane orange_method_lane(struct orange *self, const char *object, const char *method);  
   
 
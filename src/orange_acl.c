@@ -0,0 +1,343 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_acl.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fnmatch.h>
+#include <alloca.h>
+#include <utype/avl.h>
+#include <utype/avl-cmp.h>
+#include <utype/list.h>
+#include <utype/utils.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+enum {
+	ACL_MATCH_EXACT, // no wildcards
+	ACL_MATCH_ANY, // rest of the pattern is a single '*'
+	ACL_MATCH_GLOB
+}; 
+
+struct acl_rule {
+	struct list_head list; // all rules of the scope in the order they were granted
+	struct list_head node_list; // rules attached to the same trie node
+	char *object; 
+	char *method; 
+	char *perms; // revoked permissions are replaced with '-'
+	orange_perms_t mask; 
+	size_t prefix_len; // length of literal part of object pattern
+	int object_match; 
+	int method_match; 
+}; 
+
+struct acl_node {
+	struct acl_node *child; 
+	struct acl_node *next; // next sibling
+	char ch; 
+	struct list_head rules; 
+}; 
+
+struct acl_scope {
+	struct avl_node avl; 
+	struct list_head rules; 
+	struct acl_node root; 
+}; 
+
+struct orange_acl {
+	struct avl_tree scopes; 
+	int refcount; 
+}; 
+
+static orange_perms_t _perm_bit(char c){
+	if(c >= 'a' && c <= 'z') return 1ULL << (c - 'a'); 
+	if(c >= 'A' && c <= 'Z') return 1ULL << (c - 'A' + 26); 
+	return 0; 
+}
+
+bool orange_acl_perms(const char *perms, orange_perms_t *mask){
+	bool valid = true; 
+	*mask = 0; 
+	for(; *perms; perms++){
+		orange_perms_t bit = _perm_bit(*perms); 
+		if(!bit) valid = false; 
+		*mask |= bit; 
+	}
+	return valid; 
+}
+
+static int _match_type(const char *pattern){
+	size_t len = strcspn(pattern, "*?["); 
+	if(!pattern[len]) return ACL_MATCH_EXACT; 
+	if(!strcmp(pattern + len, "*")) return ACL_MATCH_ANY; 
+	return ACL_MATCH_GLOB; 
+}
+
+static struct acl_node *_node_new(char ch){
+	struct acl_node *self = calloc(1, sizeof(struct acl_node)); 
+	assert(self); 
+	self->ch = ch; 
+	INIT_LIST_HEAD(&self->rules); 
+	return self; 
+}
+
+static void _node_free_children(struct acl_node *self){
+	struct acl_node *child = self->child; 
+	while(child){
+		struct acl_node *next = child->next; 
+		_node_free_children(child); 
+		free(child); 
+		child = next; 
+	}
+	self->child = NULL; 
+}
+
+static struct acl_node *_node_child(struct acl_node *self, char ch){
+	for(struct acl_node *child = self->child; child; child = child->next){
+		if(child->ch == ch) return child; 
+	}
+	return NULL; 
+}
+
+struct orange_acl *orange_acl_new(void){
+	struct orange_acl *self = calloc(1, sizeof(struct orange_acl)); 
+	assert(self); 
+	avl_init(&self->scopes, avl_strcmp, false, NULL); 
+	self->refcount = 1; 
+	return self; 
+}
+
+void orange_acl_delete(struct orange_acl **_self){
+	assert(*_self); 
+	struct orange_acl *self = *_self; 
+	struct acl_scope *scope, *nscope; 
+	avl_remove_all_elements(&self->scopes, scope, avl, nscope){
+		struct acl_rule *rule, *nrule; 
+		list_for_each_entry_safe(rule, nrule, &scope->rules, list){
+			free(rule); 
+		}
+		_node_free_children(&scope->root); 
+		free(scope); 
+	}
+	free(self); 
+	*_self = NULL; 
+}
+
+struct orange_acl *orange_acl_ref(struct orange_acl *self){
+	__atomic_add_fetch(&self->refcount, 1, __ATOMIC_RELAXED); 
+	return self; 
+}
+
+void orange_acl_unref(struct orange_acl **self){
+	if(__atomic_sub_fetch(&(*self)->refcount, 1, __ATOMIC_ACQ_REL) == 0){
+		orange_acl_delete(self); 
+	}
+	*self = NULL; 
+}
+
+int orange_acl_grant(struct orange_acl *self, const char *scope_name, const char *object, const char *method, const char *perms){
+	struct acl_scope *scope; 
+	struct acl_rule *rule; 
+	char *new_scope, *new_obj, *new_method, *new_perms; 
+
+	if(!scope_name || !object || !method || !perms) return -EINVAL; 
+
+	scope = avl_find_element(&self->scopes, scope_name, scope, avl); 
+	if(!scope){
+		scope = calloc_a(sizeof(*scope), &new_scope, strlen(scope_name) + 1); 
+		if(!scope) return -ENOMEM; 
+		scope->avl.key = strcpy(new_scope, scope_name); 
+		INIT_LIST_HEAD(&scope->rules); 
+		INIT_LIST_HEAD(&scope->root.rules); 
+		avl_insert(&self->scopes, &scope->avl); 
+	}
+
+	rule = calloc_a(sizeof(*rule), 
+		&new_obj, strlen(object) + 1, 
+		&new_method, strlen(method) + 1, 
+		&new_perms, strlen(perms) + 1); 
+	if(!rule) return -ENOMEM; 
+
+	rule->object = strcpy(new_obj, object); 
+	rule->method = strcpy(new_method, method); 
+	rule->perms = strcpy(new_perms, perms); 
+	orange_acl_perms(perms, &rule->mask); 
+	rule->prefix_len = strcspn(object, "*?["); 
+	rule->object_match = _match_type(object); 
+	rule->method_match = (!strcmp(method, "*"))?ACL_MATCH_ANY:((_match_type(method) == ACL_MATCH_EXACT)?ACL_MATCH_EXACT:ACL_MATCH_GLOB); 
+
+	// attach the rule to the node at the end of its literal prefix
+	struct acl_node *node = &scope->root; 
+	for(size_t c = 0; c < rule->prefix_len; c++){
+		struct acl_node *child = _node_child(node, object[c]); 
+		if(!child){
+			child = _node_new(object[c]); 
+			child->next = node->child; 
+			node->child = child; 
+		}
+		node = child; 
+	}
+	list_add_tail(&rule->node_list, &node->rules); 
+	list_add_tail(&rule->list, &scope->rules); 
+
+	return 0; 
+}
+
+int orange_acl_revoke(struct orange_acl *self, const char *scope_name, const char *object, const char *method, const char *perms){
+	struct acl_scope *scope; 
+	struct acl_rule *rule; 
+
+	if(!scope_name || !object || !method || !perms) return -EINVAL; 
+
+	scope = avl_find_element(&self->scopes, scope_name, scope, avl); 
+	if(!scope) return -ENOENT; 
+
+	orange_perms_t mask; 
+	orange_acl_perms(perms, &mask); 
+
+	list_for_each_entry(rule, &scope->rules, list){
+		if(fnmatch(rule->object, object, FNM_NOESCAPE) || fnmatch(rule->method, method, FNM_NOESCAPE)) continue; 
+		rule->mask &= ~mask; 
+		for(char *p = rule->perms; *p; p++){
+			if(strchr(perms, *p)) *p = '-'; 
+		}
+	}
+	return 0; 
+}
+
+static char *_load_file(const char *path){
+	int fd = open(path, O_RDONLY); 
+	if(fd == -1) return NULL; 
+	int filesize = lseek(fd, 0, SEEK_END); 
+	lseek(fd, 0, SEEK_SET); 
+	char *text = calloc(1, filesize + 1); 
+	assert(text); 
+	int ret = read(fd, text, filesize); 
+	close(fd); 
+	if(ret != filesize) { free(text); return NULL; }
+	return text; 
+}
+
+int orange_acl_load(struct orange_acl *self, const char *path){
+	char *text = _load_file(path); 
+	if(!text) return -ENOENT; 
+	char *cur = text; 	
+	int line = 1; 
+	while(true){
+		char *nl = strchr(cur, '\n'); 
+		char *sp = NULL; 
+		if(nl) *nl = 0; 
+		char *scope = strtok_r(cur, " ", &sp); 
+		char *object = strtok_r(NULL, " ", &sp); 
+		char *method = strtok_r(NULL, " ", &sp); 
+		char *perm = strtok_r(NULL, " ", &sp); 
+		if(scope && object && method && perm){
+			if(scope[0] == '!'){
+				DEBUG("revoking acl '%s %s %s %s'\n", scope + 1, object, method, perm); 
+				orange_acl_revoke(self, scope + 1, object, method, perm); 
+			} else {
+				DEBUG("granting acl '%s %s %s %s'\n", scope, object, method, perm); 
+				orange_acl_grant(self, scope, object, method, perm); 
+			} 
+		} else {
+			ERROR("parse error on line %d of %s: expected 4 fields separated by spaces!\n", line, path); 	
+		}
+		if(!nl) break; // if this was the last line then we break 
+		cur = nl; *cur = '\n'; // restore newline 
+		while(*cur != '\n' && *cur != 0) cur++; 
+		while(*cur == '\n') cur++; 
+		if(*cur == 0) break; 
+		line++; 
+	}
+	free(text); 
+	return 0; 
+}
+
+void orange_acl_merge(struct orange_acl *self, struct orange_acl *other){
+	struct acl_scope *scope; 
+	struct acl_rule *rule; 
+	avl_for_each_element(&other->scopes, scope, avl){
+		list_for_each_entry(rule, &scope->rules, list){
+			// revoked permissions are '-' in the string so they stay revoked
+			orange_acl_grant(self, scope->avl.key, rule->object, rule->method, rule->perms); 
+		}
+	}
+}
+
+static bool _rule_matches(struct acl_rule *rule, const char *object_rest, const char *method){
+	switch(rule->object_match){
+		case ACL_MATCH_EXACT: if(*object_rest) return false; break; 
+		case ACL_MATCH_ANY: break; 
+		default: if(fnmatch(rule->object + rule->prefix_len, object_rest, FNM_NOESCAPE)) return false; break; 
+	}
+	switch(rule->method_match){
+		case ACL_MATCH_EXACT: return !strcmp(rule->method, method); 
+		case ACL_MATCH_ANY: return true; 
+		default: return !fnmatch(rule->method, method, FNM_NOESCAPE); 
+	}
+}
+
+bool orange_acl_lookup(struct orange_acl *self, const char *scope_name, const char *object, const char *method, orange_perms_t *perms){
+	struct acl_scope *scope; 
+	struct acl_rule *rule; 
+
+	*perms = 0; 
+	if(!scope_name || !object || !method) return false; 
+
+	scope = avl_find_element(&self->scopes, scope_name, scope, avl); 
+	if(!scope) return false; 
+
+	struct acl_node *node = &scope->root; 
+	const char *rest = object; 
+	while(node){
+		list_for_each_entry(rule, &node->rules, node_list){
+			if((rule->mask & ~*perms) && _rule_matches(rule, rest, method)) *perms |= rule->mask; 
+		}
+		if(!*rest) break; 
+		node = _node_child(node, *rest++); 
+	}
+	return true; 
+}
+
+void orange_acl_to_blob(struct orange_acl *self, struct blob *buf){
+	struct acl_scope *scope; 
+	struct acl_rule *rule; 
+
+	avl_for_each_element(&self->scopes, scope, avl){
+		blob_put_string(buf, scope->avl.key); 
+		blob_offset_t s = blob_open_table(buf); 
+		list_for_each_entry(rule, &scope->rules, list){
+			char *prefix = alloca(rule->prefix_len + 1); 
+			strncpy(prefix, rule->object, rule->prefix_len); 
+			prefix[rule->prefix_len] = 0; 
+			blob_put_string(buf, prefix); 
+			blob_offset_t a = blob_open_table(buf); 
+			blob_put_string(buf, "object"); 
+			blob_put_string(buf, rule->object); 
+			blob_put_string(buf, "method"); 
+			blob_put_string(buf, rule->method); 
+			blob_put_string(buf, "perms"); 
+			blob_put_string(buf, rule->perms); 
+			blob_close_table(buf, a); 
+		}
+		blob_close_table(buf, s); 
+	}
+}
@@ -0,0 +1,73 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Compiled access control lists. 
+
+	An acl is a set of rules of the form "scope object method perms" where
+	object and method are glob patterns and perms is a string of permission
+	letters. Access to an object and method is the union of the perms of all
+	rules in the scope whose patterns match. 
+
+	Rules of each scope are kept in a trie over the literal part of their
+	object pattern (everything before the first wildcard), so a lookup walks
+	the object name once and only looks at rules whose literal prefix matches.
+	Patterns that are plain strings or end in a single '*' are matched without
+	calling fnmatch(). Permissions are kept as bit masks with one bit for each
+	letter. Other characters can not be granted. 
+
+	Revoking clears permissions from the rules that have already been granted
+	and match the given object and method. Rules granted later are not
+	affected. 
+
+	An acl has no lock of its own. Callers serialize changes and lookups.
+	Acls that are shared through references must not be changed anymore and
+	can then be read by any number of threads at once. 
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <blobpack/blobpack.h>
+
+typedef uint64_t orange_perms_t; 
+
+struct orange_acl; 
+
+struct orange_acl *orange_acl_new(void); 
+void orange_acl_delete(struct orange_acl **self); 
+// takes another reference. New acls start with one reference. 
+struct orange_acl *orange_acl_ref(struct orange_acl *self); 
+// drops a reference and deletes the acl when it was the last one
+void orange_acl_unref(struct orange_acl **self); 
+
+// reads rules from an acl file with one "scope object method perms" rule per line. Scopes starting with '!' revoke. 
+int orange_acl_load(struct orange_acl *self, const char *path); 
+// appends copies of all rules of other in the same order
+void orange_acl_merge(struct orange_acl *self, struct orange_acl *other); 
+
+int orange_acl_grant(struct orange_acl *self, const char *scope, const char *object, const char *method, const char *perms); 
+// returns -ENOENT if scope has no rules
+int orange_acl_revoke(struct orange_acl *self, const char *scope, const char *object, const char *method, const char *perms); 
+// sets perms to the permissions granted for object and method. Returns false if scope has no rules. 
+bool orange_acl_lookup(struct orange_acl *self, const char *scope, const char *object, const char *method, orange_perms_t *perms); 
+
+// converts a permission string to a mask. Returns false if the string contains characters that can not be granted. 
+bool orange_acl_perms(const char *perms, orange_perms_t *mask); 
+
+// writes scopes and their rules into an open table
+void orange_acl_to_blob(struct orange_acl *self, struct blob *buf); 
@@ -0,0 +1,163 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_acl_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <glob.h>
+#include <alloca.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <utype/avl.h>
+#include <utype/avl-cmp.h>
+#include <utype/utils.h>
+
+#include "internal.h"
+
+struct acl_file {
+	char *path; 
+	struct stat st; 
+}; 
+
+struct acl_profile {
+	struct avl_node avl; 
+	char *key; // names of user acls separated by newlines
+	struct orange_acl *acl; 
+	struct stat dir_st; 
+	struct acl_file *files; 
+	size_t num_files; 
+}; 
+
+struct orange_acl_cache {
+	pthread_mutex_t lock; 
+	char *dir; 
+	struct avl_tree profiles; 
+}; 
+
+static bool _stat_changed(const struct stat *a, const struct stat *b){
+	return a->st_ino != b->st_ino || a->st_size != b->st_size || 
+		a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec; 
+}
+
+static void _profile_delete(struct acl_profile **_self){
+	struct acl_profile *self = *_self; 
+	for(size_t c = 0; c < self->num_files; c++) free(self->files[c].path); 
+	free(self->files); 
+	orange_acl_unref(&self->acl); 
+	free(self->key); 
+	free(self); 
+	*_self = NULL; 
+}
+
+static bool _profile_valid(struct orange_acl_cache *self, struct acl_profile *profile){
+	struct stat st; 
+	// adding, removing or renaming files changes the directory
+	if(stat(self->dir, &st) != 0 || _stat_changed(&st, &profile->dir_st)) return false; 
+	for(size_t c = 0; c < profile->num_files; c++){
+		if(stat(profile->files[c].path, &st) != 0 || _stat_changed(&st, &profile->files[c].st)) return false; 
+	}
+	return true; 
+}
+
+static void _profile_add_file(struct acl_profile *self, const char *path){
+	struct stat st; 
+	if(stat(path, &st) != 0) return; 
+	DEBUG("loading acls from %s\n", path); 
+	if(orange_acl_load(self->acl, path) != 0) return; 
+	self->files = realloc(self->files, sizeof(struct acl_file) * (self->num_files + 1)); 
+	assert(self->files); 
+	self->files[self->num_files].path = strdup(path); 
+	self->files[self->num_files].st = st; 
+	self->num_files++; 
+}
+
+static struct acl_profile *_profile_new(struct orange_acl_cache *self, const char *key, struct orange_user *user){
+	struct acl_profile *profile = calloc(1, sizeof(struct acl_profile)); 
+	assert(profile); 
+	profile->key = strdup(key); 
+	profile->avl.key = profile->key; 
+	profile->acl = orange_acl_new(); 
+	// taken before reading so that changes made while we read are seen next time
+	if(stat(self->dir, &profile->dir_st) != 0) memset(&profile->dir_st, 0, sizeof(profile->dir_st)); 
+
+	struct orange_user_acl *uacl; 
+	orange_user_for_each_acl(user, uacl){
+		char path[255]; 
+		glob_t glob_result; 
+		snprintf(path, sizeof(path), "%s/%s.acl", self->dir, (const char*)uacl->avl.key); 
+		if(glob(path, 0, NULL, &glob_result) == 0){
+			for(size_t i = 0; i < glob_result.gl_pathc; ++i){
+				_profile_add_file(profile, glob_result.gl_pathv[i]); 
+			}
+		}
+		globfree(&glob_result); 
+	}
+	return profile; 
+}
+
+struct orange_acl_cache *orange_acl_cache_new(const char *dir){
+	struct orange_acl_cache *self = calloc(1, sizeof(struct orange_acl_cache)); 
+	assert(self); 
+	pthread_mutex_init(&self->lock, NULL); 
+	self->dir = strdup(dir); 
+	avl_init(&self->profiles, avl_strcmp, false, NULL); 
+	return self; 
+}
+
+void orange_acl_cache_delete(struct orange_acl_cache **_self){
+	assert(*_self); 
+	struct orange_acl_cache *self = *_self; 
+	struct acl_profile *profile, *nprofile; 
+	avl_remove_all_elements(&self->profiles, profile, avl, nprofile){
+		_profile_delete(&profile); 
+	}
+	free(self->dir); 
+	pthread_mutex_destroy(&self->lock); 
+	free(self); 
+	*_self = NULL; 
+}
+
+struct orange_acl *orange_acl_cache_get(struct orange_acl_cache *self, struct orange_user *user){
+	struct orange_user_acl *uacl; 
+	size_t len = 1; 
+	orange_user_for_each_acl(user, uacl){
+		len += strlen((const char*)uacl->avl.key) + 1; 
+	}
+	char *key = alloca(len); 
+	key[0] = 0; 
+	orange_user_for_each_acl(user, uacl){
+		strcat(key, (const char*)uacl->avl.key); 
+		strcat(key, "\n"); 
+	}
+
+	pthread_mutex_lock(&self->lock); 
+	struct acl_profile *profile = avl_find_element(&self->profiles, key, profile, avl); 
+	if(profile && !_profile_valid(self, profile)){
+		DEBUG("acl files changed. Reloading acls.\n"); 
+		avl_delete(&self->profiles, &profile->avl); 
+		_profile_delete(&profile); 
+	}
+	if(!profile){
+		profile = _profile_new(self, key, user); 
+		avl_insert(&self->profiles, &profile->avl); 
+	}
+	struct orange_acl *acl = orange_acl_ref(profile->acl); 
+	pthread_mutex_unlock(&self->lock); 
+	return acl; 
+}
@@ -0,0 +1,39 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Cache of acls compiled from acl files. 
+
+	Users that have the same list of acl names get the same compiled acl so
+	acl files are parsed once and not for every login. Cached acls are never
+	changed and are shared by reference. Before a cached acl is handed out
+	the acl directory and every file it was built from are checked with
+	stat(). If any of them has changed (or files were added or removed) the
+	acl is built again. Sessions that still hold the old acl keep using it.
+*/
+
+#pragma once
+
+#include "orange_acl.h"
+#include "orange_user.h"
+
+struct orange_acl_cache; 
+
+struct orange_acl_cache *orange_acl_cache_new(const char *dir); 
+void orange_acl_cache_delete(struct orange_acl_cache **self); 
+
+// returns a reference to the acl built from all acl files of the user. Release it with orange_acl_unref(). 
+struct orange_acl *orange_acl_cache_get(struct orange_acl_cache *self, struct orange_user *user); 
@@ -0,0 +1,222 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_coalesce.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <utype/avl.h>
+#include <utype/avl-cmp.h>
+#include <utype/list.h>
+#include <utype/utils.h>
+#include <blobpack/blobpack.h>
+
+// token counts are kept in millionths so that buckets can be refilled with integer math
+#define TOKEN 1000000ULL
+// longest key (event name and data value)
+#define COALESCE_MAX_KEY 256
+
+struct coalesce_entry {
+	struct avl_node avl; 
+	char *key; 
+	char *name; 
+	struct blob data; // latest payload while pending
+	bool pending; 
+	struct list_head list; // entry in pending list (in order of arrival)
+	unsigned long long ts_due; // pending event is not delivered before this time
+	unsigned long long tokens; 
+	unsigned long long ts_refill; 
+}; 
+
+struct orange_coalesce {
+	struct avl_tree entries; 
+	struct list_head pending; 
+	unsigned long long window_us; 
+	unsigned int rate; 
+	unsigned int burst; 
+	char *data_key; 
+	struct orange_coalesce_stats stats; 
+}; 
+
+struct orange_coalesce *orange_coalesce_new(void){
+	struct orange_coalesce *self = calloc(1, sizeof(struct orange_coalesce)); 
+	assert(self); 
+	avl_init(&self->entries, avl_strcmp, false, NULL); 
+	INIT_LIST_HEAD(&self->pending); 
+	return self; 
+}
+
+static void _entry_free(struct coalesce_entry *e){
+	list_del_init(&e->list); 
+	blob_free(&e->data); 
+	free(e->key); 
+	free(e->name); 
+	free(e); 
+}
+
+void orange_coalesce_delete(struct orange_coalesce **self){
+	struct coalesce_entry *e, *tmp; 
+	avl_remove_all_elements(&(*self)->entries, e, avl, tmp){
+		_entry_free(e); 
+	}
+	free((*self)->data_key); 
+	free(*self); 
+	*self = NULL; 
+}
+
+void orange_coalesce_configure(struct orange_coalesce *self, unsigned long long window_us, unsigned int rate, unsigned int burst, const char *data_key){
+	self->window_us = window_us; 
+	self->rate = rate; 
+	self->burst = (burst)?burst:rate; 
+	free(self->data_key); 
+	self->data_key = (data_key && *data_key)?strdup(data_key):NULL; 
+}
+
+bool orange_coalesce_enabled(struct orange_coalesce *self){
+	return self->window_us || self->rate; 
+}
+
+// builds key from event name and value of the data key field. Returns -ENOSPC if key does not fit. 
+static int _make_key(struct orange_coalesce *self, const char *name, const struct blob_field *data, char *key, size_t size){
+	const char *value = NULL; 
+	char num[32]; 
+	if(self->data_key && data && blob_field_type(data) == BLOB_FIELD_TABLE){
+		struct blob_field *k; 
+		// table is stored as key, value pairs
+		blob_field_for_each_child(data, k){
+			struct blob_field *v = blob_field_next_child(data, k); 
+			if(!v) break; 
+			if(strcmp(blob_field_get_string(k), self->data_key) == 0){
+				if(blob_field_type(v) == BLOB_FIELD_STRING){
+					value = blob_field_get_string(v); 
+				} else {
+					snprintf(num, sizeof(num), "%lld", blob_field_get_int(v)); 
+					value = num; 
+				}
+				break; 
+			}
+			k = v; 
+		}
+	}
+	int len = (value)?snprintf(key, size, "%s\x1f%s", name, value):snprintf(key, size, "%s", name); 
+	return (len < 0 || (size_t)len >= size)?-ENOSPC:0; 
+}
+
+static unsigned long long _tokens_at(struct orange_coalesce *self, struct coalesce_entry *e, unsigned long long now_us){
+	unsigned long long max = self->burst * TOKEN; 
+	unsigned long long tokens = e->tokens; 
+	if(now_us > e->ts_refill) tokens += (now_us - e->ts_refill) * self->rate; 
+	return (tokens > max)?max:tokens; 
+}
+
+static void _refill(struct orange_coalesce *self, struct coalesce_entry *e, unsigned long long now_us){
+	e->tokens = _tokens_at(self, e, now_us); 
+	e->ts_refill = now_us; 
+}
+
+// time at which the pending event of entry can be delivered
+static unsigned long long _ready_at(struct orange_coalesce *self, struct coalesce_entry *e, unsigned long long now_us){
+	if(!self->rate) return e->ts_due; 
+	unsigned long long tokens = _tokens_at(self, e, now_us); 
+	unsigned long long t = now_us; 
+	if(tokens < TOKEN) t += (TOKEN - tokens + self->rate - 1) / self->rate; 
+	return (t > e->ts_due)?t:e->ts_due; 
+}
+
+// removes keys that carry no state (nothing pending and a full bucket)
+static void _sweep(struct orange_coalesce *self, unsigned long long now_us){
+	struct coalesce_entry *e, *tmp; 
+	avl_for_each_element_safe(&self->entries, e, avl, tmp){
+		if(e->pending) continue; 
+		if(self->rate && _tokens_at(self, e, now_us) < self->burst * TOKEN) continue; 
+		avl_delete(&self->entries, &e->avl); 
+		_entry_free(e); 
+		self->stats.keys--; 
+	}
+}
+
+int orange_coalesce_push(struct orange_coalesce *self, const char *name, const struct blob_field *data, unsigned long long now_us){
+	char key[COALESCE_MAX_KEY]; 
+	if(!name || _make_key(self, name, data, key, sizeof(key)) < 0) return -ENOSPC; 
+	struct coalesce_entry *e = avl_find_element(&self->entries, key, e, avl); 
+	if(!e){
+		if(self->stats.keys >= ORANGE_COALESCE_MAX_KEYS) _sweep(self, now_us); 
+		if(self->stats.keys >= ORANGE_COALESCE_MAX_KEYS) return -ENOSPC; 
+		e = calloc(1, sizeof(struct coalesce_entry)); 
+		assert(e); 
+		e->key = strdup(key); 
+		e->name = strdup(name); 
+		e->avl.key = e->key; 
+		blob_init(&e->data, 0, 0); 
+		INIT_LIST_HEAD(&e->list); 
+		e->tokens = self->burst * TOKEN; 
+		e->ts_refill = now_us; 
+		avl_insert(&self->entries, &e->avl); 
+		self->stats.keys++; 
+	}
+	if(e->pending){
+		// only the latest payload is delivered
+		if(now_us < e->ts_due) self->stats.merged++; 
+		else self->stats.dropped++; 
+	} else {
+		e->pending = true; 
+		e->ts_due = now_us + self->window_us; 
+		list_add_tail(&e->list, &self->pending); 
+		self->stats.pending++; 
+	}
+	blob_reset(&e->data); 
+	if(data) blob_put_attr(&e->data, data); 
+	return 0; 
+}
+
+int orange_coalesce_flush(struct orange_coalesce *self, unsigned long long now_us, orange_coalesce_emit_fn emit, void *arg){
+	struct coalesce_entry *e, *tmp; 
+	int count = 0; 
+	list_for_each_entry_safe(e, tmp, &self->pending, list){
+		if(now_us < e->ts_due) continue; 
+		if(self->rate){
+			_refill(self, e, now_us); 
+			if(e->tokens < TOKEN) continue; 
+			e->tokens -= TOKEN; 
+		}
+		emit(arg, e->name, blob_field_first_child(blob_head(&e->data))); 
+		e->pending = false; 
+		list_del_init(&e->list); 
+		self->stats.pending--; 
+		self->stats.delivered++; 
+		count++; 
+	}
+	return count; 
+}
+
+long long orange_coalesce_next_due(struct orange_coalesce *self, unsigned long long now_us){
+	struct coalesce_entry *e; 
+	long long next = -1; 
+	list_for_each_entry(e, &self->pending, list){
+		unsigned long long t = _ready_at(self, e, now_us); 
+		long long left = (t > now_us)?(long long)(t - now_us):0; 
+		if(next < 0 || left < next) next = left; 
+		if(next == 0) break; 
+	}
+	return next; 
+}
+
+void orange_coalesce_get_stats(struct orange_coalesce *self, struct orange_coalesce_stats *stats){
+	*stats = self->stats; 
+}
@@ -0,0 +1,77 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Coalescing and rate limiting of broadcast events. 
+
+	Events are grouped by key. The key is the event name, optionally
+	followed by the value of one field of the event data (for example
+	"interface" so that updates of different interfaces are kept apart).
+	The first event of a key is held for window_us and any event of the
+	same key that arrives in the meantime replaces it (counted as merged),
+	so only the latest payload is delivered. 
+
+	Every key also has a token bucket that allows rate events per second
+	with bursts of up to burst events. An event that is due but finds the
+	bucket empty stays pending until a token is available. Events that
+	replace such a held back event are counted as dropped. 
+
+	Keys that have nothing pending and a full bucket carry no state and are
+	removed when the table fills up. Times are given by the caller in
+	microseconds of a monotonic clock. 
+
+	The coalescer is not thread safe. Callers protect it with their own lock. 
+*/
+
+#pragma once
+
+#include <stdbool.h>
+
+struct blob_field; 
+
+// most keys tracked at the same time. Events of further keys are not coalesced. 
+#define ORANGE_COALESCE_MAX_KEYS 256
+
+struct orange_coalesce; 
+
+struct orange_coalesce_stats {
+	unsigned long long merged; // replaced within the window
+	unsigned long long dropped; // replaced while held back by the rate limit
+	unsigned long long delivered; 
+	unsigned int pending; 
+	unsigned int keys; 
+}; 
+
+typedef void (*orange_coalesce_emit_fn)(void *arg, const char *name, const struct blob_field *data); 
+
+struct orange_coalesce *orange_coalesce_new(void); 
+void orange_coalesce_delete(struct orange_coalesce **self); 
+
+// rate is events per second for each key (0 for no limit) and burst defaults to rate if 0. 
+// data_key names the field of event data that becomes part of the key (NULL to use event name only). 
+// Coalescing is disabled when both window_us and rate are 0. 
+void orange_coalesce_configure(struct orange_coalesce *self, unsigned long long window_us, unsigned int rate, unsigned int burst, const char *data_key); 
+bool orange_coalesce_enabled(struct orange_coalesce *self); 
+
+// takes over the event. Returns 0 on success and -ENOSPC if no more keys can be tracked 
+// (caller should then deliver the event right away). 
+int orange_coalesce_push(struct orange_coalesce *self, const char *name, const struct blob_field *data, unsigned long long now_us); 
+// calls emit for every pending event that is due. Returns number of delivered events. 
+int orange_coalesce_flush(struct orange_coalesce *self, unsigned long long now_us, orange_coalesce_emit_fn emit, void *arg); 
+// returns microseconds until the next pending event is due (0 if one is due now) or -1 if nothing is pending
+long long orange_coalesce_next_due(struct orange_coalesce *self, unsigned long long now_us); 
+
+void orange_coalesce_get_stats(struct orange_coalesce *self, struct orange_coalesce_stats *stats); 
@@ -0,0 +1,202 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_creds.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <utype/avl.h>
+#include <utype/avl-cmp.h>
+#include <utype/utils.h>
+
+#include "internal.h"
+
+struct creds_entry {
+	struct avl_node avl; 
+	char *hash; 
+}; 
+
+struct creds_table {
+	struct avl_tree users; 
+}; 
+
+struct orange_creds {
+	pthread_rwlock_t lock; // protects table pointer
+	pthread_mutex_t update_lock; // only one thread reads the file at a time
+	char *path; 
+	struct creds_table *table; 
+	struct stat st; // of the file that table was read from
+}; 
+
+static void _table_delete(struct creds_table **_self){
+	struct creds_table *self = *_self; 
+	struct creds_entry *entry, *nentry; 
+	avl_remove_all_elements(&self->users, entry, avl, nentry){
+		free(entry); 
+	}
+	free(self); 
+	*_self = NULL; 
+}
+
+static struct creds_table *_table_new(void){
+	struct creds_table *self = calloc(1, sizeof(struct creds_table)); 
+	assert(self); 
+	// later entries for the same user replace earlier ones
+	avl_init(&self->users, avl_strcmp, false, NULL); 
+	return self; 
+}
+
+static void _table_put(struct creds_table *self, const char *user, const char *hash){
+	struct creds_entry *entry = avl_find_element(&self->users, user, entry, avl); 
+	if(entry){
+		avl_delete(&self->users, &entry->avl); 
+		free(entry); 
+	}
+	char *new_user, *new_hash; 
+	entry = calloc_a(sizeof(*entry), &new_user, strlen(user) + 1, &new_hash, strlen(hash) + 1); 
+	assert(entry); 
+	entry->avl.key = strcpy(new_user, user); 
+	entry->hash = strcpy(new_hash, hash); 
+	avl_insert(&self->users, &entry->avl); 
+}
+
+static struct creds_table *_table_load(const char *path, struct stat *st){
+	int fd = open(path, O_RDONLY); 
+	if(fd == -1) return NULL; 
+	// stat the file we actually read so that a change right after it is not missed
+	if(fstat(fd, st) != 0){
+		close(fd); 
+		return NULL; 
+	}
+	char *text = calloc(1, st->st_size + 1); 
+	assert(text); 
+	ssize_t ret = read(fd, text, st->st_size); 
+	close(fd); 
+	if(ret != st->st_size) {
+		free(text); 
+		return NULL; 
+	}
+
+	DEBUG("loading passwords from %s\n", path); 
+	struct creds_table *table = _table_new(); 
+	char *cur = text; 
+	int line = 0; 
+	while(1){	
+		char *nl = strchr(cur, '\n'); 
+		char *sp = NULL; 
+		if(nl) *nl = 0; 
+		char *user = strtok_r(cur, " ", &sp); 
+		char *hash = strtok_r(NULL, " ", &sp); 
+		if(user && hash){
+			_table_put(table, user, hash); 
+		} else {
+			ERROR("Could not load user password on line %d: expected format <user> <hash>!\n", line); 
+		}
+		if(!nl) break; 
+		cur = nl + 1; 
+		// skip empty lines
+		while(*cur == '\n') cur++; 
+		if(*cur == 0) break; 
+		line++; 
+	}
+	free(text); 
+	return table; 
+}
+
+static bool _stat_changed(const struct stat *a, const struct stat *b){
+	return a->st_ino != b->st_ino || a->st_dev != b->st_dev || a->st_size != b->st_size || 
+		a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec; 
+}
+
+static int _update(struct orange_creds *self){
+	struct stat st; 
+	if(stat(self->path, &st) != 0) return -ENOENT; 
+	if(self->table && !_stat_changed(&st, &self->st)) return 0; 
+
+	struct creds_table *table = _table_load(self->path, &st); 
+	if(!table) return -ENOENT; 
+
+	pthread_rwlock_wrlock(&self->lock); 
+	struct creds_table *old = self->table; 
+	self->table = table; 
+	self->st = st; 
+	pthread_rwlock_unlock(&self->lock); 
+
+	if(old) _table_delete(&old); 
+	return 0; 
+}
+
+struct orange_creds *orange_creds_new(const char *path){
+	struct orange_creds *self = calloc(1, sizeof(struct orange_creds)); 
+	assert(self); 
+	pthread_rwlock_init(&self->lock, NULL); 
+	pthread_mutex_init(&self->update_lock, NULL); 
+	self->path = strdup(path); 
+	if(_update(self) != 0){
+		ERROR("could not load password file from %s\n", path); 
+	}
+	return self; 
+}
+
+void orange_creds_delete(struct orange_creds **_self){
+	assert(*_self); 
+	struct orange_creds *self = *_self; 
+	if(self->table) _table_delete(&self->table); 
+	pthread_rwlock_destroy(&self->lock); 
+	pthread_mutex_destroy(&self->update_lock); 
+	free(self->path); 
+	free(self); 
+	*_self = NULL; 
+}
+
+int orange_creds_update(struct orange_creds *self){
+	pthread_mutex_lock(&self->update_lock); 
+	int ret = _update(self); 
+	pthread_mutex_unlock(&self->update_lock); 
+	return ret; 
+}
+
+int orange_creds_get(struct orange_creds *self, const char *username, char *hash, size_t size){
+	// if another thread is already checking the file then we just use what we have
+	if(pthread_mutex_trylock(&self->update_lock) == 0){
+		_update(self); 
+		pthread_mutex_unlock(&self->update_lock); 
+	}
+
+	int ret = -ENOENT; 
+	pthread_rwlock_rdlock(&self->lock); 
+	struct creds_entry *entry = NULL; 
+	if(self->table && username) entry = avl_find_element(&self->table->users, username, entry, avl); 
+	if(entry){
+		size_t len = strlen(entry->hash); 
+		if(len < size){
+			memcpy(hash, entry->hash, len + 1); 
+			ret = 0; 
+		} else {
+			ret = -ENOSPC; 
+		}
+	}
+	pthread_rwlock_unlock(&self->lock); 
+	return ret; 
+}
@@ -0,0 +1,40 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Password hashes of users. 
+
+	Hashes are read from a file with one "<user> <hash>" entry per line.
+	Lookups check whether the file has changed (inode, size and mtime) and
+	only read it again when it has. The new table is built without holding
+	any lock that lookups need and is then swapped in, so a login storm costs
+	one stat() per login and readers never wait for the file to be parsed.
+	If the file can not be read the last table that was read stays in use. 
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+struct orange_creds; 
+
+struct orange_creds *orange_creds_new(const char *path); 
+void orange_creds_delete(struct orange_creds **self); 
+
+// copies the password hash of username into hash. Returns -ENOENT if user has no hash and -ENOSPC if hash is too small. 
+int orange_creds_get(struct orange_creds *self, const char *username, char *hash, size_t size); 
+// reads the file again if it has changed. Returns -ENOENT if the file can not be read. 
+int orange_creds_update(struct orange_creds *self); 
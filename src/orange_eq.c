@@ -16,50 +16,380 @@
 */
 
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <unistd.h>
 #include <blobpack/blobpack.h>
 
 #include "orange_eq.h"
 #include "util.h"
 
-int orange_eq_open(struct orange_eq *self, const char *queue_name, bool server){
-	memset(self, 0, sizeof(struct orange_eq)); 
-	if(!queue_name) queue_name = "/orangerpcd-events"; 
+#define EQ_DEFAULT_NAME "/orangerpcd-events"
+// shm_open() names live in this directory. The doorbell fifo is created next to the ring. 
+#define EQ_SHM_DIR "/dev/shm"
+
+#define EQ_RING_MAGIC 0x4f455131
+#define EQ_RING_ALIGN(x) (((x) + 7) & ~(size_t)7)
+// how often a waiting server looks at a ring that has an uncommitted reservation
+#define EQ_STUCK_POLL_US 100000LL
+
+enum {
+	EQ_RECORD_FREE, 
+	EQ_RECORD_EVENT, 
+	EQ_RECORD_PAD // filler up to the end of the ring so that records never wrap around
+}; 
+
+// header of every record in the ring. Consumer zeroes records after reading them so free space always reads as EQ_RECORD_FREE. 
+struct eq_record {
+	uint32_t len; 
+	uint32_t state; 
+}; 
+
+static int _mq_open(struct orange_eq *self, const char *queue_name, bool server){
 	if(server){
 		mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-		self->mq = mq_open(queue_name, O_RDONLY | O_CREAT, mode, NULL); 
+		self->mq = mq_open(queue_name, O_RDONLY | O_CREAT | O_NONBLOCK, mode, NULL); 
 	} else {
 		self->mq = mq_open(queue_name, O_WRONLY); 
 	}
-	if(self->mq == -1) return -1; 
+	if(self->mq == -1) return -errno; 
 	mq_getattr(self->mq, &self->attr); 
-	self->buf = malloc(self->attr.mq_msgsize); 
-	if(!self->buf) return -ENOMEM; 
 	return 0; 
 }
 
+#if defined(CONFIG_EQ_SHM)
+static void _bell_path(const char *name, char *path, size_t size){
+	snprintf(path, size, EQ_SHM_DIR "%s.bell", name); 
+}
+
+static int _ring_open(struct orange_eq *self, const char *name, bool server){
+	size_t map_size = sizeof(struct orange_eq_ring) + ORANGE_EQ_SHM_SIZE; 
+	char bell[128]; 
+	struct stat st; 
+	int fd; 
+	if(strlen(name) >= sizeof(self->ring_name) || name[0] != '/') return -EINVAL; 
+	_bell_path(name, bell, sizeof(bell)); 
+	if(server){
+		mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+		// start with a clean ring. Producers that still have the old one mapped will get an error when they ring the bell. 
+		shm_unlink(name); 
+		unlink(bell); 
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode); 
+		if(fd < 0) return -errno; 
+		if(ftruncate(fd, map_size) < 0){
+			int err = errno; 
+			close(fd); 
+			shm_unlink(name); 
+			return -err; 
+		}
+	} else {
+		fd = shm_open(name, O_RDWR | O_CLOEXEC, 0); 
+		if(fd < 0) return -errno; 
+		if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct orange_eq_ring)){
+			close(fd); 
+			return -EINVAL; 
+		}
+		map_size = st.st_size; 
+	}
+	if(fstat(fd, &st) < 0){
+		int err = errno; 
+		close(fd); 
+		if(server) shm_unlink(name); 
+		return -err; 
+	}
+	self->ring_dev = st.st_dev; 
+	self->ring_ino = st.st_ino; 
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); 
+	close(fd); 
+	if(map == MAP_FAILED){
+		if(server) shm_unlink(name); 
+		return -ENOMEM; 
+	}
+	self->ring = (struct orange_eq_ring*)map; 
+	self->ring_map_size = map_size; 
+	strcpy(self->ring_name, name); 
+
+	if(server){
+		// a fresh segment is all zeroes so the ring is empty
+		self->ring->size = ORANGE_EQ_SHM_SIZE; 
+		__atomic_store_n(&self->ring->magic, EQ_RING_MAGIC, __ATOMIC_RELEASE); 
+		// fifo is opened for writing as well so that it does not report hangup when no producer has it open
+		if(mkfifo(bell, S_IRUSR | S_IWUSR | S_IWGRP | S_IWOTH) < 0 || (self->bellfd = open(bell, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0){
+			return -errno; 
+		}
+	} else {
+		uint32_t size = self->ring->size; 
+		if(__atomic_load_n(&self->ring->magic, __ATOMIC_ACQUIRE) != EQ_RING_MAGIC || !size || (size & (size - 1)) || 
+			sizeof(struct orange_eq_ring) + size > map_size){
+			return -EINVAL; 
+		}
+		// fails with ENXIO if there is no server
+		if((self->bellfd = open(bell, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0) return -errno; 
+	}
+	return 0; 
+}
+
+// checks whether the name now refers to another segment (or none) because a new server has created its own ring
+static bool _ring_replaced(struct orange_eq *self){
+	char path[128]; 
+	struct stat st; 
+	snprintf(path, sizeof(path), EQ_SHM_DIR "%s", self->ring_name); 
+	return stat(path, &st) != 0 || st.st_dev != self->ring_dev || st.st_ino != self->ring_ino; 
+}
+
+static void _ring_close(struct orange_eq *self){
+	if(self->bellfd >= 0) close(self->bellfd); 
+	self->bellfd = -1; 
+	if(!self->ring) return; 
+	// producers that still have the ring mapped get -EPIPE from now on
+	if(self->server) __atomic_store_n(&self->ring->closed, 1, __ATOMIC_RELEASE); 
+	munmap(self->ring, self->ring_map_size); 
+	self->ring = NULL; 
+	self->stuck_pending = false; 
+	// after a handoff the name belongs to the ring of the new instance
+	if(self->server && !_ring_replaced(self)){
+		char bell[128]; 
+		_bell_path(self->ring_name, bell, sizeof(bell)); 
+		shm_unlink(self->ring_name); 
+		unlink(bell); 
+	}
+}
+
+static int _ring_send(struct orange_eq *self, const void *data, size_t len){
+	struct orange_eq_ring *ring = self->ring; 
+	size_t size = ring->size; 
+	size_t need = EQ_RING_ALIGN(sizeof(struct eq_record) + len); 
+	size_t pad; 
+	if(len > ORANGE_EQ_SHM_MAX_EVENT) return -EMSGSIZE; 
+	if(__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) return -EPIPE; 
+
+	// reserve space. Padding up to the end of the ring is part of our reservation when the record does not fit there. 
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED); 
+	while(1){
+		uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); 
+		size_t off = head & (size - 1); 
+		pad = (off + need > size)?size - off:0; 
+		// a full ring may also be one that nobody reads any more because the server died
+		if(head + pad + need - tail > size) return (_ring_replaced(self))?-EPIPE:-EAGAIN; 
+		if(__atomic_compare_exchange_n(&ring->head, &head, head + pad + need, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break; 
+	}
+	if(pad){
+		struct eq_record *filler = (struct eq_record*)(ring->data + (head & (size - 1))); 
+		filler->len = pad; 
+		__atomic_store_n(&filler->state, EQ_RECORD_PAD, __ATOMIC_RELEASE); 
+	}
+	struct eq_record *rec = (struct eq_record*)(ring->data + ((head + pad) & (size - 1))); 
+	rec->len = len; 
+	memcpy(rec + 1, data, len); 
+	__atomic_store_n(&rec->state, EQ_RECORD_EVENT, __ATOMIC_RELEASE); 
+
+	// only ring the bell if server is going to sleep. Pairs with the check in orange_eq_wait(). 
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); 
+	if(__atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)){
+		char ch = 0; 
+		if(write(self->bellfd, &ch, 1) < 0 && errno != EAGAIN) return -errno; 
+	}
+	return 0; 
+}
+
+static bool _ring_ready(struct orange_eq *self){
+	struct orange_eq_ring *ring = self->ring; 
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); 
+	struct eq_record *rec = (struct eq_record*)(ring->data + (tail & (ring->size - 1))); 
+	return __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE) != EQ_RECORD_FREE; 
+}
+
+// checks whether the record at tail has been reserved but not committed for longer than ORANGE_EQ_SHM_STUCK_US. 
+// A producer that died in between would stall the ring forever, so the ring is then dropped like a broken one. 
+// Returns true if it was dropped. 
+static bool _ring_stuck(struct orange_eq *self){
+	struct orange_eq_ring *ring = self->ring; 
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); 
+	if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail){
+		self->stuck_pending = false; 
+		return false; 
+	}
+	if(!self->stuck_pending || self->stuck_tail != tail){
+		self->stuck_pending = true; 
+		self->stuck_tail = tail; 
+		timespec_from_now_us(&self->ts_stuck, ORANGE_EQ_SHM_STUCK_US); 
+		return false; 
+	}
+	if(!timespec_expired(&self->ts_stuck)) return false; 
+	_ring_close(self); 
+	return true; 
+}
+
+static int _ring_recv(struct orange_eq *self, struct blob *out){
+	struct orange_eq_ring *ring = self->ring; 
+	size_t size = ring->size; 
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); 
+	while(1){
+		size_t off = tail & (size - 1); 
+		struct eq_record *rec = (struct eq_record*)(ring->data + off); 
+		uint32_t state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE); 
+		size_t len = rec->len; 
+		size_t used = (state == EQ_RECORD_PAD)?len:EQ_RING_ALIGN(sizeof(struct eq_record) + len); 
+		if(state == EQ_RECORD_FREE){
+			_ring_stuck(self); 
+			return -EAGAIN; 
+		}
+		// producers are not trusted. A broken ring is dropped and we continue with the message queue. 
+		if((state != EQ_RECORD_EVENT && state != EQ_RECORD_PAD) || 
+			(state == EQ_RECORD_EVENT && (len > ORANGE_EQ_SHM_MAX_EVENT || off + used > size)) || 
+			(state == EQ_RECORD_PAD && off + used != size)){
+			_ring_close(self); 
+			return -EAGAIN; 
+		}
+		if(state == EQ_RECORD_EVENT) memcpy(self->buf, rec + 1, len); 
+		// free space must read as free records before producers can reserve it again
+		memset(rec, 0, used); 
+		tail += used; 
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); 
+		if(state == EQ_RECORD_EVENT){
+			blob_init(out, self->buf, len); 
+			return 1; 
+		}
+	}
+}
+#else
+static int _ring_open(struct orange_eq *self, const char *name, bool server){ return -ENOTSUP; }
+static void _ring_close(struct orange_eq *self){}
+static int _ring_send(struct orange_eq *self, const void *data, size_t len){ return -ENOTSUP; }
+static bool _ring_ready(struct orange_eq *self){ return false; }
+static bool _ring_stuck(struct orange_eq *self){ return false; }
+static int _ring_recv(struct orange_eq *self, struct blob *out){ return -EAGAIN; }
+#endif
+
+int orange_eq_open_transport(struct orange_eq *self, const char *queue_name, bool server, enum orange_eq_transport transport){
+	memset(self, 0, sizeof(struct orange_eq)); 
+	self->mq = -1; 
+	self->wakefd = -1; 
+	self->bellfd = -1; 
+	self->server = server; 
+	if(!queue_name) queue_name = EQ_DEFAULT_NAME; 
+
+	int ring_ret = -ENOTSUP, mq_ret = -ENOTSUP; 
+	if(transport != ORANGE_EQ_MQUEUE){
+		ring_ret = _ring_open(self, queue_name, server); 
+		if(ring_ret < 0) _ring_close(self); 
+	}
+	// server listens on all transports. Producers only need one. 
+	if(transport == ORANGE_EQ_MQUEUE || (transport == ORANGE_EQ_AUTO && (server || ring_ret < 0))){
+		mq_ret = _mq_open(self, queue_name, server); 
+	}
+	if(ring_ret < 0 && mq_ret < 0){
+		orange_eq_close(self); 
+		errno = (mq_ret != -ENOTSUP)?-mq_ret:-ring_ret; 
+		return -1; 
+	}
+
+	if(server){
+		self->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK); 
+		if(self->wakefd < 0){
+			int err = errno; 
+			orange_eq_close(self); 
+			errno = err; 
+			return -1; 
+		}
+		self->buf_size = (self->ring)?ORANGE_EQ_SHM_MAX_EVENT:0; 
+		if(self->mq != -1 && (size_t)self->attr.mq_msgsize > self->buf_size) self->buf_size = self->attr.mq_msgsize; 
+		self->buf = malloc(self->buf_size); 
+		if(!self->buf){
+			orange_eq_close(self); 
+			return -ENOMEM; 
+		}
+	}
+	return 0; 
+}
+
+int orange_eq_open(struct orange_eq *self, const char *queue_name, bool server){
+	return orange_eq_open_transport(self, queue_name, server, ORANGE_EQ_AUTO); 
+}
+
 int orange_eq_close(struct orange_eq *self){
+	_ring_close(self); 
 	if(self->mq != -1){
 		mq_close(self->mq);
 		self->mq = -1; 
 	}
+	if(self->wakefd >= 0){
+		close(self->wakefd); 
+		self->wakefd = -1; 
+	}
 	if(self->buf) free(self->buf); 
+	self->buf = NULL; 
+	self->buf_size = 0; 
 	memset(&self->attr, 0, sizeof(self->attr)); 
 	return 0; 
 }
 
 int orange_eq_send(struct orange_eq *self, struct blob *in){
-	if(!self->buf || self->mq == -1) return -EINVAL; 
-	return mq_send(self->mq, (void*)blob_head(in), blob_size(in), 0); 
+	if(self->server) return -EINVAL; 
+	if(self->ring) return _ring_send(self, blob_head(in), blob_size(in)); 
+	if(self->mq == -1) return -EINVAL; 
+	if(mq_send(self->mq, (void*)blob_head(in), blob_size(in), 0) < 0) return -errno; 
+	return 0; 
 }
 
 int orange_eq_recv(struct orange_eq *self, struct blob *out){
-	if(!self->buf || self->mq == -1) return -EINVAL; 
-	struct timespec ts; 
-	timespec_from_now_us(&ts, 5000000UL); 
-	int rsize = mq_timedreceive(self->mq, self->buf, self->attr.mq_msgsize, NULL, &ts);  
+	if(!self->buf) return -EINVAL; 
+	if(self->ring && _ring_recv(self, out) > 0) return 1; 
+	if(self->mq == -1) return -EAGAIN; 
+	ssize_t rsize = mq_receive(self->mq, self->buf, self->buf_size, NULL);  
 	if(rsize <= 0) return -EAGAIN; 
 	blob_init(out, self->buf, rsize); 
 	return 1; 
 }
 
+int orange_eq_wait(struct orange_eq *self, long long timeout_us){
+	if(self->wakefd < 0) return -EINVAL; 
+	struct pollfd fds[3]; 
+	int nfds = 0, mq_idx = -1, bell_idx = -1; 
+	fds[nfds++] = (struct pollfd){ .fd = self->wakefd, .events = POLLIN }; 
+	// on linux a message queue descriptor is a file descriptor that can be polled
+	if(self->mq != -1){
+		mq_idx = nfds; 
+		fds[nfds++] = (struct pollfd){ .fd = (int)self->mq, .events = POLLIN }; 
+	}
+	if(self->ring){
+		// ask producers to ring the bell and then look once more so that an event committed meanwhile is not missed
+		__atomic_store_n(&self->ring->waiting, 1, __ATOMIC_SEQ_CST); 
+		if(_ring_ready(self)){
+			__atomic_store_n(&self->ring->waiting, 0, __ATOMIC_SEQ_CST); 
+			return 1; 
+		}
+		// caller goes on with the message queue when a stalled ring has been dropped
+		if(_ring_stuck(self)) return 1; 
+		bell_idx = nfds; 
+		fds[nfds++] = (struct pollfd){ .fd = self->bellfd, .events = POLLIN }; 
+		// producers may not ring the bell again while the ring is stalled so look at it periodically
+		if(self->stuck_pending && (timeout_us < 0 || timeout_us > EQ_STUCK_POLL_US)) timeout_us = EQ_STUCK_POLL_US; 
+	}
+	int timeout_ms = (timeout_us < 0)?-1:(int)((timeout_us + 999) / 1000); 
+	int ret = poll(fds, nfds, timeout_ms); 
+	if(self->ring) __atomic_store_n(&self->ring->waiting, 0, __ATOMIC_SEQ_CST); 
+	if(ret < 0) return (errno == EINTR)?0:-errno; 
+	// wakeup counter is never read so every later wait returns immediately as well
+	if(fds[0].revents) return -ECANCELED; 
+	ret = 0; 
+	if(bell_idx >= 0 && (fds[bell_idx].revents & POLLIN)){
+		char buf[64]; 
+		while(read(self->bellfd, buf, sizeof(buf)) > 0); 
+		ret = 1; 
+	}
+	if(mq_idx >= 0 && (fds[mq_idx].revents & POLLIN)) ret = 1; 
+	return ret; 
+}
+
+int orange_eq_wakeup(struct orange_eq *self){
+	uint64_t one = 1; 
+	if(self->wakefd < 0) return -EINVAL; 
+	// write can only fail with EAGAIN if counter would overflow and then we are already woken up
+	if(write(self->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) return -errno; 
+	return 0; 
+}
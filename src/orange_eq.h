@@ -20,23 +20,96 @@
 
 	An event blob, expressed as json, looks like this: 
 	[ "<name>", {..data..} ]
+
+	There are two transports. The POSIX message queue needs CONFIG_POSIX_MQUEUE
+	in the kernel, limits events to mq_msgsize and costs a system call for
+	every event on both ends. When built with CONFIG_EQ_SHM there is also a
+	ring buffer in shared memory (shm_open) that any number of producers
+	write to without system calls. The server is only woken up through a
+	doorbell (a fifo next to the shared memory) when it is sleeping, so a
+	burst of events costs at most one write and one wakeup. 
+
+	The server opens every transport that is available and drains all of
+	them. Producers use the shared memory ring and fall back to the message
+	queue unless a transport is given explicitly. A producer that dies
+	between reserving space in the ring and committing its event would stall
+	the ring, so the server drops a ring whose oldest reservation has not been
+	committed within ORANGE_EQ_SHM_STUCK_US and continues with the message
+	queue. Every server creates a new ring. Producers get -EPIPE from
+	orange_eq_send() once their ring has been closed or replaced and then
+	open the queue again. 
+
+	The server end of the queue is non blocking. Reader waits for events with 
+	orange_eq_wait() (which polls the queue descriptors together with an eventfd 
+	so that another thread can wake it up on shutdown) and then drains the queue 
+	with orange_eq_recv() until it returns -EAGAIN. 
 */
 
 #pragma once
 
 #include <mqueue.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+// size of the shared memory ring (power of two) and largest event that can be sent through it
+#define ORANGE_EQ_SHM_SIZE (256 * 1024)
+#define ORANGE_EQ_SHM_MAX_EVENT (64 * 1024)
+// how long a reserved record may stay uncommitted before the server gives up on the ring
+#define ORANGE_EQ_SHM_STUCK_US 1000000
 
 struct blob; 
 
+// layout of the shared memory segment (mapped by the server and every producer)
+struct orange_eq_ring {
+	uint32_t magic; 
+	uint32_t size; // bytes in data (power of two)
+	uint32_t closed; // server has stopped reading this ring
+	uint64_t head __attribute__((aligned(64))); // end of space reserved by producers
+	uint64_t tail __attribute__((aligned(64))); // start of data not yet consumed by server
+	uint32_t waiting __attribute__((aligned(64))); // server sleeps and wants the doorbell to be rung
+	char data[] __attribute__((aligned(64))); 
+}; 
+
+enum orange_eq_transport {
+	ORANGE_EQ_AUTO, // server: everything available. Producer: shared memory first, then message queue. 
+	ORANGE_EQ_MQUEUE, 
+	ORANGE_EQ_SHM
+}; 
+
 struct orange_eq {
 	mqd_t mq;  
 	struct mq_attr attr; 
 	char *buf; 
+	size_t buf_size; 
+	int wakefd; // eventfd used to interrupt orange_eq_wait() (server only, -1 otherwise)
+	bool server; 
+	// shared memory ring (NULL if not used)
+	struct orange_eq_ring *ring; 
+	size_t ring_map_size; 
+	int bellfd; // doorbell fifo
+	char ring_name[64]; 
+	dev_t ring_dev; // identity of the segment so that a replaced ring can be told apart
+	ino_t ring_ino; 
+	// server: oldest reservation that has not been committed yet
+	bool stuck_pending; 
+	uint64_t stuck_tail; 
+	struct timespec ts_stuck; 
 }; 
 
 int orange_eq_open(struct orange_eq *self, const char *queue_name, bool server); 
+int orange_eq_open_transport(struct orange_eq *self, const char *queue_name, bool server, enum orange_eq_transport transport); 
 int orange_eq_close(struct orange_eq *self); 
+// sends one event. Returns 0 on success, -EAGAIN if the ring is full, -EMSGSIZE if event is too big and -EPIPE if 
+// the server has gone away or replaced the ring (close and open the queue again). 
 int orange_eq_send(struct orange_eq *self, struct blob *in); 
+// receives one event without blocking. Returns 1 on success and -EAGAIN if queue is empty. 
+// Blob points into the queue buffer and is only valid until the next call. 
 int orange_eq_recv(struct orange_eq *self, struct blob *out); 
-
+// waits until queue has events (returns 1), timeout expires (returns 0) or orange_eq_wakeup() is called (returns -ECANCELED). 
+// A negative timeout waits forever. 
+int orange_eq_wait(struct orange_eq *self, long long timeout_us); 
+// makes current and all later calls to orange_eq_wait() return -ECANCELED
+int orange_eq_wakeup(struct orange_eq *self); 
@@ -0,0 +1,131 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_evlog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <utype/list.h>
+#include <blobpack/blobpack.h>
+
+struct evlog_entry {
+	struct list_head list; 
+	unsigned long long seq; 
+	size_t size; // bytes accounted for this entry
+	char *name; 
+	struct blob data; 
+}; 
+
+struct orange_evlog {
+	struct list_head entries; // oldest first
+	size_t count; 
+	size_t bytes; 
+	size_t max_bytes; 
+	unsigned long long last_seq; 
+}; 
+
+struct orange_evlog *orange_evlog_new(size_t max_bytes){
+	struct orange_evlog *self = calloc(1, sizeof(struct orange_evlog)); 
+	assert(self); 
+	INIT_LIST_HEAD(&self->entries); 
+	self->max_bytes = max_bytes; 
+	return self; 
+}
+
+static void _entry_free(struct evlog_entry *e){
+	list_del_init(&e->list); 
+	blob_free(&e->data); 
+	free(e->name); 
+	free(e); 
+}
+
+void orange_evlog_delete(struct orange_evlog **self){
+	struct evlog_entry *e, *tmp; 
+	list_for_each_entry_safe(e, tmp, &(*self)->entries, list){
+		_entry_free(e); 
+	}
+	free(*self); 
+	*self = NULL; 
+}
+
+// drops oldest events until extra more bytes fit
+static void _evict(struct orange_evlog *self, size_t extra){
+	while(!list_empty(&self->entries) && self->bytes + extra > self->max_bytes){
+		struct evlog_entry *e = list_first_entry(&self->entries, struct evlog_entry, list); 
+		self->bytes -= e->size; 
+		self->count--; 
+		_entry_free(e); 
+	}
+}
+
+void orange_evlog_set_size(struct orange_evlog *self, size_t max_bytes){
+	self->max_bytes = max_bytes; 
+	_evict(self, 0); 
+}
+
+unsigned long long orange_evlog_append(struct orange_evlog *self, const char *name, const struct blob_field *data){
+	unsigned long long seq = ++self->last_seq; 
+	struct evlog_entry *e = calloc(1, sizeof(struct evlog_entry)); 
+	assert(e); 
+	INIT_LIST_HEAD(&e->list); 
+	e->seq = seq; 
+	e->name = strdup(name); 
+	blob_init(&e->data, 0, 0); 
+	if(data) blob_put_attr(&e->data, data); 
+	e->size = sizeof(struct evlog_entry) + strlen(name) + 1 + blob_size(&e->data); 
+	if(e->size > self->max_bytes){
+		// event does not fit at all. Whatever is in the log is now older than a gap so it can not be replayed either. 
+		_entry_free(e); 
+		_evict(self, self->max_bytes + 1); 
+		return seq; 
+	}
+	_evict(self, e->size); 
+	list_add_tail(&e->list, &self->entries); 
+	self->count++; 
+	self->bytes += e->size; 
+	return seq; 
+}
+
+unsigned long long orange_evlog_last_seq(struct orange_evlog *self){
+	return self->last_seq; 
+}
+
+int orange_evlog_replay(struct orange_evlog *self, unsigned long long since, orange_evlog_emit_fn emit, void *arg){
+	if(since > self->last_seq) return -ERANGE; 
+	if(since == self->last_seq) return 0; 
+	// oldest event we still have must directly follow the one client has seen
+	struct evlog_entry *e; 
+	if(list_empty(&self->entries)) return -ERANGE; 
+	e = list_first_entry(&self->entries, struct evlog_entry, list); 
+	if(e->seq > since + 1) return -ERANGE; 
+	int count = 0; 
+	list_for_each_entry(e, &self->entries, list){
+		if(e->seq <= since) continue; 
+		emit(arg, e->seq, e->name, blob_field_first_child(blob_head(&e->data))); 
+		count++; 
+	}
+	return count; 
+}
+
+size_t orange_evlog_count(struct orange_evlog *self){
+	return self->count; 
+}
+
+size_t orange_evlog_bytes(struct orange_evlog *self){
+	return self->bytes; 
+}
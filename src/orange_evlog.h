@@ -0,0 +1,59 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Log of recently broadcast events. 
+
+	Every event gets a sequence number that grows by one with each event
+	and starts at 1. The log keeps the most recent events until their total
+	size (including bookkeeping) would exceed max_bytes and then drops the
+	oldest ones. A client that knows the sequence number of the last event
+	it has seen can get everything it missed replayed as long as those
+	events are still in the log. 
+
+	The log is not thread safe. Callers protect it with their own lock. 
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+struct blob_field; 
+
+struct orange_evlog; 
+
+typedef void (*orange_evlog_emit_fn)(void *arg, unsigned long long seq, const char *name, const struct blob_field *data); 
+
+// max_bytes of 0 keeps no events (sequence numbers are still assigned)
+struct orange_evlog *orange_evlog_new(size_t max_bytes); 
+void orange_evlog_delete(struct orange_evlog **self); 
+
+// changes size limit and drops oldest events that no longer fit
+void orange_evlog_set_size(struct orange_evlog *self, size_t max_bytes); 
+
+// stores a copy of the event and returns its sequence number
+unsigned long long orange_evlog_append(struct orange_evlog *self, const char *name, const struct blob_field *data); 
+
+// sequence number of the last appended event (0 if there has been none)
+unsigned long long orange_evlog_last_seq(struct orange_evlog *self); 
+
+// calls emit for all events after since in order. Returns number of events or -ERANGE if some of them 
+// are no longer in the log (or since is from the future, for example from before a restart). 
+int orange_evlog_replay(struct orange_evlog *self, unsigned long long since, orange_evlog_emit_fn emit, void *arg); 
+
+// number of stored events and bytes they use
+size_t orange_evlog_count(struct orange_evlog *self); 
+size_t orange_evlog_bytes(struct orange_evlog *self); 
@@ -0,0 +1,326 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_handoff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "internal.h"
+
+#define HANDOFF_MAGIC 0x6f726831
+
+// sent together with the descriptors. Followed by urls (nul terminated, in the order of the descriptors) and state. 
+struct handoff_header {
+	uint32_t magic; 
+	uint32_t num_sockets; 
+	uint32_t urls_len; 
+	uint32_t state_len; 
+}; 
+
+void orange_handoff_init(struct orange_handoff *self){
+	memset(self, 0, sizeof(*self)); 
+	self->sock = -1; 
+	self->pid = -1; 
+}
+
+void orange_handoff_deinit(struct orange_handoff *self){
+	if(self->sock >= 0) close(self->sock); 
+	for(int c = 0; c < self->num_sockets; c++){
+		close(self->sockets[c].fd); 
+		free(self->sockets[c].url); 
+	}
+	free(self->state); 
+	orange_handoff_init(self); 
+}
+
+int orange_handoff_add_socket(struct orange_handoff *self, const char *url, int fd){
+	if(self->num_sockets >= ORANGE_HANDOFF_MAX_SOCKETS){
+		close(fd); 
+		return -ENOSPC; 
+	}
+	self->sockets[self->num_sockets].url = strdup(url); 
+	self->sockets[self->num_sockets].fd = fd; 
+	self->num_sockets++; 
+	return 0; 
+}
+
+int orange_handoff_take_socket(struct orange_handoff *self, const char *url){
+	for(int c = 0; c < self->num_sockets; c++){
+		if(strcmp(self->sockets[c].url, url) != 0) continue; 
+		int fd = self->sockets[c].fd; 
+		free(self->sockets[c].url); 
+		self->sockets[c] = self->sockets[--self->num_sockets]; 
+		return fd; 
+	}
+	return -ENOENT; 
+}
+
+void orange_handoff_set_state(struct orange_handoff *self, const struct blob_field *state){
+	free(self->state); 
+	self->state = blob_field_to_json(state); 
+}
+
+bool orange_handoff_get_state(struct orange_handoff *self, struct blob *out){
+	if(!self->state) return false; 
+	blob_reset(out); 
+	return blob_put_json(out, self->state); 
+}
+
+static int _write_all(int fd, const void *data, size_t len){
+	const uint8_t *ptr = (const uint8_t*)data; 
+	while(len){
+		ssize_t ret = send(fd, ptr, len, MSG_NOSIGNAL); 
+		if(ret < 0 && errno == EINTR) continue; 
+		if(ret <= 0) return -errno; 
+		ptr += ret; 
+		len -= ret; 
+	}
+	return 0; 
+}
+
+static int _wait_readable(int fd, int timeout_ms){
+	struct pollfd pfd = { .fd = fd, .events = POLLIN }; 
+	int ret; 
+	while((ret = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR); 
+	if(ret < 0) return -errno; 
+	if(ret == 0) return -ETIMEDOUT; 
+	return 0; 
+}
+
+static int _read_all(int fd, void *data, size_t len, int timeout_ms){
+	uint8_t *ptr = (uint8_t*)data; 
+	while(len){
+		int ret = _wait_readable(fd, timeout_ms); 
+		if(ret < 0) return ret; 
+		ssize_t rd = recv(fd, ptr, len, 0); 
+		if(rd < 0 && errno == EINTR) continue; 
+		if(rd < 0) return -errno; 
+		if(rd == 0) return -EPIPE; 
+		ptr += rd; 
+		len -= rd; 
+	}
+	return 0; 
+}
+
+static int _handoff_send(struct orange_handoff *self){
+	size_t urls_len = 0, state_len = (self->state)?strlen(self->state):0; 
+	for(int c = 0; c < self->num_sockets; c++) urls_len += strlen(self->sockets[c].url) + 1; 
+
+	struct handoff_header hdr = {
+		.magic = HANDOFF_MAGIC, 
+		.num_sockets = self->num_sockets, 
+		.urls_len = urls_len, 
+		.state_len = state_len
+	}; 
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) }; 
+	union {
+		struct cmsghdr hdr; 
+		char buf[CMSG_SPACE(sizeof(int) * ORANGE_HANDOFF_MAX_SOCKETS)]; 
+	} cbuf; 
+	struct msghdr msg; 
+	memset(&msg, 0, sizeof(msg)); 
+	memset(&cbuf, 0, sizeof(cbuf)); 
+	msg.msg_iov = &iov; 
+	msg.msg_iovlen = 1; 
+	if(self->num_sockets){
+		msg.msg_control = cbuf.buf; 
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * self->num_sockets); 
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); 
+		cmsg->cmsg_level = SOL_SOCKET; 
+		cmsg->cmsg_type = SCM_RIGHTS; 
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * self->num_sockets); 
+		int *fds = (int*)CMSG_DATA(cmsg); 
+		for(int c = 0; c < self->num_sockets; c++) fds[c] = self->sockets[c].fd; 
+	}
+	ssize_t ret; 
+	while((ret = sendmsg(self->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR); 
+	if(ret < 0) return -errno; 
+	if(ret != sizeof(hdr)) return -EIO; 
+
+	for(int c = 0; c < self->num_sockets; c++){
+		int err = _write_all(self->sock, self->sockets[c].url, strlen(self->sockets[c].url) + 1); 
+		if(err < 0) return err; 
+	}
+	if(state_len) return _write_all(self->sock, self->state, state_len); 
+	return 0; 
+}
+
+// NOTE: new instance has not confirmed so it must not keep running next to us
+static void _handoff_abort(struct orange_handoff *self){
+	if(self->pid > 0){
+		kill(self->pid, SIGKILL); 
+		waitpid(self->pid, NULL, 0); 
+		self->pid = -1; 
+	}
+	if(self->sock >= 0){
+		close(self->sock); 
+		self->sock = -1; 
+	}
+}
+
+int orange_handoff_spawn(struct orange_handoff *self, char *const argv[]){
+	int sv[2]; 
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -errno; 
+
+	// environment is prepared before fork because only async signal safe calls are allowed in the child
+	char var[64]; 
+	snprintf(var, sizeof(var), "%s=%d", ORANGE_HANDOFF_ENV, sv[1]); 
+	size_t count = 0; 
+	while(environ && environ[count]) count++; 
+	char **envp = calloc(count + 2, sizeof(char*)); 
+	if(!envp){
+		close(sv[0]); 
+		close(sv[1]); 
+		return -ENOMEM; 
+	}
+	size_t n = 0; 
+	for(size_t c = 0; c < count; c++){
+		if(strncmp(environ[c], ORANGE_HANDOFF_ENV "=", strlen(ORANGE_HANDOFF_ENV) + 1) == 0) continue; 
+		envp[n++] = environ[c]; 
+	}
+	envp[n] = var; 
+
+	pid_t pid = fork(); 
+	if(pid == 0){
+		// our end of the socket must survive exec
+		fcntl(sv[1], F_SETFD, 0); 
+		execvpe(argv[0], argv, envp); 
+		_exit(127); 
+	}
+	int err = errno; 
+	free(envp); 
+	close(sv[1]); 
+	if(pid < 0){
+		close(sv[0]); 
+		return -err; 
+	}
+
+	self->pid = pid; 
+	self->sock = sv[0]; 
+	DEBUG("handoff: started new instance %d\n", (int)pid); 
+
+	int ret = _handoff_send(self); 
+	if(ret < 0){
+		ERROR("handoff: could not send sockets to new instance: %s\n", strerror(-ret)); 
+		_handoff_abort(self); 
+	}
+	return ret; 
+}
+
+int orange_handoff_wait(struct orange_handoff *self, int timeout_ms){
+	if(self->sock < 0) return -ENOTCONN; 
+	int32_t status = 0; 
+	int ret = _read_all(self->sock, &status, sizeof(status), timeout_ms); 
+	if(ret == 0 && status == 0) return 0; 
+	if(ret == 0) ret = (status < 0)?status:-EIO; 
+	ERROR("handoff: new instance did not take over: %s\n", strerror(-ret)); 
+	_handoff_abort(self); 
+	return ret; 
+}
+
+int orange_handoff_receive(struct orange_handoff *self, int timeout_ms){
+	const char *env = getenv(ORANGE_HANDOFF_ENV); 
+	if(!env) return 0; 
+	int sock = atoi(env); 
+	// instances that we start later must not think that they were handed off to
+	unsetenv(ORANGE_HANDOFF_ENV); 
+	if(sock < 0 || fcntl(sock, F_SETFD, FD_CLOEXEC) < 0) return -EBADF; 
+	self->sock = sock; 
+
+	int ret = _wait_readable(sock, timeout_ms); 
+	if(ret < 0) return ret; 
+
+	struct handoff_header hdr; 
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) }; 
+	union {
+		struct cmsghdr hdr; 
+		char buf[CMSG_SPACE(sizeof(int) * ORANGE_HANDOFF_MAX_SOCKETS)]; 
+	} cbuf; 
+	struct msghdr msg; 
+	memset(&msg, 0, sizeof(msg)); 
+	msg.msg_iov = &iov; 
+	msg.msg_iovlen = 1; 
+	msg.msg_control = cbuf.buf; 
+	msg.msg_controllen = sizeof(cbuf.buf); 
+	ssize_t len; 
+	while((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR); 
+	if(len < 0) return -errno; 
+	if(len == 0) return -EPIPE; 
+
+	int fds[ORANGE_HANDOFF_MAX_SOCKETS]; 
+	int num_fds = 0; 
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue; 
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); 
+		for(int c = 0; c < count && num_fds < ORANGE_HANDOFF_MAX_SOCKETS; c++){
+			memcpy(&fds[num_fds++], CMSG_DATA(cmsg) + c * sizeof(int), sizeof(int)); 
+		}
+	}
+
+	// the rest of the header may arrive separately (descriptors only come with the first byte)
+	if(len < (ssize_t)sizeof(hdr)) ret = _read_all(sock, (uint8_t*)&hdr + len, sizeof(hdr) - len, timeout_ms); 
+	if(ret == 0 && (hdr.magic != HANDOFF_MAGIC || hdr.num_sockets != (uint32_t)num_fds || (msg.msg_flags & MSG_CTRUNC) || 
+		hdr.urls_len > ORANGE_HANDOFF_MAX_STATE || hdr.state_len > ORANGE_HANDOFF_MAX_STATE)) ret = -EPROTO; 
+
+	char *payload = NULL; 
+	if(ret == 0){
+		payload = calloc(1, hdr.urls_len + hdr.state_len + 1); 
+		if(!payload) ret = -ENOMEM; 
+		else ret = _read_all(sock, payload, hdr.urls_len + hdr.state_len, timeout_ms); 
+	}
+	if(ret < 0){
+		for(int c = 0; c < num_fds; c++) close(fds[c]); 
+		free(payload); 
+		ERROR("handoff: could not receive sockets from previous instance: %s\n", strerror(-ret)); 
+		return ret; 
+	}
+
+	const char *url = payload; 
+	for(int c = 0; c < num_fds; c++){
+		// urls must all be within their part of the payload
+		size_t left = hdr.urls_len - (url - payload); 
+		size_t ulen = strnlen(url, left); 
+		if(ulen == left){
+			close(fds[c]); 
+			continue; 
+		}
+		orange_handoff_add_socket(self, url, fds[c]); 
+		url += ulen + 1; 
+	}
+	if(hdr.state_len) self->state = strndup(payload + hdr.urls_len, hdr.state_len); 
+	free(payload); 
+
+	DEBUG("handoff: received %d sockets from previous instance\n", self->num_sockets); 
+	return 1; 
+}
+
+int orange_handoff_complete(struct orange_handoff *self, int status){
+	if(self->sock < 0) return -ENOTCONN; 
+	int32_t st = status; 
+	int ret = _write_all(self->sock, &st, sizeof(st)); 
+	close(self->sock); 
+	self->sock = -1; 
+	return ret; 
+}
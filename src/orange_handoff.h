@@ -0,0 +1,74 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Handoff of listening sockets and state to a new instance of the server. 
+
+	The running instance starts a new copy of itself with orange_handoff_spawn()
+	which passes a connected unix socket to the new process (its number is put
+	into the ORANGE_HANDOFF_FD environment variable). Listening sockets are
+	sent over it as SCM_RIGHTS ancillary data together with the url each one
+	was listening on and a json document with application state. The new
+	instance picks them up with orange_handoff_receive(), starts serving and
+	confirms with orange_handoff_complete(). Until then connection attempts
+	simply wait in the backlog of the listening socket so no client is
+	refused while the two processes change places. 
+*/
+
+#pragma once
+
+#include <sys/types.h>
+#include <blobpack/blobpack.h>
+
+#define ORANGE_HANDOFF_ENV "ORANGE_HANDOFF_FD"
+#define ORANGE_HANDOFF_MAX_SOCKETS 8
+// largest state document accepted from the old instance
+#define ORANGE_HANDOFF_MAX_STATE (4 * 1024 * 1024)
+
+struct orange_handoff_socket {
+	char *url; 
+	int fd; 
+}; 
+
+struct orange_handoff {
+	int sock; // connection between old and new instance (-1 if there is none)
+	pid_t pid; // new instance (only set in the old instance)
+	struct orange_handoff_socket sockets[ORANGE_HANDOFF_MAX_SOCKETS]; 
+	int num_sockets; 
+	char *state; // json text
+}; 
+
+void orange_handoff_init(struct orange_handoff *self); 
+// closes the connection and all sockets that were not taken
+void orange_handoff_deinit(struct orange_handoff *self); 
+
+// adds a listening socket to be passed on. Handoff takes ownership of fd. 
+int orange_handoff_add_socket(struct orange_handoff *self, const char *url, int fd); 
+// returns socket that was listening on url (caller takes ownership) or -ENOENT
+int orange_handoff_take_socket(struct orange_handoff *self, const char *url); 
+void orange_handoff_set_state(struct orange_handoff *self, const struct blob_field *state); 
+// puts received state into out. Returns false if there is none. 
+bool orange_handoff_get_state(struct orange_handoff *self, struct blob *out); 
+
+// old instance: executes argv as the new instance and sends it sockets and state
+int orange_handoff_spawn(struct orange_handoff *self, char *const argv[]); 
+// old instance: waits until new instance is serving. Returns 0 on success. On failure the new instance is killed. 
+int orange_handoff_wait(struct orange_handoff *self, int timeout_ms); 
+
+// new instance: receives sockets and state. Returns 1 if we were started by a handoff, 0 if not and negative error. 
+int orange_handoff_receive(struct orange_handoff *self, int timeout_ms); 
+// new instance: lets the old instance know that we are serving (status 0) or that we have failed 
+int orange_handoff_complete(struct orange_handoff *self, int status); 
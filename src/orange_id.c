@@ -15,11 +15,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <utype/avl-cmp.h>
 
 #include "orange_id.h"
-
-static int random_fd = -1;
+#include "orange_rand.h"
 
 static int ubus_cmp_id(const void *k1, const void *k2, void *ptr){
 	const uint32_t *id1 = k1, *id2 = k2;
@@ -38,13 +38,6 @@ void orange_id_string_tree_init(struct avl_tree *tree, bool dup)
 */
 
 void orange_id_tree_init(struct avl_tree *tree){
-	if (random_fd < 0) {
-		random_fd = open("/dev/urandom", O_RDONLY);
-		if (random_fd < 0) {
-			perror("!! ERROR failed to open /dev/urandom");
-		}
-	}
-
 	avl_init(tree, ubus_cmp_id, false, NULL);
 }
 
@@ -56,10 +49,7 @@ bool orange_id_alloc(struct avl_tree *tree, struct orange_id *id, uint32_t val){
 	}
 
 	do {
-		if(random_fd < 0) id->id = rand(); 
-		else if(read(random_fd, &id->id, sizeof(id->id)) != sizeof(id->id))
-			return false;
-		id->id &= 0x7fffffff; // limit to only positive 32 bit ints
+		id->id = orange_rand_u32() & 0x7fffffff; // limit to only positive 32 bit ints
 	} while (avl_insert(tree, &id->avl) != 0);
 
 	return true;
@@ -79,3 +69,54 @@ struct orange_id *orange_id_find(struct avl_tree *tree, uint32_t id){
 	return container_of(avl, struct orange_id, avl);
 }
 
+struct orange_peer_id {
+	struct orange_id id; 
+	const void *owner; 
+}; 
+
+static pthread_mutex_t peer_lock = PTHREAD_MUTEX_INITIALIZER; 
+static struct avl_tree peer_ids; 
+static bool peer_ids_init = false; 
+
+uint32_t orange_peer_id_alloc(const void *owner){
+	struct orange_peer_id *self = calloc(1, sizeof(struct orange_peer_id)); 
+	if(!self) return 0; 
+	self->owner = owner; 
+	pthread_mutex_lock(&peer_lock); 
+	if(!peer_ids_init){
+		orange_id_tree_init(&peer_ids); 
+		peer_ids_init = true; 
+	}
+	while(true){
+		if(!orange_id_alloc(&peer_ids, &self->id, 0)){
+			pthread_mutex_unlock(&peer_lock); 
+			free(self); 
+			return 0; 
+		}
+		if(self->id.id != 0) break; 
+		// zero is reserved for broadcasts
+		orange_id_free(&peer_ids, &self->id); 
+	}
+	uint32_t id = self->id.id; 
+	pthread_mutex_unlock(&peer_lock); 
+	return id; 
+}
+
+void orange_peer_id_free(uint32_t id){
+	pthread_mutex_lock(&peer_lock); 
+	struct orange_id *oid = (peer_ids_init)?orange_id_find(&peer_ids, id):NULL; 
+	if(oid){
+		orange_id_free(&peer_ids, oid); 
+		free(container_of(oid, struct orange_peer_id, id)); 
+	}
+	pthread_mutex_unlock(&peer_lock); 
+}
+
+const void *orange_peer_id_owner(uint32_t id){
+	const void *owner = NULL; 
+	pthread_mutex_lock(&peer_lock); 
+	struct orange_id *oid = (peer_ids_init)?orange_id_find(&peer_ids, id):NULL; 
+	if(oid) owner = container_of(oid, struct orange_peer_id, id)->owner; 
+	pthread_mutex_unlock(&peer_lock); 
+	return owner; 
+}
@@ -27,3 +27,8 @@ bool orange_id_alloc(struct avl_tree *tree, struct orange_id *id, uint32_t val);
 void orange_id_free(struct avl_tree *tree, struct orange_id *id); 
 struct orange_id *orange_id_find(struct avl_tree *tree, uint32_t id); 
 
+// process wide peer ids. Servers allocate connection ids from here so that peers of different servers never share an id and a message can be routed back to the server that owns the peer. 
+uint32_t orange_peer_id_alloc(const void *owner); 
+void orange_peer_id_free(uint32_t id); 
+const void *orange_peer_id_owner(uint32_t id); 
+
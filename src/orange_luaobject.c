@@ -23,6 +23,11 @@
 #include "orange_lua.h"
 
 #define JUCI_LUA_LIB_PATH "/usr/lib/orange/lib/"
+// optional table in the plugin object that maps method names to lanes ("control", "normal" or "bulk")
+#define JUCI_LUA_LANES_KEY "__lanes"
+// registry key of the cancel flag of the running call and how often (in lua instructions) it is checked
+#define JUCI_LUA_CANCEL_KEY "orange_cancel"
+#define JUCI_LUA_CANCEL_CHECK_INTERVAL 1000
 
 static lua_State * _luaobject_create_lua_state(void){
 	lua_State *L = luaL_newstate(); 		
@@ -43,6 +48,7 @@ struct orange_luaobject* orange_luaobject_new(const char *name){
 	self->avl.key = self->name; 
 	luaL_openlibs(self->lua); 
 	blob_init(&self->signature, 0, 0); 
+	blob_init(&self->lanes, 0, 0); 
 
 	// add proper lua paths
 	lua_getglobal(self->lua, "package"); 
@@ -82,6 +88,7 @@ void orange_luaobject_free_state(struct orange_luaobject *self){
 void orange_luaobject_delete(struct orange_luaobject **self){
 	orange_luaobject_free_state(*self); 
 	blob_free(&(*self)->signature); 
+	blob_free(&(*self)->lanes); 
 	free((*self)->name); 
 	pthread_mutex_destroy(&(*self)->lock); 
 	free(*self); 
@@ -106,7 +113,24 @@ int orange_luaobject_load(struct orange_luaobject *self, const char *file){
 	lua_pushnil(self->lua); 
 	const char *k; 
 	blob_offset_t root = blob_open_table(&self->signature); 
+	blob_offset_t lanes = blob_open_table(&self->lanes); 
 	while(lua_next(self->lua, -2)){
+		k = lua_tostring(self->lua, -2); 
+		if(k && strcmp(k, JUCI_LUA_LANES_KEY) == 0){
+			// lane hints are not methods
+			if(lua_type(self->lua, -1) == LUA_TTABLE){
+				lua_pushnil(self->lua); 
+				while(lua_next(self->lua, -2)){
+					if(lua_type(self->lua, -2) == LUA_TSTRING && lua_type(self->lua, -1) == LUA_TSTRING){
+						blob_put_string(&self->lanes, lua_tostring(self->lua, -2)); 
+						blob_put_string(&self->lanes, lua_tostring(self->lua, -1)); 
+					}
+					lua_pop(self->lua, 1); 
+				}
+			}
+			lua_pop(self->lua, 1); 
+			continue; 
+		}
 		lua_pop(self->lua, 1); 
 		k = lua_tostring(self->lua, -1); 
 		blob_put_string(&self->signature, k); 
@@ -114,12 +138,41 @@ int orange_luaobject_load(struct orange_luaobject *self, const char *file){
 		blob_close_array(&self->signature, m); 
 	}
 	blob_close_table(&self->signature, root); 
+	blob_close_table(&self->lanes, lanes); 
 
 	pthread_mutex_unlock(&self->lock); 
 	return 0; 
 }
 
-int orange_luaobject_call(struct orange_luaobject *self, struct orange_session *session, const char *method, const struct blob_field *in, struct blob *out){
+enum orange_lane orange_luaobject_lane(struct orange_luaobject *self, const char *method){
+	struct blob_field *key; 
+	struct blob_field *root = blob_field_first_child(blob_head(&self->lanes)); 
+	enum orange_lane lane = ORANGE_LANE_NORMAL; 
+	if(!root) return lane; 
+	// table is stored as key, value pairs
+	blob_field_for_each_child(root, key){
+		struct blob_field *value = blob_field_next_child(root, key); 
+		if(!value) break; 
+		if(strcmp(blob_field_get_string(key), method) != 0){
+			key = value; 
+			continue; 
+		}
+		const char *name = blob_field_get_string(value); 
+		if(strcmp(name, "control") == 0) lane = ORANGE_LANE_CONTROL; 
+		else if(strcmp(name, "bulk") == 0) lane = ORANGE_LANE_BULK; 
+		break; 
+	}
+	return lane; 
+}
+
+static void _luaobject_cancel_hook(lua_State *L, lua_Debug *ar){
+	lua_getfield(L, LUA_REGISTRYINDEX, JUCI_LUA_CANCEL_KEY); 
+	const volatile int *cancel = (const volatile int*)lua_touserdata(L, -1); 
+	lua_pop(L, 1); 
+	if(cancel && *cancel) luaL_error(L, "request cancelled"); 
+}
+
+int orange_luaobject_call(struct orange_luaobject *self, struct orange_session *session, const char *method, const struct blob_field *in, const volatile int *cancel, struct blob *out){
 	if(!self || !self->lua) return -1; 
 	
 	char errbuf[255];
@@ -167,8 +220,21 @@ int orange_luaobject_call(struct orange_luaobject *self, struct orange_session *
 	if(in) orange_lua_blob_to_table(self->lua, in, true); 
 	else lua_newtable(self->lua); 
 
+	// long running scripts can be interrupted (C functions such as os.execute are not interrupted until they return)
+	if(cancel){
+		lua_pushlightuserdata(self->lua, (void*)cancel); 
+		lua_setfield(self->lua, LUA_REGISTRYINDEX, JUCI_LUA_CANCEL_KEY); 
+		lua_sethook(self->lua, _luaobject_cancel_hook, LUA_MASKCOUNT, JUCI_LUA_CANCEL_CHECK_INTERVAL); 
+	}
+
 	// call the method that we previously poped out of the table
-	if(lua_pcall(self->lua, 1, 1, 0) != 0){
+	int call_ret = lua_pcall(self->lua, 1, 1, 0); 
+	if(cancel){
+		lua_sethook(self->lua, NULL, 0, 0); 
+		lua_pushnil(self->lua); 
+		lua_setfield(self->lua, LUA_REGISTRYINDEX, JUCI_LUA_CANCEL_KEY); 
+	}
+	if(call_ret != 0){
 		snprintf(errbuf, sizeof(errbuf), "error calling %s: %s", method, lua_tostring(self->lua, -1));
 		ERROR("%s\n", errbuf);
 
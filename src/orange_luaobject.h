@@ -22,12 +22,15 @@
 #include <blobpack/blobpack.h>
 #include <utype/avl.h>
 
+#include "orange.h"
+
 struct orange_session; 
 
 struct orange_luaobject {
 	struct avl_node avl; 
 	char *name; 
 	struct blob signature; 
+	struct blob lanes; // method name -> lane name (from __lanes table of the plugin)
 	lua_State *lua; 
 	pthread_mutex_t lock; 
 }; 
@@ -35,7 +38,9 @@ struct orange_luaobject {
 struct orange_luaobject* orange_luaobject_new(const char *name); 
 void orange_luaobject_delete(struct orange_luaobject **self); 
 int orange_luaobject_load(struct orange_luaobject *self, const char *file); 
-int orange_luaobject_call(struct orange_luaobject *self, struct orange_session *ses, const char *method, const struct blob_field *in, struct blob *out); 
+enum orange_lane orange_luaobject_lane(struct orange_luaobject *self, const char *method); 
+// cancel (optional) is checked while the method runs and aborts the call with an error once it becomes nonzero
+int orange_luaobject_call(struct orange_luaobject *self, struct orange_session *ses, const char *method, const struct blob_field *in, const volatile int *cancel, struct blob *out); 
 
 // frees the lua state but leaves signature etc. 
 void orange_luaobject_free_state(struct orange_luaobject *self); 
@@ -16,18 +16,37 @@
 */
 
 #include "orange_message.h"
+#include <string.h>
 
 struct orange_message *orange_message_new(){
 	struct orange_message *self = calloc(1, sizeof(struct orange_message)); 
 	assert(self); 
 	blob_init(&self->buf, 0, 0); 
 	INIT_LIST_HEAD(&self->list); 
+	self->type = UBUS_MSG_METHOD_CALL; 
 	return self; 
 }
 
 void orange_message_delete(struct orange_message **self){
 	blob_free(&(*self)->buf); 
 	list_del_init(&(*self)->list); 
+	free((*self)->sid); 
+	free((*self)->topic); 
 	free(*self); 
 	*self = 0; 
 }
+
+const char *orange_message_event_topic(const struct blob_field *event){
+	if(!event || blob_field_type(event) != BLOB_FIELD_TABLE) return NULL; 
+	struct blob_field *key; 
+	// table is stored as key, value pairs
+	blob_field_for_each_child(event, key){
+		struct blob_field *value = blob_field_next_child(event, key); 
+		if(!value) break; 
+		if(strcmp(blob_field_get_string(key), "method") == 0 && blob_field_type(value) == BLOB_FIELD_STRING){
+			return blob_field_get_string(value); 
+		}
+		key = value; 
+	}
+	return NULL; 
+}
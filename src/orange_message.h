@@ -16,6 +16,8 @@
 #define __UBUSMSG_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
 #include <blobpack/blobpack.h>
 #include <utype/list.h>
 
@@ -41,14 +43,40 @@ enum orange_msg_type {
 	__UBUS_MSG_LAST
 }; 
 
+struct orange_rpc_batch; 
+
+// json-rpc envelope of a request. Parsed once by rpc when it first looks at the request and points into buf. 
+struct orange_rpc_envelope {
+	int state; // 0 until parsed, 1 for valid requests and -1 for invalid ones
+	uint32_t id; 
+	const char *method; 
+	const struct blob_field *params; 
+	long long deadline_ms; // 0 if request has no deadline
+}; 
+
 struct orange_message {
 	struct list_head list; 
 	struct blob buf; 
 	int32_t peer; 
+	char *sid; // session id supplied by transport outside of the message (for example http header) 
+	char *topic; // broadcasts: event name used to select subscribed peers (NULL sends to everybody)
+	// broadcasts: buf is an array of event notifications that servers deliver as separate messages in one pass 
+	// over their clients. Topic of each event is its "method" field. 
+	bool event_batch; 
+	// UBUS_MSG_METHOD_CALL for requests. Servers send UBUS_MSG_PEER_DISCONNECTED (with empty buf) when a peer goes away. 
+	enum orange_msg_type type; 
+	struct timespec ts_queued; // when server placed the message on its receive queue
+	struct timespec ts_deadline; // request must not be started after this time (zero if there is no deadline)
+	// set by rpc for requests that are elements of a json-rpc batch
+	struct orange_rpc_batch *batch; 
+	unsigned int batch_index; 
+	struct orange_rpc_envelope env; 
 }; 
 
 struct orange_message *orange_message_new(void); 
 void orange_message_delete(struct orange_message **self); 
+// returns "method" of an event notification (one element of an event batch) or NULL
+const char *orange_message_event_topic(const struct blob_field *event); 
 static inline struct blob *orange_message_blob(struct orange_message *self) { return &self->buf; }
 
 static __attribute__((unused)) const char *orange_message_types[] = {
@@ -0,0 +1,248 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <blobpack/blobpack.h>
+
+#include "orange_msgpack.h"
+
+// maximum nesting depth that we accept from the network (same limit as json checker)
+#define MSGPACK_MAX_DEPTH 10
+
+struct msgpack_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+static bool _buf_reserve(struct msgpack_buf *self, size_t len){
+	if(self->len + len <= self->size) return true;
+	size_t size = self->size * 2;
+	while(size < self->len + len) size *= 2;
+	uint8_t *data = realloc(self->data, size);
+	if(!data) return false;
+	self->data = data;
+	self->size = size;
+	return true;
+}
+
+static bool _buf_put(struct msgpack_buf *self, const void *data, size_t len){
+	if(!_buf_reserve(self, len)) return false;
+	memcpy(self->data + self->len, data, len);
+	self->len += len;
+	return true;
+}
+
+static bool _buf_put_be(struct msgpack_buf *self, uint8_t tag, uint64_t val, int bytes){
+	uint8_t tmp[9];
+	tmp[0] = tag;
+	for(int c = 0; c < bytes; c++){
+		tmp[bytes - c] = (uint8_t)(val >> (c * 8));
+	}
+	return _buf_put(self, tmp, bytes + 1);
+}
+
+static bool _pack_int(struct msgpack_buf *self, long long val){
+	if(val >= 0){
+		if(val < 128) return _buf_put_be(self, (uint8_t)val, 0, 0);
+		if(val <= UINT8_MAX) return _buf_put_be(self, 0xcc, val, 1);
+		if(val <= UINT16_MAX) return _buf_put_be(self, 0xcd, val, 2);
+		if(val <= UINT32_MAX) return _buf_put_be(self, 0xce, val, 4);
+		return _buf_put_be(self, 0xcf, val, 8);
+	}
+	if(val >= -32) return _buf_put_be(self, (uint8_t)(int8_t)val, 0, 0);
+	if(val >= INT8_MIN) return _buf_put_be(self, 0xd0, (uint8_t)val, 1);
+	if(val >= INT16_MIN) return _buf_put_be(self, 0xd1, (uint16_t)val, 2);
+	if(val >= INT32_MIN) return _buf_put_be(self, 0xd2, (uint32_t)val, 4);
+	return _buf_put_be(self, 0xd3, (uint64_t)val, 8);
+}
+
+static bool _pack_real(struct msgpack_buf *self, double val){
+	uint64_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+	return _buf_put_be(self, 0xcb, bits, 8);
+}
+
+static bool _pack_string(struct msgpack_buf *self, const char *str){
+	size_t len = strlen(str);
+	bool ok;
+	if(len < 32) ok = _buf_put_be(self, 0xa0 | len, 0, 0);
+	else if(len <= UINT8_MAX) ok = _buf_put_be(self, 0xd9, len, 1);
+	else if(len <= UINT16_MAX) ok = _buf_put_be(self, 0xda, len, 2);
+	else ok = _buf_put_be(self, 0xdb, len, 4);
+	return ok && _buf_put(self, str, len);
+}
+
+static bool _pack_container(struct msgpack_buf *self, bool map, uint32_t count){
+	if(count < 16) return _buf_put_be(self, (map?0x80:0x90) | count, 0, 0);
+	if(count <= UINT16_MAX) return _buf_put_be(self, map?0xde:0xdc, count, 2);
+	return _buf_put_be(self, map?0xdf:0xdd, count, 4);
+}
+
+static bool _pack_field(struct msgpack_buf *self, const struct blob_field *field){
+	const struct blob_field *child;
+	uint32_t count = 0;
+	switch(blob_field_type(field)){
+		case BLOB_FIELD_INT8:
+		case BLOB_FIELD_INT16:
+		case BLOB_FIELD_INT32:
+		case BLOB_FIELD_INT64:
+			return _pack_int(self, blob_field_get_int(field));
+		case BLOB_FIELD_FLOAT32:
+		case BLOB_FIELD_FLOAT64:
+			return _pack_real(self, blob_field_get_real(field));
+		case BLOB_FIELD_STRING:
+			return _pack_string(self, blob_field_get_string(field));
+		case BLOB_FIELD_ARRAY:
+		case BLOB_FIELD_TABLE: {
+			bool map = blob_field_type(field) == BLOB_FIELD_TABLE;
+			blob_field_for_each_child(field, child) count++;
+			// tables store keys and values as consecutive children
+			if(!_pack_container(self, map, (map)?(count / 2):count)) return false;
+			blob_field_for_each_child(field, child){
+				if(!_pack_field(self, child)) return false;
+			}
+			return true;
+		}
+		default:
+			// nil for everything that has no msgpack representation
+			return _buf_put_be(self, 0xc0, 0, 0);
+	}
+}
+
+uint8_t *orange_msgpack_pack(const struct blob_field *field, size_t headroom, size_t tailroom, size_t *len){
+	struct msgpack_buf buf = { .len = headroom, .size = headroom + 256 + tailroom };
+	if(!field) return NULL;
+	buf.data = calloc(1, buf.size);
+	if(!buf.data) return NULL;
+	if(!_pack_field(&buf, field) || !_buf_reserve(&buf, tailroom)){
+		free(buf.data);
+		return NULL;
+	}
+	*len = buf.len - headroom;
+	return buf.data;
+}
+
+struct msgpack_reader {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+};
+
+static bool _read_be(struct msgpack_reader *self, int bytes, uint64_t *val){
+	if(self->pos + bytes > self->len) return false;
+	*val = 0;
+	for(int c = 0; c < bytes; c++){
+		*val = (*val << 8) | self->data[self->pos++];
+	}
+	return true;
+}
+
+static bool _unpack_string(struct msgpack_reader *self, struct blob *out, size_t len){
+	if(self->pos + len > self->len) return false;
+	// strings must not contain embedded zeros since blob strings are zero terminated
+	if(memchr(self->data + self->pos, 0, len)) return false;
+	char *str = malloc(len + 1);
+	if(!str) return false;
+	memcpy(str, self->data + self->pos, len);
+	str[len] = 0;
+	blob_put_string(out, str);
+	free(str);
+	self->pos += len;
+	return true;
+}
+
+static bool _unpack_field(struct msgpack_reader *self, struct blob *out, int depth, bool key);
+
+static bool _unpack_container(struct msgpack_reader *self, struct blob *out, int depth, bool map, uint32_t count){
+	if(depth >= MSGPACK_MAX_DEPTH) return false;
+	// every element takes at least one byte so reject counts that can not possibly fit
+	if(count > self->len - self->pos) return false;
+	blob_offset_t o = (map)?blob_open_table(out):blob_open_array(out);
+	for(uint32_t c = 0; c < count; c++){
+		if(map && !_unpack_field(self, out, depth + 1, true)) return false;
+		if(!_unpack_field(self, out, depth + 1, false)) return false;
+	}
+	if(map) blob_close_table(out, o);
+	else blob_close_array(out, o);
+	return true;
+}
+
+static bool _unpack_field(struct msgpack_reader *self, struct blob *out, int depth, bool key){
+	uint64_t val;
+	if(self->pos >= self->len) return false;
+	uint8_t tag = self->data[self->pos++];
+
+	if((tag & 0xe0) == 0xa0) return _unpack_string(self, out, tag & 0x1f);
+	if(tag == 0xd9 || tag == 0xda || tag == 0xdb){
+		if(!_read_be(self, 1 << (tag - 0xd9), &val)) return false;
+		return _unpack_string(self, out, val);
+	}
+	// only strings are allowed as table keys
+	if(key) return false;
+
+	if(tag < 0x80){ blob_put_int(out, tag); return true; }
+	if(tag >= 0xe0){ blob_put_int(out, (int8_t)tag); return true; }
+	if((tag & 0xf0) == 0x80) return _unpack_container(self, out, depth, true, tag & 0x0f);
+	if((tag & 0xf0) == 0x90) return _unpack_container(self, out, depth, false, tag & 0x0f);
+
+	switch(tag){
+		case 0xc0: blob_put_int(out, 0); return true; // no null in blobs
+		case 0xc2: blob_put_bool(out, false); return true;
+		case 0xc3: blob_put_bool(out, true); return true;
+		case 0xcc: case 0xcd: case 0xce: case 0xcf:
+			if(!_read_be(self, 1 << (tag - 0xcc), &val)) return false;
+			blob_put_int(out, (long long)val);
+			return true;
+		case 0xd0: if(!_read_be(self, 1, &val)) return false; blob_put_int(out, (int8_t)val); return true;
+		case 0xd1: if(!_read_be(self, 2, &val)) return false; blob_put_int(out, (int16_t)val); return true;
+		case 0xd2: if(!_read_be(self, 4, &val)) return false; blob_put_int(out, (int32_t)val); return true;
+		case 0xd3: if(!_read_be(self, 8, &val)) return false; blob_put_int(out, (int64_t)val); return true;
+		case 0xca: {
+			float f;
+			uint32_t bits;
+			if(!_read_be(self, 4, &val)) return false;
+			bits = (uint32_t)val;
+			memcpy(&f, &bits, sizeof(f));
+			blob_put_real(out, f);
+			return true;
+		}
+		case 0xcb: {
+			double d;
+			if(!_read_be(self, 8, &val)) return false;
+			memcpy(&d, &val, sizeof(d));
+			blob_put_real(out, d);
+			return true;
+		}
+		case 0xdc: case 0xdd:
+			if(!_read_be(self, (tag == 0xdc)?2:4, &val)) return false;
+			return _unpack_container(self, out, depth, false, val);
+		case 0xde: case 0xdf:
+			if(!_read_be(self, (tag == 0xde)?2:4, &val)) return false;
+			return _unpack_container(self, out, depth, true, val);
+		default:
+			// bin and ext types are not supported
+			return false;
+	}
+}
+
+bool orange_msgpack_unpack(struct blob *out, const uint8_t *data, size_t len){
+	struct msgpack_reader reader = { .data = data, .len = len, .pos = 0 };
+	if(!data || !len) return false;
+	if(!_unpack_field(&reader, out, 0, false)) return false;
+	// trailing garbage is not allowed
+	return reader.pos == reader.len;
+}
@@ -0,0 +1,38 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	MessagePack codec for blob fields.
+
+	This is the binary wire encoding used by the "rpc-msgpack" websocket
+	subprotocol. Tables map to msgpack maps (keys are always strings), arrays
+	map to msgpack arrays and scalars map to their closest msgpack type.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct blob;
+struct blob_field;
+
+// packs a blob field into a newly allocated buffer. The buffer starts with headroom bytes of free space (for transport headers) and has at least tailroom bytes of free space after the packed data. Returns NULL on failure.
+uint8_t *orange_msgpack_pack(const struct blob_field *field, size_t headroom, size_t tailroom, size_t *len);
+
+// unpacks exactly one msgpack object from data and appends it to out. Returns false if data is not a valid (or supported) msgpack object.
+bool orange_msgpack_unpack(struct blob *out, const uint8_t *data, size_t len);
@@ -0,0 +1,239 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_mux_server.h"
+#include <utype/list.h>
+#include <utype/utils.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+#include "orange_id.h"
+#include "internal.h"
+#include "util.h"
+#include <blobpack/blobpack.h>
+
+// how long forwarder threads block in backend recv before checking for shutdown
+#define ORANGE_MUX_POLL_US 100000UL
+
+struct orange_mux_server;
+
+struct orange_mux_backend {
+	struct orange_mux_server *mux;
+	orange_server_t server;
+	char *name;
+	pthread_t thread;
+};
+
+struct orange_mux_server {
+	const struct orange_server_api *api;
+	bool shutdown;
+	pthread_mutex_t lock;
+	pthread_cond_t rx_ready;
+	struct list_head rx_queue;
+	struct orange_mux_backend backends[ORANGE_MUX_MAX_BACKENDS];
+	int num_backends;
+	void *user_data;
+};
+
+static void *_mux_forward_thread(void *ptr){
+	struct orange_mux_backend *backend = (struct orange_mux_backend*)ptr;
+	struct orange_mux_server *self = backend->mux;
+	prctl(PR_SET_NAME, "mux_forward");
+
+	pthread_mutex_lock(&self->lock);
+	while(!self->shutdown){
+		pthread_mutex_unlock(&self->lock);
+		struct orange_message *msg = NULL;
+		int ret = orange_server_recv(backend->server, &msg, ORANGE_MUX_POLL_US);
+		pthread_mutex_lock(&self->lock);
+		if(ret > 0 && msg){
+			list_add_tail(&msg->list, &self->rx_queue);
+			pthread_cond_signal(&self->rx_ready);
+		} else if(ret < 0 && ret != -EAGAIN && !self->shutdown){
+			// backend is shutting down or broken. Avoid spinning.
+			pthread_mutex_unlock(&self->lock);
+			usleep(ORANGE_MUX_POLL_US);
+			pthread_mutex_lock(&self->lock);
+		}
+	}
+	pthread_mutex_unlock(&self->lock);
+	pthread_exit(0);
+	return NULL;
+}
+
+int orange_mux_server_add(orange_server_t socket, const char *name, orange_server_t backend){
+	struct orange_mux_server *self = container_of(socket, struct orange_mux_server, api);
+	pthread_mutex_lock(&self->lock);
+	if(self->num_backends >= ORANGE_MUX_MAX_BACKENDS){
+		pthread_mutex_unlock(&self->lock);
+		return -ENOSPC;
+	}
+	struct orange_mux_backend *b = &self->backends[self->num_backends++];
+	b->mux = self;
+	b->server = backend;
+	b->name = strdup(name);
+	pthread_create(&b->thread, NULL, _mux_forward_thread, b);
+	pthread_mutex_unlock(&self->lock);
+	return 0;
+}
+
+static int _mux_listen(orange_server_t socket, const char *path){
+	// backends are set up by the caller
+	return -ENOTSUP;
+}
+
+static int _mux_connect(orange_server_t socket, const char *path){
+	return -ENOTSUP;
+}
+
+static struct orange_message *_message_copy(struct orange_message *msg){
+	struct orange_message *copy = orange_message_new();
+	blob_reset(&copy->buf);
+	blob_put_attr(&copy->buf, blob_field_first_child(blob_head(&msg->buf)));
+	copy->peer = msg->peer;
+	copy->topic = (msg->topic)?strdup(msg->topic):NULL;
+	copy->event_batch = msg->event_batch;
+	return copy;
+}
+
+static int _mux_send(orange_server_t socket, struct orange_message **msg){
+	struct orange_mux_server *self = container_of(socket, struct orange_mux_server, api);
+
+	if((*msg)->peer == 0){
+		// last backend gets the original message and the rest get copies
+		for(int c = 0; c < self->num_backends; c++){
+			struct orange_message *m = (c == self->num_backends - 1)?*msg:_message_copy(*msg);
+			orange_server_send(self->backends[c].server, &m);
+		}
+		if(self->num_backends) *msg = NULL;
+		else orange_message_delete(msg);
+		return 0;
+	}
+
+	const void *owner = orange_peer_id_owner((*msg)->peer);
+	for(int c = 0; c < self->num_backends; c++){
+		if(owner == self->backends[c].server){
+			return orange_server_send(self->backends[c].server, msg);
+		}
+	}
+	// peer has already disconnected
+	orange_message_delete(msg);
+	return -1;
+}
+
+static int _mux_recv(orange_server_t socket, struct orange_message **msg, unsigned long long timeout_us){
+	struct orange_mux_server *self = container_of(socket, struct orange_mux_server, api);
+	struct timespec t;
+
+	*msg = NULL;
+	timespec_from_now_us(&t, timeout_us);
+
+	pthread_mutex_lock(&self->lock);
+	while(list_empty(&self->rx_queue)){
+		if(self->shutdown){
+			pthread_mutex_unlock(&self->lock);
+			return -1;
+		}
+		if(pthread_cond_timedwait(&self->rx_ready, &self->lock, &t) == ETIMEDOUT){
+			pthread_mutex_unlock(&self->lock);
+			return -EAGAIN;
+		}
+	}
+	struct orange_message *m = list_first_entry(&self->rx_queue, struct orange_message, list);
+	list_del_init(&m->list);
+	*msg = m;
+	pthread_mutex_unlock(&self->lock);
+	return 1;
+}
+
+static void *_mux_userdata(orange_server_t socket, void *ptr){
+	struct orange_mux_server *self = container_of(socket, struct orange_mux_server, api);
+	pthread_mutex_lock(&self->lock);
+	if(ptr) self->user_data = ptr;
+	void *ret = self->user_data;
+	pthread_mutex_unlock(&self->lock);
+	return ret;
+}
+
+static int _mux_stats(orange_server_t socket, struct blob *out){
+	struct orange_mux_server *self = container_of(socket, struct orange_mux_server, api);
+	blob_offset_t t = blob_open_table(out);
+	for(int c = 0; c < self->num_backends; c++){
+		blob_put_string(out, self->backends[c].name);
+		if(orange_server_stats(self->backends[c].server, out) < 0){
+			blob_put_int(out, 0);
+		}
+	}
+	blob_close_table(out, t);
+	return 0;
+}
+
+static int _mux_subscribe(orange_server_t socket, uint32_t peer, const char *pattern, bool subscribe){
+	struct orange_mux_server *self = container_of(socket, struct orange_mux_server, api);
+	const void *owner = orange_peer_id_owner(peer);
+	for(int c = 0; c < self->num_backends; c++){
+		if(owner != self->backends[c].server) continue;
+		if(subscribe) return orange_server_subscribe(self->backends[c].server, peer, pattern);
+		return orange_server_unsubscribe(self->backends[c].server, peer, pattern);
+	}
+	return -ENOENT;
+}
+
+static void _mux_destroy(orange_server_t socket){
+	struct orange_mux_server *self = container_of(socket, struct orange_mux_server, api);
+
+	pthread_mutex_lock(&self->lock);
+	self->shutdown = true;
+	pthread_cond_broadcast(&self->rx_ready);
+	pthread_mutex_unlock(&self->lock);
+
+	for(int c = 0; c < self->num_backends; c++){
+		pthread_join(self->backends[c].thread, NULL);
+		orange_server_delete(self->backends[c].server);
+		free(self->backends[c].name);
+	}
+
+	struct orange_message *msg, *nmsg;
+	list_for_each_entry_safe(msg, nmsg, &self->rx_queue, list){
+		orange_message_delete(&msg);
+	}
+
+	pthread_mutex_destroy(&self->lock);
+	pthread_cond_destroy(&self->rx_ready);
+	free(self);
+}
+
+orange_server_t orange_mux_server_new(void){
+	struct orange_mux_server *self = calloc(1, sizeof(struct orange_mux_server));
+	assert(self);
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->rx_ready, NULL);
+	INIT_LIST_HEAD(&self->rx_queue);
+	static const struct orange_server_api api = {
+		.destroy = _mux_destroy,
+		.listen = _mux_listen,
+		.connect = _mux_connect,
+		.send = _mux_send,
+		.recv = _mux_recv,
+		.userdata = _mux_userdata,
+		.stats = _mux_stats,
+		.subscribe = _mux_subscribe
+	};
+	self->api = &api;
+	return &self->api;
+}
@@ -0,0 +1,35 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Server that combines several servers into one.
+
+	Requests from all backends are delivered through a single recv() call.
+	Responses are routed back to the backend that owns the peer (see
+	orange_peer_id_alloc) and broadcasts are sent to all backends. Backends
+	are owned by the mux and are destroyed together with it.
+*/
+
+#pragma once
+
+#include "orange_server.h"
+
+#define ORANGE_MUX_MAX_BACKENDS 4
+
+orange_server_t orange_mux_server_new(void);
+
+// adds a server that is already listening. Name is used as key in stats output.
+int orange_mux_server_add(orange_server_t mux, const char *name, orange_server_t backend);
@@ -0,0 +1,178 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_rand.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "internal.h"
+
+// number of ChaCha20 blocks generated at once. First 32 bytes of each batch become the next key. 
+#define RAND_BLOCKS 16
+#define RAND_BUF_SIZE (RAND_BLOCKS * 64)
+#define RAND_KEY_SIZE 32
+// fresh seed is read from the kernel after this many bytes of output
+#define RAND_RESEED_BYTES (1024 * 1024)
+
+struct rand_state {
+	uint32_t input[16]; 
+	uint8_t buf[RAND_BUF_SIZE]; 
+	size_t avail; // unused bytes at the end of buf
+	size_t until_reseed; 
+	unsigned int fork_gen; 
+	bool seeded; 
+}; 
+
+static __thread struct rand_state rand_state; 
+static unsigned int rand_fork_gen = 0; 
+static pthread_once_t rand_once = PTHREAD_ONCE_INIT; 
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7); 
+
+void orange_rand_chacha20_block(const uint32_t state[16], uint8_t out[64]){
+	uint32_t x[16]; 
+	memcpy(x, state, sizeof(x)); 
+	for(int c = 0; c < 10; c++){
+		QUARTERROUND(x[0], x[4], x[8], x[12]); 
+		QUARTERROUND(x[1], x[5], x[9], x[13]); 
+		QUARTERROUND(x[2], x[6], x[10], x[14]); 
+		QUARTERROUND(x[3], x[7], x[11], x[15]); 
+		QUARTERROUND(x[0], x[5], x[10], x[15]); 
+		QUARTERROUND(x[1], x[6], x[11], x[12]); 
+		QUARTERROUND(x[2], x[7], x[8], x[13]); 
+		QUARTERROUND(x[3], x[4], x[9], x[14]); 
+	}
+	for(int c = 0; c < 16; c++){
+		uint32_t v = x[c] + state[c]; 
+		out[c * 4] = v; 
+		out[c * 4 + 1] = v >> 8; 
+		out[c * 4 + 2] = v >> 16; 
+		out[c * 4 + 3] = v >> 24; 
+	}
+}
+
+static uint32_t _load32(const uint8_t *p){
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); 
+}
+
+static void _atfork_child(void){
+	// the child has a copy of the parent state so it must not produce the same numbers
+	__atomic_add_fetch(&rand_fork_gen, 1, __ATOMIC_RELAXED); 
+}
+
+static void _init_once(void){
+	pthread_atfork(NULL, NULL, _atfork_child); 
+}
+
+static int _get_entropy(uint8_t *buf, size_t len){
+#ifdef SYS_getrandom
+	size_t got = 0; 
+	while(got < len){
+		long ret = syscall(SYS_getrandom, buf + got, len - got, 0); 
+		if(ret < 0 && errno == EINTR) continue; 
+		if(ret <= 0) break; 
+		got += ret; 
+	}
+	if(got == len) return 0; 
+#endif
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC); 
+	if(fd < 0) return -errno; 
+	size_t done = 0; 
+	while(done < len){
+		ssize_t ret = read(fd, buf + done, len - done); 
+		if(ret < 0 && errno == EINTR) continue; 
+		if(ret <= 0) break; 
+		done += ret; 
+	}
+	close(fd); 
+	return (done == len)?0:-EIO; 
+}
+
+static void _seed(struct rand_state *self){
+	// key and nonce
+	uint8_t seed[RAND_KEY_SIZE + 12]; 
+	pthread_once(&rand_once, _init_once); 
+	if(_get_entropy(seed, sizeof(seed)) != 0){
+		// handing out predictable session ids is worse than not running at all
+		ERROR("could not get random seed from the kernel!\n"); 
+		abort(); 
+	}
+	self->input[0] = 0x61707865; 
+	self->input[1] = 0x3320646e; 
+	self->input[2] = 0x79622d32; 
+	self->input[3] = 0x6b206574; 
+	for(int c = 0; c < 8; c++) self->input[4 + c] = _load32(seed + c * 4); 
+	self->input[12] = 0; 
+	for(int c = 0; c < 3; c++) self->input[13 + c] = _load32(seed + RAND_KEY_SIZE + c * 4); 
+	memset(seed, 0, sizeof(seed)); 
+	self->avail = 0; 
+	self->until_reseed = RAND_RESEED_BYTES; 
+	self->fork_gen = __atomic_load_n(&rand_fork_gen, __ATOMIC_RELAXED); 
+	self->seeded = true; 
+}
+
+static void _refill(struct rand_state *self){
+	if(!self->seeded || self->until_reseed < RAND_BUF_SIZE || 
+		self->fork_gen != __atomic_load_n(&rand_fork_gen, __ATOMIC_RELAXED)){
+		_seed(self); 
+	}
+	for(int c = 0; c < RAND_BLOCKS; c++){
+		orange_rand_chacha20_block(self->input, self->buf + c * 64); 
+		self->input[12]++; 
+	}
+	// fast key erasure: start of the output becomes the new key and is never handed out
+	for(int c = 0; c < 8; c++) self->input[4 + c] = _load32(self->buf + c * 4); 
+	self->input[12] = 0; 
+	memset(self->buf, 0, RAND_KEY_SIZE); 
+	self->avail = RAND_BUF_SIZE - RAND_KEY_SIZE; 
+	self->until_reseed -= RAND_BUF_SIZE; 
+}
+
+void orange_rand_bytes(void *_buf, size_t len){
+	struct rand_state *self = &rand_state; 
+	uint8_t *buf = (uint8_t*)_buf; 
+	if(self->fork_gen != __atomic_load_n(&rand_fork_gen, __ATOMIC_RELAXED)) self->avail = 0; 
+	while(len){
+		if(!self->avail) _refill(self); 
+		size_t n = (len < self->avail)?len:self->avail; 
+		uint8_t *src = self->buf + RAND_BUF_SIZE - self->avail; 
+		memcpy(buf, src, n); 
+		// used output is wiped so that it can not be read back later
+		memset(src, 0, n); 
+		self->avail -= n; 
+		buf += n; 
+		len -= n; 
+	}
+}
+
+uint32_t orange_rand_u32(void){
+	uint32_t v; 
+	orange_rand_bytes(&v, sizeof(v)); 
+	return v; 
+}
@@ -0,0 +1,37 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Fast random numbers for session ids, login challenges and peer ids. 
+
+	Every thread has its own ChaCha20 generator that is seeded from
+	getrandom() (or /dev/urandom on kernels without it), so generating a
+	random value normally does not make a system call or take a lock. The
+	generator rekeys itself from its own output after every block of output
+	so earlier output can not be recovered from its state, reseeds from the
+	kernel after RAND_RESEED_BYTES and also reseeds in forked children. 
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+void orange_rand_bytes(void *buf, size_t len); 
+uint32_t orange_rand_u32(void); 
+
+// runs the ChaCha20 block function on state (constants, key, counter, nonce). Exposed for tests. 
+void orange_rand_chacha20_block(const uint32_t state[16], uint8_t out[64]); 
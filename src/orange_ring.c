@@ -0,0 +1,164 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_ring.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// keep indices that are written by producers and consumers on separate cache lines
+#define ORANGE_RING_CACHELINE 64
+
+struct orange_ring_slot {
+	size_t seq; 
+	void *ptr; 
+}; 
+
+struct orange_ring {
+	size_t mask; 
+	struct orange_ring_slot *slots; 
+	char pad0[ORANGE_RING_CACHELINE]; 
+	size_t head; // next slot to push
+	char pad1[ORANGE_RING_CACHELINE]; 
+	size_t tail; // next slot to pop
+	char pad2[ORANGE_RING_CACHELINE]; 
+	uint32_t futex; // incremented on every push that may have to wake somebody
+	uint32_t waiters; 
+	bool closed; 
+}; 
+
+static int _futex(uint32_t *addr, int op, uint32_t val, const struct timespec *ts){
+	return syscall(SYS_futex, addr, op, val, ts, NULL, 0); 
+}
+
+struct orange_ring *orange_ring_new(size_t size){
+	struct orange_ring *self = calloc(1, sizeof(struct orange_ring)); 
+	assert(self); 
+	size_t n = 2; 
+	while(n < size) n <<= 1; 
+	self->mask = n - 1; 
+	self->slots = calloc(n, sizeof(struct orange_ring_slot)); 
+	assert(self->slots); 
+	for(size_t c = 0; c < n; c++) self->slots[c].seq = c; 
+	return self; 
+}
+
+void orange_ring_delete(struct orange_ring **self){
+	assert(self && *self); 
+	free((*self)->slots); 
+	free(*self); 
+	*self = NULL; 
+}
+
+int orange_ring_push(struct orange_ring *self, void *ptr){
+	size_t pos = __atomic_load_n(&self->head, __ATOMIC_RELAXED); 
+	struct orange_ring_slot *slot; 
+	while(1){
+		slot = &self->slots[pos & self->mask]; 
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE); 
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos; 
+		if(diff == 0){
+			// slot is free for this lap. Try to claim it. 
+			if(__atomic_compare_exchange_n(&self->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break; 
+		} else if(diff < 0){
+			// consumer has not yet released the slot from previous lap
+			return -EAGAIN; 
+		} else {
+			pos = __atomic_load_n(&self->head, __ATOMIC_RELAXED); 
+		}
+	}
+	slot->ptr = ptr; 
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE); 
+
+	// only do the syscall if a consumer is (about to be) parked. Fence orders the slot store before the waiters load. 
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); 
+	if(__atomic_load_n(&self->waiters, __ATOMIC_SEQ_CST)){
+		__atomic_add_fetch(&self->futex, 1, __ATOMIC_SEQ_CST); 
+		_futex(&self->futex, FUTEX_WAKE_PRIVATE, 1, NULL); 
+	}
+	return 0; 
+}
+
+void *orange_ring_pop(struct orange_ring *self){
+	size_t pos = __atomic_load_n(&self->tail, __ATOMIC_RELAXED); 
+	struct orange_ring_slot *slot; 
+	while(1){
+		slot = &self->slots[pos & self->mask]; 
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE); 
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1); 
+		if(diff == 0){
+			if(__atomic_compare_exchange_n(&self->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break; 
+		} else if(diff < 0){
+			// empty
+			return NULL; 
+		} else {
+			pos = __atomic_load_n(&self->tail, __ATOMIC_RELAXED); 
+		}
+	}
+	void *ptr = slot->ptr; 
+	// release the slot for the next lap
+	__atomic_store_n(&slot->seq, pos + self->mask + 1, __ATOMIC_RELEASE); 
+	return ptr; 
+}
+
+static long long _now_us(void){
+	struct timespec ts; 
+	clock_gettime(CLOCK_MONOTONIC, &ts); 
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000; 
+}
+
+int orange_ring_pop_wait(struct orange_ring *self, void **ptr, unsigned long long timeout_us){
+	long long deadline = _now_us() + (long long)timeout_us; 
+	while(1){
+		if((*ptr = orange_ring_pop(self))) return 1; 
+		if(__atomic_load_n(&self->closed, __ATOMIC_ACQUIRE)) return -ECANCELED; 
+
+		// register as waiter before checking the ring again so that a push after the check always sees us
+		uint32_t val = __atomic_load_n(&self->futex, __ATOMIC_SEQ_CST); 
+		__atomic_add_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST); 
+		if((*ptr = orange_ring_pop(self))){
+			__atomic_sub_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST); 
+			return 1; 
+		}
+		long long left = deadline - _now_us(); 
+		if(left <= 0){
+			__atomic_sub_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST); 
+			return -EAGAIN; 
+		}
+		struct timespec ts = { .tv_sec = left / 1000000LL, .tv_nsec = (left % 1000000LL) * 1000 }; 
+		_futex(&self->futex, FUTEX_WAIT_PRIVATE, val, &ts); 
+		__atomic_sub_fetch(&self->waiters, 1, __ATOMIC_SEQ_CST); 
+	}
+	return -EAGAIN; 
+}
+
+void orange_ring_close(struct orange_ring *self){
+	__atomic_store_n(&self->closed, true, __ATOMIC_RELEASE); 
+	__atomic_add_fetch(&self->futex, 1, __ATOMIC_SEQ_CST); 
+	_futex(&self->futex, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL); 
+}
+
+size_t orange_ring_count(struct orange_ring *self){
+	size_t head = __atomic_load_n(&self->head, __ATOMIC_RELAXED); 
+	size_t tail = __atomic_load_n(&self->tail, __ATOMIC_RELAXED); 
+	return (head > tail)?head - tail:0; 
+}
@@ -0,0 +1,48 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Bounded lock-free multi producer multi consumer queue of pointers.
+
+	Based on the sequence number ring by Dmitry Vyukov: every slot carries a
+	sequence counter that tells producers and consumers whether the slot is
+	free or filled for the current lap so push and pop only need one compare
+	and swap on the shared head or tail index. Idle consumers park on a futex
+	that producers only touch when somebody is actually waiting. 
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct orange_ring; 
+
+// size is rounded up to the next power of two
+struct orange_ring *orange_ring_new(size_t size); 
+void orange_ring_delete(struct orange_ring **self); 
+
+// returns 0 on success or -EAGAIN if the ring is full
+int orange_ring_push(struct orange_ring *self, void *ptr); 
+// returns NULL if ring is empty
+void *orange_ring_pop(struct orange_ring *self); 
+// waits for an element. Returns 1 on success, -EAGAIN on timeout and -ECANCELED if ring has been closed. 
+int orange_ring_pop_wait(struct orange_ring *self, void **ptr, unsigned long long timeout_us); 
+
+// wakes up all waiting consumers and makes further waits fail. Elements can still be popped. 
+void orange_ring_close(struct orange_ring *self); 
+
+size_t orange_ring_count(struct orange_ring *self); 
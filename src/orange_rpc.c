@@ -22,211 +22,775 @@
 
 #include "orange.h"
 #include "orange_rpc.h"
+#include "orange_topic.h"
 #include "orange_eq.h"
+#include "orange_coalesce.h"
+#include "orange_evlog.h"
+#include "orange_rand.h"
 #include "internal.h"
 #include "util.h"
 
 #define WORKER_TIMEOUT_US 10000000UL
+// how often the monitor checks the worker pool
+#define WORKER_MONITOR_TICK_US 100000UL
+// how often the monitor checks for hanged requests
+#define WORKER_HANG_CHECK_US 5000000UL
+// defaults for pool growth (see orange_rpc_set_max_workers)
+#define WORKER_GROW_AFTER_US 200000UL
+#define WORKER_IDLE_TIMEOUT_US 30000000UL
+// worker time a client may use in one scheduling round within a lane
+#define LANE_QUANTUM_US 10000LL
+// limit on how much worker time a client can owe (keeps rounds short when it is the only client)
+#define LANE_MAX_DEBT_US 1000000LL
 
-struct request_record {
+// requests taken from each lane per round (control, normal, bulk)
+static const unsigned int _lane_weights[ORANGE_LANE_COUNT] = { 8, 4, 1 }; 
+static const char *_lane_names[ORANGE_LANE_COUNT] = { "control", "normal", "bulk" }; 
+
+// default for how many requests one client may have running at the same time
+#define PEER_MAX_INFLIGHT 4
+// default for largest json-rpc batch
+#define BATCH_MAX 64
+// defaults for how many requests may wait for a worker in total and per client
+#define QUEUE_MAX 4096
+#define PEER_MAX_QUEUED 256
+// defaults for how many local events are broadcast together and how long to wait for more events of a burst
+#define EVENT_BATCH_MAX 32
+#define EVENT_WINDOW_US 0
+// default size of the log of recent events that reconnecting clients can have replayed
+#define EVENT_LOG_SIZE (64 * 1024)
+// how often drain checks whether all requests have completed
+#define DRAIN_POLL_US 10000UL
+// most positional params taken by a built in method (after session id)
+#define RPC_MAX_PARAMS 3
+// random bytes in a login challenge
+#define CHALLENGE_BYTES 16
+
+struct orange_rpc_peer; 
+
+// queued requests of one peer within a lane
+struct orange_rpc_flow {
+	struct avl_node avl; 
+	uint32_t peer; 
+	struct orange_rpc_peer *owner; 
+	struct list_head requests; 
+	struct list_head active; // entry in lane active list (empty when flow has no queued requests or peer is at its limit)
+	long long deficit_us; 
+	unsigned int inflight; 
+}; 
+
+// all requests of one peer across lanes
+struct orange_rpc_peer {
 	struct avl_node avl; 
-	char *name; 
+	uint32_t peer; 
+	struct orange_rpc_flow *flows[ORANGE_LANE_COUNT]; 
+	struct list_head running; // running requests in the order they were dispatched
+	unsigned int inflight; 
+	unsigned int queued; 
+	unsigned long long completed; 
+	unsigned long long reordered; // requests that finished while an earlier request of the same peer was still running
+}; 
+
+// requests that arrived together in one json-rpc batch array. Each element is scheduled as a separate 
+// request and the combined response is sent when the last element has been answered. 
+struct orange_rpc_batch {
+	uint32_t peer; 
+	unsigned int count; 
+	unsigned int pending; // updated atomically because elements complete on different workers
+	struct orange_message **results; // in request order (NULL for elements that could not be parsed)
+}; 
+
+// call in progress. Every worker owns one record that is reused for all of its calls and is linked into 
+// orange_rpc.calls while a call is running so that monitor and cancel can find it. 
+struct request_record {
+	struct list_head list; 
+	const char *object; // point into the request message which outlives the call
+	const char *method; 
 	struct timespec ts_expired; 
+	uint32_t peer; 
+	uint32_t rpc_id; 
+	volatile int cancel; // set by cancel method or when the peer disconnects
 }; 
 
-static bool rpcmsg_parse_call(struct blob *msg, uint32_t *id, const char **method, const struct blob_field **params){
-	if(!msg) return false; 
-	struct blob_policy policy[] = {
-		{ .name = "id", .type = BLOB_FIELD_ANY, .value = NULL },
-		{ .name = "method", .type = BLOB_FIELD_STRING, .value = NULL },
-		{ .name = "params", .type = BLOB_FIELD_ARRAY, .value = NULL }
-	}; 
-	const struct blob_field *b = blob_field_first_child(blob_head(msg));  
-	blob_field_parse_values(b, policy, 3); 
-	*id = blob_field_get_int(policy[0].value); 
-	*method = blob_field_get_string(policy[1].value); 
-	*params = policy[2].value; 
-	return !!(policy[0].value && method && params); 
-}
-
-static bool rpcmsg_parse_call_params(struct blob_field *params, const char **sid, const char **object, const char **method, const struct blob_field **args){
-	if(!params) return false; 
-	struct blob_policy policy[] = {
-		{ .type = BLOB_FIELD_STRING }, // sid
-		{ .type = BLOB_FIELD_STRING }, // object 
-		{ .type = BLOB_FIELD_STRING }, // method
-		{ .type = BLOB_FIELD_TABLE } // args
-	}; 
-	if(!blob_field_parse_values(params, policy, 4)) return false;  
-	*sid = blob_field_get_string(policy[0].value); 
-	*object = blob_field_get_string(policy[1].value); 
-	*method = blob_field_get_string(policy[2].value); 
-	*args = policy[3].value; 
-	return !!(sid && object && method && args); 
-}
-
-static bool rpcmsg_parse_authenticate(struct blob_field *params, const char **sid){
-	if(!params) return false; 
-	struct blob_policy policy[] = {
-		{ .type = BLOB_FIELD_STRING }, // sid
-	}; 
-	if(!blob_field_parse_values(params, policy, 1)) return false;  
-	*sid = blob_field_get_string(policy[0].value); 
-	return !!(sid); 
-}
-
-static bool rpcmsg_parse_list_params(struct blob_field *params, const char **sid, const char **path){
-	if(!params) return false; 
-	struct blob_policy policy[] = {
-		{ .type = BLOB_FIELD_STRING }, // sid
-		{ .type = BLOB_FIELD_STRING } // path
-	}; 
-	if(!blob_field_parse_values(params, policy, 2)) return false;  
-	*sid = blob_field_get_string(policy[0].value); 
-	*path = blob_field_get_string(policy[1].value); 
-	return !!(sid && path); 
-}
-
-static bool rpcmsg_parse_login(struct blob_field *params, const char **username, const char **response){
-	if(!params) return false; 
-	struct blob_policy policy[] = {
-		{ .type = BLOB_FIELD_STRING }, // username
-		{ .type = BLOB_FIELD_STRING }  // challenge response
-	}; 
-	if(!blob_field_parse_values(params, policy, 2)) return false; 
-	*username = blob_field_get_string(policy[0].value); 
-	*response = blob_field_get_string(policy[1].value); 
-	return !!(username && response); 
+// built in rpc methods. Handlers add either "result" or "error" to the response table. 
+typedef void (*rpc_method_handler_t)(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out); 
+
+// login challenge handed out to a client
+struct orange_rpc_challenge {
+	struct avl_node avl; 
+	uint32_t peer; 
+	char token[CHALLENGE_BYTES * 2 + 1]; 
+}; 
+
+struct rpc_method {
+	const char *name; 
+	rpc_method_handler_t handler; 
+	enum orange_lane lane; 
+	bool plugin_lane; // lane is decided by the called plugin method
+}; 
+
+// parses json-rpc envelope of a request on first use (single pass over the top level table). Returns NULL for invalid requests. 
+static const struct orange_rpc_envelope *_request_envelope(struct orange_message *msg){
+	struct orange_rpc_envelope *env = &msg->env; 
+	if(env->state) return (env->state > 0)?env:NULL; 
+	env->state = -1; 
+	struct blob_field *root = blob_field_first_child(blob_head(&msg->buf)); 
+	if(!root || blob_field_type(root) != BLOB_FIELD_TABLE) return NULL; 
+	bool has_id = false; 
+	struct blob_field *key; 
+	// table is stored as key, value pairs
+	blob_field_for_each_child(root, key){
+		struct blob_field *value = blob_field_next_child(root, key); 
+		if(!value) break; 
+		const char *name = blob_field_get_string(key); 
+		if(strcmp(name, "id") == 0){
+			env->id = blob_field_get_int(value); 
+			has_id = true; 
+		} else if(strcmp(name, "method") == 0 && blob_field_type(value) == BLOB_FIELD_STRING){
+			env->method = blob_field_get_string(value); 
+		} else if(strcmp(name, "params") == 0 && blob_field_type(value) == BLOB_FIELD_ARRAY){
+			env->params = value; 
+		} else if(strcmp(name, "deadline") == 0){
+			env->deadline_ms = blob_field_get_int(value); 
+		}
+		key = value; 
+	}
+	if(!has_id || !env->method || !env->params) return NULL; 
+	env->state = 1; 
+	return env; 
+}
+
+// collects first n positional params in one pass. Missing params are set to NULL. 
+static void _params_get(const struct blob_field *params, const struct blob_field **out, int n){
+	struct blob_field *child; 
+	int c = 0; 
+	for(int i = 0; i < n; i++) out[i] = NULL; 
+	blob_field_for_each_child((struct blob_field*)params, child){
+		if(c == n) break; 
+		out[c++] = child; 
+	}
+}
+
+static const char *_param_str(const struct blob_field *field){
+	return (field && blob_field_type(field) == BLOB_FIELD_STRING)?blob_field_get_string(field):NULL; 
+}
+
+// gets session id and the n params that follow it. Session id is either supplied by the transport (http header) or is the first param. 
+static const char *_request_params(struct orange_message *msg, const struct orange_rpc_envelope *env, const struct blob_field **out, int n){
+	const struct blob_field *p[RPC_MAX_PARAMS + 1]; 
+	assert(n <= RPC_MAX_PARAMS); 
+	_params_get(env->params, p, n + 1); 
+	if(msg->sid){
+		for(int c = 0; c < n; c++) out[c] = p[c]; 
+		return msg->sid; 
+	}
+	for(int c = 0; c < n; c++) out[c] = p[c + 1]; 
+	return _param_str(p[0]); 
+}
+
+// converts optional "deadline" extension field (milliseconds after the request was received) into msg->ts_deadline
+static void rpcmsg_parse_deadline(struct orange_message *msg){
+	const struct orange_rpc_envelope *env = _request_envelope(msg); 
+	if(!env || env->deadline_ms <= 0) return; 
+	long long ms = env->deadline_ms; 
+	struct timespec t = msg->ts_queued; 
+	if(!t.tv_sec && !t.tv_nsec) timespec_now(&t); 
+	unsigned long long nsec = t.tv_nsec + (ms % 1000) * 1000000ULL; 
+	msg->ts_deadline.tv_sec = t.tv_sec + ms / 1000 + nsec / 1000000000ULL; 
+	msg->ts_deadline.tv_nsec = nsec % 1000000000ULL; 
+}
+
+static bool _message_expired(struct orange_message *msg){
+	if(!msg->ts_deadline.tv_sec && !msg->ts_deadline.tv_nsec) return false; 
+	return timespec_expired(&msg->ts_deadline); 
+}
+
+// writes a json-rpc notification for the event. Seq is the position of the event in the event log. 
+static void _put_event(struct blob *buf, const char *name, const struct blob_field *data, unsigned long long seq){
+	blob_offset_t t = blob_open_table(buf); 
+	blob_put_string(buf, "jsonrpc"); 
+	blob_put_string(buf, "2.0"); 
+	blob_put_string(buf, "method"); 
+	blob_put_string(buf, name); 
+	blob_put_string(buf, "params"); 
+	blob_put_attr(buf, data); 
+	blob_put_string(buf, "seq"); 
+	blob_put_int(buf, seq); 
+	blob_close_table(buf, t); 
+}
+
+// json-rpc requires "id": null in replies to requests whose id could not be determined. Blobs have no 
+// null type of their own so the value goes through the json parser, same as a null sent by a client. 
+static void _put_null_id(struct blob *buf){
+	blob_put_string(buf, "id"); 
+	if(!blob_put_json(buf, "null")){
+		// any other value would be taken as a real request id by the client
+		ERROR("rpc: could not put null id into reply!\n"); 
+		abort(); 
+	}
+}
+
+static void _put_error(struct blob *buf, int code, const char *str){
+	blob_put_string(buf, "error"); 
+	blob_offset_t o = blob_open_table(buf); 
+	blob_put_string(buf, "code"); 
+	blob_put_int(buf, code); 
+	blob_put_string(buf, "str"); 
+	blob_put_string(buf, str); 
+	blob_close_table(buf, o); 
+}
+
+// stores result of one batch element. Sends the whole batch response when this was the last element. Takes ownership of result. 
+static void _batch_complete(struct orange_rpc *self, struct orange_rpc_batch *batch, unsigned int idx, struct orange_message *result){
+	batch->results[idx] = result; 
+	if(__sync_sub_and_fetch(&batch->pending, 1) != 0) return; 
+
+	struct orange_message *res = orange_message_new(); 
+	res->peer = batch->peer; 
+	blob_offset_t a = blob_open_array(&res->buf); 
+	for(unsigned int c = 0; c < batch->count; c++){
+		if(batch->results[c]){
+			blob_put_attr(&res->buf, blob_field_first_child(blob_head(&batch->results[c]->buf))); 
+			orange_message_delete(&batch->results[c]); 
+		} else {
+			blob_offset_t t = blob_open_table(&res->buf); 
+			blob_put_string(&res->buf, "jsonrpc"); 
+			blob_put_string(&res->buf, "2.0"); 
+			_put_null_id(&res->buf); 
+			_put_error(&res->buf, -EINVAL, "Invalid Request"); 
+			blob_close_table(&res->buf, t); 
+		}
+	}
+	blob_close_array(&res->buf, a); 
+	orange_server_send(self->server, &res); 
+	free(batch->results); 
+	free(batch); 
+}
+
+// sends response to a request (or stores it if the request is part of a batch). Takes ownership of result. 
+static void _rpc_reply(struct orange_rpc *self, struct orange_message *msg, struct orange_message **result){
+	if(msg->batch){
+		_batch_complete(self, msg->batch, msg->batch_index, *result); 
+		msg->batch = NULL; 
+		*result = NULL; 
+		return; 
+	}
+	orange_server_send(self->server, result); 
+}
+
+// frees a request. Batch elements that were never answered are counted as failed so that the batch response still goes out. 
+static void _request_free(struct orange_rpc *self, struct orange_message **msg){
+	if((*msg)->batch){
+		_batch_complete(self, (*msg)->batch, (*msg)->batch_index, NULL); 
+		(*msg)->batch = NULL; 
+	}
+	orange_message_delete(msg); 
+}
+
+// splits a json-rpc batch array into separate requests that are placed on out. Returns false if message is not a batch. 
+// Invalid batches are answered right away. Takes ownership of the message if it is a batch. 
+static bool _batch_expand(struct orange_rpc *self, struct orange_message *msg, struct list_head *out){
+	struct blob_field *root = blob_field_first_child(blob_head(&msg->buf)); 
+	if(!root || blob_field_type(root) != BLOB_FIELD_ARRAY) return false; 
+
+	unsigned int count = 0; 
+	struct blob_field *child; 
+	blob_field_for_each_child(root, child) count++; 
+
+	if(count == 0 || count > self->max_batch){
+		struct orange_message *result = orange_message_new(); 
+		result->peer = msg->peer; 
+		blob_offset_t t = blob_open_table(&result->buf); 
+		blob_put_string(&result->buf, "jsonrpc"); 
+		blob_put_string(&result->buf, "2.0"); 
+		_put_null_id(&result->buf); 
+		if(count) _put_error(&result->buf, -E2BIG, "Batch too large"); 
+		else _put_error(&result->buf, -EINVAL, "Invalid Request"); 
+		blob_close_table(&result->buf, t); 
+		orange_server_send(self->server, &result); 
+		orange_message_delete(&msg); 
+		return true; 
+	}
+
+	struct orange_rpc_batch *batch = calloc(1, sizeof(struct orange_rpc_batch)); 
+	assert(batch); 
+	batch->results = calloc(count, sizeof(struct orange_message*)); 
+	assert(batch->results); 
+	batch->peer = msg->peer; 
+	batch->count = batch->pending = count; 
+
+	unsigned int idx = 0; 
+	blob_field_for_each_child(root, child){
+		struct orange_message *m = orange_message_new(); 
+		blob_reset(&m->buf); 
+		blob_put_attr(&m->buf, child); 
+		m->peer = msg->peer; 
+		m->sid = (msg->sid)?strdup(msg->sid):NULL; 
+		m->ts_queued = msg->ts_queued; 
+		m->batch = batch; 
+		m->batch_index = idx++; 
+		list_add_tail(&m->list, out); 
+	}
+
+	pthread_mutex_lock(&self->lock); 
+	self->batches++; 
+	pthread_mutex_unlock(&self->lock); 
+
+	orange_message_delete(&msg); 
+	return true; 
+}
+
+// answers a request that will not be executed. Takes ownership of the message. 
+static void _rpc_reject(struct orange_rpc *self, struct orange_message *msg, int code, const char *str){
+	const struct orange_rpc_envelope *env = _request_envelope(msg); 
+	if(env){
+		struct orange_message *result = orange_message_new(); 
+		result->peer = msg->peer; 
+		blob_offset_t t = blob_open_table(&result->buf); 
+		blob_put_string(&result->buf, "jsonrpc"); 
+		blob_put_string(&result->buf, "2.0"); 
+		blob_put_string(&result->buf, "id"); 
+		blob_put_int(&result->buf, env->id); 
+		_put_error(&result->buf, code, str); 
+		blob_close_table(&result->buf, t); 
+		_rpc_reply(self, msg, &result); 
+	}
+	_request_free(self, &msg); 
+}
+
+// marks running requests for cancellation. Cancels all requests of the peer if all is true. Returns number of requests marked. 
+// NOTE: must be called with lock held
+static int _cancel_running(struct orange_rpc *self, uint32_t peer, uint32_t rpc_id, bool all){
+	struct request_record *req; 
+	int count = 0; 
+	list_for_each_entry(req, &self->calls, list){
+		if(req->peer != peer || (!all && req->rpc_id != rpc_id)) continue; 
+		req->cancel = 1; 
+		count++; 
+	}
+	return count; 
 }
 
 #ifdef CONFIG_THREADS
-static int orange_rpc_process_requests(struct orange_rpc *self){
-#else 
-int orange_rpc_process_requests(struct orange_rpc *self){
+static struct orange_message *_sched_remove(struct orange_rpc *self, uint32_t peer, uint32_t rpc_id); 
 #endif
-	struct orange_message *msg = NULL;         
-	struct timespec tss, tse; 
 
-	int ret = orange_server_recv(self->server, &msg, self->timeout_us); 
+static void _method_call(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	const struct blob_field *p[3]; 
+	const char *sid = _request_params(msg, env, p, 3); 
+	const char *object = _param_str(p[0]), *method = _param_str(p[1]); 
+	if(!sid || !object || !method || !p[2] || blob_field_type(p[2]) != BLOB_FIELD_TABLE){
+		DEBUG("Could not parse call message!\n"); 
+		_put_error(out, -EINVAL, "Invalid call message format!"); 
+		return; 
+	}
 
-	if(ret < 0){  
-		return ret; 
+	// make the call visible to monitor and cancel
+	slot->object = object; 
+	slot->method = method; 
+	slot->peer = msg->peer; 
+	slot->rpc_id = env->id; 
+	slot->cancel = 0; 
+	timespec_from_now_us(&slot->ts_expired, WORKER_TIMEOUT_US); 
+	pthread_mutex_lock(&self->lock); 
+	list_add_tail(&slot->list, &self->calls); 
+	pthread_mutex_unlock(&self->lock); 
+
+	orange_call_cancelable(self->ctx, sid, object, method, p[2], &slot->cancel, out); 
+
+	pthread_mutex_lock(&self->lock); 
+	list_del_init(&slot->list); 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+static void _method_list(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	const struct blob_field *p[1]; 
+	const char *sid = _request_params(msg, env, p, 1); 
+	const char *path = _param_str(p[0]); 
+	if(sid && path){
+		blob_put_string(out, "result"); 
+		orange_list(self->ctx, sid, path, out); 
 	}
-	
-	if(!msg) return -EOF; 
+}
+
+static int _challenge_cmp(const void *k1, const void *k2, void *ptr){
+	const uint32_t *a = k1, *b = k2; 
+	if(*a < *b) return -1; 
+	return *a > *b; 
+}
+
+// gives the peer a new random challenge. Earlier challenge of the peer is no longer valid after this. 
+static void _challenge_new(struct orange_rpc *self, uint32_t peer, char *token){
+	unsigned char nonce[CHALLENGE_BYTES]; 
+	orange_rand_bytes(nonce, sizeof(nonce)); 
+	pthread_mutex_lock(&self->lock); 
+	struct orange_rpc_challenge *ch = avl_find_element(&self->challenges, &peer, ch, avl); 
+	if(!ch){
+		ch = calloc(1, sizeof(struct orange_rpc_challenge)); 
+		assert(ch); 
+		ch->peer = peer; 
+		ch->avl.key = &ch->peer; 
+		avl_insert(&self->challenges, &ch->avl); 
+	}
+	hex_encode(ch->token, nonce, sizeof(nonce)); 
+	strcpy(token, ch->token); 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+// removes the challenge of the peer so that it can only be used for one login attempt
+// NOTE: must be called with lock held
+static bool _challenge_take(struct orange_rpc *self, uint32_t peer, char *token){
+	struct orange_rpc_challenge *ch = avl_find_element(&self->challenges, &peer, ch, avl); 
+	if(!ch) return false; 
+	if(token) strcpy(token, ch->token); 
+	avl_delete(&self->challenges, &ch->avl); 
+	free(ch); 
+	return true; 
+}
+
+static void _method_challenge(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	blob_put_string(out, "result"); 
+	blob_offset_t o = blob_open_table(out); 
+	blob_put_string(out, "token"); 
+	char token[CHALLENGE_BYTES * 2 + 1]; 
+	_challenge_new(self, msg->peer, token); 
+	blob_put_string(out, token);  
+	blob_close_table(out, o); 
+}
+
+static void _method_login(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	const struct blob_field *p[2]; 
+	struct orange_sid _sid; 
+
+	// client must ask for a new challenge before every login attempt
+	char token[CHALLENGE_BYTES * 2 + 1]; 
+	pthread_mutex_lock(&self->lock); 
+	bool have_token = _challenge_take(self, msg->peer, token); 
+	pthread_mutex_unlock(&self->lock); 
+
+	_params_get(env->params, p, 2); 
+	const char *username = _param_str(p[0]), *response = _param_str(p[1]); 
+	if(username && response){
+		if(have_token && orange_login(self->ctx, username, token, response, &_sid) == 0){
+			blob_put_string(out, "result"); 
+			blob_offset_t o = blob_open_table(out); 
+			blob_put_string(out, "success"); 
+			blob_put_string(out, _sid.hash); 
+			blob_close_table(out, o); 
+		} else {
+			blob_put_string(out, "error"); 
+			blob_offset_t o = blob_open_table(out); 
+			blob_put_string(out, "code"); 
+			blob_put_string(out, "EACCESS"); 
+			blob_close_table(out, o); 
+		}	
+	} else {
+		blob_put_string(out, "error"); 
+		blob_offset_t o = blob_open_table(out); 
+		blob_put_string(out, "code"); 
+		blob_put_string(out, "EINVAL"); 
+		blob_close_table(out, o); 
+		DEBUG("Could not parse login parameters!\n"); 
+	}
+}
+
+static void _method_logout(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	const char *sid = _request_params(msg, env, NULL, 0); 
+	if(sid && orange_logout(self->ctx, sid) == 0){
+		blob_put_string(out, "result"); 
+		blob_offset_t o = blob_open_table(out); 
+			blob_put_string(out, "success"); 
+			blob_put_string(out, "VALID"); 
+		blob_close_table(out, o); 
+	} else {
+		blob_put_string(out, "error"); 
+		blob_put_string(out, "Could not logout!"); 
+	}
+}
+
+static void _method_cancel(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	// clients can only cancel their own requests
+	const struct blob_field *p[1]; 
+	struct orange_message *queued = NULL; 
+	int running = 0; 
+	_params_get(env->params, p, 1); 
+	if(p[0]){
+		uint32_t cancel_id = blob_field_get_int(p[0]); 
+		pthread_mutex_lock(&self->lock); 
+		#ifdef CONFIG_THREADS
+		queued = _sched_remove(self, msg->peer, cancel_id); 
+		#endif
+		if(!queued) running = _cancel_running(self, msg->peer, cancel_id, false); 
+		if(queued || running) self->requests_cancelled++; 
+		pthread_mutex_unlock(&self->lock); 
+	}
+	if(queued || running){
+		blob_put_string(out, "result"); 
+		blob_offset_t o = blob_open_table(out); 
+		blob_put_string(out, "cancelled"); 
+		blob_put_string(out, (queued)?"queued":"running"); 
+		blob_close_table(out, o); 
+	} else {
+		_put_error(out, -ENOENT, "No such request"); 
+	}
+	if(queued) _rpc_reject(self, queued, -ECANCELED, "Request cancelled"); 
+}
+
+static void _method_stats(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	const char *sid = _request_params(msg, env, NULL, 0); 
+	if(!sid || !orange_session_is_valid(self->ctx, sid)){
+		blob_put_string(out, "error"); 
+		blob_offset_t o = blob_open_table(out); 
+		blob_put_string(out, "code"); 
+		blob_put_string(out, "EACCESS"); 
+		blob_close_table(out, o); 
+		return; 
+	}
+	blob_put_string(out, "result"); 
+	blob_offset_t o = blob_open_table(out); 
+	blob_put_string(out, "server"); 
+	if(orange_server_stats(self->server, out) < 0){
+		blob_put_int(out, 0); 
+	}
+	blob_put_string(out, "workers"); 
+	blob_offset_t w = blob_open_table(out); 
+	pthread_mutex_lock(&self->lock); 
+	blob_put_string(out, "live"); 
+	blob_put_int(out, self->live_workers); 
+	blob_put_string(out, "busy"); 
+	blob_put_int(out, self->busy_workers); 
+	blob_put_string(out, "min"); 
+	blob_put_int(out, self->num_workers); 
+	blob_put_string(out, "max"); 
+	blob_put_int(out, self->max_workers); 
+	blob_put_string(out, "grown"); 
+	blob_put_int(out, self->workers_grown); 
+	blob_put_string(out, "shrunk"); 
+	blob_put_int(out, self->workers_shrunk); 
+	blob_close_table(out, w); 
+	blob_put_string(out, "requests"); 
+	blob_offset_t r = blob_open_table(out); 
+	blob_put_string(out, "expired"); 
+	blob_put_int(out, self->requests_expired); 
+	blob_put_string(out, "purged"); 
+	blob_put_int(out, self->requests_purged); 
+	blob_put_string(out, "cancelled"); 
+	blob_put_int(out, self->requests_cancelled); 
+	blob_put_string(out, "batches"); 
+	blob_put_int(out, self->batches); 
+	blob_close_table(out, r); 
+	blob_put_string(out, "events"); 
+	blob_offset_t ev = blob_open_table(out); 
+	blob_put_string(out, "received"); 
+	blob_put_int(out, self->events_received); 
+	blob_put_string(out, "batches"); 
+	blob_put_int(out, self->event_batches); 
+	struct orange_coalesce_stats cs; 
+	orange_coalesce_get_stats(self->coalesce, &cs); 
+	blob_put_string(out, "merged"); 
+	blob_put_int(out, cs.merged); 
+	blob_put_string(out, "dropped"); 
+	blob_put_int(out, cs.dropped); 
+	blob_put_string(out, "pending"); 
+	blob_put_int(out, cs.pending); 
+	blob_put_string(out, "seq"); 
+	blob_put_int(out, orange_evlog_last_seq(self->evlog)); 
+	blob_put_string(out, "logged"); 
+	blob_put_int(out, orange_evlog_count(self->evlog)); 
+	blob_put_string(out, "log_bytes"); 
+	blob_put_int(out, orange_evlog_bytes(self->evlog)); 
+	blob_close_table(out, ev); 
+	blob_put_string(out, "queue"); 
+	blob_offset_t q = blob_open_table(out); 
+	blob_put_string(out, "limit"); 
+	blob_put_int(out, self->max_queued); 
+	blob_put_string(out, "stalled"); 
+	blob_put_int(out, self->reader_stalled); 
+	blob_close_table(out, q); 
+	blob_put_string(out, "lanes"); 
+	blob_offset_t l = blob_open_table(out); 
+	for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+		blob_put_string(out, _lane_names[c]); 
+		blob_offset_t e = blob_open_table(out); 
+		blob_put_string(out, "queued"); 
+		blob_put_int(out, self->lanes[c].queued); 
+		blob_put_string(out, "busy"); 
+		blob_put_int(out, self->lanes[c].busy); 
+		blob_put_string(out, "dispatched"); 
+		blob_put_int(out, self->lanes[c].dispatched); 
+		blob_close_table(out, e); 
+	}
+	blob_close_table(out, l); 
+	blob_put_string(out, "peers"); 
+	blob_offset_t p = blob_open_table(out); 
+	blob_put_string(out, "limit"); 
+	blob_put_int(out, self->peer_max_inflight); 
+	blob_put_string(out, "limited"); 
+	blob_put_int(out, self->peer_limited); 
+	blob_put_string(out, "max_queued"); 
+	blob_put_int(out, self->peer_max_queued); 
+	blob_put_string(out, "rejected"); 
+	blob_put_int(out, self->requests_rejected); 
+	blob_put_string(out, "active"); 
+	blob_offset_t a = blob_open_array(out); 
+	#if CONFIG_THREADS
+	struct orange_rpc_peer *peer; 
+	avl_for_each_element(&self->peers, peer, avl){
+		blob_offset_t e = blob_open_table(out); 
+		blob_put_string(out, "peer"); 
+		blob_put_int(out, peer->peer); 
+		blob_put_string(out, "inflight"); 
+		blob_put_int(out, peer->inflight); 
+		blob_put_string(out, "queued"); 
+		blob_put_int(out, peer->queued); 
+		blob_put_string(out, "completed"); 
+		blob_put_int(out, peer->completed); 
+		blob_put_string(out, "reordered"); 
+		blob_put_int(out, peer->reordered); 
+		blob_close_table(out, e); 
+	}
+	#endif
+	blob_close_table(out, a); 
+	blob_close_table(out, p); 
+	pthread_mutex_unlock(&self->lock); 
+	blob_close_table(out, o); 
+}
+
+// replays logged events to one client
+struct event_replay {
+	struct orange_rpc *self; 
+	uint32_t peer; 
+	const char *pattern; 
+	int count; 
+}; 
+
+// NOTE: must be called with lock held
+static void _event_replay(void *ptr, unsigned long long seq, const char *name, const struct blob_field *data){
+	struct event_replay *r = (struct event_replay*)ptr; 
+	if(!orange_topic_pattern_match(r->pattern, name)) return; 
+	struct orange_message *m = orange_message_new(); 
+	m->peer = r->peer; 
+	_put_event(&m->buf, name, data, seq); 
+	orange_server_send(r->self->server, &m); 
+	r->count++; 
+}
+
+static void _method_subscribe(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	const struct blob_field *p[2]; 
+	const char *sid = _request_params(msg, env, p, 2); 
+	const char *pattern = _param_str(p[0]); 
+	int ret = -EINVAL; 
+	// access is checked once here so that broadcasting only needs to look at the topic index
+	if(!sid || !pattern || !orange_topic_pattern_valid(pattern)) ret = -EINVAL; 
+	else if(orange_event_access(self->ctx, sid, pattern) < 0) ret = -EACCES; 
+	else ret = orange_server_subscribe(self->server, msg->peer, pattern); 
+	if(ret == 0 || ret == -EEXIST){
+		blob_put_string(out, "result"); 
+		blob_offset_t o = blob_open_table(out); 
+		blob_put_string(out, "subscribed"); 
+		blob_put_string(out, pattern); 
+		// optional third param is the seq of the last event client has seen. Events after it that are 
+		// still in the log are sent again. Events broadcast meanwhile may arrive twice (clients skip seqs they already have). 
+		pthread_mutex_lock(&self->lock); 
+		if(p[1]){
+			struct event_replay r = { .self = self, .peer = msg->peer, .pattern = pattern, .count = 0 }; 
+			int replayed = orange_evlog_replay(self->evlog, blob_field_get_int(p[1]), _event_replay, &r); 
+			if(replayed < 0){
+				// too much has happened since. Client has to fetch current state instead. 
+				blob_put_string(out, "gap"); 
+				blob_put_bool(out, true); 
+			} else {
+				blob_put_string(out, "replayed"); 
+				blob_put_int(out, r.count); 
+			}
+		}
+		blob_put_string(out, "seq"); 
+		blob_put_int(out, orange_evlog_last_seq(self->evlog)); 
+		pthread_mutex_unlock(&self->lock); 
+		blob_close_table(out, o); 
+	} else {
+		_put_error(out, ret, (ret == -EACCES)?"Permission denied!":"Could not subscribe"); 
+	}
+}
+
+static void _method_unsubscribe(struct orange_rpc *self, struct orange_message *msg, const struct orange_rpc_envelope *env, struct request_record *slot, struct blob *out){
+	const struct blob_field *p[1]; 
+	_request_params(msg, env, p, 1); 
+	const char *pattern = _param_str(p[0]); 
+	int ret = (pattern)?orange_server_unsubscribe(self->server, msg->peer, pattern):-EINVAL; 
+	if(ret == 0){
+		blob_put_string(out, "result"); 
+		blob_offset_t o = blob_open_table(out); 
+		blob_put_string(out, "unsubscribed"); 
+		blob_put_string(out, pattern); 
+		blob_close_table(out, o); 
+	} else {
+		_put_error(out, ret, "Not subscribed"); 
+	}
+}
+
+// method table is indexed by RPC_METHOD_HASH of the name. Indices are chosen so that built in names do not collide 
+// (checked by orange_rpc_check_methods). When adding a method pick a free slot or change the hash so that all names stay unique. 
+#define RPC_METHOD_SLOTS 32
+#define RPC_METHOD_HASH(name, len) (((unsigned)(unsigned char)(name)[0] + (unsigned char)(name)[(len) - 1] + (len)) & (RPC_METHOD_SLOTS - 1))
 
+static const struct rpc_method _rpc_methods[RPC_METHOD_SLOTS] = {
+	[1] = { .name = "subscribe", .handler = _method_subscribe, .lane = ORANGE_LANE_CONTROL }, 
+	[4] = { .name = "list", .handler = _method_list, .lane = ORANGE_LANE_NORMAL }, 
+	[5] = { .name = "unsubscribe", .handler = _method_unsubscribe, .lane = ORANGE_LANE_CONTROL }, 
+	[6] = { .name = "logout", .handler = _method_logout, .lane = ORANGE_LANE_CONTROL }, 
+	[11] = { .name = "stats", .handler = _method_stats, .lane = ORANGE_LANE_CONTROL }, 
+	[17] = { .name = "challenge", .handler = _method_challenge, .lane = ORANGE_LANE_CONTROL }, 
+	[19] = { .name = "call", .handler = _method_call, .lane = ORANGE_LANE_NORMAL, .plugin_lane = true }, 
+	[21] = { .name = "cancel", .handler = _method_cancel, .lane = ORANGE_LANE_CONTROL }, 
+	[31] = { .name = "login", .handler = _method_login, .lane = ORANGE_LANE_CONTROL }
+}; 
+
+static const struct rpc_method *_rpc_method_find(const char *name){
+	size_t len = strlen(name); 
+	if(!len) return NULL; 
+	const struct rpc_method *m = &_rpc_methods[RPC_METHOD_HASH(name, len)]; 
+	if(!m->name || strcmp(m->name, name) != 0) return NULL; 
+	return m; 
+}
+
+int orange_rpc_check_methods(void){
+	int misplaced = 0; 
+	for(int c = 0; c < RPC_METHOD_SLOTS; c++){
+		if(!_rpc_methods[c].name || _rpc_method_find(_rpc_methods[c].name) == &_rpc_methods[c]) continue; 
+		ERROR("rpc: method %s is in slot %d which is not the slot of its hash!\n", _rpc_methods[c].name, c); 
+		misplaced++; 
+	}
+	return misplaced; 
+}
+
+// processes one request and sends back the response. Slot is the calling worker's request record. Takes ownership of the message. 
+static int _rpc_handle_message(struct orange_rpc *self, struct orange_message *msg, struct request_record *slot){
 	if(orange_debug_level >= JUCI_DBG_DEBUG){
 		DEBUG("got message from %08x: ", msg->peer); 
 		blob_dump_json(&msg->buf);
 	}
 
-	struct blob_field *params = NULL, *args = NULL; 
-	const char *sid = "", *rpc_method = "", *object = "", *method = ""; 
-	uint32_t rpc_id = 0; 
-	
-	struct orange_message *result = orange_message_new(); 
-	result->peer = msg->peer; 
-
-	if(!rpcmsg_parse_call(&msg->buf, &rpc_id, &rpc_method, (const struct blob_field**)&params)){
+	const struct orange_rpc_envelope *env = _request_envelope(msg); 
+	if(!env){
 		DEBUG("could not parse incoming message\n"); 
 		// we silently discard invalid messages!
-		orange_message_delete(&msg); 
+		_request_free(self, &msg); 
 		return -EPROTO; 
 	}
 
+	struct orange_message *result = orange_message_new(); 
+	result->peer = msg->peer; 
+
 	blob_offset_t t = blob_open_table(&result->buf); 
 	blob_put_string(&result->buf, "jsonrpc"); 
 	blob_put_string(&result->buf, "2.0"); 
 	blob_put_string(&result->buf, "id"); 
-	blob_put_int(&result->buf, rpc_id); 
-
-	if(rpc_method && strcmp(rpc_method, "call") == 0){
-		if(rpcmsg_parse_call_params(params, &sid, &object, &method, (const struct blob_field**)&args)){
-			// store the request for monitoring 
-			struct request_record *req = calloc(1, sizeof(struct request_record)); 
-			size_t len = strlen(object) + strlen(method) + 2; 
-			req->name = calloc(1, len); 
-			timespec_from_now_us(&req->ts_expired, WORKER_TIMEOUT_US); 
-			snprintf(req->name, len, "%s.%s", object, method); 
-			req->avl.key = req->name; 
-
-			pthread_mutex_lock(&self->lock); 
-			avl_insert(&self->requests, &req->avl); 
-			pthread_mutex_unlock(&self->lock); 
-
-			orange_call(self->ctx, sid, object, method, args, &result->buf); 
+	blob_put_int(&result->buf, env->id); 
 
-			pthread_mutex_lock(&self->lock); 
-			avl_delete(&self->requests, &req->avl); 
-			pthread_mutex_unlock(&self->lock); 
-			free(req->name); 
-			free(req); 
-		} else {
-			DEBUG("Could not parse call message!\n"); 
-			blob_put_string(&result->buf, "error"); 
-			blob_offset_t o = blob_open_table(&result->buf); 
-			blob_put_string(&result->buf, "code"); 
-			blob_put_int(&result->buf, -EINVAL); 
-			blob_put_string(&result->buf, "str"); 
-			blob_put_string(&result->buf, "Invalid call message format!"); 
-			blob_close_table(&result->buf, o); 
-		}
-	} else if(rpc_method && strcmp(rpc_method, "list") == 0){
-		const char *path = "*"; 	
-		if(rpcmsg_parse_list_params(params, &sid, &path)){
-			blob_put_string(&result->buf, "result"); 
-			orange_list(self->ctx, sid, path, &result->buf); 
-		}
-	} else if(rpc_method && strcmp(rpc_method, "challenge") == 0){
-		blob_put_string(&result->buf, "result"); 
-		blob_offset_t o = blob_open_table(&result->buf); 
-		blob_put_string(&result->buf, "token"); 
-		char token[32]; 
-		snprintf(token, sizeof(token), "%08x", msg->peer); //TODO: make hash
-		blob_put_string(&result->buf, token);  
-		blob_close_table(&result->buf, o); 
-	} else if(rpc_method && strcmp(rpc_method, "login") == 0){
-		// TODO: make challenge response work. Perhaps use custom pw database where only sha1 hasing is used. 
-		const char *username = NULL, *response = NULL; 
-		struct orange_sid _sid; 
-
-		char token[32]; 
-		snprintf(token, sizeof(token), "%08x", msg->peer); //TODO: make hash
-
-		if(rpcmsg_parse_login(params, &username, &response)){
-			if(orange_login(self->ctx, username, token, response, &_sid) == 0){
-				blob_put_string(&result->buf, "result"); 
-				blob_offset_t o = blob_open_table(&result->buf); 
-				blob_put_string(&result->buf, "success"); 
-				blob_put_string(&result->buf, _sid.hash); 
-				blob_close_table(&result->buf, o); 
-			} else {
-				blob_put_string(&result->buf, "error"); 
-				blob_offset_t o = blob_open_table(&result->buf); 
-				blob_put_string(&result->buf, "code"); 
-				blob_put_string(&result->buf, "EACCESS"); 
-				blob_close_table(&result->buf, o); 
-			}	
-		} else {
-			blob_put_string(&result->buf, "error"); 
-			blob_offset_t o = blob_open_table(&result->buf); 
-			blob_put_string(&result->buf, "code"); 
-			blob_put_string(&result->buf, "EINVAL"); 
-			blob_close_table(&result->buf, o); 
-			DEBUG("Could not parse login parameters!\n"); 
-		}
-	} else if(rpc_method && strcmp(rpc_method, "logout") == 0){
-		const char *_sid = NULL; 
-		if(rpcmsg_parse_authenticate(params, &_sid) && orange_logout(self->ctx, _sid) == 0){
-			blob_put_string(&result->buf, "result"); 
-			blob_offset_t o = blob_open_table(&result->buf); 
-				blob_put_string(&result->buf, "success"); 
-				blob_put_string(&result->buf, "VALID"); 
-			blob_close_table(&result->buf, o); 
-		} else {
-			blob_put_string(&result->buf, "error"); 
-			blob_put_string(&result->buf, "Could not logout!"); 
-		}
+	const struct rpc_method *m = _rpc_method_find(env->method); 
+	if(m){
+		m->handler(self, msg, env, slot, &result->buf); 
 	} else {
 		blob_put_string(&result->buf, "error"); 
 		blob_offset_t o = blob_open_table(&result->buf); 
@@ -244,80 +808,591 @@ int orange_rpc_process_requests(struct orange_rpc *self){
 		blob_field_dump_json(blob_field_first_child(blob_head(&result->buf))); 
 	}
 
-	orange_server_send(self->server, &result); 		
-	orange_message_delete(&msg); 
+	_rpc_reply(self, msg, &result); 
+	_request_free(self, &msg); 
 
 	return 0; 
 }
 
-static void *_event_queue_task(void *ptr){
-	struct orange_rpc *self = (struct orange_rpc*) ptr; 
-	struct orange_eq eq; 
+#ifndef CONFIG_THREADS
+int orange_rpc_process_requests(struct orange_rpc *self){
+	struct orange_message *msg = NULL;         
 
-	prctl(PR_SET_NAME, "local_event_queue"); 
-	if(orange_eq_open(&eq, NULL, true) != 0){
-		perror("Unable to open local message queue"); 
-		fprintf(stderr, "If you see 'Function not implemented' above, then enable CONFIG_POSIX_MQUEUE in your kernel to use local events\n");  
-		return NULL; 
+	int ret = orange_server_recv(self->server, &msg, self->timeout_us); 
+
+	if(ret < 0){  
+		return ret; 
 	}
+	
+	if(!msg) return -EOF; 
 
-	pthread_mutex_lock(&self->lock); 
-	while(!self->shutdown){
-		pthread_mutex_unlock(&self->lock); 
+	// nothing is queued here so disconnects only need to stop running calls (there are none)
+	if(msg->type != UBUS_MSG_METHOD_CALL){
+		if(msg->type == UBUS_MSG_PEER_DISCONNECTED){
+			pthread_mutex_lock(&self->lock); 
+			_challenge_take(self, msg->peer, NULL); 
+			pthread_mutex_unlock(&self->lock); 
+		}
+		orange_message_delete(&msg); 
+		return 0; 
+	}
+
+	struct request_record slot; 
+	INIT_LIST_HEAD(&slot.list); 
+
+	// batch elements are executed one after another
+	struct list_head batch; 
+	INIT_LIST_HEAD(&batch); 
+	if(!_batch_expand(self, msg, &batch)) list_add_tail(&msg->list, &batch); 
+
+	struct orange_message *m, *tmp; 
+	list_for_each_entry_safe(m, tmp, &batch, list){
+		list_del_init(&m->list); 
+		rpcmsg_parse_deadline(m); 
+		if(_message_expired(m)){
+			self->requests_expired++; 
+			_rpc_reject(self, m, -ETIMEDOUT, "Request expired"); 
+			continue; 
+		}
+		ret = _rpc_handle_message(self, m, &slot); 
+	}
+	return ret; 
+}
+#endif
+
+static long long _elapsed_us(struct timespec *start){
+	struct timespec now; 
+	clock_gettime(CLOCK_MONOTONIC, &now); 
+	return (long long)(now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000; 
+}
+
+static unsigned long long _monotonic_us(void){
+	struct timespec now; 
+	clock_gettime(CLOCK_MONOTONIC, &now); 
+	return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000; 
+}
+
+// drains the local event queue into an array of [name, data] pairs. After the queue runs empty we keep waiting for 
+// more events until window_us has passed since the first one so that a burst ends up in as few broadcasts as possible. 
+// Returns number of events put into out. 
+static int _event_queue_drain(struct orange_eq *eq, struct blob *out, unsigned int max_events, long long window_us){
+	struct timespec start; 
+	clock_gettime(CLOCK_MONOTONIC, &start); 
+	blob_offset_t a = blob_open_array(out); 
+	unsigned int count = 0; 
+	while(count < max_events){
 		struct blob b; 
-		if(orange_eq_recv(&eq, &b) <= 0) goto cont;
+		if(orange_eq_recv(eq, &b) <= 0){
+			long long left = window_us - _elapsed_us(&start); 
+			// shutdown also ends the wait and is then seen by the caller
+			if(left <= 0 || orange_eq_wait(eq, left) <= 0) break; 
+			continue; 
+		}
 		const struct blob_field *name = blob_field_first_child(blob_head(&b)); 
 		const struct blob_field *data = blob_field_next_child(blob_head(&b), name); 
-		if(!name || !data ) goto cont;  
-		orange_rpc_broadcast_event(self, blob_field_get_string(name), data); 		
-	cont: 
-		pthread_mutex_lock(&self->lock); 
+		if(!name || !data || blob_field_type(name) != BLOB_FIELD_STRING) continue; 
+		blob_offset_t e = blob_open_array(out); 
+		blob_put_string(out, blob_field_get_string(name)); 
+		blob_put_attr(out, data); 
+		blob_close_array(out, e); 
+		count++; 
 	}
+	blob_close_array(out, a); 
+	return count; 
+}
+
+// broadcast that is being filled with events
+struct event_batch {
+	struct orange_rpc *self; 
+	struct orange_message *msg; 
+	int count; 
+}; 
+
+// NOTE: must be called with lock held
+static void _event_emit(void *ptr, const char *name, const struct blob_field *data){
+	struct event_batch *batch = (struct event_batch*)ptr; 
+	unsigned long long seq = orange_evlog_append(batch->self->evlog, name, data); 
+	_put_event(&batch->msg->buf, name, data, seq); 
+	batch->count++; 
+}
+
+// turns drained events into notifications of the broadcast. With coalescing the events go through the coalescer 
+// and only the ones that are due come out. Every event that goes out is added to the event log. 
+// Returns number of notifications put into msg. 
+static int _event_queue_dispatch(struct orange_rpc *self, const struct blob *events, struct orange_message *msg, bool coalesce){
+	const struct blob_field *root = blob_field_first_child(blob_head(events)); 
+	struct blob_field *pair; 
+	struct event_batch batch = { .self = self, .msg = msg, .count = 0 }; 
+	pthread_mutex_lock(&self->lock); 
+	unsigned long long now = _monotonic_us(); 
+	if(root){
+		blob_field_for_each_child(root, pair){
+			const struct blob_field *name = blob_field_first_child(pair); 
+			const struct blob_field *data = blob_field_next_child(pair, name); 
+			// events that can not be tracked go out right away
+			if(coalesce && orange_coalesce_push(self->coalesce, blob_field_get_string(name), data, now) == 0) continue; 
+			_event_emit(&batch, blob_field_get_string(name), data); 
+		}
+	}
+	if(coalesce) orange_coalesce_flush(self->coalesce, now, _event_emit, &batch); 
 	pthread_mutex_unlock(&self->lock); 
+	return batch.count; 
+}
+
+static void *_event_queue_task(void *ptr){
+	struct orange_rpc *self = (struct orange_rpc*) ptr; 
+	struct blob events; 
+
+	prctl(PR_SET_NAME, "local_event_queue"); 
+	blob_init(&events, 0, 0); 
+
+	// there is no polling timeout. We only wake up for new events, for coalesced events that become due 
+	// and when deinit tells us through the queue that it is time to exit. 
+	while(1){
+		pthread_mutex_lock(&self->lock); 
+		unsigned int max_events = self->event_batch_max; 
+		long long window_us = self->event_window_us; 
+		long long due_us = orange_coalesce_next_due(self->coalesce, _monotonic_us()); 
+		bool coalesce = due_us >= 0 || orange_coalesce_enabled(self->coalesce); 
+		pthread_mutex_unlock(&self->lock); 
+
+		int ret = orange_eq_wait(&self->events, due_us); 
+		if(ret == -ECANCELED) break; 
+		if(ret < 0){
+			ERROR("local event queue failed: %s\n", strerror(-ret)); 
+			break; 
+		}
+		if(ret == 0 && due_us < 0) continue; 
+
+		blob_reset(&events); 
+		int received = (ret > 0)?_event_queue_drain(&self->events, &events, max_events, window_us):0; 
+
+		struct orange_message *msg = orange_message_new(); 
+		msg->peer = 0; 
+		// every event in the batch is delivered separately but servers only go over their clients once
+		msg->event_batch = true; 
+		blob_offset_t a = blob_open_array(&msg->buf); 
+		int count = _event_queue_dispatch(self, &events, msg, coalesce); 
+		blob_close_array(&msg->buf, a); 
+
+		pthread_mutex_lock(&self->lock); 
+		self->events_received += received; 
+		if(count) self->event_batches++; 
+		pthread_mutex_unlock(&self->lock); 
 
-	orange_eq_close(&eq); 
+		if(count) orange_server_send(self->server, &msg); 
+		else orange_message_delete(&msg); 
+	}
 
+	blob_free(&events); 
 	DEBUG("rpc queue listener exiting..\n"); 
 	pthread_exit(0); 
 	return NULL; 
 }
 
 #ifdef CONFIG_THREADS
+static int _flow_cmp(const void *k1, const void *k2, void *ptr){
+	const uint32_t *a = k1, *b = k2; 
+	if(*a < *b) return -1; 
+	return *a > *b; 
+}
+
+static enum orange_lane _request_lane(struct orange_rpc *self, struct orange_message *msg){
+	const struct orange_rpc_envelope *env = _request_envelope(msg); 
+	// invalid messages are cheap to reject
+	if(!env) return ORANGE_LANE_CONTROL; 
+	const struct rpc_method *m = _rpc_method_find(env->method); 
+	if(!m) return ORANGE_LANE_CONTROL; 
+	if(!m->plugin_lane) return m->lane; 
+	// params are [sid, object, method, args] unless sid was supplied by the transport
+	const struct blob_field *p[2]; 
+	_request_params(msg, env, p, 2); 
+	const char *object = _param_str(p[0]); 
+	const char *name = _param_str(p[1]); 
+	if(!object || !name) return ORANGE_LANE_CONTROL; 
+	return orange_method_lane(self->ctx, object, name); 
+}
+
+// NOTE: must be called with lock held
+static bool _peer_limited(struct orange_rpc *self, struct orange_rpc_peer *peer){
+	return self->peer_max_inflight && peer->inflight >= self->peer_max_inflight; 
+}
+
+// frees flow (and its peer) when nothing of it is queued or running any more
+// NOTE: must be called with lock held
+static void _flow_release(struct orange_rpc *self, unsigned int l, struct orange_rpc_flow *flow){
+	if(flow->inflight || !list_empty(&flow->requests)) return; 
+	struct orange_rpc_peer *peer = flow->owner; 
+	avl_delete(&self->lanes[l].flows, &flow->avl); 
+	peer->flows[l] = NULL; 
+	free(flow); 
+	if(!peer->inflight && !peer->queued){
+		avl_delete(&self->peers, &peer->avl); 
+		free(peer); 
+	}
+}
+
+// NOTE: must be called with lock held. Takes ownership of the message. 
+static void _sched_push(struct orange_rpc *self, enum orange_lane l, struct orange_message *msg){
+	struct orange_rpc_lane *lane = &self->lanes[l]; 
+	struct orange_rpc_flow *flow = NULL; 
+	struct orange_rpc_peer *peer = NULL; 
+	struct avl_node *node = avl_find(&self->peers, &msg->peer); 
+	if(node){
+		peer = container_of(node, struct orange_rpc_peer, avl); 
+	} else {
+		peer = calloc(1, sizeof(struct orange_rpc_peer)); 
+		assert(peer); 
+		peer->peer = msg->peer; 
+		peer->avl.key = &peer->peer; 
+		INIT_LIST_HEAD(&peer->running); 
+		avl_insert(&self->peers, &peer->avl); 
+	}
+	flow = peer->flows[l]; 
+	if(!flow){
+		flow = calloc(1, sizeof(struct orange_rpc_flow)); 
+		assert(flow); 
+		flow->peer = msg->peer; 
+		flow->owner = peer; 
+		flow->avl.key = &flow->peer; 
+		INIT_LIST_HEAD(&flow->requests); 
+		INIT_LIST_HEAD(&flow->active); 
+		avl_insert(&lane->flows, &flow->avl); 
+		peer->flows[l] = flow; 
+	}
+	list_add_tail(&msg->list, &flow->requests); 
+	// a peer that is at its limit is put back into rotation by _sched_done. Control requests (such as cancel) are never held back. 
+	if(list_empty(&flow->active) && (l == ORANGE_LANE_CONTROL || !_peer_limited(self, peer))) list_add_tail(&flow->active, &lane->active); 
+	lane->queued++; 
+	peer->queued++; 
+}
+
+// picks next request using weighted round robin between lanes and deficit round robin between peers within a lane. 
+// Running is linked into the peer's list of running requests until _sched_done is called. 
+// NOTE: must be called with lock held
+static struct orange_message *_sched_pop(struct orange_rpc *self, unsigned int *lane_idx, struct orange_rpc_flow **flow_out, struct list_head *running){
+	// slow requests may never take all workers so that control requests can always get through
+	unsigned int bulk_limit = (self->live_workers > 1)?self->live_workers / 2:1; 
+	for(unsigned int n = 0; n < 2 * ORANGE_LANE_COUNT; n++){
+		struct orange_rpc_lane *lane = &self->lanes[self->cur_lane]; 
+		bool blocked = self->cur_lane == ORANGE_LANE_BULK && lane->busy >= bulk_limit; 
+		// lane may still have queued requests of peers that are at their limit
+		if(list_empty(&lane->active) || blocked || lane->credit == 0){
+			lane->credit = lane->weight; 
+			self->cur_lane = (self->cur_lane + 1) % ORANGE_LANE_COUNT; 
+			continue; 
+		}
+		lane->credit--; 
+		struct orange_rpc_flow *flow; 
+		while(1){
+			flow = list_first_entry(&lane->active, struct orange_rpc_flow, active); 
+			if(flow->deficit_us > 0) break; 
+			flow->deficit_us += LANE_QUANTUM_US; 
+			list_move_tail(&flow->active, &lane->active); 
+		}
+		struct orange_rpc_peer *peer = flow->owner; 
+		struct orange_message *msg = list_first_entry(&flow->requests, struct orange_message, list); 
+		list_del_init(&msg->list); 
+		if(list_empty(&flow->requests)) list_del_init(&flow->active); 
+		// charge one quantum up front so that parallel workers do not all pick the same peer. Corrected in _sched_done. 
+		flow->deficit_us -= LANE_QUANTUM_US; 
+		flow->inflight++; 
+		lane->queued--; 
+		lane->busy++; 
+		lane->dispatched++; 
+		if(self->reader_waiting) pthread_cond_signal(&self->queue_space); 
+		peer->queued--; 
+		peer->inflight++; 
+		list_add_tail(running, &peer->running); 
+		if(_peer_limited(self, peer)){
+			// hold back the rest of this peer's requests in all lanes
+			for(int c = ORANGE_LANE_CONTROL + 1; c < ORANGE_LANE_COUNT; c++){
+				if(peer->flows[c]) list_del_init(&peer->flows[c]->active); 
+			}
+			if(peer->queued) self->peer_limited++; 
+		}
+		*lane_idx = self->cur_lane; 
+		*flow_out = flow; 
+		return msg; 
+	}
+	return NULL; 
+}
+
+// NOTE: must be called with lock held
+static void _sched_done(struct orange_rpc *self, unsigned int l, struct orange_rpc_flow *flow, struct list_head *running, long long used_us){
+	struct orange_rpc_lane *lane = &self->lanes[l]; 
+	struct orange_rpc_peer *peer = flow->owner; 
+	lane->busy--; 
+	flow->inflight--; 
+	flow->deficit_us += LANE_QUANTUM_US - used_us; 
+	if(flow->deficit_us < -LANE_MAX_DEBT_US) flow->deficit_us = -LANE_MAX_DEBT_US; 
+	// responses are sent as soon as they are ready so a later request may finish first
+	if(peer->running.next != running) peer->reordered++; 
+	list_del_init(running); 
+	peer->inflight--; 
+	peer->completed++; 
+	if(!_peer_limited(self, peer)){
+		// release requests that were held back while peer was at its limit
+		for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+			struct orange_rpc_flow *f = peer->flows[c]; 
+			if(f && !list_empty(&f->requests) && list_empty(&f->active)) list_add_tail(&f->active, &self->lanes[c].active); 
+		}
+	}
+	_flow_release(self, l, flow); 
+}
+
+// NOTE: must be called with lock held
+static void _sched_unlink(struct orange_rpc *self, unsigned int l, struct orange_rpc_flow *flow, struct orange_message *msg){
+	list_del_init(&msg->list); 
+	self->lanes[l].queued--; 
+	flow->owner->queued--; 
+	if(self->reader_waiting) pthread_cond_signal(&self->queue_space); 
+	if(list_empty(&flow->requests)){
+		list_del_init(&flow->active); 
+		_flow_release(self, l, flow); 
+	}
+}
+
+// removes queued request with given id of a peer. 
+// NOTE: must be called with lock held
+static struct orange_message *_sched_remove(struct orange_rpc *self, uint32_t peer, uint32_t rpc_id){
+	for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+		struct orange_rpc_lane *lane = &self->lanes[c]; 
+		struct avl_node *node = avl_find(&lane->flows, &peer); 
+		if(!node) continue; 
+		struct orange_rpc_flow *flow = container_of(node, struct orange_rpc_flow, avl); 
+		struct orange_message *msg; 
+		list_for_each_entry(msg, &flow->requests, list){
+			const struct orange_rpc_envelope *env = _request_envelope(msg); 
+			if(env && env->id == rpc_id){
+				_sched_unlink(self, c, flow, msg); 
+				return msg; 
+			}
+		}
+	}
+	return NULL; 
+}
+
+// drops all queued requests of a peer that has disconnected and aborts its running calls. 
+// NOTE: must be called with lock held
+static void _sched_purge_peer(struct orange_rpc *self, uint32_t peer){
+	for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+		struct orange_rpc_lane *lane = &self->lanes[c]; 
+		struct avl_node *node = avl_find(&lane->flows, &peer); 
+		if(!node) continue; 
+		struct orange_rpc_flow *flow = container_of(node, struct orange_rpc_flow, avl); 
+		while(!list_empty(&flow->requests)){
+			struct orange_message *msg = list_first_entry(&flow->requests, struct orange_message, list); 
+			// flow may be freed when the last request is unlinked
+			bool last = (msg->list.next == &flow->requests); 
+			_sched_unlink(self, c, flow, msg); 
+			_request_free(self, &msg); 
+			self->requests_purged++; 
+			if(last) break; 
+		}
+	}
+	_cancel_running(self, peer, 0, true); 
+}
+
+// NOTE: must be called with lock held
+static unsigned int _sched_queued(struct orange_rpc *self){
+	unsigned int queued = 0; 
+	for(int c = 0; c < ORANGE_LANE_COUNT; c++) queued += self->lanes[c].queued; 
+	return queued; 
+}
+
+// checks whether peer may queue another request
+// NOTE: must be called with lock held
+static bool _sched_peer_full(struct orange_rpc *self, uint32_t peer){
+	struct avl_node *node = avl_find(&self->peers, &peer); 
+	return node && container_of(node, struct orange_rpc_peer, avl)->queued >= self->peer_max_queued; 
+}
+
+// queues a request unless its peer already has too many requests waiting. Rejected requests are answered right away. 
+// NOTE: must be called with lock held. Lock is released while the rejection is sent. Takes ownership of the message. 
+static bool _sched_admit(struct orange_rpc *self, enum orange_lane l, struct orange_message *msg){
+	if(!_sched_peer_full(self, msg->peer)){
+		_sched_push(self, l, msg); 
+		return true; 
+	}
+	self->requests_rejected++; 
+	pthread_mutex_unlock(&self->lock); 
+	_rpc_reject(self, msg, -EBUSY, "Too many queued requests"); 
+	pthread_mutex_lock(&self->lock); 
+	return false; 
+}
+
+static bool _sched_has_work(struct orange_rpc *self){
+	for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+		if(!list_empty(&self->lanes[c].active)) return true; 
+	}
+	return false; 
+}
+
+static void *_request_reader(void *ptr){
+	struct orange_rpc *self = (struct orange_rpc*)ptr; 
+	prctl(PR_SET_NAME, "request_reader"); 
+	pthread_mutex_lock(&self->lock); 
+	while(!self->shutdown){
+		// stop taking requests off the server while the scheduler is full. Its queue then fills up and 
+		// applies backpressure to the clients instead of requests piling up here. 
+		if(_sched_queued(self) >= self->max_queued){
+			struct timespec t; 
+			timespec_from_now_us(&t, self->timeout_us); 
+			if(!self->reader_waiting) self->reader_stalled++; 
+			self->reader_waiting = true; 
+			pthread_cond_timedwait(&self->queue_space, &self->lock, &t); 
+			continue; 
+		}
+		self->reader_waiting = false; 
+		pthread_mutex_unlock(&self->lock); 
+		struct orange_message *msg = NULL; 
+		int ret = orange_server_recv(self->server, &msg, self->timeout_us); 
+		if(ret > 0 && msg && msg->type == UBUS_MSG_PEER_DISCONNECTED){
+			pthread_mutex_lock(&self->lock); 
+			_sched_purge_peer(self, msg->peer); 
+			_challenge_take(self, msg->peer, NULL); 
+			orange_message_delete(&msg); 
+			continue; 
+		}
+		struct list_head batch; 
+		INIT_LIST_HEAD(&batch); 
+		if(ret > 0 && msg && _batch_expand(self, msg, &batch)){
+			// every element is scheduled like a separate request so that they run in parallel
+			struct orange_message *m, *tmp; 
+			list_for_each_entry_safe(m, tmp, &batch, list){
+				list_del_init(&m->list); 
+				rpcmsg_parse_deadline(m); 
+				enum orange_lane l = _request_lane(self, m); 
+				pthread_mutex_lock(&self->lock); 
+				_sched_admit(self, l, m); 
+				pthread_mutex_unlock(&self->lock); 
+			}
+			pthread_mutex_lock(&self->lock); 
+			pthread_cond_broadcast(&self->work_ready); 
+			continue; 
+		}
+		if(ret > 0 && msg) rpcmsg_parse_deadline(msg); 
+		enum orange_lane lane = (ret > 0 && msg)?_request_lane(self, msg):ORANGE_LANE_NORMAL; 
+		pthread_mutex_lock(&self->lock); 
+		if(ret > 0 && msg){
+			if(_sched_admit(self, lane, msg)) pthread_cond_signal(&self->work_ready); 
+		} else if(ret < 0 && ret != -EAGAIN && !self->shutdown){
+			// server is shutting down or broken. Avoid spinning. 
+			pthread_mutex_unlock(&self->lock); 
+			usleep(WORKER_MONITOR_TICK_US); 
+			pthread_mutex_lock(&self->lock); 
+		}
+	}
+	pthread_mutex_unlock(&self->lock); 
+	DEBUG("rpc request reader exiting..\n"); 
+	pthread_exit(0); 
+	return NULL; 
+}
+
 static void *_request_dispatcher(void *ptr){
 	struct orange_rpc *self = (struct orange_rpc*)ptr; 
+	struct timespec ts_idle; 
+	struct request_record slot; 
+	INIT_LIST_HEAD(&slot.list); 
 	prctl(PR_SET_NAME, "request_dispatcher"); 
 	pthread_mutex_lock(&self->lock); 
+	timespec_from_now_us(&ts_idle, self->idle_timeout_us); 
 	while(!self->shutdown){
-		sem_wait(&self->sem_bw); 
+		unsigned int lane = 0; 
+		struct orange_rpc_flow *flow = NULL; 
+		struct list_head running; 
+		struct orange_message *msg = _sched_pop(self, &lane, &flow, &running); 
+		if(!msg){
+			struct timespec t; 
+			timespec_from_now_us(&t, self->timeout_us); 
+			if(pthread_cond_timedwait(&self->work_ready, &self->lock, &t) == ETIMEDOUT && 
+				self->live_workers > self->num_workers && timespec_expired(&ts_idle)){
+				// pool has grown during a burst of slow requests and this worker is no longer needed
+				self->workers_shrunk++; 
+				break; 
+			}
+			continue; 
+		}
+
+		// client is no longer interested in the result
+		if(_message_expired(msg)){
+			self->requests_expired++; 
+			_sched_done(self, lane, flow, &running, 0); 
+			pthread_mutex_unlock(&self->lock); 
+			_rpc_reject(self, msg, -ETIMEDOUT, "Request expired"); 
+			pthread_mutex_lock(&self->lock); 
+			continue; 
+		}
+
+		// occupancy accounting used to decide when the pool should grow
+		self->busy_workers++; 
+		if(self->busy_workers == self->live_workers){
+			timespec_from_now_us(&self->ts_grow, self->grow_after_us); 
+		}
 		pthread_mutex_unlock(&self->lock); 
-		orange_rpc_process_requests(self);
+
+		struct timespec tss; 
+		clock_gettime(CLOCK_MONOTONIC, &tss); 
+		_rpc_handle_message(self, msg, &slot); 
+		long long used_us = _elapsed_us(&tss); 
+
 		pthread_mutex_lock(&self->lock); 
-		sem_post(&self->sem_bw); 
+		_sched_done(self, lane, flow, &running, used_us); 
+		self->busy_workers--; 
+		// held back bulk requests may be runnable now
+		if(_sched_has_work(self)) pthread_cond_signal(&self->work_ready); 
+		timespec_from_now_us(&ts_idle, self->idle_timeout_us); 
 	}
 	DEBUG("rpc request dispatcher exiting..\n"); 
+	self->live_workers--; 
+	pthread_cond_broadcast(&self->workers_exited); 
 	pthread_mutex_unlock(&self->lock); 
 	pthread_exit(0); 
 	return NULL; 
 }
 
+// NOTE: must be called with lock held
+static void _start_worker(struct orange_rpc *self){
+	pthread_t thread; 
+	if(pthread_create(&thread, NULL, _request_dispatcher, self) != 0){
+		ERROR("could not start rpc worker!\n"); 
+		return; 
+	}
+	// workers are waited for using live_workers count
+	pthread_detach(thread); 
+	self->live_workers++; 
+}
+
 // NOTE: there is always a possibility that some errornous script will go into an infinite loop and subsequent calls to it will consume all our worker threads. 
-// this is highly critical so we need to monitor for it
+// this is highly critical so we need to monitor for it and start more workers so that other requests can still be served
 static void *_request_monitor(void *ptr){
 	struct orange_rpc *self = (struct orange_rpc*)ptr; 
+	struct timespec ts_hang_check; 
 	prctl(PR_SET_NAME, "request_monitor"); 
+	timespec_from_now_us(&ts_hang_check, WORKER_HANG_CHECK_US); 
 	pthread_mutex_lock(&self->lock); 
 	while(!self->shutdown){
-		struct request_record *req, *tmp; 
-		int hanged = 0; 
-		avl_for_each_element_safe(&self->requests, req, avl, tmp){
-			if(timespec_expired(&req->ts_expired)){
-				syslog(LOG_CRIT, "request %s may have hanged. You can ignore this message if this is expected.", req->name); 
-				DEBUG("Request %s may have hanged!\n", req->name); 
-				hanged++; 
+		// all workers have been occupied for too long and queued requests are waiting for one. Long running calls 
+		// alone are no reason to grow since nobody would be served by the new worker. 
+		if(self->live_workers < self->max_workers && self->busy_workers >= self->live_workers && timespec_expired(&self->ts_grow) && 
+			_sched_has_work(self)){
+			DEBUG("all %d rpc workers are busy, starting one more\n", self->live_workers); 
+			_start_worker(self); 
+			self->workers_grown++; 
+		}
+		if(timespec_expired(&ts_hang_check)){
+			struct request_record *req; 
+			list_for_each_entry(req, &self->calls, list){
+				if(timespec_expired(&req->ts_expired)){
+					syslog(LOG_CRIT, "request %s.%s may have hanged. You can ignore this message if this is expected.", req->object, req->method); 
+					DEBUG("Request %s.%s may have hanged!\n", req->object, req->method); 
+				}
 			}
+			timespec_from_now_us(&ts_hang_check, WORKER_HANG_CHECK_US); 
 		}
 		pthread_mutex_unlock(&self->lock); 
-		sleep(5); 
+		usleep(WORKER_MONITOR_TICK_US); 
 		pthread_mutex_lock(&self->lock); 
 	}
 	pthread_mutex_unlock(&self->lock); 
@@ -332,21 +1407,63 @@ void orange_rpc_init(struct orange_rpc *self, orange_server_t server, struct ora
 	self->ctx = ctx; 
 	self->timeout_us = timeout_us; 
 	self->shutdown = 0; 
-	self->num_workers = num_workers; 
-	avl_init(&self->requests, avl_strcmp, true, NULL);
+	INIT_LIST_HEAD(&self->calls); 
+
+	// misplaced methods can not be called so report them even in release builds
+	orange_rpc_check_methods(); 
 
 	if(num_workers == 0) num_workers = 1; 
-	self->threads = malloc(num_workers * sizeof(pthread_t)); 
-	memset(self->threads, 0, num_workers * sizeof(pthread_t)); 
+	self->num_workers = num_workers; 
+	self->max_workers = num_workers; 
+	self->live_workers = 0; 
+	self->busy_workers = 0; 
+	self->grow_after_us = WORKER_GROW_AFTER_US; 
+	self->idle_timeout_us = WORKER_IDLE_TIMEOUT_US; 
+	self->workers_grown = self->workers_shrunk = 0; 
+	self->requests_expired = self->requests_purged = self->requests_cancelled = 0; 
+	self->max_batch = BATCH_MAX; 
+	self->batches = 0; 
+	self->event_batch_max = EVENT_BATCH_MAX; 
+	self->event_window_us = EVENT_WINDOW_US; 
+	self->events_received = self->event_batches = 0; 
+	self->coalesce = orange_coalesce_new(); 
+	self->evlog = orange_evlog_new(EVENT_LOG_SIZE); 
+	timespec_from_now_us(&self->ts_grow, self->grow_after_us); 
 
 	pthread_mutex_init(&self->lock, NULL); 
-	sem_init(&self->sem_bw, false, num_workers); 
+	pthread_cond_init(&self->workers_exited, NULL); 
+	pthread_cond_init(&self->work_ready, NULL); 
+	pthread_cond_init(&self->queue_space, NULL); 
+
+	for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+		struct orange_rpc_lane *lane = &self->lanes[c]; 
+		memset(lane, 0, sizeof(*lane)); 
+		#if CONFIG_THREADS
+		avl_init(&lane->flows, _flow_cmp, false, NULL); 
+		#endif
+		INIT_LIST_HEAD(&lane->active); 
+		lane->weight = lane->credit = _lane_weights[c]; 
+	}
+	self->cur_lane = 0; 
+	self->peer_max_inflight = PEER_MAX_INFLIGHT; 
+	self->peer_limited = 0; 
+	self->max_queued = QUEUE_MAX; 
+	self->peer_max_queued = PEER_MAX_QUEUED; 
+	self->reader_waiting = false; 
+	self->reader_stalled = self->requests_rejected = 0; 
+	avl_init(&self->challenges, _challenge_cmp, false, NULL); 
 
 	#if CONFIG_THREADS
+	avl_init(&self->peers, _flow_cmp, false, NULL); 
 	// start threads that will be handling rpc messages
+	pthread_mutex_lock(&self->lock); 
 	for(unsigned int c = 0; c < num_workers; c++){
-		pthread_create(&self->threads[c], NULL, _request_dispatcher, self); 
+		_start_worker(self); 
 	}
+	pthread_mutex_unlock(&self->lock); 
+
+	// start reader that feeds requests from the server to the workers
+	pthread_create(&self->reader, NULL, _request_reader, self); 
 
 	// start a monitor thread to check periodically if we are running out of workers
 	pthread_create(&self->monitor, NULL, _request_monitor, self); 
@@ -354,20 +1471,140 @@ void orange_rpc_init(struct orange_rpc *self, orange_server_t server, struct ora
 	#endif
 
 	// start event queue task
-	pthread_create(&self->eq_task, NULL, _event_queue_task, self);   
+	if(orange_eq_open(&self->events, NULL, true) == 0){
+		pthread_create(&self->eq_task, NULL, _event_queue_task, self);   
+	} else {
+		perror("Unable to open local event queue"); 
+		fprintf(stderr, "If you see 'Function not implemented' above, then enable CONFIG_POSIX_MQUEUE in your kernel or build with shared memory events to use local events\n");  
+		orange_eq_close(&self->events); 
+	}
 }
 
 void orange_rpc_deinit(struct orange_rpc *self){
 	pthread_mutex_lock(&self->lock); 
 	self->shutdown = 1; 
+	pthread_cond_broadcast(&self->work_ready); 
+	pthread_cond_broadcast(&self->queue_space); 
+	// workers are detached so we wait until all of them have exited
+	while(self->live_workers > 0){
+		pthread_cond_wait(&self->workers_exited, &self->lock); 
+	}
 	pthread_mutex_unlock(&self->lock); 
-	for(unsigned c = 0; c < self->num_workers; c++){
-		pthread_join(self->threads[c], NULL); 
+	#if CONFIG_THREADS
+	pthread_join(self->reader, NULL); 
+	// drop requests that never got a worker
+	for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+		struct orange_rpc_flow *flow, *tmp; 
+		avl_remove_all_elements(&self->lanes[c].flows, flow, avl, tmp){
+			struct orange_message *msg, *nmsg; 
+			list_for_each_entry_safe(msg, nmsg, &flow->requests, list){
+				list_del_init(&msg->list); 
+				_request_free(self, &msg); 
+			}
+			free(flow); 
+		}
+	}
+	struct orange_rpc_peer *peer, *ptmp; 
+	avl_remove_all_elements(&self->peers, peer, avl, ptmp){
+		free(peer); 
+	}
+	#endif
+	// event task is only running if queue could be opened
+	if(self->events.wakefd >= 0){
+		orange_eq_wakeup(&self->events); 
+		pthread_join(self->eq_task, NULL); 
+		orange_eq_close(&self->events); 
 	}
-	pthread_join(self->eq_task, NULL); 
 	pthread_join(self->monitor, NULL); 
+	orange_coalesce_delete(&self->coalesce); 
+	orange_evlog_delete(&self->evlog); 
+	struct orange_rpc_challenge *ch, *chtmp; 
+	avl_remove_all_elements(&self->challenges, ch, avl, chtmp){
+		free(ch); 
+	}
 	pthread_mutex_destroy(&self->lock); 
-	free(self->threads); 
+	pthread_cond_destroy(&self->workers_exited); 
+	pthread_cond_destroy(&self->work_ready); 
+	pthread_cond_destroy(&self->queue_space); 
+}
+
+int orange_rpc_drain(struct orange_rpc *self, unsigned long long timeout_us){
+	struct timespec ts_until; 
+	timespec_from_now_us(&ts_until, timeout_us); 
+	pthread_mutex_lock(&self->lock); 
+	while(true){
+		unsigned int queued = 0; 
+		for(int c = 0; c < ORANGE_LANE_COUNT; c++) queued += self->lanes[c].queued; 
+		if(!queued && !self->busy_workers) break; 
+		if(timespec_expired(&ts_until)){
+			pthread_mutex_unlock(&self->lock); 
+			return -ETIMEDOUT; 
+		}
+		pthread_mutex_unlock(&self->lock); 
+		usleep(DRAIN_POLL_US); 
+		pthread_mutex_lock(&self->lock); 
+	}
+	pthread_mutex_unlock(&self->lock); 
+	return 0; 
+}
+
+void orange_rpc_set_max_workers(struct orange_rpc *self, unsigned int max_workers, unsigned long long grow_after_us, unsigned long long idle_timeout_us){
+	pthread_mutex_lock(&self->lock); 
+	self->max_workers = (max_workers > self->num_workers)?max_workers:self->num_workers; 
+	if(grow_after_us) self->grow_after_us = grow_after_us; 
+	if(idle_timeout_us) self->idle_timeout_us = idle_timeout_us; 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void orange_rpc_set_max_batch(struct orange_rpc *self, unsigned int max_batch){
+	pthread_mutex_lock(&self->lock); 
+	self->max_batch = max_batch; 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void orange_rpc_set_event_batch(struct orange_rpc *self, unsigned int max_events, unsigned long long window_us){
+	pthread_mutex_lock(&self->lock); 
+	self->event_batch_max = (max_events)?max_events:1; 
+	self->event_window_us = window_us; 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void orange_rpc_set_event_coalescing(struct orange_rpc *self, unsigned long long window_us, unsigned int rate, unsigned int burst, const char *data_key){
+	pthread_mutex_lock(&self->lock); 
+	orange_coalesce_configure(self->coalesce, window_us, rate, burst, data_key); 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void orange_rpc_set_event_log_size(struct orange_rpc *self, size_t max_bytes){
+	pthread_mutex_lock(&self->lock); 
+	orange_evlog_set_size(self->evlog, max_bytes); 
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void orange_rpc_set_peer_limit(struct orange_rpc *self, unsigned int max_inflight){
+	pthread_mutex_lock(&self->lock); 
+	self->peer_max_inflight = max_inflight; 
+	#if CONFIG_THREADS
+	// raising the limit may release held back requests
+	struct orange_rpc_peer *peer; 
+	avl_for_each_element(&self->peers, peer, avl){
+		if(_peer_limited(self, peer)) continue; 
+		for(int c = 0; c < ORANGE_LANE_COUNT; c++){
+			struct orange_rpc_flow *f = peer->flows[c]; 
+			if(f && !list_empty(&f->requests) && list_empty(&f->active)) list_add_tail(&f->active, &self->lanes[c].active); 
+		}
+	}
+	pthread_cond_broadcast(&self->work_ready); 
+	#endif
+	pthread_mutex_unlock(&self->lock); 
+}
+
+void orange_rpc_set_queue_limit(struct orange_rpc *self, unsigned int max_queued, unsigned int peer_max_queued){
+	pthread_mutex_lock(&self->lock); 
+	if(max_queued) self->max_queued = max_queued; 
+	if(peer_max_queued) self->peer_max_queued = peer_max_queued; 
+	pthread_cond_broadcast(&self->queue_space); 
+	pthread_mutex_unlock(&self->lock); 
 }
 
 void orange_rpc_broadcast_event(struct orange_rpc *self, const char *name, const struct blob_field *data){
@@ -375,15 +1612,9 @@ void orange_rpc_broadcast_event(struct orange_rpc *self, const char *name, const
 	// send broadcast message
 	struct orange_message *result = orange_message_new(); 
 	result->peer = 0; 
-
-	blob_offset_t t = blob_open_table(&result->buf); 
-	blob_put_string(&result->buf, "jsonrpc"); 
-	blob_put_string(&result->buf, "2.0"); 
-	blob_put_string(&result->buf, "method"); 
-	blob_put_string(&result->buf, name); 
-	blob_put_string(&result->buf, "params"); 
-	blob_put_attr(&result->buf, data); 
-	blob_close_table(&result->buf, t); 
+	// server only delivers the event to clients subscribed to it
+	result->topic = strdup(name); 
+	_put_event(&result->buf, name, data, orange_evlog_append(self->evlog, name, data)); 
 
 	orange_server_send(self->server, &result); 
 
@@ -17,10 +17,28 @@
 #pragma once
 
 #include "orange_server.h"
+#include "orange.h"
+#include "orange_eq.h"
 #include <pthread.h>
-#include <semaphore.h>
+#include <time.h>
+#include <utype/avl.h>
+#include <utype/list.h>
 
 struct orange; 
+struct orange_coalesce; 
+struct orange_evlog; 
+
+// requests waiting for a worker. Each lane holds one flow per peer so that requests of one client are served in order 
+// while different clients take turns (deficit round robin charged by worker time used). 
+struct orange_rpc_lane {
+	struct avl_tree flows; 
+	struct list_head active; // flows that have queued requests in round robin order
+	unsigned int weight; // number of requests taken from this lane per scheduling round
+	unsigned int credit; 
+	unsigned int queued; 
+	unsigned int busy; // workers currently processing requests from this lane
+	unsigned long long dispatched; 
+}; 
 
 struct orange_rpc{
 	//struct blob buf; 
@@ -28,21 +46,104 @@ struct orange_rpc{
 	orange_server_t server; 
 	struct orange *ctx; 
 	unsigned long long timeout_us; 
-	pthread_t *threads; 
 	pthread_t monitor; 
 	pthread_t eq_task; 
+	pthread_t reader; // moves requests from the server into lanes
 	pthread_mutex_t lock; 
-	unsigned int num_workers; 
 	int shutdown; 
-	struct avl_tree requests; 
+	struct list_head calls; // calls in progress (one request_record per busy worker)
+
+	// worker pool (protected by lock). Pool grows up to max_workers when all workers have been busy 
+	// for longer than grow_after_us and extra workers exit again after being idle for idle_timeout_us. 
+	unsigned int num_workers; // minimum number of workers
+	unsigned int max_workers; 
+	unsigned int live_workers; 
+	unsigned int busy_workers; // workers that are currently processing a request
+	unsigned long long grow_after_us; 
+	unsigned long long idle_timeout_us; 
+	struct timespec ts_grow; // pool may grow if all workers are still busy after this time
+	pthread_cond_t workers_exited; 
+	unsigned long long workers_grown; 
+	unsigned long long workers_shrunk; 
+
+	// requests that were dropped before execution (protected by lock)
+	unsigned long long requests_expired; 
+	unsigned long long requests_purged; // client disconnected while request was queued
+	unsigned long long requests_cancelled; 
+
+	// largest accepted json-rpc batch (number of requests)
+	unsigned int max_batch; 
+	unsigned long long batches; 
+
+	// local event queue. Events that arrive together are broadcast in batches of up to event_batch_max 
+	// and the reader waits up to event_window_us for more events of a burst (settings protected by lock). 
+	struct orange_eq events; 
+	unsigned int event_batch_max; 
+	unsigned long long event_window_us; 
+	unsigned long long events_received; 
+	unsigned long long event_batches; 
+	struct orange_coalesce *coalesce; // merges and rate limits events per event name (protected by lock)
+	struct orange_evlog *evlog; // recently broadcast events for clients that reconnect (protected by lock)
+
+	// request scheduling (protected by lock)
+	struct orange_rpc_lane lanes[ORANGE_LANE_COUNT]; 
+	unsigned int cur_lane; 
+	pthread_cond_t work_ready; 
+
+	// per client accounting (protected by lock). A client may have at most peer_max_inflight requests running 
+	// at the same time (0 means no limit). Further requests stay queued until one of the running ones finishes. 
+	struct avl_tree peers; 
+	unsigned int peer_max_inflight; 
+	unsigned long long peer_limited; // number of times a client was held back because of the limit
+
+	// limits on requests waiting for a worker (protected by lock). When max_queued requests are waiting the reader 
+	// stops taking requests off the server so that the server queue fills up and pushes back on the clients. 
+	// A client that already has peer_max_queued requests waiting gets further requests rejected. 
+	unsigned int max_queued; 
+	unsigned int peer_max_queued; 
+	pthread_cond_t queue_space; 
+	bool reader_waiting; 
+	unsigned long long reader_stalled; // number of times the reader stopped because the queue was full
+	unsigned long long requests_rejected; 
 
-	// number of busy workers 
-	sem_t sem_bw; 
+	// login challenges of clients keyed by peer (protected by lock). Removed when used or when the client disconnects. 
+	struct avl_tree challenges; 
 }; 
 
 void orange_rpc_init(struct orange_rpc *self, orange_server_t server, struct orange *ctx, unsigned long long timeout_us, unsigned int num_workers); 
 void orange_rpc_deinit(struct orange_rpc *self); 
 
+// waits until no requests are queued or running. Returns -ETIMEDOUT if that did not happen within timeout_us. 
+int orange_rpc_drain(struct orange_rpc *self, unsigned long long timeout_us); 
+
+// allows pool to grow up to max_workers threads. Default is a fixed pool of num_workers. 
+void orange_rpc_set_max_workers(struct orange_rpc *self, unsigned int max_workers, unsigned long long grow_after_us, unsigned long long idle_timeout_us); 
+
+// sets largest number of requests accepted in one json-rpc batch array
+void orange_rpc_set_max_batch(struct orange_rpc *self, unsigned int max_batch); 
+
+// sets how many local events are broadcast together and how long (in microseconds) to wait for more events 
+// after the queue runs empty. A window of 0 broadcasts whatever is queued right away. 
+void orange_rpc_set_event_batch(struct orange_rpc *self, unsigned int max_events, unsigned long long window_us); 
+
+// holds events for window_us so that only the latest one of a storm is sent and limits each event name to rate 
+// events per second (bursts of up to burst). With data_key the value of that field of event data becomes part of 
+// the key so that for example updates of different interfaces are coalesced separately. Both 0 disables it. 
+void orange_rpc_set_event_coalescing(struct orange_rpc *self, unsigned long long window_us, unsigned int rate, unsigned int burst, const char *data_key); 
+
+// sets how many bytes of recent events are kept for replay to reconnecting clients (0 keeps none)
+void orange_rpc_set_event_log_size(struct orange_rpc *self, size_t max_bytes); 
+
+// limits number of requests one client can have running at the same time (0 disables the limit)
+void orange_rpc_set_peer_limit(struct orange_rpc *self, unsigned int max_inflight); 
+
+// limits number of requests waiting for a worker in total and per client (0 keeps the current value)
+void orange_rpc_set_queue_limit(struct orange_rpc *self, unsigned int max_queued, unsigned int peer_max_queued); 
+
+// returns number of built in methods that are not in the method table slot of their hash (and thus can not be called). 
+// Misplaced methods are logged. 
+int orange_rpc_check_methods(void); 
+
 void orange_rpc_broadcast_event(struct orange_rpc *self, const char *name, const struct blob_field *data); 
 
 #ifndef CONFIG_THREADS
@@ -18,6 +18,9 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
 #include "orange_message.h"
 
 #define UBUS_PEER_BROADCAST (-1)
@@ -32,6 +35,17 @@ struct orange_server_api {
 	int 	(*send)(orange_server_t ptr, struct orange_message **msg); 
 	int 	(*recv)(orange_server_t ptr, struct orange_message **msg, unsigned long long timeout_us); 
 	void*	(*userdata)(orange_server_t ptr, void *data); 
+	// optional: puts a table of server specific counters into out
+	int 	(*stats)(orange_server_t ptr, struct blob *out); 
+	// optional: adds (or removes) a topic pattern for a peer. Broadcasts that carry a topic are only sent to 
+	// peers with a matching pattern. Peers that have no patterns keep receiving all broadcasts. 
+	int 	(*subscribe)(orange_server_t ptr, uint32_t peer, const char *pattern, bool subscribe); 
+	// optional: stops accepting new connections and returns the listening socket (caller owns it). Connected 
+	// clients are served until the server is deleted. Used to pass the socket on to a new instance. 
+	int 	(*detach)(orange_server_t ptr); 
+	// optional: starts accepting connections on an already listening socket (for example one that was detached 
+	// by a previous instance). Server takes ownership of fd even on failure. 
+	int 	(*adopt)(orange_server_t ptr, const char *path, int fd); 
 }; 
 
 #define UBUS_TARGET_PEER (0)
@@ -44,3 +58,8 @@ struct orange_server_api {
 #define orange_server_recv(sock, msg, timeout) (*sock)->recv(sock, msg, timeout)
 #define orange_server_get_userdata(sock) (*sock)->userdata(sock, NULL)
 #define orange_server_set_userdata(sock, ptr) (*sock)->userdata(sock, ptr)
+#define orange_server_stats(sock, out) (((*sock)->stats)?(*sock)->stats(sock, out):-ENOTSUP)
+#define orange_server_subscribe(sock, peer, pattern) (((*sock)->subscribe)?(*sock)->subscribe(sock, peer, pattern, true):-ENOTSUP)
+#define orange_server_unsubscribe(sock, peer, pattern) (((*sock)->subscribe)?(*sock)->subscribe(sock, peer, pattern, false):-ENOTSUP)
+#define orange_server_detach(sock) (((*sock)->detach)?(*sock)->detach(sock):-ENOTSUP)
+#define orange_server_adopt(sock, path, fd) (((*sock)->adopt)?(*sock)->adopt(sock, path, fd):(close(fd), -ENOTSUP))
@@ -49,45 +49,17 @@
 #include "util.h"
 
 #include "orange_session.h"
+#include "orange_rand.h"
 
 struct orange_session_data {
 	struct avl_node avl;
 	struct blob_field *attr;
 };
 
-struct orange_session_acl_scope {
-	struct avl_node avl;
-	struct avl_tree acls;
-};
-
-struct orange_session_acl {
-	struct avl_node avl;
-	const char *object;
-	const char *function;
-	char *perms; 
-	int sort_len;
-};
-
-static int _generate_sid(struct orange_sid *sid){
-	unsigned char buf[16] = { 0 };
-	FILE *f;
-	unsigned int i;
-	int ret;
-
-	f = fopen("/dev/urandom", "r");
-	if (!f)
-		return -1;
-
-	ret = fread(buf, 1, sizeof(buf), f);
-	fclose(f);
-
-	if (ret < 0)
-		return ret;
-
-	for (i = 0; i < sizeof(buf); i++)
-		sprintf(&sid->hash[i<<1], "%02x", buf[i]);
-
-	return 0;
+static void _generate_sid(struct orange_sid *sid){
+	unsigned char buf[ORANGE_SID_BYTES]; 
+	orange_rand_bytes(buf, sizeof(buf)); 
+	hex_encode(sid->hash, buf, sizeof(buf)); 
 }
 
 struct orange_session *orange_session_new(struct orange_user *user, unsigned long long timeout_s){
@@ -96,14 +68,13 @@ struct orange_session *orange_session_new(struct orange_user *user, unsigned lon
 	
 	_generate_sid(&self->sid); 
 
-	self->avl.key = self->sid.hash; 
-
-	avl_init(&self->acl_scopes, avl_strcmp, false, NULL);
+	self->acl = orange_acl_new(); 
 	avl_init(&self->data, avl_strcmp, false, NULL);
 
 	self->user = user; 
-	timespec_from_now_us(&self->ts_expired, timeout_s * 1000000UL); 
+	orange_session_set_expiry(self, timeout_s); 
 	self->timeout_s = timeout_s; 	
+	self->refcount = 1; 
 	pthread_mutex_init(&self->lock, NULL); 
 
 	return self; 
@@ -112,17 +83,10 @@ struct orange_session *orange_session_new(struct orange_user *user, unsigned lon
 void orange_session_delete(struct orange_session **_self){
 	assert(*_self); 
 	struct orange_session *self = *_self; 
-	struct orange_session_acl *acl, *nacl;
-    struct orange_session_acl_scope *acl_scope, *nacl_scope;
     struct orange_session_data *data, *ndata;
 
-    avl_for_each_element_safe(&self->acl_scopes, acl_scope, avl, nacl_scope) {
-        avl_remove_all_elements(&acl_scope->acls, acl, avl, nacl)
-            free(acl);
-
-        avl_delete(&self->acl_scopes, &acl_scope->avl);
-        free(acl_scope);
-    }
+	if(self->profile) orange_acl_unref(&self->profile); 
+	orange_acl_delete(&self->acl); 
 
     avl_remove_all_elements(&self->data, data, avl, ndata)
         free(data);
@@ -133,183 +97,175 @@ void orange_session_delete(struct orange_session **_self){
 	*_self = NULL; 
 }
 
-/*
- * Keys in the AVL tree contain all pattern characters up to the first wildcard.
- * To look up entries, start with the last entry that has a key less than or
- * equal to the method name, then work backwards as long as the AVL key still
- * matches its counterpart in the object name
- */
-#define uh_foreach_matching_acl_prefix(_acl, _avl, _obj, _func)     \
-    for (_acl = avl_find_le_element(_avl, _obj, _acl, avl);         \
-         _acl;                                                      \
-         _acl = avl_is_first(_avl, &(_acl)->avl) ? NULL :           \
-            avl_prev_element((_acl), avl))
-
-#define uh_foreach_matching_acl(_acl, _avl, _obj, _func)            \
-    uh_foreach_matching_acl_prefix(_acl, _avl, _obj, _func)         \
-        if (!strncmp((_acl)->object, _obj, (_acl)->sort_len) &&     \
-            !fnmatch((_acl)->object, (_obj), FNM_NOESCAPE) &&       \
-            !fnmatch((_acl)->function, (_func), FNM_NOESCAPE))
+struct orange_session *orange_session_ref(struct orange_session *self){
+	__atomic_add_fetch(&self->refcount, 1, __ATOMIC_RELAXED); 
+	return self; 
+}
 
+void orange_session_unref(struct orange_session **self){
+	if(__atomic_sub_fetch(&(*self)->refcount, 1, __ATOMIC_ACQ_REL) == 0){
+		orange_session_delete(self); 
+	}
+	*self = NULL; 
+}
 
-int orange_session_grant(struct orange_session *self, const char *scope, const char *object, const char *function, const char *perm){
-    struct orange_session_acl *acl;
-    struct orange_session_acl_scope *acl_scope;
-    char *new_scope, *new_obj, *new_func, *new_id, *new_perms;
-    int id_len;
+static long long _now_ms(void){
+	struct timespec ts; 
+	timespec_now(&ts); 
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000; 
+}
 
-    if (!object || !function)
-        return -EINVAL;
+void orange_session_set_expiry(struct orange_session *self, unsigned long long seconds){
+	__atomic_store_n(&self->expires_ms, _now_ms() + (long long)seconds * 1000, __ATOMIC_RELAXED); 
+}
 
+void orange_session_set_profile(struct orange_session *self, struct orange_acl **profile){
 	pthread_mutex_lock(&self->lock); 
+	if(self->profile) orange_acl_unref(&self->profile); 
+	self->profile = *profile; 
+	*profile = NULL; 
+	__atomic_add_fetch(&self->acl_gen, 1, __ATOMIC_RELEASE); 
+	pthread_mutex_unlock(&self->lock); 
+}
 
-    acl_scope = avl_find_element(&self->acl_scopes, scope, acl_scope, avl);
-
-    if (!acl_scope) {
-        acl_scope = calloc_a(sizeof(*acl_scope),
-                             &new_scope, strlen(scope) + 1);
-		
-        if (!acl_scope){ 
-			pthread_mutex_unlock(&self->lock); 
-            return -1;
-		}
-
-        acl_scope->avl.key = strcpy(new_scope, scope);
-        avl_init(&acl_scope->acls, avl_strcmp, true, NULL);
-        avl_insert(&self->acl_scopes, &acl_scope->avl);
-    }
-
-    id_len = strcspn(object, "*?[");
-    acl = calloc_a(sizeof(*acl),
-        &new_obj, strlen(object) + 1,
-        &new_func, strlen(function) + 1,
-        &new_id, id_len + 1, 
-		&new_perms, strlen(perm) + 1);
-
-    if (!acl){
-		pthread_mutex_unlock(&self->lock); 
-        return -1;
-	}
-
-    acl->object = strcpy(new_obj, object);
-    acl->function = strcpy(new_func, function);
-	acl->perms = strcpy(new_perms, perm);  
-    acl->avl.key = strncpy(new_id, object, id_len);
-    avl_insert(&acl_scope->acls, &acl->avl);
+int orange_session_grant(struct orange_session *self, const char *scope, const char *object, const char *function, const char *perm){
+	if (!object || !function)
+		return -EINVAL;
 
+	pthread_mutex_lock(&self->lock); 
+	int ret = orange_acl_grant(self->acl, scope, object, function, perm); 
+	__atomic_add_fetch(&self->acl_gen, 1, __ATOMIC_RELEASE); 
 	pthread_mutex_unlock(&self->lock); 
-    return 0;
+	return ret; 
 }
 
-//! New revoke marks permissions as '-' without actually deleting any nodes. 
+//! Revoke clears permissions of matching acls that have already been granted
 int orange_session_revoke(struct orange_session *self,
                const char *scope, const char *object, const char *function, const char *perm){
-	struct orange_session_acl *acl;
-	struct orange_session_acl_scope *acl_scope;
-
 	pthread_mutex_lock(&self->lock); 
-
-	acl_scope = avl_find_element(&self->acl_scopes, scope, acl_scope, avl);
-	if (acl_scope) {
-		size_t len = strlen(perm); 
-
-		uh_foreach_matching_acl(acl, &acl_scope->acls, object, function){
-			for(size_t c = 0; c < len; c++){
-				for(size_t j = 0; j < strlen(acl->perms); j++) {
-					if(perm[c] == acl->perms[j]) { 
-						acl->perms[j] = '-'; 
-					}
-				}
-				
-			}
-		}
-		pthread_mutex_unlock(&self->lock); 
-		return 0; 
+	if(self->profile){
+		// revoke may apply to shared rules so the session gets its own copy of them
+		struct orange_acl *acl = orange_acl_new(); 
+		orange_acl_merge(acl, self->profile); 
+		orange_acl_merge(acl, self->acl); 
+		orange_acl_delete(&self->acl); 
+		orange_acl_unref(&self->profile); 
+		self->acl = acl; 
 	}
-	
+	int ret = orange_acl_revoke(self->acl, scope, object, function, perm); 
+	__atomic_add_fetch(&self->acl_gen, 1, __ATOMIC_RELEASE); 
 	pthread_mutex_unlock(&self->lock); 
-	return -ENOENT;
+	return ret; 
 }
 
-bool orange_session_access(struct orange_session *self, const char *scope, const char *obj, const char *fun, const char *perm){
-	struct orange_session_acl *acl;
-	struct orange_session_acl_scope *acl_scope;
+// packs "scope\0object\0method" into key. Returns length or 0 if it does not fit. 
+static size_t _memo_key(char *key, const char *scope, const char *obj, const char *fun){
+	size_t ls = strlen(scope) + 1, lo = strlen(obj) + 1, lf = strlen(fun) + 1; 
+	if(ls + lo + lf > ORANGE_SESSION_MEMO_KEY) return 0; 
+	memcpy(key, scope, ls); 
+	memcpy(key + ls, obj, lo); 
+	memcpy(key + ls + lo, fun, lf); 
+	return ls + lo + lf; 
+}
 
-	pthread_mutex_lock(&self->lock); 
+static uint32_t _memo_hash(const char *key, size_t len){
+	// fnv-1a
+	uint32_t hash = 2166136261u; 
+	for(size_t c = 0; c < len; c++){
+		hash ^= (uint8_t)key[c]; 
+		hash *= 16777619u; 
+	}
+	return hash; 
+}
+
+// lock free read of a remembered check (seqlock style)
+static bool _memo_get(struct orange_session *self, const char *key, uint32_t len, uint32_t hash, unsigned int gen, bool *scope_found, orange_perms_t *perms){
+	struct orange_session_memo *m = &self->memo[hash & (ORANGE_SESSION_MEMO_SIZE - 1)]; 
+	unsigned int seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE); 
+	if(seq & 1) return false; 
+	bool hit = __atomic_load_n(&m->hash, __ATOMIC_RELAXED) == hash && 
+		__atomic_load_n(&m->gen, __ATOMIC_RELAXED) == gen && 
+		__atomic_load_n(&m->key_len, __ATOMIC_RELAXED) == len && 
+		!memcmp(m->key, key, len); 
+	*scope_found = __atomic_load_n(&m->scope_found, __ATOMIC_RELAXED); 
+	*perms = __atomic_load_n(&m->perms, __ATOMIC_RELAXED); 
+	__atomic_thread_fence(__ATOMIC_ACQUIRE); 
+	return hit && __atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq; 
+}
+
+// writers are serialized by the session lock
+static void _memo_put(struct orange_session *self, const char *key, uint32_t len, uint32_t hash, unsigned int gen, bool scope_found, orange_perms_t perms){
+	struct orange_session_memo *m = &self->memo[hash & (ORANGE_SESSION_MEMO_SIZE - 1)]; 
+	unsigned int seq = m->seq; 
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED); 
+	__atomic_thread_fence(__ATOMIC_RELEASE); 
+	__atomic_store_n(&m->hash, hash, __ATOMIC_RELAXED); 
+	__atomic_store_n(&m->gen, gen, __ATOMIC_RELAXED); 
+	__atomic_store_n(&m->key_len, len, __ATOMIC_RELAXED); 
+	__atomic_store_n(&m->scope_found, scope_found, __ATOMIC_RELAXED); 
+	__atomic_store_n(&m->perms, perms, __ATOMIC_RELAXED); 
+	memcpy(m->key, key, len); 
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE); 
+}
+
+bool orange_session_access(struct orange_session *self, const char *scope, const char *obj, const char *fun, const char *perm){
+	orange_perms_t want, have = 0; 
+	bool scope_found = false; 
+	char key[ORANGE_SESSION_MEMO_KEY]; 
 
 	// update the timeout
-	timespec_from_now_us(&self->ts_expired, self->timeout_s * 1000000UL); 
-
-	acl_scope = avl_find_element(&self->acl_scopes, scope, acl_scope, avl);
-
-	if (acl_scope) {
-		size_t len = strlen(perm); 
-		char *found = alloca(len); 
-		memset(found, 0, len); 
-
-		uh_foreach_matching_acl(acl, &acl_scope->acls, obj, fun){
-			// check each character in perms and see if it is allowed
-			// if no perms are specified then this will always return true
-			for(size_t c = 0; c < strlen(perm); c++){
-				for(size_t j = 0; j < strlen(acl->perms); j++) {
-					if(perm[c] == acl->perms[j]) { 
-						found[c] = 1; 
-						break; 
-					}
-				}
-				
-			}
-		}
-		for(size_t i = 0; i < len; i++){
-			if(!found[i]) {
-				pthread_mutex_unlock(&self->lock); 
-				return false; 
-			}
+	orange_session_set_expiry(self, self->timeout_s); 
+
+	if(!scope || !obj || !fun || !perm) return false; 
+	// permissions that can never be granted are never there
+	if(!orange_acl_perms(perm, &want)) return false; 
+
+	uint32_t len = _memo_key(key, scope, obj, fun); 
+	uint32_t hash = (len)?_memo_hash(key, len):0; 
+	unsigned int gen = __atomic_load_n(&self->acl_gen, __ATOMIC_ACQUIRE); 
+
+	if(!len || !_memo_get(self, key, len, hash, gen, &scope_found, &have)){
+		pthread_mutex_lock(&self->lock); 
+		gen = self->acl_gen; 
+		scope_found = orange_acl_lookup(self->acl, scope, obj, fun, &have); 
+		if(self->profile){
+			orange_perms_t shared = 0; 
+			if(orange_acl_lookup(self->profile, scope, obj, fun, &shared)) scope_found = true; 
+			have |= shared; 
 		}
+		if(len) _memo_put(self, key, len, hash, gen, scope_found, have); 
 		pthread_mutex_unlock(&self->lock); 
-		return true; 
 	}
-	
-	pthread_mutex_unlock(&self->lock); 
-	return false;
+
+	// if no perms are specified then this will always return true if there is a scope
+	return scope_found && (have & want) == want; 
 }
 
 bool orange_session_expired(struct orange_session *self){
-	struct timespec ts_now; 
-	timespec_now(&ts_now); 
-	pthread_mutex_lock(&self->lock); 
-	if(timespec_before(&self->ts_expired, &ts_now)){
-		pthread_mutex_unlock(&self->lock); 
-		return true; 
-	}
-	pthread_mutex_unlock(&self->lock); 
-	return false; 
+	return __atomic_load_n(&self->expires_ms, __ATOMIC_RELAXED) < _now_ms(); 
 }
 
-void orange_session_to_blob(struct orange_session *self, struct blob *buf){
-	struct orange_session_acl *acl;
-    struct orange_session_acl_scope *acl_scope;
+long long orange_session_seconds_left(struct orange_session *self){
+	long long left = __atomic_load_n(&self->expires_ms, __ATOMIC_RELAXED) - _now_ms(); 
+	// round up so that a session is not reported expired before it is
+	if(left <= 0) return left / 1000; 
+	return (left + 999) / 1000; 
+}
 
+void orange_session_to_blob(struct orange_session *self, struct blob *buf){
 	pthread_mutex_lock(&self->lock); 
 
 	blob_reset(buf); 
 	blob_offset_t r = blob_open_table(buf); 
-    avl_for_each_element(&self->acl_scopes, acl_scope, avl) {
-		blob_put_string(buf, acl_scope->avl.key); 
-		blob_offset_t s = blob_open_table(buf); 
-        avl_for_each_element(&acl_scope->acls, acl, avl){
-			blob_put_string(buf, acl->avl.key); 
-			blob_offset_t a = blob_open_table(buf); 
-			blob_put_string(buf, "object"); 
-			blob_put_string(buf, acl->object); 	
-			blob_put_string(buf, "method"); 
-			blob_put_string(buf, acl->function); 	
-			blob_put_string(buf, "perms"); 
-			blob_put_string(buf, acl->perms); 	
-			blob_close_table(buf, a); 
-		}
-		blob_close_table(buf, s); 
-    }
+	if(self->profile){
+		struct orange_acl *acl = orange_acl_new(); 
+		orange_acl_merge(acl, self->profile); 
+		orange_acl_merge(acl, self->acl); 
+		orange_acl_to_blob(acl, buf); 
+		orange_acl_delete(&acl); 
+	} else {
+		orange_acl_to_blob(self->acl, buf); 
+	}
 	blob_close_table(buf, r); 
 
 	pthread_mutex_unlock(&self->lock); 
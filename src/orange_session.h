@@ -2,28 +2,61 @@
 
 #include <utype/avl.h>
 #include "orange_user.h"
+#include "orange_acl.h"
+
+// session ids are this many random bytes written out as hex
+#define ORANGE_SID_BYTES 16
 
 struct orange_sid {
 	// 1 extra byte for trailing zero
-	char hash[32 + 1]; 
+	char hash[ORANGE_SID_BYTES * 2 + 1]; 
+}; 
+
+// number of remembered access checks per session (power of two)
+#define ORANGE_SESSION_MEMO_SIZE 32
+// checks with longer "scope object method" keys are not remembered
+#define ORANGE_SESSION_MEMO_KEY 64
+
+// result of an access check. Entries are read without locking and are only valid while seq is even and unchanged. 
+struct orange_session_memo {
+	unsigned int seq; 
+	unsigned int gen; 
+	uint32_t hash; 
+	uint32_t key_len; 
+	bool scope_found; 
+	orange_perms_t perms; 
+	char key[ORANGE_SESSION_MEMO_KEY]; 
 }; 
 
 struct orange_session {
-	struct avl_node avl; 
 	struct orange_sid sid; 
 	struct avl_tree data; 
-	struct avl_tree acl_scopes; 
-	struct timespec ts_expired; 
+	struct orange_acl *profile; // acls shared with other sessions. Never changed. 
+	struct orange_acl *acl; // acls granted to this session only
+	unsigned int acl_gen; // bumped on every change to acl so that remembered checks become invalid
+	struct orange_session_memo memo[ORANGE_SESSION_MEMO_SIZE]; 
+	long long expires_ms; // realtime in ms. Updated atomically so that access checks do not need the lock. 
 	unsigned long long timeout_s; 
 
 	pthread_mutex_t lock; 
 	struct orange_user *user; 
+	int refcount; // session is deleted when last reference is dropped
 }; 
 
 struct orange_session *orange_session_new(struct orange_user *user, unsigned long long timeout_s); 
 void orange_session_delete(struct orange_session **self); 
+// takes another reference to the session. Sessions start with one reference. 
+struct orange_session *orange_session_ref(struct orange_session *self); 
+// drops a reference and deletes the session when it was the last one
+void orange_session_unref(struct orange_session **self); 
+// sets shared acls of the session. Session takes over the reference. 
+void orange_session_set_profile(struct orange_session *self, struct orange_acl **profile); 
 int orange_session_grant(struct orange_session *self, const char *scope, const char *object, const char *method, const char *perm); 
 int orange_session_revoke(struct orange_session *self, const char *scope, const char *object, const char *method, const char *perm); 
 bool orange_session_access(struct orange_session *self, const char *scope, const char *obj, const char *fun, const char *perm); 
 bool orange_session_expired(struct orange_session *self); 
+// session expires seconds from now unless it is used
+void orange_session_set_expiry(struct orange_session *self, unsigned long long seconds); 
+// returns whole seconds until the session expires (0 or less if it has expired)
+long long orange_session_seconds_left(struct orange_session *self); 
 void orange_session_to_blob(struct orange_session *self, struct blob *buf); 
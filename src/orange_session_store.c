@@ -0,0 +1,340 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_session_store.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <utype/list.h>
+#include "util.h"
+
+// each level of the wheel has 64 slots. Level 0 covers 64 seconds, level 1 about an hour and level 2 three days. 
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 3
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+// when the clock moves ahead by more than this the wheel is sorted again instead of stepped one tick at a time
+#define WHEEL_MAX_STEP (1ULL << (WHEEL_BITS * 2))
+// initial size of hash table (power of two). Table grows when it becomes half full. 
+#define STORE_MIN_CAPACITY 64
+
+struct store_entry {
+	struct list_head timer; 
+	unsigned long long expires; // tick at which the entry comes due
+	uint8_t key[ORANGE_SID_BYTES]; 
+	struct orange_session *session; 
+}; 
+
+struct store_slot {
+	uint8_t key[ORANGE_SID_BYTES]; 
+	struct store_entry *entry; // NULL if the slot is free
+}; 
+
+struct orange_session_store {
+	pthread_rwlock_t lock; 
+	struct store_slot *slots; 
+	size_t capacity; 
+	size_t count; 
+	struct list_head wheel[WHEEL_LEVELS][WHEEL_SIZE]; 
+	unsigned long long tick; // wheel time (seconds)
+}; 
+
+static unsigned long long _now_s(void){
+	struct timespec ts; 
+	timespec_now(&ts); 
+	return ts.tv_sec; 
+}
+
+static int _hex(char c){
+	if(c >= '0' && c <= '9') return c - '0'; 
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10; 
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10; 
+	return -1; 
+}
+
+static bool _sid_to_key(const char *sid, uint8_t *key){
+	if(!sid) return false; 
+	for(int c = 0; c < ORANGE_SID_BYTES; c++){
+		int hi = _hex(sid[c * 2]); 
+		if(hi < 0) return false; 
+		int lo = _hex(sid[c * 2 + 1]); 
+		if(lo < 0) return false; 
+		key[c] = (hi << 4) | lo; 
+	}
+	return sid[ORANGE_SID_BYTES * 2] == 0; 
+}
+
+static size_t _hash(const uint8_t *key){
+	uint64_t h; 
+	memcpy(&h, key, sizeof(h)); 
+	return (size_t)h; 
+}
+
+// returns slot holding key or the free slot where it would go
+static size_t _probe(const struct orange_session_store *self, const uint8_t *key, bool *found){
+	size_t mask = self->capacity - 1; 
+	size_t i = _hash(key) & mask; 
+	while(self->slots[i].entry){
+		if(memcmp(self->slots[i].key, key, ORANGE_SID_BYTES) == 0){
+			*found = true; 
+			return i; 
+		}
+		i = (i + 1) & mask; 
+	}
+	*found = false; 
+	return i; 
+}
+
+// frees slot i and moves following entries back so that no probe sequence is broken (no tombstones needed)
+static void _slot_clear(struct orange_session_store *self, size_t i){
+	size_t mask = self->capacity - 1; 
+	size_t j = i; 
+	self->slots[i].entry = NULL; 
+	while(true){
+		j = (j + 1) & mask; 
+		if(!self->slots[j].entry) break; 
+		size_t home = _hash(self->slots[j].key) & mask; 
+		// entry at j can fill the hole if its home slot is not between the hole and j
+		bool between = (i <= j)?(i < home && home <= j):(i < home || home <= j); 
+		if(between) continue; 
+		self->slots[i] = self->slots[j]; 
+		self->slots[j].entry = NULL; 
+		i = j; 
+	}
+	self->count--; 
+}
+
+static void _grow(struct orange_session_store *self){
+	struct store_slot *old = self->slots; 
+	size_t old_capacity = self->capacity; 
+	self->capacity *= 2; 
+	self->slots = calloc(self->capacity, sizeof(struct store_slot)); 
+	assert(self->slots); 
+	for(size_t c = 0; c < old_capacity; c++){
+		if(!old[c].entry) continue; 
+		bool found; 
+		size_t i = _probe(self, old[c].key, &found); 
+		self->slots[i] = old[c]; 
+	}
+	free(old); 
+}
+
+static void _wheel_add(struct orange_session_store *self, struct store_entry *e){
+	// entries that are already due go into the next slot so that they are not missed
+	if(e->expires <= self->tick) e->expires = self->tick + 1; 
+	unsigned long long delta = e->expires - self->tick; 
+	if(delta >= WHEEL_SPAN){
+		// checked again when it comes due
+		e->expires = self->tick + WHEEL_SPAN - 1; 
+		delta = WHEEL_SPAN - 1; 
+	}
+	int level = 0; 
+	while(level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) level++; 
+	list_add_tail(&e->timer, &self->wheel[level][(e->expires >> (WHEEL_BITS * level)) & WHEEL_MASK]); 
+}
+
+// moves entries of the current slot of a level down to lower levels
+static void _wheel_cascade(struct orange_session_store *self, int level){
+	struct list_head list; 
+	INIT_LIST_HEAD(&list); 
+	list_splice_init(&self->wheel[level][(self->tick >> (WHEEL_BITS * level)) & WHEEL_MASK], &list); 
+	struct store_entry *e, *tmp; 
+	list_for_each_entry_safe(e, tmp, &list, timer){
+		list_del_init(&e->timer); 
+		_wheel_add(self, e); 
+	}
+}
+
+// moves wheel time to now and collects entries that have come due
+static void _wheel_advance(struct orange_session_store *self, unsigned long long now, struct list_head *due){
+	if(now <= self->tick) return; 
+	if(now - self->tick > WHEEL_MAX_STEP || !self->count){
+		// clock jumped (or nothing to do) so sort all entries again relative to now
+		struct list_head all; 
+		INIT_LIST_HEAD(&all); 
+		for(int l = 0; l < WHEEL_LEVELS; l++){
+			for(int s = 0; s < WHEEL_SIZE; s++) list_splice_init(&self->wheel[l][s], &all); 
+		}
+		self->tick = now; 
+		struct store_entry *e, *tmp; 
+		list_for_each_entry_safe(e, tmp, &all, timer){
+			list_del_init(&e->timer); 
+			if(e->expires <= now) list_add_tail(&e->timer, due); 
+			else _wheel_add(self, e); 
+		}
+		return; 
+	}
+	while(self->tick < now){
+		self->tick++; 
+		for(int level = 1; level < WHEEL_LEVELS; level++){
+			if(self->tick & ((1ULL << (WHEEL_BITS * level)) - 1)) break; 
+			_wheel_cascade(self, level); 
+		}
+		list_splice_tail_init(&self->wheel[0][self->tick & WHEEL_MASK], due); 
+	}
+}
+
+// NOTE: must be called with write lock held
+static void _entry_remove(struct orange_session_store *self, size_t slot){
+	struct store_entry *e = self->slots[slot].entry; 
+	list_del_init(&e->timer); 
+	_slot_clear(self, slot); 
+	orange_session_unref(&e->session); 
+	free(e); 
+}
+
+// NOTE: must be called with write lock held
+static int _expire(struct orange_session_store *self){
+	struct list_head due; 
+	INIT_LIST_HEAD(&due); 
+	_wheel_advance(self, _now_s(), &due); 
+
+	int removed = 0; 
+	struct store_entry *e, *tmp; 
+	list_for_each_entry_safe(e, tmp, &due, timer){
+		list_del_init(&e->timer); 
+		long long left = orange_session_seconds_left(e->session); 
+		if(left > 0){
+			// session has been used since it was put on the wheel
+			e->expires = self->tick + left; 
+			_wheel_add(self, e); 
+			continue; 
+		}
+		bool found; 
+		size_t slot = _probe(self, e->key, &found); 
+		assert(found); 
+		_entry_remove(self, slot); 
+		removed++; 
+	}
+	return removed; 
+}
+
+struct orange_session_store *orange_session_store_new(void){
+	struct orange_session_store *self = calloc(1, sizeof(struct orange_session_store)); 
+	assert(self); 
+	pthread_rwlock_init(&self->lock, NULL); 
+	self->capacity = STORE_MIN_CAPACITY; 
+	self->slots = calloc(self->capacity, sizeof(struct store_slot)); 
+	assert(self->slots); 
+	for(int l = 0; l < WHEEL_LEVELS; l++){
+		for(int s = 0; s < WHEEL_SIZE; s++) INIT_LIST_HEAD(&self->wheel[l][s]); 
+	}
+	self->tick = _now_s(); 
+	return self; 
+}
+
+void orange_session_store_delete(struct orange_session_store **_self){
+	struct orange_session_store *self = *_self; 
+	for(size_t c = 0; c < self->capacity; c++){
+		struct store_entry *e = self->slots[c].entry; 
+		if(!e) continue; 
+		orange_session_unref(&e->session); 
+		free(e); 
+	}
+	free(self->slots); 
+	pthread_rwlock_destroy(&self->lock); 
+	free(self); 
+	*_self = NULL; 
+}
+
+int orange_session_store_insert(struct orange_session_store *self, struct orange_session *session){
+	struct store_entry *e = calloc(1, sizeof(struct store_entry)); 
+	if(!e) return -ENOMEM; 
+	if(!_sid_to_key(session->sid.hash, e->key)){
+		free(e); 
+		return -EINVAL; 
+	}
+	INIT_LIST_HEAD(&e->timer); 
+	e->session = session; 
+
+	pthread_rwlock_wrlock(&self->lock); 
+	_expire(self); 
+	bool found; 
+	size_t slot = _probe(self, e->key, &found); 
+	if(found){
+		pthread_rwlock_unlock(&self->lock); 
+		free(e); 
+		return -EEXIST; 
+	}
+	if((self->count + 1) * 2 > self->capacity){
+		_grow(self); 
+		slot = _probe(self, e->key, &found); 
+	}
+	memcpy(self->slots[slot].key, e->key, ORANGE_SID_BYTES); 
+	self->slots[slot].entry = e; 
+	self->count++; 
+	e->expires = self->tick + orange_session_seconds_left(session); 
+	_wheel_add(self, e); 
+	pthread_rwlock_unlock(&self->lock); 
+	return 0; 
+}
+
+struct orange_session *orange_session_store_find(struct orange_session_store *self, const char *sid){
+	uint8_t key[ORANGE_SID_BYTES]; 
+	if(!_sid_to_key(sid, key)) return NULL; 
+	struct orange_session *session = NULL; 
+	pthread_rwlock_rdlock(&self->lock); 
+	bool found; 
+	size_t slot = _probe(self, key, &found); 
+	// expired sessions stay in the table until the wheel gets to them but they are no longer valid
+	if(found && !orange_session_expired(self->slots[slot].entry->session)){
+		session = orange_session_ref(self->slots[slot].entry->session); 
+	}
+	pthread_rwlock_unlock(&self->lock); 
+	return session; 
+}
+
+int orange_session_store_remove(struct orange_session_store *self, const char *sid){
+	uint8_t key[ORANGE_SID_BYTES]; 
+	if(!_sid_to_key(sid, key)) return -EINVAL; 
+	pthread_rwlock_wrlock(&self->lock); 
+	bool found; 
+	size_t slot = _probe(self, key, &found); 
+	if(!found){
+		pthread_rwlock_unlock(&self->lock); 
+		return -ENOENT; 
+	}
+	_entry_remove(self, slot); 
+	pthread_rwlock_unlock(&self->lock); 
+	return 0; 
+}
+
+int orange_session_store_expire(struct orange_session_store *self){
+	pthread_rwlock_wrlock(&self->lock); 
+	int removed = _expire(self); 
+	pthread_rwlock_unlock(&self->lock); 
+	return removed; 
+}
+
+size_t orange_session_store_count(struct orange_session_store *self){
+	pthread_rwlock_rdlock(&self->lock); 
+	size_t count = self->count; 
+	pthread_rwlock_unlock(&self->lock); 
+	return count; 
+}
+
+void orange_session_store_for_each(struct orange_session_store *self, void (*cb)(void *arg, struct orange_session *session), void *arg){
+	pthread_rwlock_rdlock(&self->lock); 
+	for(size_t c = 0; c < self->capacity; c++){
+		if(self->slots[c].entry) cb(arg, self->slots[c].entry->session); 
+	}
+	pthread_rwlock_unlock(&self->lock); 
+}
@@ -0,0 +1,58 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Table of logged in sessions. 
+
+	Sessions are kept in an open addressing hash table (linear probing)
+	keyed by the binary form of the session id. Session ids are random so
+	their first bytes are used as hash directly. Lookups only take a read
+	lock and hand out a reference to the session so that it stays valid
+	while a call is running even if it is logged out meanwhile. 
+
+	Expiry is driven by a hierarchical timer wheel with one second ticks.
+	Each session sits in one slot of the wheel and only sessions whose slot
+	comes due are looked at, so nothing is scanned. Using a session only
+	moves its expiry time forward (see orange_session_access()). When its
+	slot comes due and the session has been used meanwhile it is simply put
+	into the slot of its new expiry time. 
+
+	All functions are thread safe. 
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <blobpack/blobpack.h>
+#include "orange_session.h"
+
+struct orange_session_store; 
+
+struct orange_session_store *orange_session_store_new(void); 
+void orange_session_store_delete(struct orange_session_store **self); 
+
+// adds a session. Store takes over the reference of the caller. Returns -EEXIST if the id is already in use. 
+int orange_session_store_insert(struct orange_session_store *self, struct orange_session *session); 
+// returns a new reference to a live session with id sid or NULL. Release it with orange_session_unref(). 
+struct orange_session *orange_session_store_find(struct orange_session_store *self, const char *sid); 
+int orange_session_store_remove(struct orange_session_store *self, const char *sid); 
+// removes sessions that have expired. Returns number of sessions removed. 
+int orange_session_store_expire(struct orange_session_store *self); 
+size_t orange_session_store_count(struct orange_session_store *self); 
+// calls cb for every session. cb must not call into the store. 
+void orange_session_store_for_each(struct orange_session_store *self, void (*cb)(void *arg, struct orange_session *session), void *arg); 
@@ -0,0 +1,282 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_topic.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <utype/avl.h>
+#include <utype/avl-cmp.h>
+#include <utype/utils.h>
+
+#define TOPIC_MAX_SEGMENTS 16
+
+struct orange_topic_node {
+	struct avl_node avl; // entry in parent children (keyed by segment)
+	struct orange_topic_node *parent; 
+	char *segment; 
+	struct avl_tree children; 
+	uint32_t *peers; // peers whose pattern ends at this node
+	size_t num_peers; 
+	size_t max_peers; 
+}; 
+
+struct orange_topic_tree {
+	struct orange_topic_node root; 
+	size_t count; 
+}; 
+
+// collects matched peers while walking the trie
+struct topic_match {
+	uint32_t *peers; 
+	size_t count; 
+	size_t size; 
+}; 
+
+static void _node_init(struct orange_topic_node *node, struct orange_topic_node *parent, const char *segment){
+	node->parent = parent; 
+	node->segment = (segment)?strdup(segment):NULL; 
+	node->avl.key = node->segment; 
+	avl_init(&node->children, avl_strcmp, false, NULL); 
+}
+
+static void _node_free(struct orange_topic_node *node){
+	struct orange_topic_node *child, *tmp; 
+	avl_remove_all_elements(&node->children, child, avl, tmp){
+		_node_free(child); 
+		free(child); 
+	}
+	free(node->peers); 
+	free(node->segment); 
+}
+
+struct orange_topic_tree *orange_topic_tree_new(void){
+	struct orange_topic_tree *self = calloc(1, sizeof(struct orange_topic_tree)); 
+	assert(self); 
+	_node_init(&self->root, NULL, NULL); 
+	return self; 
+}
+
+void orange_topic_tree_delete(struct orange_topic_tree **self){
+	_node_free(&(*self)->root); 
+	free(*self); 
+	*self = NULL; 
+}
+
+// splits name in place into segments. Returns number of segments or -EINVAL. 
+static int _split(char *name, char **segments){
+	int count = 0; 
+	char *save = NULL; 
+	size_t len = strlen(name); 
+	// strtok would silently skip empty segments
+	if(!len || name[0] == '.' || name[len - 1] == '.' || strstr(name, "..")) return -EINVAL; 
+	for(char *s = strtok_r(name, ".", &save); s; s = strtok_r(NULL, ".", &save)){
+		if(count == TOPIC_MAX_SEGMENTS) return -EINVAL; 
+		segments[count++] = s; 
+	}
+	return count; 
+}
+
+bool orange_topic_pattern_valid(const char *pattern){
+	char buf[ORANGE_TOPIC_MAX_LENGTH]; 
+	char *segments[TOPIC_MAX_SEGMENTS]; 
+	if(!pattern || strlen(pattern) >= sizeof(buf)) return false; 
+	strcpy(buf, pattern); 
+	int count = _split(buf, segments); 
+	if(count < 0) return false; 
+	for(int c = 0; c < count; c++){
+		// wildcards must be whole segments
+		if(strchr(segments[c], '*') && strcmp(segments[c], "*") != 0 && strcmp(segments[c], "**") != 0) return false; 
+		// "**.**" matches the same topics as "**" but every extra "**" multiplies the work of matching
+		if(c > 0 && strcmp(segments[c], "**") == 0 && strcmp(segments[c - 1], "**") == 0) return false; 
+	}
+	return true; 
+}
+
+// finds node for pattern. Creates missing nodes if create is set. 
+static struct orange_topic_node *_find(struct orange_topic_tree *self, const char *pattern, bool create){
+	char buf[ORANGE_TOPIC_MAX_LENGTH]; 
+	char *segments[TOPIC_MAX_SEGMENTS]; 
+	if(!orange_topic_pattern_valid(pattern)) return NULL; 
+	strcpy(buf, pattern); 
+	int count = _split(buf, segments); 
+	struct orange_topic_node *node = &self->root; 
+	for(int c = 0; c < count; c++){
+		struct orange_topic_node *child = avl_find_element(&node->children, segments[c], child, avl); 
+		if(!child){
+			if(!create) return NULL; 
+			child = calloc(1, sizeof(struct orange_topic_node)); 
+			assert(child); 
+			_node_init(child, node, segments[c]); 
+			avl_insert(&node->children, &child->avl); 
+		}
+		node = child; 
+	}
+	return node; 
+}
+
+// removes nodes that no longer hold any subscriptions
+static void _prune(struct orange_topic_node *node){
+	while(node->parent && !node->num_peers && avl_is_empty(&node->children)){
+		struct orange_topic_node *parent = node->parent; 
+		avl_delete(&parent->children, &node->avl); 
+		_node_free(node); 
+		free(node); 
+		node = parent; 
+	}
+}
+
+static int _node_remove_peer(struct orange_topic_node *node, uint32_t peer){
+	for(size_t c = 0; c < node->num_peers; c++){
+		if(node->peers[c] != peer) continue; 
+		node->peers[c] = node->peers[--node->num_peers]; 
+		return 0; 
+	}
+	return -ENOENT; 
+}
+
+int orange_topic_subscribe(struct orange_topic_tree *self, const char *pattern, uint32_t peer){
+	struct orange_topic_node *node = _find(self, pattern, true); 
+	if(!node) return -EINVAL; 
+	for(size_t c = 0; c < node->num_peers; c++){
+		if(node->peers[c] == peer) return -EEXIST; 
+	}
+	if(node->num_peers == node->max_peers){
+		node->max_peers = (node->max_peers)?node->max_peers * 2:4; 
+		node->peers = realloc(node->peers, node->max_peers * sizeof(uint32_t)); 
+		assert(node->peers); 
+	}
+	node->peers[node->num_peers++] = peer; 
+	self->count++; 
+	return 0; 
+}
+
+int orange_topic_unsubscribe(struct orange_topic_tree *self, const char *pattern, uint32_t peer){
+	struct orange_topic_node *node = _find(self, pattern, false); 
+	if(!node || _node_remove_peer(node, peer) < 0) return -ENOENT; 
+	self->count--; 
+	_prune(node); 
+	return 0; 
+}
+
+// removes peer from node and all nodes below it. Returns number of removed subscriptions. 
+static int _remove_all(struct orange_topic_tree *self, struct orange_topic_node *node, uint32_t peer){
+	int removed = 0; 
+	struct orange_topic_node *child, *tmp; 
+	avl_for_each_element_safe(&node->children, child, avl, tmp){
+		removed += _remove_all(self, child, peer); 
+	}
+	if(_node_remove_peer(node, peer) == 0) removed++; 
+	// children have already been pruned so this only removes node itself
+	if(node->parent && !node->num_peers && avl_is_empty(&node->children)){
+		avl_delete(&node->parent->children, &node->avl); 
+		_node_free(node); 
+		free(node); 
+	}
+	return removed; 
+}
+
+int orange_topic_unsubscribe_all(struct orange_topic_tree *self, uint32_t peer){
+	int removed = _remove_all(self, &self->root, peer); 
+	self->count -= removed; 
+	return removed; 
+}
+
+static void _match_add(struct topic_match *m, struct orange_topic_node *node){
+	if(!node->num_peers) return; 
+	if(m->count + node->num_peers > m->size){
+		m->size = (m->count + node->num_peers) * 2; 
+		m->peers = realloc(m->peers, m->size * sizeof(uint32_t)); 
+		assert(m->peers); 
+	}
+	memcpy(m->peers + m->count, node->peers, node->num_peers * sizeof(uint32_t)); 
+	m->count += node->num_peers; 
+}
+
+static void _match(struct orange_topic_node *node, char **segments, int count, struct topic_match *m){
+	struct orange_topic_node *any = avl_find_element(&node->children, "**", any, avl); 
+	if(any){
+		// "**" swallows any number of remaining segments
+		for(int c = 0; c <= count; c++) _match(any, segments + c, count - c, m); 
+	}
+	if(count == 0){
+		_match_add(m, node); 
+		return; 
+	}
+	struct orange_topic_node *child = avl_find_element(&node->children, segments[0], child, avl); 
+	if(child) _match(child, segments + 1, count - 1, m); 
+	struct orange_topic_node *one = avl_find_element(&node->children, "*", one, avl); 
+	if(one) _match(one, segments + 1, count - 1, m); 
+}
+
+static int _peer_cmp(const void *a, const void *b){
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b; 
+	return (x > y) - (x < y); 
+}
+
+int orange_topic_match(struct orange_topic_tree *self, const char *topic, uint32_t **peers){
+	char buf[ORANGE_TOPIC_MAX_LENGTH]; 
+	char *segments[TOPIC_MAX_SEGMENTS]; 
+	struct topic_match m = { NULL, 0, 0 }; 
+	*peers = NULL; 
+	if(!topic || strlen(topic) >= sizeof(buf) || !self->count) return 0; 
+	strcpy(buf, topic); 
+	int count = _split(buf, segments); 
+	if(count < 0) return 0; 
+
+	_match(&self->root, segments, count, &m); 
+	if(!m.count) return 0; 
+
+	// a peer may have several patterns that match the same topic
+	qsort(m.peers, m.count, sizeof(uint32_t), _peer_cmp); 
+	size_t n = 1; 
+	for(size_t c = 1; c < m.count; c++){
+		if(m.peers[c] != m.peers[n - 1]) m.peers[n++] = m.peers[c]; 
+	}
+	*peers = m.peers; 
+	return n; 
+}
+
+static bool _pattern_match(char **pattern, int pcount, char **segments, int count){
+	if(pcount == 0) return count == 0; 
+	if(strcmp(pattern[0], "**") == 0){
+		for(int c = 0; c <= count; c++){
+			if(_pattern_match(pattern + 1, pcount - 1, segments + c, count - c)) return true; 
+		}
+		return false; 
+	}
+	if(count == 0) return false; 
+	if(strcmp(pattern[0], "*") != 0 && strcmp(pattern[0], segments[0]) != 0) return false; 
+	return _pattern_match(pattern + 1, pcount - 1, segments + 1, count - 1); 
+}
+
+bool orange_topic_pattern_match(const char *pattern, const char *topic){
+	char pbuf[ORANGE_TOPIC_MAX_LENGTH], tbuf[ORANGE_TOPIC_MAX_LENGTH]; 
+	char *psegments[TOPIC_MAX_SEGMENTS], *tsegments[TOPIC_MAX_SEGMENTS]; 
+	if(!orange_topic_pattern_valid(pattern) || !topic || strlen(topic) >= sizeof(tbuf)) return false; 
+	strcpy(pbuf, pattern); 
+	strcpy(tbuf, topic); 
+	int pcount = _split(pbuf, psegments); 
+	int count = _split(tbuf, tsegments); 
+	if(count < 0) return false; 
+	return _pattern_match(psegments, pcount, tsegments, count); 
+}
+
+size_t orange_topic_count(struct orange_topic_tree *self){
+	return self->count; 
+}
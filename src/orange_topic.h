@@ -0,0 +1,62 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Index of topic subscriptions. 
+
+	Topics are dot separated names such as "wifi.scan.done". Subscription
+	patterns are stored in a trie with one node per name segment and every
+	node holds the peers whose pattern ends there. A pattern segment can be
+	a literal name, "*" which matches exactly one segment or "**" which
+	matches any number of segments (including none). Matching a topic only
+	visits the trie branches that can match it, so the cost depends on the
+	topic depth rather than on the number of subscriptions. 
+
+	The index is not thread safe. Callers protect it with their own lock. 
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ORANGE_TOPIC_MAX_LENGTH 128
+
+struct orange_topic_tree; 
+
+struct orange_topic_tree *orange_topic_tree_new(void); 
+void orange_topic_tree_delete(struct orange_topic_tree **self); 
+
+// checks that pattern is well formed (non empty segments, wildcards only as whole segments)
+bool orange_topic_pattern_valid(const char *pattern); 
+
+// returns 0 on success, -EEXIST if peer is already subscribed to the pattern and -EINVAL for invalid patterns
+int orange_topic_subscribe(struct orange_topic_tree *self, const char *pattern, uint32_t peer); 
+// returns 0 on success and -ENOENT if peer was not subscribed to the pattern
+int orange_topic_unsubscribe(struct orange_topic_tree *self, const char *pattern, uint32_t peer); 
+// removes all subscriptions of a peer. Returns number of removed subscriptions. 
+int orange_topic_unsubscribe_all(struct orange_topic_tree *self, uint32_t peer); 
+
+// finds peers with a pattern matching topic. On success *peers is a sorted array without duplicates that the caller must free. 
+// Returns number of peers (0 and *peers = NULL when there are none). 
+int orange_topic_match(struct orange_topic_tree *self, const char *topic, uint32_t **peers); 
+
+// checks a single pattern against a topic without building a tree
+bool orange_topic_pattern_match(const char *pattern, const char *topic); 
+
+// number of stored subscriptions
+size_t orange_topic_count(struct orange_topic_tree *self); 
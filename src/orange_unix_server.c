@@ -0,0 +1,648 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include "orange_unix_server.h"
+#include <utype/list.h>
+#include <utype/avl.h>
+#include <utype/utils.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ctype.h>
+#include "orange_id.h"
+#include "orange_msgpack.h"
+#include "internal.h"
+#include "json_check.h"
+#include "util.h"
+#include <blobpack/blobpack.h>
+
+// broadcasts are dropped for clients that have more than this amount of data waiting
+#define ORANGE_UNIX_TX_LIMIT (1024 * 1024)
+// socket send buffer we ask for so that large responses fit into one datagram
+#define ORANGE_UNIX_SNDBUF (1024 * 1024)
+
+struct orange_unix_frame {
+	struct list_head list;
+	uint8_t *buf;
+	size_t len;
+};
+
+struct orange_unix_client {
+	struct orange_id id;
+	int fd;
+	struct list_head tx_queue;
+	size_t tx_bytes;
+	unsigned int rx_queued; // requests on the rx queue that no worker has picked up yet
+	bool binary; // last request was msgpack so we respond in msgpack
+	bool disconnect;
+};
+
+struct orange_unix_stats {
+	unsigned long long rx_messages;
+	unsigned long long rx_errors;
+	unsigned long long tx_messages;
+	unsigned long long tx_queued; // messages that could not be sent directly
+	unsigned long long tx_dropped;
+	unsigned long long rx_paused; // times reading from a client was paused because of ORANGE_UNIX_RX_LIMIT
+};
+
+struct orange_unix_server {
+	const struct orange_server_api *api;
+	bool shutdown;
+	pthread_t thread;
+	bool thread_running;
+	pthread_mutex_t lock; // protects everything below
+	pthread_cond_t rx_ready;
+	struct list_head rx_queue;
+	struct avl_tree clients;
+	int listen_fd;
+	int wake_fd[2]; // used to wake up service thread
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	void *user_data;
+	JSON_check jc; // only used by service thread
+	uint8_t *rx_buffer; // only used by service thread
+	struct orange_unix_stats stats;
+};
+
+static struct orange_unix_frame *orange_unix_frame_new(const struct blob_field *msg, bool binary){
+	struct orange_unix_frame *self = calloc(1, sizeof(struct orange_unix_frame));
+	assert(self);
+	INIT_LIST_HEAD(&self->list);
+	if(binary){
+		self->buf = orange_msgpack_pack(msg, 0, 0, &self->len);
+	} else {
+		self->buf = (uint8_t*)blob_field_to_json(msg);
+		if(self->buf) self->len = strlen((char*)self->buf);
+	}
+	if(!self->buf){
+		free(self);
+		return NULL;
+	}
+	return self;
+}
+
+static struct orange_unix_frame *orange_unix_frame_copy(const struct orange_unix_frame *other){
+	struct orange_unix_frame *self = calloc(1, sizeof(struct orange_unix_frame));
+	assert(self);
+	INIT_LIST_HEAD(&self->list);
+	self->len = other->len;
+	self->buf = malloc(self->len);
+	assert(self->buf);
+	memcpy(self->buf, other->buf, self->len);
+	return self;
+}
+
+static void orange_unix_frame_delete(struct orange_unix_frame **self){
+	assert(self && *self);
+	free((*self)->buf);
+	free(*self);
+	*self = NULL;
+}
+
+static struct orange_unix_client *orange_unix_client_new(int fd){
+	struct orange_unix_client *self = calloc(1, sizeof(struct orange_unix_client));
+	assert(self);
+	INIT_LIST_HEAD(&self->tx_queue);
+	self->fd = fd;
+	return self;
+}
+
+static void orange_unix_client_delete(struct orange_unix_client **self){
+	struct orange_unix_frame *pos, *tmp;
+	list_for_each_entry_safe(pos, tmp, &(*self)->tx_queue, list){
+		orange_unix_frame_delete(&pos);
+	}
+	close((*self)->fd);
+	free(*self);
+	*self = NULL;
+}
+
+static void _server_wakeup(struct orange_unix_server *self){
+	char ch = 0;
+	if(write(self->wake_fd[1], &ch, 1) < 0 && errno != EAGAIN){
+		ERROR("unix: could not wake up server thread: %s\n", strerror(errno));
+	}
+}
+
+// tries to send the frame directly and queues it if the socket is full. Takes ownership of the frame.
+// NOTE: must be called with lock held. Returns true if service thread needs to be woken up.
+static bool _client_send_frame(struct orange_unix_server *self, struct orange_unix_client *client, struct orange_unix_frame *frame, bool broadcast){
+	if(client->disconnect){
+		orange_unix_frame_delete(&frame);
+		return false;
+	}
+	if(list_empty(&client->tx_queue)){
+		ssize_t ret = send(client->fd, frame->buf, frame->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(ret == (ssize_t)frame->len){
+			self->stats.tx_messages++;
+			orange_unix_frame_delete(&frame);
+			return false;
+		} else if(ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+			DEBUG("unix: send to %08x failed: %s\n", client->id.id, (ret < 0)?strerror(errno):"short write");
+			client->disconnect = true;
+			orange_unix_frame_delete(&frame);
+			return true;
+		}
+	}
+	if(broadcast && client->tx_bytes + frame->len > ORANGE_UNIX_TX_LIMIT){
+		self->stats.tx_dropped++;
+		orange_unix_frame_delete(&frame);
+		return false;
+	}
+	self->stats.tx_queued++;
+	client->tx_bytes += frame->len;
+	list_add_tail(&frame->list, &client->tx_queue);
+	return true;
+}
+
+// NOTE: must be called with lock held and only from service thread
+static void _client_flush(struct orange_unix_server *self, struct orange_unix_client *client){
+	while(!list_empty(&client->tx_queue)){
+		struct orange_unix_frame *frame = list_first_entry(&client->tx_queue, struct orange_unix_frame, list);
+		ssize_t ret = send(client->fd, frame->buf, frame->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if(ret != (ssize_t)frame->len){
+			client->disconnect = true;
+			return;
+		}
+		self->stats.tx_messages++;
+		client->tx_bytes -= frame->len;
+		list_del_init(&frame->list);
+		orange_unix_frame_delete(&frame);
+	}
+}
+
+// NOTE: must be called with lock held and only from service thread
+static void _client_close(struct orange_unix_server *self, struct orange_unix_client *client){
+	DEBUG("unix: client %08x disconnected\n", client->id.id);
+	// let the workers know so that queued requests of this client can be dropped
+	struct orange_message *msg = orange_message_new();
+	msg->type = UBUS_MSG_PEER_DISCONNECTED;
+	msg->peer = client->id.id;
+	timespec_now(&msg->ts_queued);
+	list_add_tail(&msg->list, &self->rx_queue);
+	pthread_cond_signal(&self->rx_ready);
+	orange_id_free(&self->clients, &client->id);
+	orange_peer_id_free(client->id.id);
+	orange_unix_client_delete(&client);
+}
+
+// reads one datagram from the client and places it on the rx queue. Returns false if client has disconnected.
+// NOTE: must be called with lock held and only from service thread
+static bool _client_read(struct orange_unix_server *self, struct orange_unix_client *client){
+	ssize_t len = recv(client->fd, self->rx_buffer, ORANGE_UNIX_MAX_MESSAGE, MSG_DONTWAIT | MSG_TRUNC);
+	if(len < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if(len == 0) return false;
+	if(len >= ORANGE_UNIX_MAX_MESSAGE){
+		ERROR("unix: message of %d bytes is too large! Discarded!\n", (int)len);
+		self->stats.rx_errors++;
+		return true;
+	}
+
+	struct orange_message *msg = orange_message_new();
+	blob_reset(&msg->buf);
+
+	// json messages always start with an object or an array (possibly after white space)
+	size_t pos = 0;
+	while(pos < (size_t)len && isspace(self->rx_buffer[pos])) pos++;
+	bool json = pos < (size_t)len && (self->rx_buffer[pos] == '{' || self->rx_buffer[pos] == '[');
+
+	if(json){
+		self->rx_buffer[len] = 0;
+		if(!JSON_check_string(self->jc, (char*)self->rx_buffer) || !blob_put_json(&msg->buf, (char*)self->rx_buffer)){
+			ERROR("unix: got bad message: %s\n", (char*)self->rx_buffer);
+			self->stats.rx_errors++;
+			orange_message_delete(&msg);
+			return true;
+		}
+	} else if(!orange_msgpack_unpack(&msg->buf, self->rx_buffer, len)){
+		ERROR("unix: got bad binary message of %d bytes\n", (int)len);
+		self->stats.rx_errors++;
+		orange_message_delete(&msg);
+		return true;
+	}
+
+	client->binary = !json;
+	msg->peer = client->id.id;
+	timespec_now(&msg->ts_queued);
+	self->stats.rx_messages++;
+	if(++client->rx_queued == ORANGE_UNIX_RX_LIMIT) self->stats.rx_paused++;
+	list_add_tail(&msg->list, &self->rx_queue);
+	pthread_cond_signal(&self->rx_ready);
+	return true;
+}
+
+// NOTE: must be called with lock held and only from service thread
+static void _server_accept(struct orange_unix_server *self){
+	int fd = accept4(self->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(fd < 0) return;
+	int sndbuf = ORANGE_UNIX_SNDBUF;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	struct orange_unix_client *client = orange_unix_client_new(fd);
+	orange_id_alloc(&self->clients, &client->id, orange_peer_id_alloc(&self->api));
+	DEBUG("unix: client %08x connected\n", client->id.id);
+}
+
+static void *_unix_server_thread(void *ptr){
+	struct orange_unix_server *self = (struct orange_unix_server*)ptr;
+	struct pollfd *fds = NULL;
+	struct orange_unix_client **owners = NULL;
+	size_t size = 0;
+
+	prctl(PR_SET_NAME, "unix_server");
+
+	pthread_mutex_lock(&self->lock);
+	while(!self->shutdown){
+		// rebuild poll set. Only this thread adds and removes clients so pointers stay valid while we poll.
+		size_t count = self->clients.count + 2;
+		if(count > size){
+			size = count * 2;
+			fds = realloc(fds, sizeof(struct pollfd) * size);
+			owners = realloc(owners, sizeof(struct orange_unix_client*) * size);
+			assert(fds && owners);
+		}
+		fds[0] = (struct pollfd){ .fd = self->wake_fd[0], .events = POLLIN };
+		fds[1] = (struct pollfd){ .fd = self->listen_fd, .events = POLLIN };
+		size_t nfds = 2;
+		struct orange_unix_client *client, *tmp;
+		avl_for_each_element_safe(&self->clients, client, id.avl, tmp){
+			if(client->disconnect){
+				_client_close(self, client);
+				continue;
+			}
+			// clients with too many requests waiting are not read until workers catch up (hangups are still reported)
+			short events = (client->rx_queued < ORANGE_UNIX_RX_LIMIT)?POLLIN:0;
+			fds[nfds] = (struct pollfd){ .fd = client->fd, .events = events | ((list_empty(&client->tx_queue))?0:POLLOUT) };
+			owners[nfds] = client;
+			nfds++;
+		}
+		pthread_mutex_unlock(&self->lock);
+
+		if(poll(fds, nfds, -1) < 0 && errno != EINTR){
+			ERROR("unix: poll failed: %s\n", strerror(errno));
+			usleep(1000);
+		}
+
+		pthread_mutex_lock(&self->lock);
+		if(fds[0].revents & POLLIN){
+			char buf[64];
+			while(read(self->wake_fd[0], buf, sizeof(buf)) > 0);
+		}
+		for(size_t c = 2; c < nfds; c++){
+			client = owners[c];
+			if(fds[c].revents & POLLOUT) _client_flush(self, client);
+			if((fds[c].revents & (POLLIN | POLLHUP | POLLERR)) && !_client_read(self, client)){
+				client->disconnect = true;
+			}
+		}
+		if(fds[1].revents & POLLIN) _server_accept(self);
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	free(fds);
+	free(owners);
+	pthread_exit(0);
+	return NULL;
+}
+
+// strips the scheme and checks that path fits into a socket address. Returns NULL if it does not. 
+static const char *_unix_socket_path(const char *path){
+	if(strncmp(path, ORANGE_UNIX_SCHEME, strlen(ORANGE_UNIX_SCHEME)) == 0) path += strlen(ORANGE_UNIX_SCHEME);
+	if(!strlen(path) || strlen(path) >= sizeof(((struct sockaddr_un*)0)->sun_path)){
+		fprintf(stderr, "Invalid unix socket path: %s\n", path);
+		return NULL;
+	}
+	return path;
+}
+
+// NOTE: must be called with lock held
+static void _unix_start(struct orange_unix_server *self, const char *path, int fd){
+	self->listen_fd = fd;
+	strncpy(self->path, path, sizeof(self->path) - 1);
+	if(!self->thread_running){
+		pthread_create(&self->thread, NULL, _unix_server_thread, self);
+		self->thread_running = true;
+	}
+}
+
+static int _unix_listen(orange_server_t server, const char *path){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+	struct sockaddr_un addr;
+
+	if(!(path = _unix_socket_path(path))) return -EINVAL;
+
+	pthread_mutex_lock(&self->lock);
+	if(self->listen_fd >= 0){
+		pthread_mutex_unlock(&self->lock);
+		return -EEXIST;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0){
+		pthread_mutex_unlock(&self->lock);
+		return -errno;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	// remove stale socket left behind by previous instance
+	unlink(path);
+
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0){
+		int err = errno;
+		fprintf(stderr, "Could not listen on unix socket %s: %s\n", path, strerror(err));
+		close(fd);
+		pthread_mutex_unlock(&self->lock);
+		return -err;
+	}
+
+	DEBUG("unix: listening on %s\n", path);
+	_unix_start(self, path, fd);
+	pthread_mutex_unlock(&self->lock);
+	return 0;
+}
+
+static int _unix_adopt(orange_server_t server, const char *path, int fd){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+	int type = 0;
+	socklen_t len = sizeof(type);
+
+	if(!(path = _unix_socket_path(path))){
+		close(fd);
+		return -EINVAL;
+	}
+	if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_SEQPACKET){
+		ERROR("unix: inherited socket for %s is not a seqpacket socket\n", path);
+		close(fd);
+		return -ENOTSOCK;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_lock(&self->lock);
+	if(self->listen_fd >= 0){
+		pthread_mutex_unlock(&self->lock);
+		close(fd);
+		return -EEXIST;
+	}
+	DEBUG("unix: accepting on inherited socket %s\n", path);
+	_unix_start(self, path, fd);
+	pthread_mutex_unlock(&self->lock);
+	_server_wakeup(self);
+	return 0;
+}
+
+static int _unix_detach(orange_server_t server){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+	pthread_mutex_lock(&self->lock);
+	int fd = self->listen_fd;
+	// socket file now belongs to whoever gets the socket so we must not unlink it when we exit
+	self->listen_fd = -1;
+	pthread_mutex_unlock(&self->lock);
+	if(fd < 0) return -ENOTCONN;
+	// make sure service thread no longer polls the socket
+	_server_wakeup(self);
+	return fd;
+}
+
+static int _unix_connect(orange_server_t server, const char *path){
+	return -ENOTSUP;
+}
+
+static int _unix_send(orange_server_t server, struct orange_message **msg){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+	const struct blob_field *field = blob_field_first_child(blob_head(&(*msg)->buf));
+	bool wakeup = false;
+	int ret = 0;
+
+	if((*msg)->peer == 0){
+		// events of a batch are sent as separate messages
+		const struct blob_field *child;
+		int num_events = 1;
+		if((*msg)->event_batch){
+			num_events = 0;
+			blob_field_for_each_child(field, child) num_events++;
+		}
+		if(num_events == 0){
+			orange_message_delete(msg);
+			return 0;
+		}
+		// encode each event once for each wire format and then copy the frames to clients
+		struct orange_unix_frame *(*encoded)[2] = calloc(num_events, sizeof(*encoded));
+		const struct blob_field **events = calloc(num_events, sizeof(*events));
+		if(!encoded || !events){
+			free(encoded);
+			free(events);
+			orange_message_delete(msg);
+			return -ENOMEM;
+		}
+		if((*msg)->event_batch){
+			int c = 0;
+			blob_field_for_each_child(field, child) events[c++] = child;
+		} else {
+			events[0] = field;
+		}
+		struct orange_unix_client *client;
+		pthread_mutex_lock(&self->lock);
+		avl_for_each_element(&self->clients, client, id.avl){
+			for(int c = 0; c < num_events; c++){
+				struct orange_unix_frame **tmpl = &encoded[c][client->binary];
+				if(!*tmpl) *tmpl = orange_unix_frame_new(events[c], client->binary);
+				if(!*tmpl) continue;
+				wakeup |= _client_send_frame(self, client, orange_unix_frame_copy(*tmpl), true);
+			}
+		}
+		pthread_mutex_unlock(&self->lock);
+		for(int c = 0; c < num_events; c++){
+			if(encoded[c][0]) orange_unix_frame_delete(&encoded[c][0]);
+			if(encoded[c][1]) orange_unix_frame_delete(&encoded[c][1]);
+		}
+		free(encoded);
+		free(events);
+	} else {
+		pthread_mutex_lock(&self->lock);
+		struct orange_id *id = orange_id_find(&self->clients, (*msg)->peer);
+		bool binary = id && container_of(id, struct orange_unix_client, id)->binary;
+		pthread_mutex_unlock(&self->lock);
+		if(!id){
+			orange_message_delete(msg);
+			return -1;
+		}
+
+		// encode without holding the lock so that workers do not serialize on it
+		struct orange_unix_frame *frame = orange_unix_frame_new(field, binary);
+		if(!frame){
+			orange_message_delete(msg);
+			return -EINVAL;
+		}
+
+		pthread_mutex_lock(&self->lock);
+		// client may have disconnected while we were encoding
+		id = orange_id_find(&self->clients, (*msg)->peer);
+		if(id){
+			wakeup = _client_send_frame(self, container_of(id, struct orange_unix_client, id), frame, false);
+		} else {
+			orange_unix_frame_delete(&frame);
+			ret = -1;
+		}
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	orange_message_delete(msg);
+	if(wakeup) _server_wakeup(self);
+	return ret;
+}
+
+static int _unix_recv(orange_server_t server, struct orange_message **msg, unsigned long long timeout_us){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+	struct timespec t;
+
+	*msg = NULL;
+	timespec_from_now_us(&t, timeout_us);
+
+	pthread_mutex_lock(&self->lock);
+	while(list_empty(&self->rx_queue)){
+		if(self->shutdown){
+			pthread_mutex_unlock(&self->lock);
+			return -1;
+		}
+		if(pthread_cond_timedwait(&self->rx_ready, &self->lock, &t) == ETIMEDOUT){
+			pthread_mutex_unlock(&self->lock);
+			return -EAGAIN;
+		}
+	}
+	struct orange_message *m = list_first_entry(&self->rx_queue, struct orange_message, list);
+	list_del_init(&m->list);
+	*msg = m;
+	bool resume = false;
+	struct orange_id *id = (m->type != UBUS_MSG_PEER_DISCONNECTED)?orange_id_find(&self->clients, m->peer):NULL;
+	if(id){
+		struct orange_unix_client *client = container_of(id, struct orange_unix_client, id);
+		// service thread has to add the client back to the poll set once it is below the limit again
+		resume = client->rx_queued-- == ORANGE_UNIX_RX_LIMIT;
+	}
+	pthread_mutex_unlock(&self->lock);
+	if(resume) _server_wakeup(self);
+	return 1;
+}
+
+static void *_unix_userdata(orange_server_t server, void *ptr){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+	pthread_mutex_lock(&self->lock);
+	if(ptr) self->user_data = ptr;
+	void *ret = self->user_data;
+	pthread_mutex_unlock(&self->lock);
+	return ret;
+}
+
+static int _unix_stats(orange_server_t server, struct blob *out){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+	pthread_mutex_lock(&self->lock);
+	blob_offset_t t = blob_open_table(out);
+	blob_put_string(out, "clients");
+	blob_put_int(out, self->clients.count);
+	blob_put_string(out, "rx_messages");
+	blob_put_int(out, self->stats.rx_messages);
+	blob_put_string(out, "rx_errors");
+	blob_put_int(out, self->stats.rx_errors);
+	blob_put_string(out, "tx_messages");
+	blob_put_int(out, self->stats.tx_messages);
+	blob_put_string(out, "tx_queued");
+	blob_put_int(out, self->stats.tx_queued);
+	blob_put_string(out, "tx_frames_dropped");
+	blob_put_int(out, self->stats.tx_dropped);
+	blob_put_string(out, "rx_paused");
+	blob_put_int(out, self->stats.rx_paused);
+	blob_close_table(out, t);
+	pthread_mutex_unlock(&self->lock);
+	return 0;
+}
+
+static void _unix_destroy(orange_server_t server){
+	struct orange_unix_server *self = container_of(server, struct orange_unix_server, api);
+
+	pthread_mutex_lock(&self->lock);
+	self->shutdown = true;
+	pthread_cond_broadcast(&self->rx_ready);
+	pthread_mutex_unlock(&self->lock);
+	_server_wakeup(self);
+
+	if(self->thread_running){
+		DEBUG("unix: joining server thread..\n");
+		pthread_join(self->thread, NULL);
+	}
+
+	struct orange_unix_client *client, *tmp;
+	avl_for_each_element_safe(&self->clients, client, id.avl, tmp){
+		_client_close(self, client);
+	}
+
+	struct orange_message *msg, *nmsg;
+	list_for_each_entry_safe(msg, nmsg, &self->rx_queue, list){
+		orange_message_delete(&msg);
+	}
+
+	if(self->listen_fd >= 0){
+		close(self->listen_fd);
+		unlink(self->path);
+	}
+	close(self->wake_fd[0]);
+	close(self->wake_fd[1]);
+
+	pthread_mutex_destroy(&self->lock);
+	pthread_cond_destroy(&self->rx_ready);
+	JSON_check_free(&self->jc);
+	free(self->rx_buffer);
+	free(self);
+}
+
+orange_server_t orange_unix_server_new(void){
+	struct orange_unix_server *self = calloc(1, sizeof(struct orange_unix_server));
+	assert(self);
+	if(pipe2(self->wake_fd, O_NONBLOCK | O_CLOEXEC) < 0){
+		free(self);
+		return NULL;
+	}
+	self->listen_fd = -1;
+	self->rx_buffer = malloc(ORANGE_UNIX_MAX_MESSAGE + 1);
+	assert(self->rx_buffer);
+	orange_id_tree_init(&self->clients);
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->rx_ready, NULL);
+	INIT_LIST_HEAD(&self->rx_queue);
+	static const struct orange_server_api api = {
+		.destroy = _unix_destroy,
+		.listen = _unix_listen,
+		.connect = _unix_connect,
+		.send = _unix_send,
+		.recv = _unix_recv,
+		.userdata = _unix_userdata,
+		.stats = _unix_stats,
+		.detach = _unix_detach,
+		.adopt = _unix_adopt
+	};
+	self->api = &api;
+	self->jc = JSON_check_new(10);
+	return &self->api;
+}
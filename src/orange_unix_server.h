@@ -0,0 +1,45 @@
+/*
+	JUCI Backend Websocket API Server
+
+	Copyright (C) 2016 Martin K. Schröder <mkschreder.uk@gmail.com>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version. (Please read LICENSE file on special
+	permission to include this software in signed images).
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+/*
+	Unix domain socket server for local clients.
+
+	Uses SOCK_SEQPACKET sockets so every datagram carries exactly one rpc
+	message. Messages are either JSON text or msgpack. The encoding is
+	detected per message (JSON always starts with '{' or '[') and responses
+	are sent back in the encoding of the last request received from the peer.
+	Listen path is given as unix:///path/to/socket.
+
+	A client that has ORANGE_UNIX_RX_LIMIT requests waiting for a worker is
+	not read from until the workers have picked some of them up, so a fast
+	local client can not grow the request queue without bounds.
+
+	There is no subscribe operation: every client of this backend gets every
+	broadcast event and "subscribe" fails with -ENOTSUP.
+*/
+
+#pragma once
+
+#include "orange_server.h"
+
+#define ORANGE_UNIX_SCHEME "unix://"
+
+// largest message that can be received over the unix socket
+#define ORANGE_UNIX_MAX_MESSAGE (64 * 1024)
+// requests of one client that can wait for a worker before we stop reading from it
+#define ORANGE_UNIX_RX_LIMIT 64
+
+orange_server_t orange_unix_server_new(void);
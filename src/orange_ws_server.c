@@ -26,24 +26,74 @@
 #include <pthread.h>
 #include <assert.h>
 #include <limits.h>
+#include <strings.h>
 #include <sys/prctl.h>
 
-#include <libusys/usock.h>
 #include <sys/socket.h>
+#include <netdb.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 
 #include "orange.h"
 #include "orange_id.h"
+#include "orange_msgpack.h"
+#include "orange_ring.h"
+#include "orange_topic.h"
 #include "internal.h"
 #include "json_check.h"
 #include "util.h"
 
 #include <blobpack/blobpack.h>
 
+// default send queue limits per client
+#define ORANGE_WS_TX_LOW_WATERMARK (64 * 1024)
+#define ORANGE_WS_TX_HIGH_WATERMARK (256 * 1024)
+#define ORANGE_WS_TX_HARD_LIMIT (1024 * 1024)
+// number of dropped broadcasts after which a client is considered too slow and is disconnected
+#define ORANGE_WS_TX_MAX_OVERFLOWS 32
+// maximum number of bytes written to one client per writeable callback
+#define ORANGE_WS_TX_WRITE_BUDGET (64 * 1024)
+// limits for outgoing fragment size (actual size is derived from socket send buffer)
+#define ORANGE_WS_FRAGMENT_MIN 1500
+#define ORANGE_WS_FRAGMENT_MAX (64 * 1024)
+// maximum number of requests waiting for a worker. Requests beyond this are dropped. 
+#define ORANGE_WS_RX_QUEUE_SIZE (16 * 1024)
+// url on which plain http rpc requests are accepted
+#define ORANGE_WS_HTTP_RPC_URL "/rpc"
+// file served for directory urls
+#define ORANGE_WS_HTTP_INDEX "index.html"
+// cache lifetime of static files that have a content hash in their name (app.3f9a2b1c.js)
+#define ORANGE_WS_HTTP_IMMUTABLE_MAX_AGE (365 * 24 * 3600)
+// topic patterns one client can subscribe to
+#define ORANGE_WS_MAX_SUBSCRIPTIONS 64
+// connections accepted but not yet handed to libwebsockets
+#define ORANGE_WS_ACCEPT_QUEUE 64
+// how long accept thread waits for connections before checking for shutdown
+#define ORANGE_WS_ACCEPT_POLL_MS 100
+
+struct orange_srv_ws_stats {
+	unsigned long long rx_dropped; // requests dropped because rx queue was full
+	unsigned long long rx_deferred; // disconnect notifications that had to wait for room in rx queue
+	unsigned long long frames_dropped; 
+	unsigned long long bytes_dropped; 
+	unsigned long long rx_paused; 
+	unsigned long long rx_resumed; 
+	unsigned long long clients_evicted; 
+	size_t tx_queued_bytes; 
+	unsigned long long tx_writes; // number of lws_write calls
+	unsigned long long tx_frames; // number of complete messages sent
+	unsigned long long tx_bytes; 
+	unsigned long long tx_wakeups; // number of times service thread was woken up to write data
+	unsigned long long http_files; // number of static files sent
+	unsigned long long http_not_modified; // number of static file requests answered with 304
+	unsigned long long http_file_bytes; 
+	unsigned long long events_filtered; // broadcast deliveries skipped because client was not subscribed to the event
+}; 
+
 struct lws_context; 
 struct orange_srv_ws {
 	struct lws_context *ctx; 
@@ -55,16 +105,40 @@ struct orange_srv_ws {
 	pthread_t thread; 
 	pthread_mutex_t lock; 
 	pthread_mutex_t qlock; 
-	pthread_cond_t rx_ready; 
-	struct list_head rx_queue; 
+	struct orange_ring *rx_queue; // incoming requests for the workers
+	// disconnect notifications that did not fit into rx_queue. They must never be dropped because rpc would 
+	// keep state of the client forever. Moved into rx_queue by workers as they make room (protected by qlock). 
+	struct list_head rx_deferred; 
+	int num_deferred; // read without lock by workers to skip the lock when nothing is deferred
+	struct orange_topic_tree *topics; // event subscriptions of clients (protected by qlock)
+	bool broadcast_all; // clients that never subscribed get all events (protected by qlock)
 	const char *www_root; 
 	void *user_data; 
 	JSON_check jc; 
+
+	// send queue limits (protected by qlock)
+	size_t tx_low_watermark; 
+	size_t tx_high_watermark; 
+	size_t tx_hard_limit; 
+	size_t tx_write_budget; 
+	uint8_t *tx_scratch; // used for batching small messages into one write
+	struct list_head tx_pending; // clients that have data to write and are waiting for service thread
+	bool tx_wakeup; // service thread has been woken up but has not yet picked up tx_pending
+	struct orange_srv_ws_stats stats; 
+
+	// we own the listening socket so that it can be passed on to a new instance. Accept thread accepts 
+	// connections and service thread hands them over to libwebsockets (protected by qlock). 
+	int listen_fd; 
+	pthread_t accept_thread; 
+	bool accept_running; 
+	int accepted[ORANGE_WS_ACCEPT_QUEUE]; 
+	int num_accepted; 
 }; 
 
 struct orange_srv_ws_client {
 	struct orange_id id; 
 	struct list_head tx_queue; 
+	struct list_head pending; // entry in server tx_pending list (empty when not pending)
 	struct orange_message *msg; // incoming message
 	struct lws *wsi; 
 
@@ -72,6 +146,25 @@ struct orange_srv_ws_client {
 	int buffer_start; 
 
 	bool disconnect;
+	bool binary; // client talks msgpack instead of json 
+
+	size_t tx_bytes; // number of bytes currently queued in tx_queue
+	bool rx_paused; 
+	unsigned int overflows; // number of broadcasts dropped because client was not reading
+	unsigned int subscriptions; // number of topic patterns
+	bool subscribed; // client has subscribed at least once and only gets events matching its patterns from then on
+	size_t frag_size; // outgoing fragment size
+
+	// plain http rpc client (POST /rpc)
+	bool http; 
+	bool http_complete; // response has been written and transaction can be completed
+	size_t http_content_length; 
+	char http_sid[sizeof(((struct orange_sid*)0)->hash)]; 
+
+	// static file currently being sent with sendfile (-1 if none)
+	int file_fd; 
+	off_t file_offset; 
+	off_t file_size; 
 }; 
 
 struct orange_srv_ws_frame {
@@ -79,6 +172,7 @@ struct orange_srv_ws_frame {
 	uint8_t *buf; 
 	int len; 
 	int sent_count; 
+	bool binary; 
 }; 
 
 static bool url_scanf(const char *url, char *proto, char *host, int *port, char *page){
@@ -89,11 +183,20 @@ static bool url_scanf(const char *url, char *proto, char *host, int *port, char
     return false;                       
 }
 
-static struct orange_srv_ws_frame *orange_srv_ws_frame_new(const struct blob_field *msg){
+static struct orange_srv_ws_frame *orange_srv_ws_frame_new(const struct blob_field *msg, bool binary){
 	assert(msg); 
 	struct orange_srv_ws_frame *self = calloc(1, sizeof(struct orange_srv_ws_frame)); 
 	assert(self); 
 	INIT_LIST_HEAD(&self->list); 
+	self->binary = binary; 
+	if(binary){
+		size_t len = 0; 
+		// msgpack buffer is packed directly after the padding so no copy is needed
+		self->buf = orange_msgpack_pack(msg, LWS_SEND_BUFFER_PRE_PADDING, LWS_SEND_BUFFER_POST_PADDING, &len); 
+		assert(self->buf); 
+		self->len = len; 
+		return self; 
+	}
 	char *json = blob_field_to_json(msg); 
 	self->len = strlen(json); 
 	self->buf = calloc(1, LWS_SEND_BUFFER_PRE_PADDING + self->len + LWS_SEND_BUFFER_POST_PADDING); 
@@ -103,6 +206,18 @@ static struct orange_srv_ws_frame *orange_srv_ws_frame_new(const struct blob_fie
 	return self; 
 }
 
+static struct orange_srv_ws_frame *orange_srv_ws_frame_copy(const struct orange_srv_ws_frame *other){
+	struct orange_srv_ws_frame *self = calloc(1, sizeof(struct orange_srv_ws_frame)); 
+	assert(self); 
+	INIT_LIST_HEAD(&self->list); 
+	self->binary = other->binary; 
+	self->len = other->len; 
+	self->buf = malloc(LWS_SEND_BUFFER_PRE_PADDING + self->len + LWS_SEND_BUFFER_POST_PADDING); 
+	assert(self->buf); 
+	memcpy(self->buf + LWS_SEND_BUFFER_PRE_PADDING, other->buf + LWS_SEND_BUFFER_PRE_PADDING, self->len); 
+	return self; 
+}
+
 static void orange_srv_ws_frame_delete(struct orange_srv_ws_frame **self){
 	assert(self && *self); 
 	free((*self)->buf); 
@@ -115,7 +230,9 @@ static struct orange_srv_ws_client *orange_srv_ws_client_new(void){
 	struct orange_srv_ws_client *self = calloc(1, sizeof(struct orange_srv_ws_client)); 
 	assert(self); 
 	INIT_LIST_HEAD(&self->tx_queue); 
+	INIT_LIST_HEAD(&self->pending); 
 	self->msg = orange_message_new(); 
+	self->file_fd = -1; 
 	return self; 
 }
 
@@ -126,18 +243,530 @@ static void orange_srv_ws_client_delete(struct orange_srv_ws_client **self){
 		orange_srv_ws_frame_delete(&pos);  
 	}	
 	orange_message_delete(&(*self)->msg); 
+	if((*self)->file_fd >= 0) close((*self)->file_fd); 
 	free(*self); 
 	*self = NULL;
 }
 
+// NOTE: must be called with qlock held. Takes ownership of the frame. 
+static void _client_queue_frame(struct orange_srv_ws *self, struct orange_srv_ws_client *client, struct orange_srv_ws_frame *frame, bool broadcast){
+	if(client->tx_bytes + frame->len > self->tx_hard_limit){
+		// responses are always queued because client is waiting for them and the amount is bounded by paused reads. Events are dropped. 
+		if(broadcast){
+			self->stats.frames_dropped++; 
+			self->stats.bytes_dropped += frame->len; 
+			orange_srv_ws_frame_delete(&frame); 
+		}
+		if(++client->overflows >= ORANGE_WS_TX_MAX_OVERFLOWS && !client->disconnect){
+			ERROR("websocket: client %08x is not reading its data. Disconnecting!\n", client->id.id); 
+			client->disconnect = true; 
+			self->stats.clients_evicted++; 
+		}
+	} 
+	if(frame){
+		client->tx_bytes += frame->len; 
+		self->stats.tx_queued_bytes += frame->len; 
+		list_add_tail(&frame->list, &client->tx_queue); 	
+	}
+	// let service thread know that this client needs attention
+	if(list_empty(&client->pending)){
+		list_add_tail(&client->pending, &self->tx_pending); 
+	}
+}
+
+// returns true if caller needs to wake up the service thread. Only the first producer after service thread has picked up the pending list does the wakeup. 
+// NOTE: must be called with qlock held
+static bool _server_need_wakeup(struct orange_srv_ws *self){
+	if(self->tx_wakeup || list_empty(&self->tx_pending)) return false; 
+	self->tx_wakeup = true; 
+	self->stats.tx_wakeups++; 
+	return true; 
+}
+
+// NOTE: must be called with qlock held and only from the service thread
+static void _client_update_flow_control(struct orange_srv_ws *self, struct orange_srv_ws_client *client){
+	if(!client->rx_paused && client->tx_bytes > self->tx_high_watermark){
+		// stop reading new requests until client catches up with our responses
+		lws_rx_flow_control(client->wsi, 0); 
+		client->rx_paused = true; 
+		self->stats.rx_paused++; 
+	} else if(client->rx_paused && client->tx_bytes <= self->tx_low_watermark){
+		lws_rx_flow_control(client->wsi, 1); 
+		client->rx_paused = false; 
+		client->overflows = 0; 
+		self->stats.rx_resumed++; 
+	}
+}
+
+// largest possible header of an unmasked websocket frame
+#define WS_FRAME_HEADER_MAX 10
+
+static size_t _ws_frame_header(uint8_t *hdr, bool binary, size_t len){
+	hdr[0] = 0x80 | ((binary)?0x2:0x1); // FIN + opcode
+	if(len < 126){
+		hdr[1] = len; 
+		return 2; 
+	} else if(len <= 0xffff){
+		hdr[1] = 126; 
+		hdr[2] = len >> 8; 
+		hdr[3] = len; 
+		return 4; 
+	}
+	hdr[1] = 127; 
+	for(int c = 0; c < 8; c++) hdr[9 - c] = (uint64_t)len >> (c * 8); 
+	return 10; 
+}
+
+// picks fragment size based on the socket send buffer so that one fragment can usually be handed to the kernel in one go
+static size_t _socket_fragment_size(struct lws *wsi){
+	int sndbuf = 0; 
+	socklen_t optlen = sizeof(sndbuf); 
+	int fd = lws_get_socket_fd(wsi); 
+	if(fd < 0 || getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) < 0 || sndbuf <= 0) return ORANGE_WS_FRAGMENT_MIN; 
+	// linux reports double the value to account for bookkeeping overhead
+	size_t size = sndbuf / 2; 
+	if(size < ORANGE_WS_FRAGMENT_MIN) size = ORANGE_WS_FRAGMENT_MIN; 
+	if(size > ORANGE_WS_FRAGMENT_MAX) size = ORANGE_WS_FRAGMENT_MAX; 
+	return size; 
+}
+
+static void _client_frame_done(struct orange_srv_ws *self, struct orange_srv_ws_client *client, struct orange_srv_ws_frame *frame){
+	client->tx_bytes -= frame->len; 
+	self->stats.tx_queued_bytes -= frame->len; 
+	self->stats.tx_frames++; 
+	list_del_init(&frame->list); 
+	orange_srv_ws_frame_delete(&frame); 
+}
+
+// Packs consecutive small messages back to back into the scratch buffer and sends them with a single write. 
+// lws 2.0 has no vectored write so we build the websocket framing ourselves and send it as raw data. This is only valid because we do not use any extensions. 
+// NOTE: must be called with qlock held. Returns number of bytes written or 0 if there was nothing worth batching. 
+static int _client_write_batch(struct orange_srv_ws *self, struct orange_srv_ws_client *client, size_t budget){
+	struct orange_srv_ws_frame *frame; 
+	size_t total = 0; 
+	int count = 0; 
+	if(budget > self->tx_write_budget) budget = self->tx_write_budget; 
+	list_for_each_entry(frame, &client->tx_queue, list){
+		size_t size = WS_FRAME_HEADER_MAX + frame->len; 
+		if(frame->sent_count != 0 || (size_t)frame->len > client->frag_size || total + size > budget) break; 
+		total += size; 
+		count++; 
+	}
+	if(count < 2) return 0; 
+
+	uint8_t *start = self->tx_scratch + LWS_SEND_BUFFER_PRE_PADDING; 
+	uint8_t *ptr = start; 
+	while(count--){
+		frame = list_first_entry(&client->tx_queue, struct orange_srv_ws_frame, list); 
+		ptr += _ws_frame_header(ptr, frame->binary, frame->len); 
+		memcpy(ptr, frame->buf + LWS_SEND_BUFFER_PRE_PADDING, frame->len); 
+		ptr += frame->len; 
+		_client_frame_done(self, client, frame); 
+	}
+	int n = lws_write(client->wsi, start, ptr - start, LWS_WRITE_HTTP); 
+	self->stats.tx_writes++; 
+	if(n < 0) return n; 
+	self->stats.tx_bytes += n; 
+	TRACE("sent %d bytes in one batch\n", n); 
+	return (n > 0)?n:1; 
+}
+
+// Sends the first message in the queue fragmented by client fragment size. 
+// NOTE: must be called with qlock held. Returns number of bytes written. 
+static int _client_write_frame(struct orange_srv_ws *self, struct orange_srv_ws_client *client, size_t budget){
+	struct orange_srv_ws_frame *frame = list_first_entry(&client->tx_queue, struct orange_srv_ws_frame, list);
+	size_t written = 0; 
+	do {
+		size_t towrite = frame->len - frame->sent_count; 
+		int flags; 
+		if(frame->sent_count == 0){
+			flags = (frame->binary)?LWS_WRITE_BINARY:LWS_WRITE_TEXT; 
+		} else {
+			flags = LWS_WRITE_CONTINUATION; 
+		}
+
+		if(towrite > client->frag_size){
+			towrite = client->frag_size; 
+			flags |= LWS_WRITE_NO_FIN; 
+		} 
+
+		int n = lws_write(client->wsi, &frame->buf[LWS_SEND_BUFFER_PRE_PADDING]+frame->sent_count, towrite, flags);
+		self->stats.tx_writes++; 
+		if(n < 0) return n; 
+		self->stats.tx_bytes += n; 
+		frame->sent_count += n; 
+		written += n; 
+
+		DEBUG("sent %d out of %d bytes\n", frame->sent_count, frame->len); 
+	} while(frame->sent_count < frame->len && written < budget && !lws_partial_buffered(client->wsi));  
+
+	if(frame->sent_count >= frame->len){
+		_client_frame_done(self, client, frame); 
+	} 
+	return (written > 0)?written:1; 
+}
+
+// hands a complete request over to the workers. Returns 0 on success or -EAGAIN if the request was dropped. 
+// NOTE: must be called with qlock held. Takes ownership of the message. 
+static int _server_queue_request(struct orange_srv_ws *self, struct orange_message *msg){
+	timespec_now(&msg->ts_queued); 
+	if(orange_ring_push(self->rx_queue, msg) != 0){
+		ERROR("websocket: request queue is full, dropping request from %08x\n", msg->peer); 
+		self->stats.rx_dropped++; 
+		orange_message_delete(&msg); 
+		return -EAGAIN; 
+	}
+	return 0; 
+}
+
+// moves deferred notifications into the request queue for as long as there is room
+// NOTE: must be called with qlock held
+static void _server_flush_deferred(struct orange_srv_ws *self){
+	while(!list_empty(&self->rx_deferred)){
+		struct orange_message *msg = list_first_entry(&self->rx_deferred, struct orange_message, list); 
+		if(orange_ring_push(self->rx_queue, msg) != 0) break; 
+		list_del_init(&msg->list); 
+		__atomic_sub_fetch(&self->num_deferred, 1, __ATOMIC_RELEASE); 
+	}
+}
+
+// hands a notification to the workers. Unlike requests these are never dropped. 
+// NOTE: must be called with qlock held. Takes ownership of the message. 
+static void _server_queue_control(struct orange_srv_ws *self, struct orange_message *msg){
+	timespec_now(&msg->ts_queued); 
+	// keep order with notifications that are already waiting
+	if(list_empty(&self->rx_deferred) && orange_ring_push(self->rx_queue, msg) == 0) return; 
+	list_add_tail(&msg->list, &self->rx_deferred); 
+	__atomic_add_fetch(&self->num_deferred, 1, __ATOMIC_RELEASE); 
+	self->stats.rx_deferred++; 
+}
+
+// NOTE: must be called with qlock held
+static void _client_close(struct orange_srv_ws *self, struct orange_srv_ws_client **client){
+	// let the workers know so that queued requests of this client can be dropped
+	struct orange_message *msg = orange_message_new(); 
+	msg->type = UBUS_MSG_PEER_DISCONNECTED; 
+	msg->peer = (*client)->id.id; 
+	_server_queue_control(self, msg); 
+
+	if((*client)->subscriptions) orange_topic_unsubscribe_all(self->topics, (*client)->id.id); 
+	self->stats.tx_queued_bytes -= (*client)->tx_bytes; 
+	list_del_init(&(*client)->pending); 
+	orange_id_free(&self->clients, &(*client)->id); 
+	orange_peer_id_free((*client)->id.id); 
+	orange_srv_ws_client_delete(client); 	
+}
+
+// returns client record of an http connection. Keep-alive connections reuse the client for all requests. 
+// NOTE: must be called with qlock held
+static struct orange_srv_ws_client *_http_client_get(struct orange_srv_ws *self, struct lws *wsi, struct orange_srv_ws_client **user){
+	if(!*user){
+		struct orange_srv_ws_client *client = orange_srv_ws_client_new(); 
+		orange_id_alloc(&self->clients, &client->id, orange_peer_id_alloc(&self->api)); 
+		client->wsi = wsi; 
+		client->http = true; 
+		client->frag_size = _socket_fragment_size(wsi); 
+		*user = client; 
+	}
+	return *user; 
+}
+
+// returns true if file name contains a content hash (at least 8 hex digits between two dots)
+static bool _http_is_hashed_name(const char *path){
+	const char *name = strrchr(path, '/'); 
+	name = (name)?name + 1:path; 
+	for(const char *dot = strchr(name, '.'); dot; dot = strchr(dot + 1, '.')){
+		size_t len = strspn(dot + 1, "0123456789abcdefABCDEF"); 
+		if(len >= 8 && dot[1 + len] == '.') return true; 
+	}
+	return false; 
+}
+
+// returns true if accept-encoding header value allows gzip. An explicit gzip entry takes precedence over "*" and q=0 means not acceptable. 
+static bool _http_accepts_gzip(const char *accept){
+	int gzip = -1, any = -1; 
+	while(*accept){
+		size_t len = strcspn(accept, ","); 
+		const char *name = accept + strspn(accept, " \t"); 
+		size_t nlen = strcspn(name, ";, \t"); 
+		const char *q = memchr(name, ';', (accept + len) - name); 
+		bool accepted = true; 
+		// parse the quality value if there is one
+		for(; q && q < accept + len; q = memchr(q + 1, ';', (accept + len) - (q + 1))){
+			const char *param = q + 1 + strspn(q + 1, " \t"); 
+			if((param[0] == 'q' || param[0] == 'Q') && param[1] == '='){
+				accepted = strtod(param + 2, NULL) > 0; 
+				break; 
+			}
+		}
+		if((nlen == 4 && strncasecmp(name, "gzip", 4) == 0) || (nlen == 6 && strncasecmp(name, "x-gzip", 6) == 0)) gzip = accepted; 
+		else if(nlen == 1 && name[0] == '*') any = accepted; 
+		accept += len; 
+		if(*accept == ',') accept++; 
+	}
+	return (gzip >= 0)?gzip:(any > 0); 
+}
+
+// returns true if etag is in the comma separated if-none-match list. Weak tags are compared by value as if-none-match requires. 
+static bool _http_etag_match(const char *list, const char *etag){
+	size_t etag_len = strlen(etag); 
+	while(*list){
+		list += strspn(list, " \t"); 
+		size_t len = strcspn(list, ","); 
+		const char *tag = list; 
+		size_t tag_len = len; 
+		// trim trailing white space
+		while(tag_len && (tag[tag_len - 1] == ' ' || tag[tag_len - 1] == '\t')) tag_len--; 
+		if(tag_len == 1 && tag[0] == '*') return true; 
+		if(tag_len > 2 && tag[0] == 'W' && tag[1] == '/'){
+			tag += 2; 
+			tag_len -= 2; 
+		}
+		if(tag_len == etag_len && memcmp(tag, etag, etag_len) == 0) return true; 
+		list += len; 
+		if(*list == ',') list++; 
+	}
+	return false; 
+}
+
+// opens file for a static request and fills in the headers. Returns open file descriptor or -1 if the file can not be served. 
+static int _http_file_open(struct lws *wsi, const char *path, struct stat *st, bool *gzip){
+	char buf[PATH_MAX]; 
+	char accept[256] = {0}; 
+
+	*gzip = false; 
+	// use precompressed version of the file if there is one and client accepts it
+	if(lws_hdr_copy(wsi, accept, sizeof(accept), WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0 && _http_accepts_gzip(accept) && 
+		snprintf(buf, sizeof(buf), "%s.gz", path) < (int)sizeof(buf) && stat(buf, st) == 0 && S_ISREG(st->st_mode)){
+		int fd = open(buf, O_RDONLY); 
+		if(fd >= 0){
+			*gzip = true; 
+			return fd; 
+		}
+	}
+	if(stat(path, st) != 0 || !S_ISREG(st->st_mode)) return -1; 
+	return open(path, O_RDONLY); 
+}
+
+// starts sending a static file from www_root. Returns 0 if file is being sent or nonzero if request has been answered with an error. 
+static int _http_file_begin(struct orange_srv_ws *self, struct lws *wsi, struct orange_srv_ws_client **user, const char *uri){
+	unsigned char headers[LWS_SEND_BUFFER_PRE_PADDING + 1024]; 
+	unsigned char *start = headers + LWS_SEND_BUFFER_PRE_PADDING, *p = start, *end = headers + sizeof(headers); 
+	char path[PATH_MAX], etag[64], match[256] = {0}, cache[64]; 
+	struct stat st; 
+	bool gzip = false; 
+
+	if(lws_hdr_total_length(wsi, WSI_TOKEN_GET_URI) <= 0){
+		lws_return_http_status(wsi, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL); 
+		return -1; 
+	}
+	// static files are only served when a www root has been configured
+	if(!self->www_root){
+		lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL); 
+		return -1; 
+	}
+	// never allow requests to escape from www_root or to reach hidden files (.git, .htpasswd etc)
+	if(uri[0] != '/' || strstr(uri, "/.")){
+		lws_return_http_status(wsi, HTTP_STATUS_FORBIDDEN, NULL); 
+		return -1; 
+	}
+	int len = snprintf(path, sizeof(path), "%s%s%s", self->www_root, uri, (uri[strlen(uri) - 1] == '/')?ORANGE_WS_HTTP_INDEX:""); 
+	if(len >= (int)sizeof(path)){
+		lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL); 
+		return -1; 
+	}
+
+	int fd = _http_file_open(wsi, path, &st, &gzip); 
+	if(fd < 0){
+		lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL); 
+		return -1; 
+	}
+
+	// strong etag changes whenever the file is replaced or modified
+	snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", (unsigned long long)st.st_ino, (unsigned long long)st.st_size, (unsigned long long)st.st_mtime); 
+	if(_http_is_hashed_name(path)){
+		snprintf(cache, sizeof(cache), "public, max-age=%d, immutable", ORANGE_WS_HTTP_IMMUTABLE_MAX_AGE); 
+	} else {
+		snprintf(cache, sizeof(cache), "no-cache"); 
+	}
+	const char *ext = strrchr(path, '.'); 
+	const char *mime = (ext)?mimetype_lookup(ext):"application/octet-stream"; 
+	bool not_modified = lws_hdr_copy(wsi, match, sizeof(match), WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0 && _http_etag_match(match, etag); 
+
+	if(lws_add_http_header_status(wsi, (not_modified)?HTTP_STATUS_NOT_MODIFIED:HTTP_STATUS_OK, &p, end) || 
+		lws_add_http_header_by_name(wsi, (const unsigned char*)"etag:", (const unsigned char*)etag, strlen(etag), &p, end) || 
+		lws_add_http_header_by_name(wsi, (const unsigned char*)"cache-control:", (const unsigned char*)cache, strlen(cache), &p, end) || 
+		lws_add_http_header_by_name(wsi, (const unsigned char*)"vary:", (const unsigned char*)"Accept-Encoding", 15, &p, end) || 
+		(!not_modified && (
+			lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char*)mime, strlen(mime), &p, end) || 
+			(gzip && lws_add_http_header_by_name(wsi, (const unsigned char*)"content-encoding:", (const unsigned char*)"gzip", 4, &p, end)))) || 
+		lws_add_http_header_content_length(wsi, (not_modified)?0:st.st_size, &p, end) || 
+		lws_finalize_http_header(wsi, &p, end)){
+		close(fd); 
+		return -1; 
+	}
+	if(lws_write(wsi, start, p - start, LWS_WRITE_HTTP_HEADERS) < 0){
+		close(fd); 
+		return -1; 
+	}
+
+	pthread_mutex_lock(&self->qlock); 
+	if(not_modified){
+		self->stats.http_not_modified++; 
+		pthread_mutex_unlock(&self->qlock); 
+		close(fd); 
+		return 1; 
+	}
+	struct orange_srv_ws_client *client = _http_client_get(self, wsi, user); 
+	if(client->file_fd >= 0) close(client->file_fd); 
+	client->file_fd = fd; 
+	client->file_offset = 0; 
+	client->file_size = st.st_size; 
+	self->stats.http_files++; 
+	pthread_mutex_unlock(&self->qlock); 
+
+	// file data is sent directly from the page cache in HTTP_WRITEABLE
+	lws_callback_on_writable(wsi); 
+	return 0; 
+}
+
+// sends next chunk of a static file. Returns 1 when the whole file has been sent, 0 if there is more to send and negative on error. 
+static int _http_file_write(struct orange_srv_ws *self, struct lws *wsi, struct orange_srv_ws_client *client){
+	// headers must be out before we write to the socket directly
+	if(lws_partial_buffered(wsi)) return 0; 
+	if(client->file_offset < client->file_size){
+		size_t len = client->file_size - client->file_offset; 
+		if(len > self->tx_write_budget) len = self->tx_write_budget; 
+		ssize_t n = sendfile(lws_get_socket_fd(wsi), client->file_fd, &client->file_offset, len); 
+		if(n < 0 && errno != EAGAIN && errno != EINTR) return -1; 
+		// file was truncated while we were sending it
+		if(n == 0) return -1; 
+		if(n > 0){
+			pthread_mutex_lock(&self->qlock); 
+			self->stats.http_file_bytes += n; 
+			pthread_mutex_unlock(&self->qlock); 
+		}
+		if(client->file_offset < client->file_size) return 0; 
+	}
+	close(client->file_fd); 
+	client->file_fd = -1; 
+	return 1; 
+}
+
+// starts a new http rpc request. Returns 0 if body should be received or nonzero if request has been rejected. 
+static int _http_rpc_begin(struct orange_srv_ws *self, struct lws *wsi, struct orange_srv_ws_client **user){
+	char buf[64]; 
+	const char bearer[] = "Bearer "; 
+
+	if(lws_hdr_total_length(wsi, WSI_TOKEN_POST_URI) <= 0){
+		lws_return_http_status(wsi, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL); 
+		return -1; 
+	}
+	if(lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_CONTENT_LENGTH) <= 0){
+		lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL); 
+		return -1; 
+	}
+	size_t content_length = strtoul(buf, NULL, 10); 
+	if(content_length == 0 || content_length >= sizeof((*user)->buffer)){
+		lws_return_http_status(wsi, HTTP_STATUS_REQ_ENTITY_TOO_LARGE, NULL); 
+		return -1; 
+	}
+
+	pthread_mutex_lock(&self->qlock); 
+	struct orange_srv_ws_client *client = _http_client_get(self, wsi, user); 
+	client->buffer_start = 0; 
+	client->http_complete = false; 
+	client->http_content_length = content_length; 
+	client->http_sid[0] = 0; 
+	// session id is passed as "Authorization: Bearer <sid>"
+	if(lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_AUTHORIZATION) > 0 && strncmp(buf, bearer, strlen(bearer)) == 0){
+		snprintf(client->http_sid, sizeof(client->http_sid), "%s", buf + strlen(bearer)); 
+	}
+	pthread_mutex_unlock(&self->qlock); 
+	return 0; 
+}
+
+// returns true if root is a json-rpc request that will be answered (a batch array or a table with id, method and params). 
+// Anything else would be discarded by rpc without a response and leave the http client waiting. 
+static bool _http_rpc_valid(const struct blob_field *root){
+	if(!root) return false; 
+	if(blob_field_type(root) == BLOB_FIELD_ARRAY) return true; 
+	if(blob_field_type(root) != BLOB_FIELD_TABLE) return false; 
+	bool id = false, method = false, params = false; 
+	const struct blob_field *key = blob_field_first_child(root); 
+	while(key){
+		const struct blob_field *value = blob_field_next_child(root, key); 
+		if(!value) break; 
+		const char *name = blob_field_get_string(key); 
+		if(strcmp(name, "id") == 0) id = true; 
+		else if(strcmp(name, "method") == 0) method = blob_field_type(value) == BLOB_FIELD_STRING; 
+		else if(strcmp(name, "params") == 0) params = blob_field_type(value) == BLOB_FIELD_ARRAY; 
+		key = blob_field_next_child(root, value); 
+	}
+	return id && method && params; 
+}
+
+// NOTE: called when whole request body has been received. Returns 0 if request was placed on the queue. 
+static int _http_rpc_complete(struct orange_srv_ws *self, struct lws *wsi, struct orange_srv_ws_client *client){
+	client->buffer[client->buffer_start] = 0; 
+	blob_reset(&client->msg->buf); 
+	if((size_t)client->buffer_start != client->http_content_length || !JSON_check_string(self->jc, client->buffer) || !blob_put_json(&client->msg->buf, client->buffer) || 
+		!_http_rpc_valid(blob_field_first_child(blob_head(&client->msg->buf)))){
+		ERROR("got bad http rpc message: %s\n", client->buffer); 
+		client->buffer_start = 0; 
+		lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL); 
+		return -1; 
+	}
+	client->msg->peer = client->id.id; 
+	if(strlen(client->http_sid)) client->msg->sid = strdup(client->http_sid); 
+	pthread_mutex_lock(&self->qlock); 
+	int ret = _server_queue_request(self, client->msg); 
+	client->msg = orange_message_new(); 
+	client->buffer_start = 0; 
+	pthread_mutex_unlock(&self->qlock); 
+	if(ret < 0){
+		lws_return_http_status(wsi, HTTP_STATUS_SERVICE_UNAVAILABLE, NULL); 
+		return -1; 
+	}
+	return 0; 
+}
+
+// writes rpc response as http body. Returns negative value if connection should be closed. 
+// NOTE: must be called with qlock held
+static int _http_rpc_write(struct orange_srv_ws *self, struct lws *wsi, struct orange_srv_ws_client *client){
+	unsigned char headers[LWS_SEND_BUFFER_PRE_PADDING + 256]; 
+	unsigned char *start = headers + LWS_SEND_BUFFER_PRE_PADDING, *p = start, *end = headers + sizeof(headers); 
+	const char content_type[] = "application/json"; 
+
+	if(list_empty(&client->tx_queue)) return 0; 
+	struct orange_srv_ws_frame *frame = list_first_entry(&client->tx_queue, struct orange_srv_ws_frame, list);
+
+	if(lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) || 
+		lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char*)content_type, strlen(content_type), &p, end) || 
+		lws_add_http_header_content_length(wsi, frame->len, &p, end) || 
+		lws_finalize_http_header(wsi, &p, end)) return -1; 
+
+	if(lws_write(wsi, start, p - start, LWS_WRITE_HTTP_HEADERS) < 0) return -1; 
+	// remaining data is buffered by lws if the socket is full
+	int n = lws_write(wsi, frame->buf + LWS_SEND_BUFFER_PRE_PADDING, frame->len, LWS_WRITE_HTTP); 
+	self->stats.tx_writes += 2; 
+	if(n < 0) return -1; 
+	self->stats.tx_bytes += n; 
+	_client_frame_done(self, client, frame); 
+	client->http_complete = true; 
+	return 0; 
+}
+
 static int _orange_socket_callback(struct lws *wsi, enum lws_callback_reasons reason, void *_user, void *in, size_t len){
 	// TODO: keeping user data in protocol is probably not the right place. Fix it. 
 	const struct lws_protocols *proto = lws_get_protocol(wsi); 
 
 	struct orange_srv_ws_client **user = (struct orange_srv_ws_client **)_user; 
 	
-	if(user && *user && (*user)->disconnect){
+	if(reason != LWS_CALLBACK_CLOSED && reason != LWS_CALLBACK_CLOSED_HTTP && user && *user && (*user)->disconnect){
+		static unsigned char reason_slow[] = "client too slow"; 
 		DEBUG("ws_client requested a disconnect!\n"); 
+		lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, reason_slow, sizeof(reason_slow) - 1); 
 		return -1; 
 	}
 	
@@ -147,13 +776,15 @@ static int _orange_socket_callback(struct lws *wsi, enum lws_callback_reasons re
 			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
 			pthread_mutex_lock(&self->qlock); 
 			struct orange_srv_ws_client *client = orange_srv_ws_client_new(); 
-			orange_id_alloc(&self->clients, &client->id, 0); 
+			orange_id_alloc(&self->clients, &client->id, orange_peer_id_alloc(&self->api)); 
 			*user = client; 
 			char hostname[255], ipaddr[255]; 
 			lws_get_peer_addresses(wsi, peer_id, hostname, sizeof(hostname), ipaddr, sizeof(ipaddr)); 
 			DEBUG("connection established! %s %s %d %08x\n", hostname, ipaddr, peer_id, client->id.id); 
 			//if(self->on_message) self->on_message(&self->api, (*user)->id.id, UBUS_MSG_PEER_CONNECTED, 0, NULL); 
 			client->wsi = wsi; 
+			client->binary = proto && proto->name && strcmp(proto->name, ORANGE_WS_PROTOCOL_MSGPACK) == 0; 
+			client->frag_size = _socket_fragment_size(wsi); 
 			pthread_mutex_unlock(&self->qlock); 
 			lws_callback_on_writable(wsi); 	
 			break; 
@@ -166,64 +797,106 @@ static int _orange_socket_callback(struct lws *wsi, enum lws_callback_reasons re
 			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
 			pthread_mutex_lock(&self->qlock); 
 			//if(self->on_message) self->on_message(&self->api, (*user)->id.id, UBUS_MSG_PEER_DISCONNECTED, 0, NULL); 
-			orange_id_free(&self->clients, &(*user)->id); 
-			orange_srv_ws_client_delete(user); 	
+			_client_close(self, user); 
 			pthread_mutex_unlock(&self->qlock); 
 			*user = 0; 
 			break; 
 		}
-		case LWS_CALLBACK_SERVER_WRITEABLE: {
+		case LWS_CALLBACK_CLOSED_HTTP: {
 			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
+			// only rpc requests have a client record
+			if(!user || !*user) break; 
 			pthread_mutex_lock(&self->qlock); 
-			while(!list_empty(&(*user)->tx_queue)){
-				// TODO: handle partial writes correctly 
-				struct orange_srv_ws_frame *frame = list_first_entry(&(*user)->tx_queue, struct orange_srv_ws_frame, list);
-				do {
-					int left = frame->len - frame->sent_count; 
-					int towrite = left; 
-					int flags; 
-					if(frame->sent_count == 0){
-						flags = LWS_WRITE_TEXT; 
-					} else {
-						flags = LWS_WRITE_CONTINUATION; 
-					}
-
-					// fragment the message by standard mtu size. 
-					if(left > 1500){
-						towrite = 1500; 
-						flags |= LWS_WRITE_NO_FIN; 
-					} 
-
-					int n = lws_write(wsi, &frame->buf[LWS_SEND_BUFFER_PRE_PADDING]+frame->sent_count, towrite, flags);
-					if(n < 0) { 
-						DEBUG("error while sending data over websocket!\n"); 
-						pthread_mutex_unlock(&self->qlock); 
-						// disconnect
-						return 1; 
-					}
-					// increment sent count
-					frame->sent_count += n; 
-
-					DEBUG("sent %d out of %d bytes\n", frame->sent_count, frame->len); 
-
-				} while(frame->sent_count < frame->len && !lws_partial_buffered(wsi));  
-	
-				// FIXME: is this always going to be called at the right time? 
-				if(frame->sent_count >= frame->len){
-					list_del_init(&frame->list); 
-					orange_srv_ws_frame_delete(&frame); 
-				} 
-
-				// if there is more then we need to tell lws to call us again
-				if(lws_partial_buffered(wsi)){
+			_client_close(self, user); 
+			pthread_mutex_unlock(&self->qlock); 
+			break; 
+		}
+		case LWS_CALLBACK_HTTP: {
+			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
+			const char *uri = (const char*)in; 
+			DEBUG("http request: %s\n", uri); 
+			if(!user){
+				lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL); 
+				return (lws_http_transaction_completed(wsi))?-1:0; 
+			}
+			if(strcmp(uri, ORANGE_WS_HTTP_RPC_URL) == 0){
+				if(_http_rpc_begin(self, wsi, user) != 0) return (lws_http_transaction_completed(wsi))?-1:0; 
+				// wait for the body
+				return 0; 
+			}
+			if(_http_file_begin(self, wsi, user, uri) != 0) return (lws_http_transaction_completed(wsi))?-1:0; 
+			return 0; 
+		}
+		case LWS_CALLBACK_HTTP_BODY: {
+			if(!user || !*user) return -1; 
+			if((*user)->buffer_start + len >= sizeof((*user)->buffer)){
+				ERROR("http body too large!\n"); 
+				return -1; 
+			}
+			memcpy((*user)->buffer + (*user)->buffer_start, in, len); 
+			(*user)->buffer_start += len; 
+			break; 
+		}
+		case LWS_CALLBACK_HTTP_BODY_COMPLETION: {
+			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
+			if(!user || !*user) return -1; 
+			if(_http_rpc_complete(self, wsi, *user) != 0) return (lws_http_transaction_completed(wsi))?-1:0; 
+			// response is written from HTTP_WRITEABLE once a worker has processed the request
+			break; 
+		}
+		case LWS_CALLBACK_HTTP_WRITEABLE: {
+			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
+			if(!user || !*user) break; 
+			if((*user)->file_fd >= 0){
+				int ret = _http_file_write(self, wsi, *user); 
+				if(ret < 0) return -1; 
+				if(ret == 0){
 					lws_callback_on_writable(wsi); 
 					break; 
-				} 
+				}
+				if(lws_http_transaction_completed(wsi)) return -1; 
+				break; 
 			}
+			pthread_mutex_lock(&self->qlock); 
+			if(!(*user)->http_complete && _http_rpc_write(self, wsi, *user) < 0){
+				pthread_mutex_unlock(&self->qlock); 
+				return -1; 
+			}
+			bool complete = (*user)->http_complete; 
+			pthread_mutex_unlock(&self->qlock); 
+			if(!complete) break; 
+			// wait until lws has flushed everything before completing the transaction
+			if(lws_partial_buffered(wsi)){
+				lws_callback_on_writable(wsi); 
+				break; 
+			}
+			(*user)->http_complete = false; 
+			// this resets the connection for the next (possibly pipelined) request on keep-alive connections
+			if(lws_http_transaction_completed(wsi)) return -1; 
+			break; 
+		}
+		case LWS_CALLBACK_SERVER_WRITEABLE: {
+			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
+			pthread_mutex_lock(&self->qlock); 
+			// write as much as the budget allows and then give other clients a chance
+			size_t budget = self->tx_write_budget; 
+			while(!list_empty(&(*user)->tx_queue) && budget > 0 && !lws_partial_buffered(wsi)){
+				int n = _client_write_batch(self, *user, budget); 
+				if(n == 0) n = _client_write_frame(self, *user, budget); 
+				if(n < 0) { 
+					DEBUG("error while sending data over websocket!\n"); 
+					pthread_mutex_unlock(&self->qlock); 
+					// disconnect
+					return 1; 
+				}
+				budget = ((size_t)n < budget)?(budget - n):0; 
+			}
+			// if there is more then we need to tell lws to call us again
+			if(!list_empty(&(*user)->tx_queue)){
+				lws_callback_on_writable(wsi); 
+			}
+			_client_update_flow_control(self, *user); 
 			pthread_mutex_unlock(&self->qlock); 
-			// FIXME: we need to only call this when we actually either have more data to write. But we do this every time for now just to make sure server works. 
-			//lws_callback_on_writable(wsi); 	
-			//lws_rx_flow_control(wsi, 1); 
 			break; 
 		}
 		case LWS_CALLBACK_RECEIVE: {
@@ -231,7 +904,7 @@ static int _orange_socket_callback(struct lws *wsi, enum lws_callback_reasons re
 			assert(user); 
 			if(!user) break; 
 			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
-			if((*user)->buffer_start + len > sizeof((*user)->buffer)){
+			if((*user)->buffer_start + len >= sizeof((*user)->buffer)){
 				// messages larger than maximum size are discarded
 				(*user)->buffer_start = 0; 
 				ERROR("message too large! Discarded!\n"); 
@@ -247,18 +920,26 @@ static int _orange_socket_callback(struct lws *wsi, enum lws_callback_reasons re
 				blob_reset(&(*user)->msg->buf); 
 
 				// if message is small and we have received all of it then skip the scratch buffer and process it directly 
-				if(!JSON_check_string(self->jc, (*user)->buffer) || !blob_put_json(&(*user)->msg->buf, (*user)->buffer)){
+				if((*user)->binary){
+					size_t size = (*user)->buffer_start + len; 
+					(*user)->buffer_start = 0; 
+					if(!orange_msgpack_unpack(&(*user)->msg->buf, (const uint8_t*)(*user)->buffer, size)){
+						ERROR("got bad binary message of %d bytes\n", (int)size); 
+						break; 
+					}
+				} else if(!JSON_check_string(self->jc, (*user)->buffer) || !blob_put_json(&(*user)->msg->buf, (*user)->buffer)){
 					ERROR("got bad message: %s\n", (*user)->buffer); 
+					(*user)->buffer_start = 0; 
 					break; 
 				}
 				// place the message on the queue
 				(*user)->msg->peer = (*user)->id.id; 
 				pthread_mutex_lock(&self->qlock); 
-				list_add_tail(&(*user)->msg->list, &self->rx_queue); 
+				_server_queue_request(self, (*user)->msg); 
 				(*user)->msg = orange_message_new(); 
 				blob_reset(&(*user)->msg->buf); 
 				(*user)->buffer_start = 0; 
-				pthread_cond_signal(&self->rx_ready); 
+				_client_update_flow_control(self, *user); 
 				pthread_mutex_unlock(&self->qlock); 
 			} else {
 				// write to scratch buffer
@@ -271,31 +952,6 @@ static int _orange_socket_callback(struct lws *wsi, enum lws_callback_reasons re
 			//lws_callback_on_writable(wsi); 	
 			break; 
 		}
-		/*case LWS_CALLBACK_HTTP: {
-			struct orange_srv_ws *self = (struct orange_srv_ws*)proto->user; 
-            char *requested_uri = (char *) in;
-            DEBUG("requested URI: %s\n", requested_uri);
-           
-            if (strcmp(requested_uri, "/") == 0) 
-				requested_uri = "/index.html"; 
-
-			// allocate enough memory for the resource path
-			char *resource_path = malloc(strlen(self->www_root) + strlen(requested_uri) + 1);
-		   
-			// join current working direcotry to the resource path
-			sprintf(resource_path, "%s%s", self->www_root, requested_uri);
-			DEBUG("resource path: %s\n", resource_path);
-		   
-			char *extension = strrchr(resource_path, '.');
-		  	const char *mime = mimetype_lookup(extension); 
-		   
-			// by default non existing resources return code 404
-			lws_serve_http_file(wsi, resource_path, mime, NULL, 0);
-			// we have to check this otherwise we will get incomplete transfers
-			if(lws_send_pipe_choked(wsi)) break; 
-			// return 1 so that the connection shall be closed
-			return 1; 
-       	} break;  */   
 		default: { 
 			
 		} break; 
@@ -310,103 +966,204 @@ static void _websocket_destroy(orange_server_t socket){
 	self->shutdown = true; 
 	lws_cancel_service(self->ctx); 
 	pthread_mutex_unlock(&self->lock); 
+	// wake up workers waiting in recv
+	orange_ring_close(self->rx_queue); 
 
 	DEBUG("websocket: joining worker thread..\n"); 
 	pthread_join(self->thread, NULL); 
+	if(self->accept_running) pthread_join(self->accept_thread, NULL); 
+	if(self->listen_fd >= 0) close(self->listen_fd); 
+	for(int c = 0; c < self->num_accepted; c++) close(self->accepted[c]); 
 
 	if(self->ctx) lws_context_destroy(self->ctx); 
 
 	pthread_mutex_destroy(&self->qlock); 
 	pthread_mutex_destroy(&self->lock); 
-	pthread_cond_destroy(&self->rx_ready); 
 
 	struct orange_id *id, *tmp; 
 	avl_for_each_element_safe(&self->clients, id, avl, tmp){
 		struct orange_srv_ws_client *client = container_of(id, struct orange_srv_ws_client, id);  
-		orange_id_free(&self->clients, &client->id); 
+		orange_id_free(&self->clients, &client->id);
+		orange_peer_id_free(client->id.id);  
 		orange_srv_ws_client_delete(&client); 
 	}
 	
-	struct orange_message *msg, *nmsg; 
-	list_for_each_entry_safe(msg, nmsg, &self->rx_queue, list){
+	struct orange_message *msg, *mtmp; 
+	while((msg = orange_ring_pop(self->rx_queue))){
+		orange_message_delete(&msg); 
+	}
+	list_for_each_entry_safe(msg, mtmp, &self->rx_deferred, list){
+		list_del_init(&msg->list); 
 		orange_message_delete(&msg); 
 	}
+	orange_ring_delete(&self->rx_queue); 
+	orange_topic_tree_delete(&self->topics); 
 
 	JSON_check_free(&self->jc); 
 
 	DEBUG("websocket: context destroyed\n"); 
 	free(self->protocols); 
+	free(self->tx_scratch); 
 	free(self);  
 }
 
-#include <arpa/inet.h>
-#include <net/if.h>
-#include <ifaddrs.h>
-
-static int _find_interface_from_ip(const char *ip, char *ifname, size_t out_size){
-	struct ifaddrs *addrs, *iap;
-	struct sockaddr_in *sa;
-	getifaddrs(&addrs);
-	for (iap = addrs; iap != NULL; iap = iap->ifa_next) {
-		if(!iap->ifa_addr) continue; // some interfaces can have this set to null! 
-		int family = iap->ifa_addr->sa_family; 
-		if ((iap->ifa_flags & IFF_UP) && (family == AF_INET || family == AF_INET6)) {
-			char host[NI_MAXHOST+1]; 	
-			int s = getnameinfo(iap->ifa_addr,
-				   (family == AF_INET) ? sizeof(struct sockaddr_in) :
-										 sizeof(struct sockaddr_in6),
-				   host, NI_MAXHOST,
-				   NULL, 0, NI_NUMERICHOST);
-			if (s != 0) {
-			   printf("getnameinfo() failed: %s\n", gai_strerror(s));
-			} else if(strcmp(ip, host) == 0){
-				strncpy(ifname, iap->ifa_name, out_size); 
-				freeifaddrs(addrs); 
-				return 0; 
-			}
+static void *_websocket_accept_thread(void *ptr){
+	struct orange_srv_ws *self = (struct orange_srv_ws*)ptr; 
+	prctl(PR_SET_NAME, "ws_accept"); 
+	pthread_mutex_lock(&self->qlock); 
+	while(!self->shutdown){
+		// a detached server polls nothing until it gets a socket again
+		struct pollfd pfd = { .fd = self->listen_fd, .events = POLLIN }; 
+		pthread_mutex_unlock(&self->qlock); 
+		int ret = poll(&pfd, 1, ORANGE_WS_ACCEPT_POLL_MS); 
+		pthread_mutex_lock(&self->qlock); 
+		if(ret <= 0 || !(pfd.revents & POLLIN) || pfd.fd != self->listen_fd) continue; 
+		bool wakeup = false; 
+		while(self->num_accepted < ORANGE_WS_ACCEPT_QUEUE){
+			int fd = accept4(self->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC); 
+			if(fd < 0) break; 
+			self->accepted[self->num_accepted++] = fd; 
+			wakeup = true; 
 		}
+		pthread_mutex_unlock(&self->qlock); 
+		// service thread picks up the new connections
+		if(wakeup) lws_cancel_service(self->ctx); 
+		else usleep(ORANGE_WS_ACCEPT_POLL_MS * 1000); // queue is full. Give service thread time to empty it. 
+		pthread_mutex_lock(&self->qlock); 
+	}
+	pthread_mutex_unlock(&self->qlock); 
+	pthread_exit(0); 
+	return NULL; 
+}
+
+// NOTE: must only be called from the service thread without any locks held (libwebsockets calls our callbacks)
+static void _server_adopt_accepted(struct orange_srv_ws *self){
+	int fds[ORANGE_WS_ACCEPT_QUEUE]; 
+	pthread_mutex_lock(&self->qlock); 
+	int count = self->num_accepted; 
+	memcpy(fds, self->accepted, sizeof(int) * count); 
+	self->num_accepted = 0; 
+	pthread_mutex_unlock(&self->qlock); 
+	for(int c = 0; c < count; c++){
+		// libwebsockets closes the socket if it fails
+		if(!lws_adopt_socket(self->ctx, fds[c])) DEBUG("websocket: could not adopt connection\n"); 
 	}
-	freeifaddrs(addrs);
-	return -ENOENT; 
+}
+
+// takes ownership of fd
+static int _websocket_start(struct orange_srv_ws *self, int fd){
+	pthread_mutex_lock(&self->lock); 
+	if(!self->ctx){
+		struct lws_context_creation_info info; 
+		memset(&info, 0, sizeof(info)); 
+		// connections come from our own listening socket
+		info.port = CONTEXT_PORT_NO_LISTEN; 
+		info.gid = -1; 
+		info.uid = -1; 
+		info.user = self; 
+		info.protocols = self->protocols; 
+		//info.extensions = lws_get_internal_extensions();
+		info.options = LWS_SERVER_OPTION_VALIDATE_UTF8;
+		self->ctx = lws_create_context(&info); 
+		if(!self->ctx){
+			pthread_mutex_unlock(&self->lock); 
+			close(fd); 
+			return -ENOMEM; 
+		}
+	}
+	pthread_mutex_lock(&self->qlock); 
+	if(self->listen_fd >= 0){
+		pthread_mutex_unlock(&self->qlock); 
+		pthread_mutex_unlock(&self->lock); 
+		close(fd); 
+		return -EEXIST; 
+	}
+	self->listen_fd = fd; 
+	if(!self->accept_running){
+		pthread_create(&self->accept_thread, NULL, _websocket_accept_thread, self); 
+		self->accept_running = true; 
+	}
+	pthread_mutex_unlock(&self->qlock); 
+	pthread_mutex_unlock(&self->lock); 
+	return 0; 
+}
+
+// creates a non blocking tcp socket listening on ip (all interfaces if NULL). Returns the socket or -1 with errno set. 
+static int _tcp_listen(const char *ip, const char *service){
+	struct addrinfo hints, *res = NULL, *ai; 
+	memset(&hints, 0, sizeof(hints)); 
+	hints.ai_family = AF_UNSPEC; 
+	hints.ai_socktype = SOCK_STREAM; 
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV; 
+	int ret = getaddrinfo(ip, service, &hints, &res); 
+	if(ret != 0){
+		errno = (ret == EAI_SYSTEM)?errno:EINVAL; 
+		return -1; 
+	}
+	int fd = -1; 
+	for(ai = res; ai; ai = ai->ai_next){
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol); 
+		if(fd < 0) continue; 
+		int yes = 1; 
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); 
+		if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break; 
+		int err = errno; 
+		close(fd); 
+		errno = err; 
+		fd = -1; 
+	}
+	freeaddrinfo(res); 
+	return fd; 
 }
 
 static int _websocket_listen(orange_server_t socket, const char *path){
 	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
-	struct lws_context_creation_info info; 
-	memset(&info, 0, sizeof(info)); 
 
-	char proto[NAME_MAX], ip[NAME_MAX], file[NAME_MAX], ifname[16]; 
+	char proto[NAME_MAX], ip[NAME_MAX] = {0}, file[NAME_MAX], service[16]; 
 	int port = 5303; 
 	if(!url_scanf(path, proto, ip, &port, file)){
 		fprintf(stderr, "Could not parse url: %s\n", path); 
 		return -1; 
 	}
 
-	if(strlen(ip) && _find_interface_from_ip(ip, ifname, sizeof(ifname)) < 0){
-		fprintf(stderr, "Could not find interface on which to listen for '%s' when creating websocket!\n", ip); 
-		return -1; 
-	}
-
-	if(strlen(ifname)){
-		info.iface = ifname; 
-		INFO("WARNING: no interface name supplied so will be listening on ALL interfaces. If this is not what you want then supply an ip address on which to listen!\n"); 
+	if(!strlen(ip)){
+		INFO("WARNING: no ip address supplied so will be listening on ALL interfaces. If this is not what you want then supply an ip address on which to listen!\n"); 
 	}	
 	
-	DEBUG("starting server on '%s:%d'\n", (strlen(ifname))?ifname:"*", port); 
+	DEBUG("starting server on '%s:%d'\n", (strlen(ip))?ip:"*", port); 
 
-	info.port = port;
-	info.gid = -1; 
-	info.uid = -1; 
-	info.user = self; 
-	info.protocols = self->protocols; 
-	//info.extensions = lws_get_internal_extensions();
-	info.options = LWS_SERVER_OPTION_VALIDATE_UTF8;
+	snprintf(service, sizeof(service), "%d", port); 
+	int fd = _tcp_listen((strlen(ip))?ip:NULL, service); 
+	if(fd < 0){
+		fprintf(stderr, "Could not listen on '%s:%d': %s\n", (strlen(ip))?ip:"*", port, strerror(errno)); 
+		return -1; 
+	}
 
-	pthread_mutex_lock(&self->lock); 
-	self->ctx = lws_create_context(&info); 
-	pthread_mutex_unlock(&self->lock); 
+	return _websocket_start(self, fd); 
+}
 
-	return 0; 
+static int _websocket_adopt(orange_server_t socket, const char *path, int fd){
+	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	int type = 0; 
+	socklen_t len = sizeof(type); 
+	if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM){
+		ERROR("websocket: inherited socket for %s is not a stream socket\n", path); 
+		close(fd); 
+		return -ENOTSOCK; 
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); 
+	fcntl(fd, F_SETFD, FD_CLOEXEC); 
+	DEBUG("websocket: accepting on inherited socket %s\n", path); 
+	return _websocket_start(self, fd); 
+}
+
+static int _websocket_detach(orange_server_t socket){
+	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	pthread_mutex_lock(&self->qlock); 
+	int fd = self->listen_fd; 
+	self->listen_fd = -1; 
+	pthread_mutex_unlock(&self->qlock); 
+	return (fd >= 0)?fd:-ENOTCONN; 
 }
 
 static int _websocket_connect(orange_server_t socket, const char *path){
@@ -420,19 +1177,24 @@ static void *_websocket_server_thread(void *ptr){
 	pthread_mutex_lock(&self->lock); 
 	while(!self->shutdown){
 		if(self->ctx){
-			struct orange_id *id; 
-			// go over all clients and fire writable callback if there is data pending
+			// fire writable callback only for clients that got new data since last time
 			pthread_mutex_lock(&self->qlock); 
-			avl_for_each_element(&self->clients, id, avl){
-				struct orange_srv_ws_client *client = (struct orange_srv_ws_client*)container_of(id, struct orange_srv_ws_client, id);  
-				if(!list_empty(&client->tx_queue)){
-					lws_callback_on_writable(client->wsi); 
+			while(!list_empty(&self->tx_pending)){
+				struct orange_srv_ws_client *client = list_first_entry(&self->tx_pending, struct orange_srv_ws_client, pending); 
+				list_del_init(&client->pending); 
+				if(client->disconnect){
+					// a client that stopped reading never becomes writeable so we can not wait for its callback to close it
+					lws_set_timeout(client->wsi, PENDING_TIMEOUT_USER_REASON_BASE, LWS_TO_KILL_ASYNC); 
+					continue; 
 				}
+				lws_callback_on_writable(client->wsi); 
 			}
+			self->tx_wakeup = false; 
 			pthread_mutex_unlock(&self->qlock); 
 
 			pthread_mutex_unlock(&self->lock); 
 			lws_service(self->ctx, 60000UL);	
+			_server_adopt_accepted(self); 
 			pthread_mutex_lock(&self->lock); 
 		} else {
 			pthread_mutex_unlock(&self->lock); 
@@ -445,21 +1207,89 @@ static void *_websocket_server_thread(void *ptr){
 	return 0; 
 }
 
+static int _peer_cmp(const void *a, const void *b){
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b; 
+	return (x > y) - (x < y); 
+}
+
+// one event of a broadcast together with its subscribers and encoded frames
+struct _ws_event {
+	const struct blob_field *field; 
+	const char *topic; 
+	uint32_t *subscribers; 
+	int num_subscribers; 
+	struct orange_srv_ws_frame *encoded[2]; 
+}; 
+
 static int _websocket_send(orange_server_t socket, struct orange_message **msg){
 	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	bool wakeup = false; 
 
 	if((*msg)->peer == 0){
-		// this is a broadcast message
+		// this is a broadcast message (or a batch of them). Encode each event once for each wire format and then copy the frames to clients. 
 		struct orange_id *id, *tmp; 
+		const struct blob_field *root = blob_field_first_child(blob_head(&(*msg)->buf)); 
+		int num_events = 1; 
+		if((*msg)->event_batch){
+			const struct blob_field *child; 
+			num_events = 0; 
+			blob_field_for_each_child(root, child) num_events++; 
+		}
+		if(num_events == 0){
+			orange_message_delete(msg); 
+			return 0; 
+		}
+		struct _ws_event *events = calloc(num_events, sizeof(struct _ws_event)); 
+		if(!events){
+			orange_message_delete(msg); 
+			return -ENOMEM; 
+		}
 		pthread_mutex_lock(&self->lock); 
 		pthread_mutex_lock(&self->qlock); 
+		if((*msg)->event_batch){
+			const struct blob_field *child; 
+			int c = 0; 
+			blob_field_for_each_child(root, child){
+				events[c].field = child; 
+				events[c].topic = orange_message_event_topic(child); 
+				c++; 
+			}
+		} else {
+			events[0].field = root; 
+			events[0].topic = (*msg)->topic; 
+		}
+		for(int c = 0; c < num_events; c++){
+			if(events[c].topic) events[c].num_subscribers = orange_topic_match(self->topics, events[c].topic, &events[c].subscribers); 
+		}
+		// single pass over clients no matter how many events there are
 		avl_for_each_element_safe(&self->clients, id, avl, tmp){
 			struct orange_srv_ws_client *client = container_of(id, struct orange_srv_ws_client, id);  
-			struct orange_srv_ws_frame *frame = orange_srv_ws_frame_new(blob_field_first_child(blob_head(&(*msg)->buf))); 
-			list_add_tail(&frame->list, &client->tx_queue); 	
+			// http clients only receive responses to their own requests
+			if(client->http) continue; 
+			for(int c = 0; c < num_events; c++){
+				struct _ws_event *ev = &events[c]; 
+				// clients only get events they subscribed to (access was checked on subscribe). With broadcast_all 
+				// clients that have never subscribed get everything. 
+				bool wanted = (self->broadcast_all && !client->subscribed) || 
+					(ev->topic && bsearch(&client->id.id, ev->subscribers, ev->num_subscribers, sizeof(uint32_t), _peer_cmp)); 
+				if(!wanted){
+					self->stats.events_filtered++; 
+					continue; 
+				}
+				struct orange_srv_ws_frame **tmpl = &ev->encoded[client->binary]; 
+				if(!*tmpl) *tmpl = orange_srv_ws_frame_new(ev->field, client->binary); 
+				_client_queue_frame(self, client, orange_srv_ws_frame_copy(*tmpl), true); 
+			}
 		}
+		wakeup = _server_need_wakeup(self); 
 		pthread_mutex_unlock(&self->qlock); 
 		pthread_mutex_unlock(&self->lock); 
+		for(int c = 0; c < num_events; c++){
+			free(events[c].subscribers); 
+			if(events[c].encoded[0]) orange_srv_ws_frame_delete(&events[c].encoded[0]); 
+			if(events[c].encoded[1]) orange_srv_ws_frame_delete(&events[c].encoded[1]); 
+		}
+		free(events); 
 	} else {
 		pthread_mutex_lock(&self->qlock); 
 		struct orange_id *id = orange_id_find(&self->clients, (*msg)->peer); 
@@ -470,19 +1300,45 @@ static int _websocket_send(orange_server_t socket, struct orange_message **msg){
 		}
 		
 		struct orange_srv_ws_client *client = (struct orange_srv_ws_client*)container_of(id, struct orange_srv_ws_client, id);  
-		struct orange_srv_ws_frame *frame = orange_srv_ws_frame_new(blob_field_first_child(blob_head(&(*msg)->buf))); 
-		list_add_tail(&frame->list, &client->tx_queue); 	
+		struct orange_srv_ws_frame *frame = orange_srv_ws_frame_new(blob_field_first_child(blob_head(&(*msg)->buf)), client->binary); 
+		_client_queue_frame(self, client, frame, false); 
+		wakeup = _server_need_wakeup(self); 
 		pthread_mutex_unlock(&self->qlock); 
 	}
 
 	orange_message_delete(msg); 
 
 	// the ever lasting "beauty" of libwebsockets...
-	lws_cancel_service(self->ctx); // ( cancel service so we can quickly write the outgoing data to the websocket ) 
+	// ( cancel service so we can quickly write the outgoing data to the websocket. If a wakeup is already on the way then the service thread will pick up our data as well ) 
+	if(wakeup) lws_cancel_service(self->ctx); 
 
 	return 0; 
 }
 
+static int _websocket_subscribe(orange_server_t socket, uint32_t peer, const char *pattern, bool subscribe){
+	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	pthread_mutex_lock(&self->qlock); 
+	struct orange_id *id = orange_id_find(&self->clients, peer); 
+	if(!id){
+		pthread_mutex_unlock(&self->qlock); 
+		return -ENOENT; 
+	}
+	struct orange_srv_ws_client *client = container_of(id, struct orange_srv_ws_client, id);  
+	int ret; 
+	if(subscribe){
+		if(client->http) ret = -ENOTSUP; // http clients never receive broadcasts
+		else if(client->subscriptions >= ORANGE_WS_MAX_SUBSCRIPTIONS) ret = -ENOSPC; 
+		else if((ret = orange_topic_subscribe(self->topics, pattern, peer)) == 0){
+			client->subscriptions++; 
+			client->subscribed = true; 
+		}
+	} else {
+		if((ret = orange_topic_unsubscribe(self->topics, pattern, peer)) == 0) client->subscriptions--; 
+	}
+	pthread_mutex_unlock(&self->qlock); 
+	return ret; 
+}
+
 static void *_websocket_userdata(orange_server_t socket, void *ptr){
 	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
 	pthread_mutex_lock(&self->lock); 
@@ -496,59 +1352,98 @@ static void *_websocket_userdata(orange_server_t socket, void *ptr){
 	return ptr; 
 }
 
-static int _websocket_recv(orange_server_t socket, struct orange_message **msg, unsigned long long timeout_us){
+static int _websocket_stats(orange_server_t socket, struct blob *out){
 	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
-
-	*msg = NULL; 
-
-	pthread_mutex_lock(&self->lock); 
-	if(self->shutdown) {
-		pthread_mutex_unlock(&self->lock); 
-		return -1; 
-	}
-	pthread_mutex_unlock(&self->lock); 
+	struct orange_id *id; 
+	unsigned int clients = 0, paused = 0; 
 
 	pthread_mutex_lock(&self->qlock); 
-	struct timespec t; 
-	timespec_from_now_us(&t, timeout_us); 
-
-	// lock mutex to check for the queue
-	while(list_empty(&self->rx_queue)){
-		// unlock the mutex and wait for a new event. timeout if no event received for a timeout.  
-		// this will lock mutex after either timeout or if condition is signalled
-		if(pthread_cond_timedwait(&self->rx_ready, &self->qlock, &t) == ETIMEDOUT){
-			// we still need to unlock the mutex before we exit
-			pthread_mutex_unlock(&self->qlock); 
-			return -EAGAIN; 
-		}
+	avl_for_each_element(&self->clients, id, avl){
+		struct orange_srv_ws_client *client = container_of(id, struct orange_srv_ws_client, id);  
+		clients++; 
+		if(client->rx_paused) paused++; 
 	}
+	blob_offset_t t = blob_open_table(out); 
+	blob_put_string(out, "clients"); 
+	blob_put_int(out, clients); 
+	blob_put_string(out, "clients_paused"); 
+	blob_put_int(out, paused); 
+	blob_put_string(out, "clients_evicted"); 
+	blob_put_int(out, self->stats.clients_evicted); 
+	blob_put_string(out, "rx_queued"); 
+	blob_put_int(out, orange_ring_count(self->rx_queue)); 
+	blob_put_string(out, "rx_dropped"); 
+	blob_put_int(out, self->stats.rx_dropped); 
+	blob_put_string(out, "rx_deferred"); 
+	blob_put_int(out, self->stats.rx_deferred); 
+	blob_put_string(out, "rx_paused"); 
+	blob_put_int(out, self->stats.rx_paused); 
+	blob_put_string(out, "rx_resumed"); 
+	blob_put_int(out, self->stats.rx_resumed); 
+	blob_put_string(out, "tx_queued_bytes"); 
+	blob_put_int(out, self->stats.tx_queued_bytes); 
+	blob_put_string(out, "tx_frames_dropped"); 
+	blob_put_int(out, self->stats.frames_dropped); 
+	blob_put_string(out, "tx_bytes_dropped"); 
+	blob_put_int(out, self->stats.bytes_dropped); 
+	blob_put_string(out, "tx_writes"); 
+	blob_put_int(out, self->stats.tx_writes); 
+	blob_put_string(out, "tx_frames"); 
+	blob_put_int(out, self->stats.tx_frames); 
+	blob_put_string(out, "tx_bytes"); 
+	blob_put_int(out, self->stats.tx_bytes); 
+	blob_put_string(out, "tx_wakeups"); 
+	blob_put_int(out, self->stats.tx_wakeups); 
+	blob_put_string(out, "http_files"); 
+	blob_put_int(out, self->stats.http_files); 
+	blob_put_string(out, "http_not_modified"); 
+	blob_put_int(out, self->stats.http_not_modified); 
+	blob_put_string(out, "http_file_bytes"); 
+	blob_put_int(out, self->stats.http_file_bytes); 
+	blob_put_string(out, "subscriptions"); 
+	blob_put_int(out, orange_topic_count(self->topics)); 
+	blob_put_string(out, "events_filtered"); 
+	blob_put_int(out, self->stats.events_filtered); 
+	blob_close_table(out, t); 
+	pthread_mutex_unlock(&self->qlock); 
+	return 0; 
+}
 
-	// TODO: add a way to cancel reads so we can shut down faster. 
+static int _websocket_recv(orange_server_t socket, struct orange_message **msg, unsigned long long timeout_us){
+	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	void *ptr = NULL; 
 
-	// NOTE: list will always have an element when we get here as long as rx_queue is always properly locked by qlock. 
-	if(list_empty(&self->rx_queue)){
-		TRACE("BUG: RX QUEUE IS EMPTY!\n"); 
-		exit(-1); 
-	}
+	*msg = NULL; 
 
-	// pop a message from the stack
-	struct orange_message *m = list_first_entry(&self->rx_queue, struct orange_message, list); 
-	list_del_init(&m->list); 
-	*msg = m; 
+	// workers take requests from the ring without any locks and park on a futex when there is nothing to do
+	int ret = orange_ring_pop_wait(self->rx_queue, &ptr, timeout_us); 
+	// room has been made for notifications that did not fit
+	if(__atomic_load_n(&self->num_deferred, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&self->qlock); 
+		_server_flush_deferred(self); 
+		pthread_mutex_unlock(&self->qlock); 
+	}
+	if(ret == -ECANCELED) return -1; 
+	if(ret < 0) return ret; 
 
-	// unlock mutex and return with positive number to signal message received. 
-	pthread_mutex_unlock(&self->qlock); 
+	*msg = (struct orange_message*)ptr; 
 	return 1; 
 }
 
 orange_server_t orange_ws_server_new(const char *www_root){
 	struct orange_srv_ws *self = calloc(1, sizeof(struct orange_srv_ws)); 
 	assert(self); 
-	self->www_root = (www_root)?www_root:"/www/"; 
-	self->protocols = calloc(2, sizeof(struct lws_protocols)); 
+	self->www_root = www_root; 
+	self->protocols = calloc(3, sizeof(struct lws_protocols)); 
 	assert(self->protocols); 
 	self->protocols[0] = (struct lws_protocols){
-		.name = "rpc",
+		.name = ORANGE_WS_PROTOCOL_JSON,
+		.callback = _orange_socket_callback,
+		.per_session_data_size = sizeof(struct orange_srv_ws_client*),
+		.user = self
+	};
+	self->protocols[1] = (struct lws_protocols){
+		.name = ORANGE_WS_PROTOCOL_MSGPACK,
 		.callback = _orange_socket_callback,
 		.per_session_data_size = sizeof(struct orange_srv_ws_client*),
 		.user = self
@@ -556,18 +1451,59 @@ orange_server_t orange_ws_server_new(const char *www_root){
 	orange_id_tree_init(&self->clients); 
 	pthread_mutex_init(&self->lock, NULL); 
 	pthread_mutex_init(&self->qlock, NULL); 
-	pthread_cond_init(&self->rx_ready, NULL); 
-	INIT_LIST_HEAD(&self->rx_queue); 
+	self->rx_queue = orange_ring_new(ORANGE_WS_RX_QUEUE_SIZE); 
+	INIT_LIST_HEAD(&self->rx_deferred); 
+	self->topics = orange_topic_tree_new(); 
+	INIT_LIST_HEAD(&self->tx_pending); 
+	self->tx_low_watermark = ORANGE_WS_TX_LOW_WATERMARK; 
+	self->tx_high_watermark = ORANGE_WS_TX_HIGH_WATERMARK; 
+	self->tx_hard_limit = ORANGE_WS_TX_HARD_LIMIT; 
+	self->tx_write_budget = ORANGE_WS_TX_WRITE_BUDGET; 
+	self->tx_scratch = malloc(LWS_SEND_BUFFER_PRE_PADDING + self->tx_write_budget + LWS_SEND_BUFFER_POST_PADDING); 
+	assert(self->tx_scratch); 
+	self->listen_fd = -1; 
 	static const struct orange_server_api api = {
 		.destroy = _websocket_destroy, 
 		.listen = _websocket_listen, 
 		.connect = _websocket_connect, 
 		.send = _websocket_send, 
 		.recv = _websocket_recv, 
-		.userdata = _websocket_userdata
+		.userdata = _websocket_userdata, 
+		.stats = _websocket_stats, 
+		.subscribe = _websocket_subscribe, 
+		.detach = _websocket_detach, 
+		.adopt = _websocket_adopt
 	}; 
 	self->api = &api; 
 	self->jc = JSON_check_new(10); 
 	pthread_create(&self->thread, NULL, _websocket_server_thread, self); 
 	return &self->api; 
 }
+
+void orange_ws_server_set_tx_limits(orange_server_t socket, size_t low_watermark, size_t high_watermark, size_t hard_limit){
+	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	pthread_mutex_lock(&self->qlock); 
+	self->tx_low_watermark = low_watermark; 
+	self->tx_high_watermark = (high_watermark > low_watermark)?high_watermark:low_watermark; 
+	self->tx_hard_limit = (hard_limit > self->tx_high_watermark)?hard_limit:self->tx_high_watermark; 
+	pthread_mutex_unlock(&self->qlock); 
+}
+
+void orange_ws_server_set_tx_budget(orange_server_t socket, size_t budget){
+	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	if(budget < ORANGE_WS_FRAGMENT_MIN) budget = ORANGE_WS_FRAGMENT_MIN; 
+	uint8_t *scratch = malloc(LWS_SEND_BUFFER_PRE_PADDING + budget + LWS_SEND_BUFFER_POST_PADDING); 
+	if(!scratch) return; 
+	pthread_mutex_lock(&self->qlock); 
+	free(self->tx_scratch); 
+	self->tx_scratch = scratch; 
+	self->tx_write_budget = budget; 
+	pthread_mutex_unlock(&self->qlock); 
+}
+
+void orange_ws_server_set_broadcast_all(orange_server_t socket, bool enable){
+	struct orange_srv_ws *self = container_of(socket, struct orange_srv_ws, api); 
+	pthread_mutex_lock(&self->qlock); 
+	self->broadcast_all = enable; 
+	pthread_mutex_unlock(&self->qlock); 
+}
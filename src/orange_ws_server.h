@@ -21,5 +21,20 @@
 #include <blobpack/blobpack.h>
 #include "orange_server.h"
 
+// websocket subprotocols. Clients select the wire encoding by subprotocol at connect time. 
+#define ORANGE_WS_PROTOCOL_JSON "rpc"
+#define ORANGE_WS_PROTOCOL_MSGPACK "rpc-msgpack"
+
+// www_root is the directory that static files are served from. Pass NULL to not serve any files. 
 orange_server_t orange_ws_server_new(const char *www_root); 
 
+// sets per client send queue limits in bytes. Reads from a client are paused when its queue grows above high watermark and resumed when it drains below low watermark. Broadcast events that would grow the queue above hard limit are dropped. 
+void orange_ws_server_set_tx_limits(orange_server_t server, size_t low_watermark, size_t high_watermark, size_t hard_limit); 
+
+// sets maximum number of bytes written to one client before moving on to the next one. Small messages that fit within the budget are sent together with one write. 
+void orange_ws_server_set_tx_budget(orange_server_t server, size_t budget);
+
+// makes clients that have never subscribed to a topic receive all broadcast events (default is none). This is only 
+// for user interfaces that predate subscribe and bypasses the event acl check, so leave it off when event acls are used. 
+void orange_ws_server_set_broadcast_all(orange_server_t server, bool enable); 
+
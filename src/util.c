@@ -102,4 +102,13 @@ int timespec_expired(struct timespec *ts){
 	timespec_now(&now); 
 	return timespec_before(ts, &now); 
 }
- 
+
+void hex_encode(char *out, const void *data, size_t len){
+	static const char digits[] = "0123456789abcdef"; 
+	const unsigned char *p = (const unsigned char*)data; 
+	for(size_t c = 0; c < len; c++){
+		out[c * 2] = digits[p[c] >> 4]; 
+		out[c * 2 + 1] = digits[p[c] & 0xf]; 
+	}
+	out[len * 2] = 0; 
+}
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stddef.h>
+
 char* shell_command(const char *cmd, int *exit_code); 
 void timespec_now(struct timespec *t); 
 int timespec_before(struct timespec *a, struct timespec *before_b); 
 void timespec_from_now_us(struct timespec *t, unsigned long long timeout_us); 
 int timespec_expired(struct timespec *ts); 
-
+// writes len bytes of data as lower case hex followed by a trailing zero (out must hold len * 2 + 1 chars)
+void hex_encode(char *out, const void *data, size_t len); 
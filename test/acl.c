@@ -0,0 +1,79 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <memory.h>
+#include <errno.h>
+#include <blobpack/blobpack.h>
+#include "../src/orange_acl.h"
+
+static bool _access(struct orange_acl *acl, const char *scope, const char *obj, const char *method, const char *perms){
+	orange_perms_t have, want;
+	if(!orange_acl_perms(perms, &want)) return false;
+	if(!orange_acl_lookup(acl, scope, obj, method, &have)) return false;
+	return (have & want) == want;
+}
+
+int main(void){
+	struct orange_acl *acl = orange_acl_new();
+	orange_perms_t perms;
+
+	TEST(orange_acl_perms("rwx", &perms) && perms != 0);
+	TEST(!orange_acl_perms("r-x", &perms));
+	TEST(orange_acl_perms("", &perms) && perms == 0);
+
+	TEST(!orange_acl_lookup(acl, "rpc", "system", "info", &perms));
+	TEST(orange_acl_revoke(acl, "rpc", "system", "*", "x") == -ENOENT);
+
+	// exact, prefix and glob object patterns
+	TEST(orange_acl_grant(acl, "rpc", "system", "info", "x") == 0);
+	TEST(orange_acl_grant(acl, "rpc", "net*", "*", "r") == 0);
+	TEST(orange_acl_grant(acl, "rpc", "wifi.[ab]*", "scan*", "x") == 0);
+	TEST(orange_acl_grant(acl, "rpc", "*", "list", "l") == 0);
+
+	TEST(_access(acl, "rpc", "system", "info", "x"));
+	TEST(!_access(acl, "rpc", "system", "reboot", "x"));
+	TEST(!_access(acl, "rpc", "systemd", "info", "x"));
+	TEST(!_access(acl, "rpc", "syst", "info", "x"));
+	TEST(_access(acl, "rpc", "net", "status", "r"));
+	TEST(_access(acl, "rpc", "network", "status", "r"));
+	TEST(!_access(acl, "rpc", "network", "status", "w"));
+	TEST(_access(acl, "rpc", "wifi.a0", "scan_now", "x"));
+	TEST(_access(acl, "rpc", "wifi.b", "scan", "x"));
+	TEST(!_access(acl, "rpc", "wifi.c0", "scan", "x"));
+	TEST(!_access(acl, "rpc", "wifi.a0", "info", "x"));
+	TEST(_access(acl, "rpc", "anything", "list", "l"));
+	TEST(_access(acl, "rpc", "", "list", "l"));
+
+	// permissions of all matching rules are combined
+	TEST(orange_acl_grant(acl, "rpc", "network", "*", "w") == 0);
+	TEST(_access(acl, "rpc", "network", "status", "rw"));
+	TEST(!_access(acl, "rpc", "netbark", "status", "rw"));
+	TEST(_access(acl, "rpc", "network", "list", "rwl"));
+
+	// scope exists so empty perms are always allowed
+	TEST(_access(acl, "rpc", "unknown", "unknown", ""));
+	TEST(!_access(acl, "uci", "unknown", "unknown", ""));
+
+	// revoke only touches rules that match and are already granted
+	TEST(orange_acl_revoke(acl, "rpc", "netbark", "*", "r") == 0);
+	TEST(!_access(acl, "rpc", "netbark", "status", "r"));
+	TEST(!_access(acl, "rpc", "network", "status", "r"));
+	TEST(_access(acl, "rpc", "network", "status", "w"));
+	TEST(orange_acl_grant(acl, "rpc", "net*", "*", "r") == 0);
+	TEST(_access(acl, "rpc", "netbark", "status", "r"));
+
+	struct blob b;
+	blob_init(&b, 0, 0);
+	blob_offset_t t = blob_open_table(&b);
+	orange_acl_to_blob(acl, &b);
+	blob_close_table(&b, t);
+	char *json = blob_field_to_json(blob_field_first_child(blob_head(&b)));
+	printf("%s\n", json);
+	TEST(strstr(json, "\"perms\":\"-\"") != NULL);
+	free(json);
+	blob_free(&b);
+
+	orange_acl_delete(&acl);
+	TEST(acl == NULL);
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <memory.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <blobpack/blobpack.h>
+#include "../src/orange_acl_cache.h"
+
+#define ACL_DIR "/tmp/orange-acl-cache-test"
+
+static void _write(const char *name, const char *text){
+	char path[255];
+	snprintf(path, sizeof(path), "%s/%s", ACL_DIR, name);
+	FILE *f = fopen(path, "w");
+	TEST(f != NULL);
+	fputs(text, f);
+	fclose(f);
+}
+
+static bool _access(struct orange_acl *acl, const char *scope, const char *obj, const char *method, const char *perms){
+	orange_perms_t have, want;
+	orange_acl_perms(perms, &want);
+	return orange_acl_lookup(acl, scope, obj, method, &have) && (have & want) == want;
+}
+
+int main(void){
+	TEST(system("rm -rf " ACL_DIR " && mkdir -p " ACL_DIR) == 0);
+	_write("app-network.acl", "rpc network * x\nuci network * rw\n!uci network * w\n");
+	_write("app-system.acl", "rpc system info x\n");
+
+	struct orange_user *admin = orange_user_new("admin");
+	orange_user_add_acl(admin, "app-*");
+	struct orange_user *other = orange_user_new("other");
+	orange_user_add_acl(other, "app-*");
+	struct orange_user *guest = orange_user_new("guest");
+	orange_user_add_acl(guest, "app-system");
+
+	struct orange_acl_cache *cache = orange_acl_cache_new(ACL_DIR);
+
+	struct orange_acl *a = orange_acl_cache_get(cache, admin);
+	TEST(a != NULL);
+	TEST(_access(a, "rpc", "network", "status", "x"));
+	TEST(_access(a, "rpc", "system", "info", "x"));
+	TEST(_access(a, "uci", "network", "*", "r"));
+	TEST(!_access(a, "uci", "network", "*", "w"));
+
+	// users with the same acls share one compiled acl
+	struct orange_acl *b = orange_acl_cache_get(cache, admin);
+	struct orange_acl *c = orange_acl_cache_get(cache, other);
+	TEST(a == b && a == c);
+	orange_acl_unref(&b);
+	orange_acl_unref(&c);
+
+	struct orange_acl *g = orange_acl_cache_get(cache, guest);
+	TEST(g != a);
+	TEST(_access(g, "rpc", "system", "info", "x"));
+	TEST(!_access(g, "rpc", "network", "status", "x"));
+	orange_acl_unref(&g);
+
+	// changed file is read again and old acl stays valid for its holders
+	_write("app-system.acl", "rpc system info x\nrpc system reboot x\n");
+	b = orange_acl_cache_get(cache, admin);
+	TEST(b != a);
+	TEST(_access(b, "rpc", "system", "reboot", "x"));
+	TEST(!_access(a, "rpc", "system", "reboot", "x"));
+	orange_acl_unref(&a);
+
+	// new files matching the pattern are picked up
+	_write("app-wifi.acl", "rpc wifi * x\n");
+	a = orange_acl_cache_get(cache, admin);
+	TEST(a != b);
+	TEST(_access(a, "rpc", "wifi", "scan", "x"));
+	orange_acl_unref(&a);
+	orange_acl_unref(&b);
+
+	orange_acl_cache_delete(&cache);
+	TEST(cache == NULL);
+
+	orange_user_delete(&admin);
+	orange_user_delete(&other);
+	orange_user_delete(&guest);
+	TEST(system("rm -rf " ACL_DIR) == 0);
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include "test-funcs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <blobpack/blobpack.h>
+
+#include "../src/orange_coalesce.h"
+
+struct emitted {
+	int count; 
+	char name[64]; 
+	long long value; 
+}; 
+
+// remembers the last delivered event. Data of test events is {"value":<int>}
+static void _emit(void *arg, const char *name, const struct blob_field *data){
+	struct emitted *e = (struct emitted*)arg; 
+	e->count++; 
+	snprintf(e->name, sizeof(e->name), "%s", name); 
+	e->value = blob_field_get_int(blob_field_next_child(data, blob_field_first_child(data))); 
+}
+
+static int _push(struct orange_coalesce *co, const char *name, const char *key, const char *key_value, long long value, unsigned long long now){
+	struct blob b; 
+	blob_init(&b, 0, 0); 
+	blob_offset_t t = blob_open_table(&b); 
+	blob_put_string(&b, "value"); 
+	blob_put_int(&b, value); 
+	if(key){
+		blob_put_string(&b, key); 
+		blob_put_string(&b, key_value); 
+	}
+	blob_close_table(&b, t); 
+	int ret = orange_coalesce_push(co, name, blob_field_first_child(blob_head(&b)), now); 
+	blob_free(&b); 
+	return ret; 
+}
+
+int main(void){
+	struct orange_coalesce *co = orange_coalesce_new(); 
+	struct orange_coalesce_stats stats; 
+	struct emitted e; 
+	TEST(!orange_coalesce_enabled(co)); 
+	TEST(orange_coalesce_next_due(co, 0) == -1); 
+
+	// latest payload within the window wins
+	orange_coalesce_configure(co, 1000, 0, 0, NULL); 
+	TEST(orange_coalesce_enabled(co)); 
+	TEST(_push(co, "network.interface", NULL, NULL, 1, 0) == 0); 
+	TEST(_push(co, "network.interface", NULL, NULL, 2, 500) == 0); 
+	memset(&e, 0, sizeof(e)); 
+	TEST(orange_coalesce_flush(co, 900, _emit, &e) == 0); 
+	TEST(orange_coalesce_next_due(co, 900) == 100); 
+	TEST(orange_coalesce_flush(co, 1000, _emit, &e) == 1); 
+	TEST(strcmp(e.name, "network.interface") == 0 && e.value == 2); 
+	TEST(orange_coalesce_next_due(co, 1000) == -1); 
+	orange_coalesce_get_stats(co, &stats); 
+	TEST(stats.merged == 1 && stats.dropped == 0 && stats.delivered == 1 && stats.pending == 0); 
+
+	// data key keeps events of different interfaces apart
+	orange_coalesce_configure(co, 1000, 0, 0, "interface"); 
+	TEST(_push(co, "network.interface", "interface", "lan", 3, 2000) == 0); 
+	TEST(_push(co, "network.interface", "interface", "wan", 4, 2000) == 0); 
+	TEST(_push(co, "network.interface", "interface", "lan", 5, 2100) == 0); 
+	memset(&e, 0, sizeof(e)); 
+	TEST(orange_coalesce_flush(co, 3000, _emit, &e) == 2); 
+	orange_coalesce_get_stats(co, &stats); 
+	TEST(stats.merged == 2); 
+
+	// two events per second with bursts of one
+	orange_coalesce_configure(co, 0, 2, 1, NULL); 
+	TEST(_push(co, "link", NULL, NULL, 6, 10000000) == 0); 
+	memset(&e, 0, sizeof(e)); 
+	TEST(orange_coalesce_flush(co, 10000000, _emit, &e) == 1 && e.value == 6); 
+	TEST(_push(co, "link", NULL, NULL, 7, 10000010) == 0); 
+	TEST(orange_coalesce_flush(co, 10000010, _emit, &e) == 0); 
+	TEST(orange_coalesce_next_due(co, 10000010) == 499990); 
+	TEST(_push(co, "link", NULL, NULL, 8, 10000020) == 0); 
+	orange_coalesce_get_stats(co, &stats); 
+	TEST(stats.dropped == 1); 
+	TEST(orange_coalesce_flush(co, 10499999, _emit, &e) == 0); 
+	TEST(orange_coalesce_flush(co, 10500000, _emit, &e) == 1 && e.value == 8); 
+
+	// key table is bounded. Idle keys are reclaimed when it fills up. 
+	orange_coalesce_configure(co, 1000, 0, 0, NULL); 
+	char name[32]; 
+	for(int c = 0; c < ORANGE_COALESCE_MAX_KEYS; c++){
+		snprintf(name, sizeof(name), "ev.%d", c); 
+		TEST(_push(co, name, NULL, NULL, c, 20000000) == 0); 
+	}
+	TEST(_push(co, "ev.more", NULL, NULL, 0, 20000000) == -ENOSPC); 
+	memset(&e, 0, sizeof(e)); 
+	TEST(orange_coalesce_flush(co, 20001000, _emit, &e) == ORANGE_COALESCE_MAX_KEYS); 
+	TEST(_push(co, "ev.more", NULL, NULL, 0, 20001000) == 0); 
+	orange_coalesce_get_stats(co, &stats); 
+	TEST(stats.keys == 1 && stats.pending == 1); 
+
+	orange_coalesce_delete(&co); 
+	TEST(co == NULL); 
+	return 0; 
+}
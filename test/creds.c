@@ -0,0 +1,142 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../src/orange_creds.h"
+
+#define PWFILE "/tmp/orange-creds-test"
+#define BENCH_THREADS 4
+#define BENCH_LOGINS 20000
+#define BENCH_USERS 50
+
+static void _write(const char *text){
+	// write to a new file and rename it like passwd tools do
+	FILE *f = fopen(PWFILE ".new", "w");
+	TEST(f != NULL);
+	fputs(text, f);
+	fclose(f);
+	TEST(rename(PWFILE ".new", PWFILE) == 0);
+}
+
+static long long _now_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// reads the whole file for every login under one lock like the server did before
+static pthread_mutex_t reread_lock = PTHREAD_MUTEX_INITIALIZER;
+static int _reread_get(const char *username, char *hash, size_t size){
+	int ret = -ENOENT;
+	pthread_mutex_lock(&reread_lock);
+	int fd = open(PWFILE, O_RDONLY);
+	if(fd != -1){
+		int filesize = lseek(fd, 0, SEEK_END);
+		lseek(fd, 0, SEEK_SET);
+		char *text = calloc(1, filesize + 1);
+		if(read(fd, text, filesize) == filesize){
+			char *sp = NULL;
+			for(char *line = strtok_r(text, "\n", &sp); line; line = strtok_r(NULL, "\n", &sp)){
+				char *lsp = NULL;
+				char *user = strtok_r(line, " ", &lsp);
+				char *pw = strtok_r(NULL, " ", &lsp);
+				if(user && pw && !strcmp(user, username) && strlen(pw) < size){
+					strcpy(hash, pw);
+					ret = 0;
+				}
+			}
+		}
+		free(text);
+		close(fd);
+	}
+	pthread_mutex_unlock(&reread_lock);
+	return ret;
+}
+
+static struct orange_creds *bench_creds = NULL;
+
+static void *_bench_thread(void *ptr){
+	char hash[128], user[32];
+	int fails = 0;
+	for(int c = 0; c < BENCH_LOGINS / BENCH_THREADS; c++){
+		snprintf(user, sizeof(user), "user%d", c % BENCH_USERS);
+		int ret = (bench_creds)?orange_creds_get(bench_creds, user, hash, sizeof(hash)):_reread_get(user, hash, sizeof(hash));
+		if(ret != 0) fails++;
+	}
+	return (void*)(long)fails;
+}
+
+static long long _bench(struct orange_creds *creds){
+	pthread_t threads[BENCH_THREADS];
+	long fails = 0;
+	bench_creds = creds;
+	long long start = _now_us();
+	for(int c = 0; c < BENCH_THREADS; c++) pthread_create(&threads[c], NULL, _bench_thread, NULL);
+	for(int c = 0; c < BENCH_THREADS; c++){
+		void *ret = NULL;
+		pthread_join(threads[c], &ret);
+		fails += (long)ret;
+	}
+	TEST(fails == 0);
+	return _now_us() - start;
+}
+
+int main(void){
+	char hash[64];
+
+	unlink(PWFILE);
+	struct orange_creds *creds = orange_creds_new(PWFILE);
+	TEST(orange_creds_get(creds, "admin", hash, sizeof(hash)) == -ENOENT);
+
+	_write("admin d033e22ae348aeb5660fc2140aec35850c4da997\nuser foo\n\nbroken\n");
+	TEST(orange_creds_get(creds, "admin", hash, sizeof(hash)) == 0);
+	TEST(strcmp(hash, "d033e22ae348aeb5660fc2140aec35850c4da997") == 0);
+	TEST(orange_creds_get(creds, "user", hash, sizeof(hash)) == 0);
+	TEST(strcmp(hash, "foo") == 0);
+	TEST(orange_creds_get(creds, "broken", hash, sizeof(hash)) == -ENOENT);
+	TEST(orange_creds_get(creds, "nobody", hash, sizeof(hash)) == -ENOENT);
+	TEST(orange_creds_get(creds, "admin", hash, 8) == -ENOSPC);
+
+	// changes are picked up
+	_write("admin bar\n");
+	TEST(orange_creds_get(creds, "admin", hash, sizeof(hash)) == 0);
+	TEST(strcmp(hash, "bar") == 0);
+	TEST(orange_creds_get(creds, "user", hash, sizeof(hash)) == -ENOENT);
+
+	// last good table is kept when the file goes away
+	unlink(PWFILE);
+	TEST(orange_creds_update(creds) == -ENOENT);
+	TEST(orange_creds_get(creds, "admin", hash, sizeof(hash)) == 0);
+	TEST(strcmp(hash, "bar") == 0);
+
+	// login storm: every login re-reading the file vs change detection
+	char *text = calloc(1, BENCH_USERS * 64);
+	for(int c = 0; c < BENCH_USERS; c++){
+		char line[64];
+		snprintf(line, sizeof(line), "user%d %040d\n", c, c);
+		strcat(text, line);
+	}
+	_write(text);
+	free(text);
+	TEST(orange_creds_update(creds) == 0);
+
+	long long reread_us = _bench(NULL);
+	long long creds_us = _bench(creds);
+	printf("%d logins with %d threads: re-read %lldus (%lld/s), creds %lldus (%lld/s)\n",
+		BENCH_LOGINS, BENCH_THREADS,
+		reread_us, BENCH_LOGINS * 1000000LL / (reread_us + 1),
+		creds_us, BENCH_LOGINS * 1000000LL / (creds_us + 1));
+
+	orange_creds_delete(&creds);
+	TEST(creds == NULL);
+	unlink(PWFILE);
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+#include "test-funcs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <blobpack/blobpack.h>
+
+#include "../src/orange_eq.h"
+
+#define QUEUE_NAME "/orange-eq-test"
+#define PRODUCERS 4
+#define EVENTS 10000
+
+static void *_producer(void *ptr){
+	struct orange_eq eq; 
+	struct blob b; 
+	if(orange_eq_open_transport(&eq, QUEUE_NAME, false, ORANGE_EQ_SHM) != 0) return NULL; 
+	blob_init(&b, 0, 0); 
+	for(int c = 0; c < EVENTS; c++){
+		blob_reset(&b); 
+		blob_put_string(&b, "test.event"); 
+		blob_put_int(&b, c); 
+		// server drains the ring while we are filling it
+		while(orange_eq_send(&eq, &b) == -EAGAIN); 
+	}
+	blob_free(&b); 
+	orange_eq_close(&eq); 
+	return NULL; 
+}
+
+static void _put_event(struct blob *b, int value){
+	blob_reset(b); 
+	blob_put_string(b, "test.event"); 
+	blob_put_int(b, value); 
+}
+
+static long long _now_us(void){
+	struct timespec ts; 
+	clock_gettime(CLOCK_MONOTONIC, &ts); 
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000; 
+}
+
+// producers notice when a new server replaces their ring and the old server leaves the new ring alone
+static void _test_replace(void){
+	struct orange_eq old_server, new_server, eq; 
+	struct blob b, out; 
+	blob_init(&b, 0, 0); 
+	_put_event(&b, 1); 
+	TEST(orange_eq_open_transport(&old_server, QUEUE_NAME, true, ORANGE_EQ_SHM) == 0); 
+	TEST(orange_eq_open_transport(&eq, QUEUE_NAME, false, ORANGE_EQ_SHM) == 0); 
+	TEST(orange_eq_send(&eq, &b) == 0); 
+
+	TEST(orange_eq_open_transport(&new_server, QUEUE_NAME, true, ORANGE_EQ_SHM) == 0); 
+	TEST(orange_eq_recv(&old_server, &out) == 1); 
+	orange_eq_close(&old_server); 
+	TEST(orange_eq_send(&eq, &b) == -EPIPE); 
+	orange_eq_close(&eq); 
+
+	TEST(orange_eq_open_transport(&eq, QUEUE_NAME, false, ORANGE_EQ_SHM) == 0); 
+	TEST(orange_eq_send(&eq, &b) == 0); 
+	TEST(orange_eq_recv(&new_server, &out) == 1); 
+	orange_eq_close(&eq); 
+	orange_eq_close(&new_server); 
+	blob_free(&b); 
+}
+
+// a reservation that is never committed (producer died) makes the server drop the ring instead of stalling forever
+static void _test_stuck(void){
+	struct orange_eq server, eq; 
+	struct blob b, out; 
+	blob_init(&b, 0, 0); 
+	_put_event(&b, 1); 
+	TEST(orange_eq_open_transport(&server, QUEUE_NAME, true, ORANGE_EQ_SHM) == 0); 
+	TEST(orange_eq_open_transport(&eq, QUEUE_NAME, false, ORANGE_EQ_SHM) == 0); 
+	TEST(orange_eq_send(&eq, &b) == 0); 
+	__atomic_add_fetch(&eq.ring->head, 64, __ATOMIC_SEQ_CST); 
+	TEST(orange_eq_send(&eq, &b) == 0); 
+
+	long long start = _now_us(); 
+	TEST(orange_eq_recv(&server, &out) == 1); 
+	TEST(orange_eq_recv(&server, &out) == -EAGAIN); 
+	while(server.ring && _now_us() - start < 5 * ORANGE_EQ_SHM_STUCK_US){
+		TEST(orange_eq_wait(&server, -1) >= 0); 
+	}
+	TEST(server.ring == NULL); 
+	TEST(_now_us() - start >= ORANGE_EQ_SHM_STUCK_US); 
+	TEST(orange_eq_send(&eq, &b) == -EPIPE); 
+	orange_eq_close(&eq); 
+	orange_eq_close(&server); 
+	blob_free(&b); 
+}
+
+int main(void){
+	struct orange_eq server; 
+	if(orange_eq_open_transport(&server, QUEUE_NAME, true, ORANGE_EQ_SHM) != 0){
+		printf("shared memory event queue not available, skipping\n"); 
+		return 0; 
+	}
+
+	// producers can not connect to a ring that does not exist
+	struct orange_eq eq; 
+	TEST(orange_eq_open_transport(&eq, "/orange-eq-none", false, ORANGE_EQ_SHM) != 0); 
+
+	TEST(orange_eq_wait(&server, 1000) == 0); 
+
+	// events that do not fit into the ring are refused
+	TEST(orange_eq_open_transport(&eq, QUEUE_NAME, false, ORANGE_EQ_SHM) == 0); 
+	struct blob big; 
+	blob_init(&big, 0, 0); 
+	char *str = calloc(1, ORANGE_EQ_SHM_MAX_EVENT + 1); 
+	memset(str, 'a', ORANGE_EQ_SHM_MAX_EVENT); 
+	blob_put_string(&big, str); 
+	TEST(orange_eq_send(&eq, &big) == -EMSGSIZE); 
+	free(str); 
+	blob_free(&big); 
+	orange_eq_close(&eq); 
+
+	pthread_t threads[PRODUCERS]; 
+	for(int c = 0; c < PRODUCERS; c++) pthread_create(&threads[c], NULL, _producer, NULL); 
+
+	// every event arrives exactly once
+	int received = 0; 
+	long long sum = 0; 
+	while(received < PRODUCERS * EVENTS){
+		if(orange_eq_wait(&server, 5000000) <= 0) break; 
+		struct blob b; 
+		while(orange_eq_recv(&server, &b) > 0){
+			const struct blob_field *name = blob_field_first_child(blob_head(&b)); 
+			sum += blob_field_get_int(blob_field_next_child(blob_head(&b), name)); 
+			received++; 
+		}
+	}
+	for(int c = 0; c < PRODUCERS; c++) pthread_join(threads[c], NULL); 
+	TEST(received == PRODUCERS * EVENTS); 
+	TEST(sum == (long long)PRODUCERS * EVENTS * (EVENTS - 1) / 2); 
+
+	TEST(orange_eq_wakeup(&server) == 0); 
+	TEST(orange_eq_wait(&server, -1) == -ECANCELED); 
+	orange_eq_close(&server); 
+
+	_test_replace(); 
+	_test_stuck(); 
+	return 0; 
+}
@@ -0,0 +1,83 @@
+#include "test-funcs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <blobpack/blobpack.h>
+
+#include "../src/orange_evlog.h"
+
+struct replayed {
+	int count; 
+	unsigned long long seqs[16]; 
+}; 
+
+static void _emit(void *arg, unsigned long long seq, const char *name, const struct blob_field *data){
+	struct replayed *r = (struct replayed*)arg; 
+	if(r->count < 16) r->seqs[r->count] = seq; 
+	r->count++; 
+}
+
+static unsigned long long _append(struct orange_evlog *log, const char *name){
+	struct blob b; 
+	blob_init(&b, 0, 0); 
+	blob_offset_t t = blob_open_table(&b); 
+	blob_put_string(&b, "up"); 
+	blob_put_int(&b, 1); 
+	blob_close_table(&b, t); 
+	unsigned long long seq = orange_evlog_append(log, name, blob_field_first_child(blob_head(&b))); 
+	blob_free(&b); 
+	return seq; 
+}
+
+int main(void){
+	struct orange_evlog *log = orange_evlog_new(4096); 
+	struct replayed r; 
+
+	TEST(orange_evlog_last_seq(log) == 0); 
+	memset(&r, 0, sizeof(r)); 
+	TEST(orange_evlog_replay(log, 0, _emit, &r) == 0); 
+
+	TEST(_append(log, "network.lan") == 1); 
+	TEST(_append(log, "network.wan") == 2); 
+	TEST(_append(log, "wifi.scan") == 3); 
+	TEST(orange_evlog_count(log) == 3); 
+
+	// client that has seen event 1 gets 2 and 3
+	memset(&r, 0, sizeof(r)); 
+	TEST(orange_evlog_replay(log, 1, _emit, &r) == 2); 
+	TEST(r.seqs[0] == 2 && r.seqs[1] == 3); 
+	memset(&r, 0, sizeof(r)); 
+	TEST(orange_evlog_replay(log, 0, _emit, &r) == 3); 
+	TEST(orange_evlog_replay(log, 3, _emit, &r) == 0); 
+	// sequence number from before a restart
+	TEST(orange_evlog_replay(log, 10, _emit, &r) == -ERANGE); 
+
+	// shrinking the log drops oldest events and makes older replays impossible
+	size_t one = orange_evlog_bytes(log) / 3; 
+	orange_evlog_set_size(log, one * 2); 
+	TEST(orange_evlog_count(log) == 2); 
+	TEST(orange_evlog_bytes(log) <= one * 2); 
+	memset(&r, 0, sizeof(r)); 
+	TEST(orange_evlog_replay(log, 0, _emit, &r) == -ERANGE); 
+	TEST(r.count == 0); 
+	TEST(orange_evlog_replay(log, 1, _emit, &r) == 2); 
+
+	// log keeps the newest events as new ones come in
+	TEST(_append(log, "wifi.assoc") == 4); 
+	TEST(orange_evlog_count(log) == 2); 
+	memset(&r, 0, sizeof(r)); 
+	TEST(orange_evlog_replay(log, 2, _emit, &r) == 2); 
+	TEST(r.seqs[0] == 3 && r.seqs[1] == 4); 
+
+	// events that do not fit leave a gap
+	orange_evlog_set_size(log, 0); 
+	TEST(_append(log, "wifi.scan") == 5); 
+	TEST(orange_evlog_count(log) == 0); 
+	TEST(orange_evlog_replay(log, 4, _emit, &r) == -ERANGE); 
+	TEST(orange_evlog_replay(log, 5, _emit, &r) == 0); 
+
+	orange_evlog_delete(&log); 
+	TEST(log == NULL); 
+	return 0; 
+}
@@ -0,0 +1,170 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <blobpack/blobpack.h>
+
+#include "../src/orange_handoff.h"
+#include "../src/orange_unix_server.h"
+
+#define SOCKET_PATH "/tmp/orange-handoff-test.sock"
+#define SOCKET_URL "unix://" SOCKET_PATH
+
+static int _connect(void){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
+	return fd;
+}
+
+static struct orange_message *_recv(orange_server_t server){
+	struct orange_message *msg = NULL;
+	for(int c = 0; c < 50 && !msg; c++){
+		orange_server_recv(server, &msg, 100000UL);
+		if(msg && msg->type != UBUS_MSG_METHOD_CALL) orange_message_delete(&msg);
+	}
+	return msg;
+}
+
+static void _reply(orange_server_t server, uint32_t peer){
+	struct orange_message *res = orange_message_new();
+	res->peer = peer;
+	blob_offset_t t = blob_open_table(&res->buf);
+	blob_put_string(&res->buf, "result");
+	blob_put_string(&res->buf, "ok");
+	blob_close_table(&res->buf, t);
+	TEST(orange_server_send(server, &res) == 0);
+}
+
+static void _request(int fd){
+	const char *req = "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"list\",\"params\":[]}";
+	TEST(send(fd, req, strlen(req), 0) == (ssize_t)strlen(req));
+}
+
+// new instance: takes over the socket and answers one request
+static int _new_instance(bool fail){
+	struct orange_handoff handoff;
+	orange_handoff_init(&handoff);
+	TEST(orange_handoff_receive(&handoff, 5000) == 1);
+	TEST(getenv(ORANGE_HANDOFF_ENV) == NULL);
+	if(fail){
+		TEST(orange_handoff_complete(&handoff, -EINVAL) == 0);
+		orange_handoff_deinit(&handoff);
+		return 0;
+	}
+
+	struct blob state;
+	blob_init(&state, 0, 0);
+	TEST(orange_handoff_get_state(&handoff, &state));
+	char *json = blob_field_to_json(blob_field_first_child(blob_head(&state)));
+	TEST(strstr(json, "\"admin\"") != NULL);
+	free(json);
+	blob_free(&state);
+
+	int fd = orange_handoff_take_socket(&handoff, SOCKET_URL);
+	TEST(fd >= 0);
+	TEST(orange_handoff_take_socket(&handoff, SOCKET_URL) < 0);
+	orange_server_t server = orange_unix_server_new();
+	TEST(orange_server_adopt(server, SOCKET_URL, fd) == 0);
+	TEST(orange_handoff_complete(&handoff, 0) == 0);
+	orange_handoff_deinit(&handoff);
+
+	struct orange_message *msg = _recv(server);
+	TEST(msg != NULL);
+	_reply(server, msg->peer);
+	orange_message_delete(&msg);
+
+	// wait until old instance has read the reply and disconnected
+	for(int c = 0; c < 50 && !msg; c++){
+		orange_server_recv(server, &msg, 100000UL);
+	}
+	TEST(msg != NULL && msg->type == UBUS_MSG_PEER_DISCONNECTED);
+	orange_message_delete(&msg);
+	orange_server_delete(server);
+	return 0;
+}
+
+static void _set_state(struct orange_handoff *handoff){
+	struct blob state;
+	blob_init(&state, 0, 0);
+	blob_offset_t t = blob_open_table(&state);
+	blob_put_string(&state, "sessions");
+	blob_offset_t a = blob_open_array(&state);
+	blob_offset_t s = blob_open_array(&state);
+	blob_put_string(&state, "0123456789abcdef0123456789abcdef");
+	blob_put_string(&state, "admin");
+	blob_put_int(&state, 100);
+	blob_put_int(&state, 300);
+	blob_close_array(&state, s);
+	blob_close_array(&state, a);
+	blob_close_table(&state, t);
+	orange_handoff_set_state(handoff, blob_field_first_child(blob_head(&state)));
+	blob_free(&state);
+}
+
+int main(int argc, char **argv){
+	if(argc > 1) return _new_instance(strcmp(argv[1], "fail") == 0);
+
+	char buf[256];
+	int status = 0;
+	struct orange_handoff handoff;
+	orange_server_t server = orange_unix_server_new();
+	TEST(orange_server_listen(server, SOCKET_URL) == 0);
+
+	// new instance fails so we take the socket back and go on serving
+	int fd = orange_server_detach(server);
+	TEST(fd >= 0);
+	TEST(orange_server_detach(server) < 0);
+	orange_handoff_init(&handoff);
+	TEST(orange_handoff_add_socket(&handoff, SOCKET_URL, fd) == 0);
+	char fail[] = "fail", *fail_args[] = { argv[0], fail, NULL };
+	TEST(orange_handoff_spawn(&handoff, fail_args) == 0);
+	TEST(orange_handoff_wait(&handoff, 5000) == -EINVAL);
+	fd = orange_handoff_take_socket(&handoff, SOCKET_URL);
+	TEST(fd >= 0);
+	TEST(orange_server_adopt(server, SOCKET_URL, fd) == 0);
+	orange_handoff_deinit(&handoff);
+
+	int cfd = _connect();
+	TEST(cfd >= 0);
+	_request(cfd);
+	struct orange_message *msg = _recv(server);
+	TEST(msg != NULL);
+	_reply(server, msg->peer);
+	orange_message_delete(&msg);
+	TEST(recv(cfd, buf, sizeof(buf), 0) > 0);
+	close(cfd);
+
+	// new instance takes over. Clients that connect meanwhile wait in the backlog. 
+	fd = orange_server_detach(server);
+	TEST(fd >= 0);
+	orange_handoff_init(&handoff);
+	TEST(orange_handoff_add_socket(&handoff, SOCKET_URL, fd) == 0);
+	_set_state(&handoff);
+	char new[] = "new", *args[] = { argv[0], new, NULL };
+	TEST(orange_handoff_spawn(&handoff, args) == 0);
+	cfd = _connect();
+	TEST(cfd >= 0);
+	_request(cfd);
+	TEST(orange_handoff_wait(&handoff, 5000) == 0);
+	ssize_t len = recv(cfd, buf, sizeof(buf) - 1, 0);
+	TEST(len > 0);
+	buf[len] = 0;
+	TEST(strstr(buf, "\"ok\"") != NULL);
+	close(cfd);
+	TEST(waitpid(handoff.pid, &status, 0) == handoff.pid);
+	TEST(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	orange_handoff_deinit(&handoff);
+
+	// we no longer own the socket file
+	orange_server_delete(server);
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <math.h>
+#include <memory.h>
+#include <blobpack/blobpack.h>
+#include "../src/orange_msgpack.h"
+
+int main(void){
+	struct blob b, out; 
+	blob_init(&b, 0, 0); 
+	blob_init(&out, 0, 0); 
+
+	blob_offset_t t = blob_open_table(&b); 
+	blob_put_string(&b, "jsonrpc"); 
+	blob_put_string(&b, "2.0"); 
+	blob_put_string(&b, "id"); 
+	blob_put_int(&b, 70000); 
+	blob_put_string(&b, "method"); 
+	blob_put_string(&b, "call"); 
+	blob_put_string(&b, "params"); 
+	blob_offset_t a = blob_open_array(&b); 
+	blob_put_string(&b, "01234567890123456789012345678901234567890123456789"); 
+	blob_put_int(&b, -1); 
+	blob_put_int(&b, -40000); 
+	blob_put_real(&b, 2.25); 
+	blob_close_array(&b, a); 
+	blob_close_table(&b, t); 
+
+	// pack with some headroom and make sure that headroom is left untouched
+	size_t len = 0; 
+	uint8_t *buf = orange_msgpack_pack(blob_field_first_child(blob_head(&b)), 16, 8, &len); 
+	TEST(buf != NULL); 
+	TEST(len > 0); 
+	TEST(buf[16] == (0x80 | 4)); // fixmap with 4 entries
+	// tailroom is writable (transport may put trailer there)
+	memset(buf + 16 + len, 0xff, 8); 
+
+	// round trip should give exactly the same json
+	TEST(orange_msgpack_unpack(&out, buf + 16, len)); 
+	char *orig = blob_field_to_json(blob_field_first_child(blob_head(&b))); 
+	char *copy = blob_field_to_json(blob_field_first_child(blob_head(&out))); 
+	printf("%s\n%s\n", orig, copy); 
+	TEST(strcmp(orig, copy) == 0); 
+	free(orig); 
+	free(copy); 
+
+	// truncated and trailing data must be rejected
+	blob_reset(&out); 
+	TEST(!orange_msgpack_unpack(&out, buf + 16, len - 1)); 
+	uint8_t *trailing = malloc(len + 1); 
+	memcpy(trailing, buf + 16, len); 
+	trailing[len] = 0xc0; 
+	blob_reset(&out); 
+	TEST(!orange_msgpack_unpack(&out, trailing, len + 1)); 
+	free(trailing); 
+
+	// only strings are allowed as map keys
+	const uint8_t intkey[] = { 0x81, 0x01, 0x02 }; 
+	blob_reset(&out); 
+	TEST(!orange_msgpack_unpack(&out, intkey, sizeof(intkey))); 
+
+	// huge element counts must not be trusted
+	const uint8_t bigarray[] = { 0xdd, 0x7f, 0xff, 0xff, 0xff, 0x01 }; 
+	blob_reset(&out); 
+	TEST(!orange_msgpack_unpack(&out, bigarray, sizeof(bigarray))); 
+
+	free(buf); 
+	blob_free(&b); 
+	blob_free(&out); 
+
+	return 0; 
+}
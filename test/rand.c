@@ -0,0 +1,117 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "../src/orange_rand.h"
+#include "../src/util.h"
+
+#define BENCH_IDS 100000
+
+static long long _now_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void *_thread(void *ptr){
+	orange_rand_bytes(ptr, 16);
+	return NULL;
+}
+
+// how session ids were generated before
+static void _urandom_sid(char *hash){
+	unsigned char buf[16] = { 0 };
+	FILE *f = fopen("/dev/urandom", "r");
+	TEST(f != NULL);
+	TEST(fread(buf, 1, sizeof(buf), f) == sizeof(buf));
+	fclose(f);
+	for(size_t i = 0; i < sizeof(buf); i++) sprintf(&hash[i<<1], "%02x", buf[i]);
+}
+
+static void _rand_sid(char *hash){
+	unsigned char buf[16];
+	orange_rand_bytes(buf, sizeof(buf));
+	hex_encode(hash, buf, sizeof(buf));
+}
+
+int main(void){
+	// test vector from RFC 7539 section 2.3.2
+	uint32_t state[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+		0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+		0x00000001, 0x09000000, 0x4a000000, 0x00000000
+	};
+	static const uint8_t expected[64] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+		0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+		0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e
+	};
+	uint8_t block[64];
+	orange_rand_chacha20_block(state, block);
+	TEST(memcmp(block, expected, sizeof(block)) == 0);
+
+	char hex[9];
+	hex_encode(hex, "\x01\xab\xff\x10", 4);
+	TEST(strcmp(hex, "01abff10") == 0);
+
+	// consecutive outputs differ, also across refills
+	uint8_t a[16], b[16];
+	orange_rand_bytes(a, sizeof(a));
+	for(int c = 0; c < 1000; c++){
+		orange_rand_bytes(b, sizeof(b));
+		TEST(memcmp(a, b, sizeof(a)) != 0);
+		memcpy(a, b, sizeof(a));
+	}
+	uint8_t big[5000];
+	memset(big, 0, sizeof(big));
+	orange_rand_bytes(big, sizeof(big));
+	int zeros = 0;
+	for(size_t c = 0; c < sizeof(big); c++) if(!big[c]) zeros++;
+	TEST(zeros < 100);
+
+	// every thread has its own generator
+	pthread_t t1, t2;
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	pthread_create(&t1, NULL, _thread, a);
+	pthread_create(&t2, NULL, _thread, b);
+	pthread_join(t1, NULL);
+	pthread_join(t2, NULL);
+	TEST(memcmp(a, b, sizeof(a)) != 0);
+
+	// forked child does not repeat the numbers of the parent
+	int fds[2];
+	TEST(pipe(fds) == 0);
+	pid_t pid = fork();
+	if(pid == 0){
+		orange_rand_bytes(a, sizeof(a));
+		if(write(fds[1], a, sizeof(a)) != sizeof(a)) _exit(1);
+		_exit(0);
+	}
+	orange_rand_bytes(a, sizeof(a));
+	TEST(read(fds[0], b, sizeof(b)) == sizeof(b));
+	waitpid(pid, NULL, 0);
+	TEST(memcmp(a, b, sizeof(a)) != 0);
+	close(fds[0]);
+	close(fds[1]);
+
+	char sid[33];
+	long long start = _now_us();
+	for(int c = 0; c < BENCH_IDS; c++) _urandom_sid(sid);
+	long long urandom_us = _now_us() - start;
+	start = _now_us();
+	for(int c = 0; c < BENCH_IDS; c++) _rand_sid(sid);
+	long long rand_us = _now_us() - start;
+	TEST(strlen(sid) == 32);
+	printf("%d session ids: /dev/urandom %lldus, chacha20 %lldus\n", BENCH_IDS, urandom_us, rand_us);
+
+	return 0;
+}
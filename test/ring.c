@@ -0,0 +1,173 @@
+#include "test-funcs.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <utype/list.h>
+
+#include "../src/orange_ring.h"
+
+#define BENCH_WORKERS 4
+#define BENCH_REQUESTS 10000
+
+struct request {
+	struct list_head list; 
+	long long queued; 
+}; 
+
+struct bench_result {
+	long long total_us; 
+	long long latency_sum; 
+	long long latency_max; 
+	int received; 
+}; 
+
+static long long _now_us(void){
+	struct timespec ts; 
+	clock_gettime(CLOCK_MONOTONIC, &ts); 
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000; 
+}
+
+static void _account(struct bench_result *res, pthread_mutex_t *lock, struct request *req){
+	long long latency = _now_us() - req->queued; 
+	pthread_mutex_lock(lock); 
+	res->latency_sum += latency; 
+	if(latency > res->latency_max) res->latency_max = latency; 
+	res->received++; 
+	pthread_mutex_unlock(lock); 
+}
+
+// condvar queue as used by servers before the ring
+static struct {
+	pthread_mutex_t lock; 
+	pthread_cond_t ready; 
+	struct list_head queue; 
+	bool done; 
+	pthread_mutex_t stats_lock; 
+	struct bench_result res; 
+} cv; 
+
+static void *_cv_worker(void *ptr){
+	pthread_mutex_lock(&cv.lock); 
+	while(1){
+		while(list_empty(&cv.queue) && !cv.done) pthread_cond_wait(&cv.ready, &cv.lock); 
+		if(list_empty(&cv.queue)) break; 
+		struct request *req = list_first_entry(&cv.queue, struct request, list); 
+		list_del_init(&req->list); 
+		pthread_mutex_unlock(&cv.lock); 
+		_account(&cv.res, &cv.stats_lock, req); 
+		pthread_mutex_lock(&cv.lock); 
+	}
+	pthread_mutex_unlock(&cv.lock); 
+	return NULL; 
+}
+
+static struct bench_result _bench_condvar(struct request *reqs){
+	pthread_t threads[BENCH_WORKERS]; 
+	memset(&cv, 0, sizeof(cv)); 
+	pthread_mutex_init(&cv.lock, NULL); 
+	pthread_mutex_init(&cv.stats_lock, NULL); 
+	pthread_cond_init(&cv.ready, NULL); 
+	INIT_LIST_HEAD(&cv.queue); 
+	for(int c = 0; c < BENCH_WORKERS; c++) pthread_create(&threads[c], NULL, _cv_worker, NULL); 
+
+	long long start = _now_us(); 
+	for(int c = 0; c < BENCH_REQUESTS; c++){
+		reqs[c].queued = _now_us(); 
+		pthread_mutex_lock(&cv.lock); 
+		list_add_tail(&reqs[c].list, &cv.queue); 
+		pthread_cond_signal(&cv.ready); 
+		pthread_mutex_unlock(&cv.lock); 
+	}
+	pthread_mutex_lock(&cv.lock); 
+	cv.done = true; 
+	pthread_cond_broadcast(&cv.ready); 
+	pthread_mutex_unlock(&cv.lock); 
+	for(int c = 0; c < BENCH_WORKERS; c++) pthread_join(threads[c], NULL); 
+	cv.res.total_us = _now_us() - start; 
+	return cv.res; 
+}
+
+static struct {
+	struct orange_ring *ring; 
+	pthread_mutex_t stats_lock; 
+	struct bench_result res; 
+} rb; 
+
+static void *_ring_worker(void *ptr){
+	void *req = NULL; 
+	while(orange_ring_pop_wait(rb.ring, &req, 1000000ULL) != -ECANCELED){
+		if(req) _account(&rb.res, &rb.stats_lock, req); 
+		req = NULL; 
+	}
+	// ring is closed but there may still be requests left
+	while((req = orange_ring_pop(rb.ring))) _account(&rb.res, &rb.stats_lock, req); 
+	return NULL; 
+}
+
+static struct bench_result _bench_ring(struct request *reqs){
+	pthread_t threads[BENCH_WORKERS]; 
+	memset(&rb, 0, sizeof(rb)); 
+	pthread_mutex_init(&rb.stats_lock, NULL); 
+	rb.ring = orange_ring_new(BENCH_REQUESTS); 
+	for(int c = 0; c < BENCH_WORKERS; c++) pthread_create(&threads[c], NULL, _ring_worker, NULL); 
+
+	long long start = _now_us(); 
+	for(int c = 0; c < BENCH_REQUESTS; c++){
+		reqs[c].queued = _now_us(); 
+		if(orange_ring_push(rb.ring, &reqs[c]) != 0) break; 
+	}
+	// wait for workers to drain the ring before closing it
+	while(orange_ring_count(rb.ring)) sched_yield(); 
+	orange_ring_close(rb.ring); 
+	for(int c = 0; c < BENCH_WORKERS; c++) pthread_join(threads[c], NULL); 
+	rb.res.total_us = _now_us() - start; 
+	orange_ring_delete(&rb.ring); 
+	return rb.res; 
+}
+
+static void _print_result(const char *name, struct bench_result *res){
+	printf("%s: %d requests in %lldus, latency avg %lldus max %lldus\n", name, res->received, res->total_us, 
+		(res->received)?res->latency_sum / res->received:0, res->latency_max); 
+}
+
+int main(void){
+	struct orange_ring *ring = orange_ring_new(3); 
+	int a = 1, b = 2, c = 3, d = 4, e = 5; 
+	void *ptr = NULL; 
+
+	// size is rounded up to 4
+	TEST(orange_ring_pop(ring) == NULL); 
+	TEST(orange_ring_push(ring, &a) == 0); 
+	TEST(orange_ring_push(ring, &b) == 0); 
+	TEST(orange_ring_push(ring, &c) == 0); 
+	TEST(orange_ring_push(ring, &d) == 0); 
+	TEST(orange_ring_push(ring, &e) == -EAGAIN); 
+	TEST(orange_ring_count(ring) == 4); 
+	TEST(orange_ring_pop(ring) == &a); 
+	TEST(orange_ring_push(ring, &e) == 0); 
+	TEST(orange_ring_pop(ring) == &b); 
+	TEST(orange_ring_pop(ring) == &c); 
+	TEST(orange_ring_pop_wait(ring, &ptr, 1000) == 1 && ptr == &d); 
+	TEST(orange_ring_pop_wait(ring, &ptr, 1000) == 1 && ptr == &e); 
+	TEST(orange_ring_pop_wait(ring, &ptr, 1000) == -EAGAIN); 
+	orange_ring_close(ring); 
+	TEST(orange_ring_pop_wait(ring, &ptr, 1000) == -ECANCELED); 
+	orange_ring_delete(&ring); 
+	TEST(ring == NULL); 
+
+	// burst of queued requests handled by several workers
+	struct request *reqs = calloc(BENCH_REQUESTS, sizeof(struct request)); 
+	struct bench_result cv_res = _bench_condvar(reqs); 
+	struct bench_result ring_res = _bench_ring(reqs); 
+	_print_result("condvar", &cv_res); 
+	_print_result("ring", &ring_res); 
+	TEST(cv_res.received == BENCH_REQUESTS); 
+	TEST(ring_res.received == BENCH_REQUESTS); 
+	free(reqs); 
+
+	return 0; 
+}
@@ -0,0 +1,457 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+#include <blobpack/blobpack.h>
+#include <utype/list.h>
+#include <utype/utils.h>
+
+#include "../src/orange.h"
+#include "../src/orange_rpc.h"
+#include "../src/util.h"
+
+#define RECV_TIMEOUT_US 100000UL
+
+// in memory server that lets the test feed requests to rpc and look at the responses in the order they were sent
+struct fake_server {
+	const struct orange_server_api *api;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head rx;
+	struct list_head tx;
+	int num_tx;
+};
+
+static void _fake_destroy(orange_server_t socket){
+	struct fake_server *self = container_of(socket, struct fake_server, api);
+	struct orange_message *msg, *tmp;
+	list_for_each_entry_safe(msg, tmp, &self->rx, list){
+		list_del_init(&msg->list);
+		orange_message_delete(&msg);
+	}
+	list_for_each_entry_safe(msg, tmp, &self->tx, list){
+		list_del_init(&msg->list);
+		orange_message_delete(&msg);
+	}
+	pthread_mutex_destroy(&self->lock);
+	pthread_cond_destroy(&self->cond);
+	free(self);
+}
+
+static int _fake_send(orange_server_t socket, struct orange_message **msg){
+	struct fake_server *self = container_of(socket, struct fake_server, api);
+	pthread_mutex_lock(&self->lock);
+	list_add_tail(&(*msg)->list, &self->tx);
+	self->num_tx++;
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+	*msg = NULL;
+	return 0;
+}
+
+static int _fake_recv(orange_server_t socket, struct orange_message **msg, unsigned long long timeout_us){
+	struct fake_server *self = container_of(socket, struct fake_server, api);
+	struct timespec ts;
+	*msg = NULL;
+	timespec_from_now_us(&ts, timeout_us);
+	pthread_mutex_lock(&self->lock);
+	while(list_empty(&self->rx)){
+		if(pthread_cond_timedwait(&self->cond, &self->lock, &ts) != 0) break;
+	}
+	if(list_empty(&self->rx)){
+		pthread_mutex_unlock(&self->lock);
+		return -EAGAIN;
+	}
+	*msg = list_first_entry(&self->rx, struct orange_message, list);
+	list_del_init(&(*msg)->list);
+	pthread_mutex_unlock(&self->lock);
+	return 1;
+}
+
+static void *_fake_userdata(orange_server_t socket, void *ptr){
+	return NULL;
+}
+
+static orange_server_t _fake_server_new(void){
+	static const struct orange_server_api api = {
+		.destroy = _fake_destroy,
+		.send = _fake_send,
+		.recv = _fake_recv,
+		.userdata = _fake_userdata
+	};
+	struct fake_server *self = calloc(1, sizeof(struct fake_server));
+	assert(self);
+	self->api = &api;
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, NULL);
+	INIT_LIST_HEAD(&self->rx);
+	INIT_LIST_HEAD(&self->tx);
+	return &self->api;
+}
+
+static void _fake_push(orange_server_t server, struct orange_message *msg){
+	struct fake_server *self = container_of(server, struct fake_server, api);
+	timespec_now(&msg->ts_queued);
+	pthread_mutex_lock(&self->lock);
+	list_add_tail(&msg->list, &self->rx);
+	pthread_cond_broadcast(&self->cond);
+	pthread_mutex_unlock(&self->lock);
+}
+
+// sends a request to rpc. Params is a json array (without the brackets).
+static void _request(orange_server_t server, uint32_t peer, int id, const char *method, const char *params, int deadline_ms){
+	char json[512];
+	char deadline[32] = {0};
+	if(deadline_ms) snprintf(deadline, sizeof(deadline), ",\"deadline\":%d", deadline_ms);
+	snprintf(json, sizeof(json), "{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"%s\",\"params\":[%s]%s}", id, method, params, deadline);
+	struct orange_message *msg = orange_message_new();
+	msg->peer = peer;
+	TEST(blob_put_json(&msg->buf, json));
+	_fake_push(server, msg);
+}
+
+static void _call(orange_server_t server, const char *sid, uint32_t peer, int id, const char *method, int deadline_ms){
+	char params[128];
+	snprintf(params, sizeof(params), "\"%s\",\"/test\",\"%s\",{}", sid, method);
+	_request(server, peer, id, "call", params, deadline_ms);
+}
+
+static void _disconnect(orange_server_t server, uint32_t peer){
+	struct orange_message *msg = orange_message_new();
+	msg->type = UBUS_MSG_PEER_DISCONNECTED;
+	msg->peer = peer;
+	_fake_push(server, msg);
+}
+
+// waits until at least count responses have been sent. Returns number of responses.
+static int _wait_responses(orange_server_t server, int count, unsigned long long timeout_us){
+	struct fake_server *self = container_of(server, struct fake_server, api);
+	struct timespec ts;
+	timespec_from_now_us(&ts, timeout_us);
+	pthread_mutex_lock(&self->lock);
+	while(self->num_tx < count){
+		if(pthread_cond_timedwait(&self->cond, &self->lock, &ts) != 0) break;
+	}
+	int ret = self->num_tx;
+	pthread_mutex_unlock(&self->lock);
+	return ret;
+}
+
+// looks up a member of the response table
+static const struct blob_field *_field(struct orange_message *msg, const char *name){
+	const struct blob_field *root = blob_field_first_child(blob_head(&msg->buf));
+	const struct blob_field *key = blob_field_first_child(root);
+	while(key){
+		const struct blob_field *value = blob_field_next_child(root, key);
+		if(!value) break;
+		if(strcmp(blob_field_get_string(key), name) == 0) return value;
+		key = blob_field_next_child(root, value);
+	}
+	return NULL;
+}
+
+// returns the ids of responses in the order they were sent. Returns number of responses.
+static int _response_ids(orange_server_t server, int *ids, int max){
+	struct fake_server *self = container_of(server, struct fake_server, api);
+	struct orange_message *msg;
+	int count = 0;
+	pthread_mutex_lock(&self->lock);
+	list_for_each_entry(msg, &self->tx, list){
+		if(count == max) break;
+		const struct blob_field *id = _field(msg, "id");
+		ids[count++] = (id)?blob_field_get_int(id):-1;
+	}
+	pthread_mutex_unlock(&self->lock);
+	return count;
+}
+
+// returns error code of the response to request id of peer, 0 if it succeeded and 1 if there is no such response
+static int _response_error(orange_server_t server, uint32_t peer, int id){
+	struct fake_server *self = container_of(server, struct fake_server, api);
+	struct orange_message *msg;
+	int ret = 1;
+	pthread_mutex_lock(&self->lock);
+	list_for_each_entry(msg, &self->tx, list){
+		const struct blob_field *fid = _field(msg, "id");
+		if((uint32_t)msg->peer != peer || !fid || blob_field_get_int(fid) != id) continue;
+		const struct blob_field *err = _field(msg, "error");
+		ret = 0;
+		if(err){
+			const struct blob_field *code = blob_field_first_child(err);
+			ret = (code)?blob_field_get_int(blob_field_next_child(err, code)):-1;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&self->lock);
+	return ret;
+}
+
+// reads a scheduler counter under rpc lock
+#define RPC_GET(rpc, expr) ({ pthread_mutex_lock(&(rpc)->lock); long long __v = (expr); pthread_mutex_unlock(&(rpc)->lock); __v; })
+
+static void _wait_busy(struct orange_rpc *rpc, unsigned int busy){
+	for(int c = 0; c < 100 && RPC_GET(rpc, rpc->busy_workers) < busy; c++) usleep(10000);
+	TEST(RPC_GET(rpc, rpc->busy_workers) == busy);
+}
+
+// requests from lanes are taken by weight (control 8, normal 4) and not in arrival order
+static void _test_lane_weights(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 1);
+	orange_rpc_set_peer_limit(&rpc, 0);
+
+	// keep the only worker busy while the lanes fill up
+	_call(server, sid, 1, 1, "delay_echo", 0);
+	_wait_busy(&rpc, 1);
+	char params[64];
+	snprintf(params, sizeof(params), "\"%s\",\"*\"", sid);
+	for(int c = 0; c < 8; c++) _request(server, 10 + c, 100 + c, "list", params, 0);
+	for(int c = 0; c < 12; c++) _request(server, 20 + c, 200 + c, "challenge", "", 0);
+	for(int c = 0; c < 100 && RPC_GET(&rpc, rpc.lanes[ORANGE_LANE_CONTROL].queued) < 12; c++) usleep(10000);
+
+	TEST(_wait_responses(server, 21, 5000000UL) == 21);
+	int ids[21];
+	TEST(_response_ids(server, ids, 21) == 21);
+	TEST(ids[0] == 1);
+	// 8 control, 4 normal, remaining 4 control and then remaining 4 normal
+	for(int c = 0; c < 8; c++) TEST(ids[1 + c] == 200 + c);
+	for(int c = 0; c < 4; c++) TEST(ids[9 + c] == 100 + c);
+	for(int c = 0; c < 4; c++) TEST(ids[13 + c] == 208 + c);
+	for(int c = 0; c < 4; c++) TEST(ids[17 + c] == 104 + c);
+
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+// bulk requests never take more than half of the workers so control requests get through
+static void _test_bulk_cap(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 4);
+	orange_rpc_set_peer_limit(&rpc, 0);
+
+	for(int c = 0; c < 4; c++) _call(server, sid, 1 + c, 1, "delay_echo", 0);
+	_wait_busy(&rpc, 2);
+	usleep(100000);
+	TEST(RPC_GET(&rpc, rpc.lanes[ORANGE_LANE_BULK].busy) == 2);
+	TEST(RPC_GET(&rpc, rpc.lanes[ORANGE_LANE_BULK].queued) == 2);
+
+	_request(server, 10, 2, "challenge", "", 0);
+	TEST(_wait_responses(server, 1, 300000UL) == 1);
+	TEST(_response_error(server, 10, 2) == 0);
+
+	TEST(_wait_responses(server, 5, 5000000UL) == 5);
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+// a peer can only have peer_max_inflight requests running. Its queued requests are dropped when it disconnects.
+static void _test_peer_limit(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 4);
+	orange_rpc_set_peer_limit(&rpc, 1);
+
+	for(int c = 0; c < 3; c++) _call(server, sid, 5, 1 + c, "delay_echo", 0);
+	_wait_busy(&rpc, 1);
+	usleep(100000);
+	TEST(RPC_GET(&rpc, rpc.busy_workers) == 1);
+	TEST(RPC_GET(&rpc, rpc.lanes[ORANGE_LANE_BULK].queued) == 2);
+
+	// limit is per peer
+	_call(server, sid, 6, 1, "delay_echo", 0);
+	_wait_busy(&rpc, 2);
+
+	// control requests of a limited peer are not held back
+	_request(server, 5, 10, "challenge", "", 0);
+	TEST(_wait_responses(server, 1, 300000UL) == 1);
+	TEST(_response_error(server, 5, 10) == 0);
+
+	// queued request can be cancelled by the client
+	_request(server, 5, 11, "cancel", "3", 0);
+	TEST(_wait_responses(server, 3, 300000UL) == 3);
+	TEST(_response_error(server, 5, 11) == 0);
+	TEST(_response_error(server, 5, 3) == -ECANCELED);
+
+	// disconnect drops the remaining queued request of the peer
+	_disconnect(server, 5);
+	for(int c = 0; c < 100 && RPC_GET(&rpc, rpc.requests_purged) == 0; c++) usleep(10000);
+	TEST(RPC_GET(&rpc, rpc.requests_purged) == 1);
+	TEST(RPC_GET(&rpc, rpc.lanes[ORANGE_LANE_BULK].queued) == 0);
+
+	TEST(orange_rpc_drain(&rpc, 5000000UL) == 0);
+	TEST(_response_error(server, 5, 2) == 1);
+	TEST(_response_error(server, 6, 1) == 0);
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+// a client can only have peer_max_queued requests waiting and the reader stops reading when max_queued are waiting
+static void _test_queue_limit(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	struct fake_server *self = container_of(server, struct fake_server, api);
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 1);
+	orange_rpc_set_peer_limit(&rpc, 0);
+	orange_rpc_set_queue_limit(&rpc, 100, 2);
+
+	_call(server, sid, 1, 1, "delay_echo", 0);
+	_wait_busy(&rpc, 1);
+	for(int c = 0; c < 4; c++) _call(server, sid, 1, 2 + c, "echo", 0);
+	TEST(_wait_responses(server, 2, 500000UL) == 2);
+	TEST(_response_error(server, 1, 4) == -EBUSY);
+	TEST(_response_error(server, 1, 5) == -EBUSY);
+	TEST(RPC_GET(&rpc, rpc.requests_rejected) == 2);
+	TEST(_wait_responses(server, 5, 5000000UL) == 5);
+	TEST(_response_error(server, 1, 2) == 0);
+	TEST(_response_error(server, 1, 3) == 0);
+	TEST(orange_rpc_drain(&rpc, 1000000UL) == 0);
+
+	// requests stay with the server while the scheduler is full
+	orange_rpc_set_queue_limit(&rpc, 2, 100);
+	_call(server, sid, 2, 1, "delay_echo", 0);
+	_wait_busy(&rpc, 1);
+	for(int c = 0; c < 4; c++) _call(server, sid, 3 + c, 1, "echo", 0);
+	for(int c = 0; c < 100 && RPC_GET(&rpc, rpc.reader_stalled) == 0; c++) usleep(10000);
+	TEST(RPC_GET(&rpc, rpc.reader_stalled) == 1);
+	usleep(100000);
+	pthread_mutex_lock(&self->lock);
+	TEST(!list_empty(&self->rx));
+	pthread_mutex_unlock(&self->lock);
+	TEST(RPC_GET(&rpc, rpc.lanes[ORANGE_LANE_NORMAL].queued) == 2);
+	TEST(_wait_responses(server, 10, 5000000UL) == 10);
+	for(int c = 0; c < 4; c++) TEST(_response_error(server, 3 + c, 1) == 0);
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+// requests that waited past their deadline are answered with an error instead of being executed
+static void _test_deadline(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 1);
+
+	_call(server, sid, 1, 1, "delay_echo", 0);
+	_wait_busy(&rpc, 1);
+	_call(server, sid, 2, 2, "echo", 100);
+	_call(server, sid, 3, 3, "echo", 10000);
+
+	TEST(_wait_responses(server, 3, 5000000UL) == 3);
+	TEST(_response_error(server, 1, 1) == 0);
+	TEST(_response_error(server, 2, 2) == -ETIMEDOUT);
+	TEST(_response_error(server, 3, 3) == 0);
+	TEST(RPC_GET(&rpc, rpc.requests_expired) == 1);
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+// requests of one peer are answered in order when it may only have one running. Method names are looked up exactly.
+static void _test_ordering(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 4);
+	orange_rpc_set_peer_limit(&rpc, 1);
+
+	for(int c = 0; c < 20; c++) _call(server, sid, 7, c, "echo", 0);
+	TEST(_wait_responses(server, 20, 5000000UL) == 20);
+	int ids[20];
+	TEST(_response_ids(server, ids, 20) == 20);
+	for(int c = 0; c < 20; c++) TEST(ids[c] == c);
+
+	// names that hash to the slot of a built in method but are not that method
+	_request(server, 8, 1, "lisT", "", 0);
+	_request(server, 8, 2, "coll", "", 0);
+	_request(server, 8, 3, "", "", 0);
+	TEST(_wait_responses(server, 23, 1000000UL) == 23);
+	TEST(_response_error(server, 8, 1) == -EINVAL);
+	TEST(_response_error(server, 8, 2) == -EINVAL);
+	TEST(_response_error(server, 8, 3) == -EINVAL);
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+// empty and oversized batches are answered with a single error that carries a null id
+static void _test_batch_errors(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	struct fake_server *self = container_of(server, struct fake_server, api);
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 1);
+	orange_rpc_set_max_batch(&rpc, 2);
+
+	const char *batches[] = { "[]", "[1,2,3]" };
+	for(int c = 0; c < 2; c++){
+		struct orange_message *msg = orange_message_new();
+		msg->peer = 9;
+		TEST(blob_put_json(&msg->buf, batches[c]));
+		_fake_push(server, msg);
+		TEST(_wait_responses(server, c + 1, 1000000UL) == c + 1);
+	}
+
+	struct orange_message *msg;
+	list_for_each_entry(msg, &self->tx, list){
+		TEST(_field(msg, "id") != NULL);
+		TEST(_field(msg, "error") != NULL);
+		char *json = blob_field_to_json(blob_field_first_child(blob_head(&msg->buf)));
+		TEST(strstr(json, "\"id\":null") != NULL);
+		free(json);
+	}
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+// pool only grows when requests are waiting for a worker
+static void _test_pool_growth(struct orange *app, const char *sid){
+	struct orange_rpc rpc;
+	orange_server_t server = _fake_server_new();
+	orange_rpc_init(&rpc, server, app, RECV_TIMEOUT_US, 1);
+	orange_rpc_set_max_workers(&rpc, 2, 100000UL, 0);
+
+	_call(server, sid, 1, 1, "delay_echo", 0);
+	_wait_busy(&rpc, 1);
+	usleep(400000);
+	TEST(RPC_GET(&rpc, rpc.workers_grown) == 0);
+
+	_call(server, sid, 2, 2, "echo", 0);
+	TEST(_wait_responses(server, 1, 500000UL) == 1);
+	TEST(_response_error(server, 2, 2) == 0);
+	TEST(RPC_GET(&rpc, rpc.workers_grown) == 1);
+
+	TEST(_wait_responses(server, 2, 5000000UL) == 2);
+	orange_rpc_deinit(&rpc);
+	orange_server_delete(server);
+}
+
+int main(void){
+	// every built in method must be reachable through its name hash
+	TEST(orange_rpc_check_methods() == 0);
+
+	#ifndef CONFIG_THREADS
+	printf("rpc scheduler is only used with threads\n");
+	return 77;
+	#else
+	struct orange *app = orange_new("test-plugins", "test-pwfile", "test-acls");
+	struct orange_user *admin = orange_user_new("admin");
+	orange_user_add_acl(admin, "test-acl");
+	orange_add_user(app, &admin);
+	struct orange_sid sid;
+	TEST(orange_login_plaintext(app, "admin", "admin", &sid) == 0);
+
+	_test_lane_weights(app, sid.hash);
+	_test_bulk_cap(app, sid.hash);
+	_test_peer_limit(app, sid.hash);
+	_test_queue_limit(app, sid.hash);
+	_test_deadline(app, sid.hash);
+	_test_ordering(app, sid.hash);
+	_test_batch_errors(app, sid.hash);
+	_test_pool_growth(app, sid.hash);
+
+	orange_delete(&app);
+	return 0;
+	#endif
+}
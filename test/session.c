@@ -47,6 +47,27 @@ int main(void){
 	// read access should be still there
 	TEST(orange_session_access(ses, "uci", "network", "*", "r")); 
 
+	// remembered checks are invalidated when acls change
+	TEST(!orange_session_access(ses, "uci", "wireless", "*", "r")); 
+	TEST(orange_session_grant(ses, "uci", "wireless", "*", "r") == 0); 
+	TEST(orange_session_access(ses, "uci", "wireless", "*", "r")); 
+	TEST(orange_session_revoke(ses, "uci", "wireless", "*", "r") == 0); 
+	TEST(!orange_session_access(ses, "uci", "wireless", "*", "r")); 
+
+	// shared acls are not changed by revoking permissions from a session
+	struct orange_acl *profile = orange_acl_new(); 
+	TEST(orange_acl_grant(profile, "rpc", "system", "*", "x") == 0); 
+	struct orange_acl *shared = orange_acl_ref(profile); 
+	orange_session_set_profile(ses, &shared); 
+	TEST(shared == NULL); 
+	TEST(orange_session_access(ses, "rpc", "system", "info", "x")); 
+	TEST(orange_session_access(ses, "uci", "network", "*", "r")); 
+	TEST(orange_session_revoke(ses, "rpc", "system", "reboot", "x") == 0); 
+	TEST(!orange_session_access(ses, "rpc", "system", "info", "x")); 
+	orange_perms_t perms = 0; 
+	TEST(orange_acl_lookup(profile, "rpc", "system", "info", &perms) && perms); 
+	orange_acl_unref(&profile); 
+
 	orange_session_delete(&ses); 
 
 	return 0; 
@@ -0,0 +1,101 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <memory.h>
+#include <unistd.h>
+#include <blobpack/blobpack.h>
+#include "../src/orange_session_store.h"
+
+#define NUM_SESSIONS 200
+
+static void _count_cb(void *arg, struct orange_session *ses){
+	(*(int*)arg)++;
+}
+
+int main(void){
+	struct orange_user user;
+	memset(&user, 0, sizeof(user));
+	struct orange_session_store *store = orange_session_store_new();
+	TEST(store != NULL);
+
+	// basic insert, find and remove
+	struct orange_session *ses = orange_session_new(&user, 20);
+	char sid[sizeof(ses->sid.hash)];
+	strcpy(sid, ses->sid.hash);
+	TEST(orange_session_store_insert(store, ses) == 0);
+	TEST(orange_session_store_count(store) == 1);
+	struct orange_session *found = orange_session_store_find(store, sid);
+	TEST(found == ses);
+	orange_session_unref(&found);
+	TEST(found == NULL);
+
+	// duplicate and malformed ids are rejected
+	TEST(orange_session_store_insert(store, ses) == -EEXIST);
+	TEST(orange_session_store_find(store, "") == NULL);
+	TEST(orange_session_store_find(store, NULL) == NULL);
+	TEST(orange_session_store_find(store, "not a session id") == NULL);
+	TEST(orange_session_store_remove(store, "xyz") == -EINVAL);
+
+	// reference taken before logout keeps the session alive
+	found = orange_session_store_find(store, sid);
+	TEST(orange_session_store_remove(store, sid) == 0);
+	TEST(orange_session_store_remove(store, sid) == -ENOENT);
+	TEST(orange_session_store_find(store, sid) == NULL);
+	TEST(orange_session_store_count(store) == 0);
+	TEST(orange_session_grant(found, "rpc", "obj", "*", "x") == 0);
+	TEST(orange_session_access(found, "rpc", "obj", "method", "x"));
+	orange_session_unref(&found);
+
+	// table grows and everything can still be found after removals
+	static char sids[NUM_SESSIONS][sizeof(ses->sid.hash)];
+	for(int c = 0; c < NUM_SESSIONS; c++){
+		ses = orange_session_new(&user, 20);
+		strcpy(sids[c], ses->sid.hash);
+		TEST(orange_session_store_insert(store, ses) == 0);
+	}
+	TEST(orange_session_store_count(store) == NUM_SESSIONS);
+	for(int c = 0; c < NUM_SESSIONS; c += 2){
+		TEST(orange_session_store_remove(store, sids[c]) == 0);
+	}
+	for(int c = 0; c < NUM_SESSIONS; c++){
+		found = orange_session_store_find(store, sids[c]);
+		TEST((found != NULL) == (c & 1));
+		if(found) orange_session_unref(&found);
+	}
+	int count = 0;
+	orange_session_store_for_each(store, _count_cb, &count);
+	TEST(count == NUM_SESSIONS / 2);
+	TEST(orange_session_store_expire(store) == 0);
+
+	orange_session_store_delete(&store);
+	TEST(store == NULL);
+
+	// sessions expire unless they are used
+	store = orange_session_store_new();
+	struct orange_session *idle = orange_session_new(&user, 1);
+	struct orange_session *busy = orange_session_new(&user, 2);
+	strcpy(sids[0], idle->sid.hash);
+	strcpy(sids[1], busy->sid.hash);
+	TEST(orange_session_store_insert(store, idle) == 0);
+	TEST(orange_session_store_insert(store, busy) == 0);
+	TEST(orange_session_grant(busy, "rpc", "obj", "*", "x") == 0);
+	for(int c = 0; c < 4; c++){
+		sleep(1);
+		found = orange_session_store_find(store, sids[1]);
+		TEST(found != NULL);
+		// access refreshes the session
+		TEST(orange_session_access(found, "rpc", "obj", "method", "x"));
+		orange_session_unref(&found);
+		orange_session_store_expire(store);
+	}
+	TEST(orange_session_store_find(store, sids[0]) == NULL);
+	TEST(orange_session_store_count(store) == 1);
+
+	sleep(3);
+	TEST(orange_session_store_find(store, sids[1]) == NULL);
+	TEST(orange_session_store_expire(store) == 1);
+	TEST(orange_session_store_count(store) == 0);
+
+	orange_session_store_delete(&store);
+
+	return 0;
+}
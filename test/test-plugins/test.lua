@@ -48,6 +48,11 @@ return {
 	test_c_calls = test_c_calls,
 	deferred_shell = test_deferred_shell, 
 	error_code = test_error_code,
-	exit = test_exit
+	exit = test_exit, 
+	-- slow methods are scheduled in the bulk lane
+	__lanes = {
+		delay_echo = "bulk", 
+		deferred_shell = "bulk"
+	}
 }
 
@@ -0,0 +1,76 @@
+#include "test-funcs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#include "../src/orange_topic.h"
+
+// returns true if topic reaches exactly the n given peers (in ascending order)
+static bool _matches(struct orange_topic_tree *tree, const char *topic, int n, ...){
+	uint32_t *peers = NULL; 
+	int count = orange_topic_match(tree, topic, &peers); 
+	bool ok = count == n; 
+	va_list ap; 
+	va_start(ap, n); 
+	for(int c = 0; c < n; c++){
+		uint32_t expected = va_arg(ap, uint32_t); 
+		if(ok && peers[c] != expected) ok = false; 
+	}
+	va_end(ap); 
+	free(peers); 
+	return ok; 
+}
+
+int main(void){
+	struct orange_topic_tree *tree = orange_topic_tree_new(); 
+
+	TEST(orange_topic_pattern_valid("wifi.scan")); 
+	TEST(orange_topic_pattern_valid("wifi.*")); 
+	TEST(orange_topic_pattern_valid("**")); 
+	TEST(!orange_topic_pattern_valid("")); 
+	TEST(!orange_topic_pattern_valid("wifi..scan")); 
+	TEST(!orange_topic_pattern_valid(".wifi")); 
+	TEST(!orange_topic_pattern_valid("wifi.sc*")); 
+	TEST(!orange_topic_pattern_valid("wifi.**.**")); 
+	TEST(orange_topic_pattern_valid("**.wifi.**")); 
+
+	TEST(orange_topic_subscribe(tree, "wifi.scan", 1) == 0); 
+	TEST(orange_topic_subscribe(tree, "wifi.scan", 1) == -EEXIST); 
+	TEST(orange_topic_subscribe(tree, "wifi.*", 2) == 0); 
+	TEST(orange_topic_subscribe(tree, "**", 3) == 0); 
+	TEST(orange_topic_subscribe(tree, "network.**", 4) == 0); 
+	TEST(orange_topic_subscribe(tree, "*.scan", 4) == 0); 
+	TEST(orange_topic_subscribe(tree, "bad..pattern", 5) == -EINVAL); 
+	TEST(orange_topic_subscribe(tree, "**.**.**.**.**.**.**.**.**.**.**.**.**.**.**.**", 5) == -EINVAL); 
+	TEST(orange_topic_count(tree) == 5); 
+
+	TEST(_matches(tree, "wifi.scan", 4, 1, 2, 3, 4)); 
+	TEST(_matches(tree, "wifi.status", 2, 2, 3)); 
+	TEST(_matches(tree, "wifi", 1, 3)); 
+	TEST(_matches(tree, "network", 2, 3, 4)); 
+	TEST(_matches(tree, "network.lan.up", 2, 3, 4)); 
+	TEST(_matches(tree, "system.reboot", 1, 3)); 
+
+	TEST(orange_topic_unsubscribe(tree, "wifi.*", 1) == -ENOENT); 
+	TEST(orange_topic_unsubscribe(tree, "wifi.*", 2) == 0); 
+	TEST(_matches(tree, "wifi.status", 1, 3)); 
+
+	TEST(orange_topic_unsubscribe_all(tree, 4) == 2); 
+	TEST(orange_topic_unsubscribe_all(tree, 3) == 1); 
+	TEST(_matches(tree, "wifi.scan", 1, 1)); 
+	TEST(_matches(tree, "network.lan", 0)); 
+	TEST(orange_topic_count(tree) == 1); 
+
+	TEST(orange_topic_pattern_match("wifi.*", "wifi.scan")); 
+	TEST(!orange_topic_pattern_match("wifi.*", "wifi.scan.done")); 
+	TEST(orange_topic_pattern_match("network.**", "network")); 
+	TEST(orange_topic_pattern_match("**.up", "network.lan.up")); 
+	TEST(!orange_topic_pattern_match("wifi", "network"));
+	TEST(!orange_topic_pattern_match("**.**.**.**.**.**.**.**.**.**.**.**.**.**.**.x", "a.a.a.a.a.a.a.a.a.a.a.a.a.a.a.a")); 
+
+	orange_topic_tree_delete(&tree); 
+	TEST(tree == NULL); 
+	return 0; 
+}
@@ -0,0 +1,184 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <memory.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <blobpack/blobpack.h>
+
+#include "../src/orange_unix_server.h"
+#include "../src/orange_mux_server.h"
+#include "../src/orange_msgpack.h"
+
+#define SOCKET_PATH "/tmp/orange-test.sock"
+
+static int _connect(void){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
+	return fd;
+}
+
+static struct orange_message *_recv(orange_server_t server){
+	struct orange_message *msg = NULL;
+	// give server thread some time to accept and read
+	for(int c = 0; c < 20 && !msg; c++){
+		orange_server_recv(server, &msg, 100000UL);
+		// skip disconnect notifications of earlier connections
+		if(msg && msg->type != UBUS_MSG_METHOD_CALL) orange_message_delete(&msg);
+	}
+	return msg;
+}
+
+// replies to the peer with {"id":<id>,"result":"ok"}
+static void _reply(orange_server_t server, uint32_t peer, int id){
+	struct orange_message *res = orange_message_new();
+	res->peer = peer;
+	blob_offset_t t = blob_open_table(&res->buf);
+	blob_put_string(&res->buf, "id");
+	blob_put_int(&res->buf, id);
+	blob_put_string(&res->buf, "result");
+	blob_put_string(&res->buf, "ok");
+	blob_close_table(&res->buf, t);
+	TEST(orange_server_send(server, &res) == 0);
+}
+
+static void _test_server(orange_server_t server){
+	char buf[256];
+	int fd = _connect();
+	TEST(fd >= 0);
+
+	// json request gets json response
+	const char *req = "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"list\",\"params\":[]}";
+	TEST(send(fd, req, strlen(req), 0) == (ssize_t)strlen(req));
+	struct orange_message *msg = _recv(server);
+	TEST(msg != NULL);
+	TEST(msg->peer != 0);
+	char *json = blob_field_to_json(blob_field_first_child(blob_head(&msg->buf)));
+	TEST(strstr(json, "\"method\":\"list\"") != NULL);
+	free(json);
+	_reply(server, msg->peer, 1);
+	ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+	TEST(len > 0);
+	buf[len] = 0;
+	printf("%s\n", buf);
+	TEST(buf[0] == '{' && strstr(buf, "\"ok\"") != NULL);
+	orange_message_delete(&msg);
+
+	// msgpack request gets msgpack response
+	struct blob b;
+	blob_init(&b, 0, 0);
+	blob_offset_t t = blob_open_table(&b);
+	blob_put_string(&b, "id");
+	blob_put_int(&b, 2);
+	blob_close_table(&b, t);
+	size_t plen = 0;
+	uint8_t *packed = orange_msgpack_pack(blob_field_first_child(blob_head(&b)), 0, 0, &plen);
+	TEST(send(fd, packed, plen, 0) == (ssize_t)plen);
+	free(packed);
+	msg = _recv(server);
+	TEST(msg != NULL);
+	_reply(server, msg->peer, 2);
+	len = recv(fd, buf, sizeof(buf), 0);
+	TEST(len > 0);
+	TEST((uint8_t)buf[0] == (0x80 | 2));
+	blob_reset(&b);
+	TEST(orange_msgpack_unpack(&b, (uint8_t*)buf, len));
+	orange_message_delete(&msg);
+
+	// invalid messages are dropped and do not kill the connection
+	TEST(send(fd, "{foo", 4, 0) == 4);
+	TEST(send(fd, "\xc1", 1, 0) == 1);
+	TEST(send(fd, req, strlen(req), 0) == (ssize_t)strlen(req));
+	msg = _recv(server);
+	TEST(msg != NULL);
+	orange_message_delete(&msg);
+
+	// broadcast reaches the client in its last used encoding (json)
+	struct orange_message *ev = orange_message_new();
+	ev->peer = 0;
+	t = blob_open_table(&ev->buf);
+	blob_put_string(&ev->buf, "method");
+	blob_put_string(&ev->buf, "event");
+	blob_close_table(&ev->buf, t);
+	TEST(orange_server_send(server, &ev) == 0);
+	len = recv(fd, buf, sizeof(buf) - 1, 0);
+	TEST(len > 0);
+	buf[len] = 0;
+	TEST(strstr(buf, "\"event\"") != NULL);
+
+	// sending to an unknown peer fails
+	struct orange_message *res = orange_message_new();
+	res->peer = 1;
+	blob_put_int(&res->buf, 0);
+	TEST(orange_server_send(server, &res) < 0);
+
+	struct blob stats;
+	blob_init(&stats, 0, 0);
+	TEST(orange_server_stats(server, &stats) == 0);
+	blob_dump_json(&stats);
+	blob_free(&stats);
+
+	blob_free(&b);
+	close(fd);
+
+	// server reports the disconnect
+	msg = NULL;
+	for(int c = 0; c < 20 && !msg; c++){
+		orange_server_recv(server, &msg, 100000UL);
+	}
+	TEST(msg != NULL);
+	TEST(msg->type == UBUS_MSG_PEER_DISCONNECTED);
+	orange_message_delete(&msg);
+}
+
+// a client that floods the server is not read from while it has too many requests waiting
+static void _test_rx_limit(orange_server_t server){
+	int fd = _connect();
+	TEST(fd >= 0);
+	const char *req = "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"list\",\"params\":[]}";
+	for(int c = 0; c < ORANGE_UNIX_RX_LIMIT + 8; c++){
+		TEST(send(fd, req, strlen(req), 0) == (ssize_t)strlen(req));
+	}
+	// let the server thread read everything it is allowed to
+	usleep(200000);
+
+	struct blob stats;
+	blob_init(&stats, 0, 0);
+	TEST(orange_server_stats(server, &stats) == 0);
+	char *json = blob_field_to_json(blob_field_first_child(blob_head(&stats)));
+	TEST(strstr(json, "\"rx_paused\":1") != NULL);
+	free(json);
+	blob_free(&stats);
+
+	// reading resumes when workers pick up requests so all of them arrive
+	for(int c = 0; c < ORANGE_UNIX_RX_LIMIT + 8; c++){
+		struct orange_message *msg = _recv(server);
+		TEST(msg != NULL);
+		orange_message_delete(&msg);
+	}
+	close(fd);
+}
+
+int main(void){
+	orange_server_t server = orange_unix_server_new();
+	TEST(server != NULL);
+	TEST(orange_server_listen(server, "unix://") < 0);
+	TEST(orange_server_listen(server, "unix://" SOCKET_PATH) == 0);
+	TEST(access(SOCKET_PATH, F_OK) == 0);
+	_test_server(server);
+	_test_rx_limit(server);
+
+	// same tests through the mux
+	orange_server_t mux = orange_mux_server_new();
+	TEST(orange_mux_server_add(mux, "unix", server) == 0);
+	_test_server(mux);
+
+	orange_server_delete(mux);
+	TEST(access(SOCKET_PATH, F_OK) != 0);
+
+	return 0;
+}
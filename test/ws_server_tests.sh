@@ -29,6 +29,10 @@ TEST "${ORANGE} call /test echo []" 234
 # echo test 
 TEST "${ORANGE} call /test echo {\"foo\":\"bar\"}" 0
 
+# binary msgpack encoding
+TEST "${ORANGE} --msgpack call /test echo {\"foo\":\"bar\"}" 0
+TEST "${ORANGE} --msgpack list * {}" 0
+
 # submod test 
 TEST "${ORANGE} call /subdir/submod echo {\"foo\":\"bar\"}" 0
 
@@ -40,5 +44,21 @@ TEST "${ORANGE} call /test error_code {\"code\":-6}" 250
 
 TEST "${ORANGE} speedtest /test delay_echo {\"foo\":\"echoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoechoecho\"}" 0
 
+# plain http rpc on the same port (unknown urls return 404 and curl exits with 22)
+TEST "curl -sf -d {\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"challenge\",\"params\":[]} http://localhost:61413/rpc" 0
+TEST "curl -sf -d {} http://localhost:61413/foo" 22
+# hidden files are never served (403 and curl exits with 22)
+TEST "curl -sf http://localhost:61413/.git/config" 22
+TEST "curl -sf http://localhost:61413/sub/.htpasswd" 22
+# requests without id, method or params are rejected instead of being left unanswered
+TEST "curl -sf -m 5 -d {} http://localhost:61413/rpc" 22
+TEST "curl -sf -m 5 -d {\"jsonrpc\":\"2.0\",\"method\":\"challenge\",\"params\":[]} http://localhost:61413/rpc" 22
+# batch of requests is answered with one array
+TEST "curl -sf -d [{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"challenge\",\"params\":[]},{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"challenge\",\"params\":[]}] http://localhost:61413/rpc" 0
+
+# burst of small responses (tx_writes in stats counts lws_write calls, not syscalls. Timing of write coalescing is measured by ws_tx)
+TEST "${ORANGE} --count 200 speedtest /test echo {\"foo\":\"bar\"}" 0
+TEST "${ORANGE} stats" 0
+
 sleep 1
 ${ORANGE} call '/test' exit {}
@@ -0,0 +1,198 @@
+#include "test-funcs.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <memory.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <blobpack/blobpack.h>
+
+#include "../src/orange_ws_server.h"
+
+#define TEST_PORT 61414
+#define MAX_EVENTS 20000
+#define BENCH_EVENTS 20000
+#define BENCH_EVENT_SIZE 800
+
+// returns value of one counter from server stats (or -1 if there is no such counter)
+static long long _stat(orange_server_t server, const char *name){
+	struct blob b;
+	long long ret = -1;
+	blob_init(&b, 0, 0);
+	TEST(orange_server_stats(server, &b) == 0);
+	const struct blob_field *t = blob_field_first_child(blob_head(&b));
+	const struct blob_field *key = blob_field_first_child(t);
+	while(key){
+		const struct blob_field *value = blob_field_next_child(t, key);
+		if(!value) break;
+		if(strcmp(blob_field_get_string(key), name) == 0) ret = blob_field_get_int(value);
+		key = blob_field_next_child(t, value);
+	}
+	blob_free(&b);
+	return ret;
+}
+
+static long long _now_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// opens a websocket connection and reads the handshake response but nothing after it
+static int _connect(int rcvbuf){
+	struct sockaddr_in addr;
+	struct timeval tv = { .tv_sec = 5 };
+	char buf[1024];
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	TEST(fd >= 0);
+	if(rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	for(int c = 0; c < 20; c++){
+		if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) break;
+		usleep(100000);
+	}
+	const char *req =
+		"GET / HTTP/1.1\r\n"
+		"Host: localhost\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		"Sec-WebSocket-Protocol: " ORANGE_WS_PROTOCOL_JSON "\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n";
+	TEST(send(fd, req, strlen(req), 0) == (ssize_t)strlen(req));
+	// read byte by byte so that we do not consume any frames after the headers
+	size_t len = 0;
+	while(len < sizeof(buf) - 1 && recv(fd, buf + len, 1, 0) == 1){
+		buf[++len] = 0;
+		if(len >= 4 && strcmp(buf + len - 4, "\r\n\r\n") == 0) break;
+	}
+	TEST(strstr(buf, " 101 ") != NULL);
+	return fd;
+}
+
+static void _broadcast(orange_server_t server, const char *data){
+	struct orange_message *ev = orange_message_new();
+	ev->peer = 0;
+	blob_offset_t t = blob_open_table(&ev->buf);
+	blob_put_string(&ev->buf, "method");
+	blob_put_string(&ev->buf, "event");
+	blob_put_string(&ev->buf, "params");
+	blob_put_string(&ev->buf, data);
+	blob_close_table(&ev->buf, t);
+	TEST(orange_server_send(server, &ev) == 0);
+}
+
+// reads until count complete (unmasked) websocket messages have been received. Returns number of messages. 
+static int _read_frames(int fd, int count){
+	static uint8_t buf[256 * 1024];
+	size_t len = 0;
+	int frames = 0;
+	while(frames < count){
+		ssize_t n = recv(fd, buf + len, sizeof(buf) - len, 0);
+		if(n <= 0) break;
+		len += n;
+		size_t pos = 0;
+		while(len - pos >= 2){
+			size_t hdr = 2, size = buf[pos + 1] & 0x7f;
+			if(size == 126){
+				hdr = 4;
+				if(len - pos < hdr) break;
+				size = (buf[pos + 2] << 8) | buf[pos + 3];
+			} else if(size == 127){
+				hdr = 10;
+				if(len - pos < hdr) break;
+				size = 0;
+				for(int c = 0; c < 8; c++) size = (size << 8) | buf[pos + 2 + c];
+			}
+			if(len - pos < hdr + size) break;
+			if(buf[pos] & 0x80) frames++;
+			pos += hdr + size;
+		}
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+	}
+	return frames;
+}
+
+// sends a burst of events to one client with given write budget and returns microseconds until client has received all of them
+static long long _bench(orange_server_t server, size_t budget, const char *data){
+	orange_ws_server_set_tx_budget(server, budget);
+	int fd = _connect(0);
+	for(int c = 0; c < 20 && _stat(server, "clients") != 1; c++) usleep(100000);
+	TEST(_stat(server, "clients") == 1);
+
+	long long writes = _stat(server, "tx_writes"), frames = _stat(server, "tx_frames");
+	long long start = _now_us();
+	for(int c = 0; c < BENCH_EVENTS; c++) _broadcast(server, data);
+	TEST(_read_frames(fd, BENCH_EVENTS) == BENCH_EVENTS);
+	long long elapsed = _now_us() - start;
+	writes = _stat(server, "tx_writes") - writes;
+	frames = _stat(server, "tx_frames") - frames;
+	printf("budget %d: %d events in %lldus, %lld frames in %lld lws writes\n", (int)budget, BENCH_EVENTS, elapsed, frames, writes);
+
+	close(fd);
+	for(int c = 0; c < 20 && _stat(server, "clients") != 0; c++) usleep(100000);
+	return elapsed;
+}
+
+int main(void){
+	char listen_socket[64], data[1024], small[BENCH_EVENT_SIZE];
+	snprintf(listen_socket, sizeof(listen_socket), "ws://127.0.0.1:%d", TEST_PORT);
+	memset(data, 'x', sizeof(data) - 1);
+	data[sizeof(data) - 1] = 0;
+	memset(small, 'x', sizeof(small) - 1);
+	small[sizeof(small) - 1] = 0;
+
+	orange_server_t server = orange_ws_server_new(NULL);
+	TEST(orange_server_listen(server, listen_socket) == 0);
+
+	// clients that have not subscribed get no events by default
+	int fd = _connect(0);
+	for(int c = 0; c < 20 && _stat(server, "clients") != 1; c++) usleep(100000);
+	_broadcast(server, small);
+	for(int c = 0; c < 20 && _stat(server, "events_filtered") != 1; c++) usleep(100000);
+	TEST(_stat(server, "events_filtered") == 1);
+	close(fd);
+	for(int c = 0; c < 20 && _stat(server, "clients") != 0; c++) usleep(100000);
+
+	// the remaining test clients do not subscribe
+	orange_ws_server_set_broadcast_all(server, true);
+
+	// write coalescing: with the smallest budget no two events fit into one write so every event is written separately
+	orange_ws_server_set_tx_limits(server, 64 * 1024 * 1024, 64 * 1024 * 1024, 64 * 1024 * 1024);
+	long long single = _bench(server, 0, small);
+	long long batched = _bench(server, 64 * 1024, small);
+	printf("batched writes took %lld%% of the time of single writes\n", batched * 100 / single);
+	TEST(_stat(server, "tx_frames_dropped") == 0);
+
+	// small receive window so that the server queue fills up quickly
+	orange_ws_server_set_tx_limits(server, 4096, 8192, 16384);
+	fd = _connect(4096);
+	for(int c = 0; c < 20 && _stat(server, "clients") != 1; c++) usleep(100000);
+	TEST(_stat(server, "clients") == 1);
+
+	// client never reads so its queue hits the hard limit and it gets evicted
+	int sent = 0;
+	for(; sent < MAX_EVENTS && _stat(server, "clients_evicted") == 0; sent++){
+		_broadcast(server, data);
+		if((sent % 100) == 0) usleep(1000);
+	}
+	printf("client evicted after %d events\n", sent);
+	TEST(_stat(server, "clients_evicted") == 1);
+	TEST(_stat(server, "tx_frames_dropped") > 0);
+
+	// connection must be closed by the server even though the client never becomes writeable
+	for(int c = 0; c < 50 && _stat(server, "clients") != 0; c++) usleep(100000);
+	TEST(_stat(server, "clients") == 0);
+	TEST(_stat(server, "tx_queued_bytes") == 0);
+
+	close(fd);
+	orange_server_delete(server);
+	return 0;
+}